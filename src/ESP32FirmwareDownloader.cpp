@@ -1,39 +1,92 @@
 #include "ESP32FirmwareDownloader.h"
+#include "FirmwareDownloaderCore.h"   // sessions, generations, wear, jobs, upload sink
+#include "fwdl.h"              // C flash engine: regions, sources, upload sinks
 #include <WiFi.h>
+#if FWDL_ENABLE_PULLCLONE
+  #include <HTTPClient.h>       // /pullclone
+#endif
+#if FWDL_ENABLE_MULTICAST
+  #include <AsyncUDP.h>         // Multicast distribution
+#endif
 #include <SPI.h>
 #include "esp_flash.h"       // esp_flash_read() and esp_flash_default_chip()
 #include "esp_partition.h"   // Partition APIs
 #include "esp_ota_ops.h"     // OTA update APIs
+#include "esp_image_format.h" // esp_image_get_metadata() for batch verify
 #include <esp_task_wdt.h>    // esp_task_wdt_reset()
 #include <esp_err.h>
+#include "esp_timer.h"         // Session watchdog timer
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+#include "mbedtls/sha256.h"    // Raw dump digest trailer
+#include "esp_rom_crc.h"        // esp_rom_crc32_le() for serial frames
+#include "nvs.h"                // Job history
+#include "soc/soc.h"             // RAM region bounds for /ramdump
+#include "esp_heap_caps.h"
+#if defined(CONFIG_HEAP_TASK_TRACKING) && __has_include("esp_heap_task_info.h")
+  #include "esp_heap_task_info.h"   // per-task heap totals for /ramdump?heap=1
+  #define RAMDUMP_HAS_TASK_INFO 1
+#else
+  #define RAMDUMP_HAS_TASK_INFO 0
+#endif
+#if defined(CONFIG_ESP_COREDUMP_ENABLE_TO_FLASH) && defined(CONFIG_ESP_COREDUMP_DATA_FORMAT_ELF) && \
+    __has_include("esp_core_dump.h")
+  #include "esp_core_dump.h"   // esp_core_dump_get_summary() for /coredump?summary=1
+  #define COREDUMP_HAS_SUMMARY 1
+#else
+  #define COREDUMP_HAS_SUMMARY 0
+#endif
+#if __has_include("spi_flash_mmap.h")
+  #include "spi_flash_mmap.h"      // spi_flash_cache2phys() (IDF 5)
+#else
+  #include "esp_spi_flash.h"       // spi_flash_cache2phys() (IDF 4)
+#endif
+#include <memory>               // std::shared_ptr for consistent-dump state
+#include <algorithm>            // std::sort for dedup known lists
 
 #ifndef ESP_IMAGE_HEADER_MAGIC
   #define ESP_IMAGE_HEADER_MAGIC 0xE9
 #endif
 
+typedef FirmwareDownloaderCore Core;
+
 // Fixed constants for bootloader download.
-static const uint32_t BOOTLOADER_OFFSET = 0x1000;
-static const uint32_t BOOTLOADER_SIZE   = 0x7000;
+static const uint32_t BOOTLOADER_OFFSET = FWDL_BOOTLOADER_OFFSET;
+static const uint32_t BOOTLOADER_SIZE   = FWDL_BOOTLOADER_SIZE;
 static const size_t   CHUNK_SIZE        = 4096;
-
-// Global variables for streaming.
-static uint32_t g_flashSizeDirect = 0;
-static uint32_t g_genPartStart = 0;
-static uint32_t g_genPartSize  = 0;
+static const uint32_t SECTOR_SIZE       = FWDL_SECTOR_SIZE;
+static const uint32_t PARTITION_TABLE_END = 0x9000;   // bootloader + partition table live below
 
 // Forward declarations for helper functions.
+static const esp_partition_t* findPartitionByLabel(const char* label);
+#if FWDL_ENABLE_UPLOAD
 static bool isPartitionValid(const esp_partition_t* part);
-static bool cloneActiveToInactive();
+static bool cloneActiveToInactive(volatile uint32_t *progress = nullptr);
+#endif
 
 // Initialize static members.
 ESP32FirmwareDownloader* ESP32FirmwareDownloader::_instance = nullptr;
-ESP32FirmwareDownloader::BlankRegion ESP32FirmwareDownloader::_blankRegions[MAX_BLANK_REGIONS];
-int ESP32FirmwareDownloader::_numBlankRegions = 0;
+#if FWDL_ENABLE_RAW_TCP
+AsyncServer* ESP32FirmwareDownloader::_rawServer = nullptr;
+#endif
+#if FWDL_ENABLE_SERIAL
+ESP32FirmwareDownloader::SerialLink* ESP32FirmwareDownloader::_serialLink = nullptr;
+#endif
+#if FWDL_ENABLE_WEBSOCKET
+AsyncWebSocket* ESP32FirmwareDownloader::_ws = nullptr;
+ESP32FirmwareDownloader::WsConn* ESP32FirmwareDownloader::_wsConns[MAX_WS_CONNS];
+#endif
 
 ////////////////////
 // Helper Functions
 ////////////////////
 
+// Look up a partition by label, preferring APP partitions over DATA.
+static const esp_partition_t* findPartitionByLabel(const char* label) {
+  return fwdl_find_partition(label);
+}
+
+#if FWDL_ENABLE_UPLOAD
 // Check if a partition appears valid by reading its first byte.
 static bool isPartitionValid(const esp_partition_t* part) {
   uint8_t magic;
@@ -44,632 +97,6236 @@ static bool isPartitionValid(const esp_partition_t* part) {
   }
   return (magic == ESP_IMAGE_HEADER_MAGIC);
 }
+#endif
 
-// Clone the active APP partition to the inactive APP partition.
-static bool cloneActiveToInactive() {
-  const esp_partition_t *running = esp_ota_get_running_partition();
-  if (!running) {
-    Serial.println("Failed to get running partition!");
-    return false;
+static inline uint32_t readLE32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void writeLE32(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+#if FWDL_ENABLE_HASHING || FWDL_ENABLE_DEDUP
+static void sha256Of(const uint8_t *data, size_t len, uint8_t out[32]) {
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, data, len);
+  mbedtls_sha256_finish(&sha, out);
+  mbedtls_sha256_free(&sha);
+}
+#endif
+
+#if FWDL_ENABLE_HASHING || FWDL_ENABLE_PULLCLONE || FWDL_ENABLE_DIAGNOSTICS || FWDL_ENABLE_BATCH
+static void toHex(const uint8_t *data, size_t len, char *out) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[i * 2] = digits[data[i] >> 4];
+    out[i * 2 + 1] = digits[data[i] & 0x0F];
   }
-  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
-  const esp_partition_t *inactive = nullptr;
-  while (it != NULL) {
-    const esp_partition_t *p = esp_partition_get(it);
-    if (p && (p->address != running->address)) {
-      inactive = p;
+  out[len * 2] = '\0';
+}
+#endif
+
+//////////////////////////////
+// Write Generations
+//////////////////////////////
+// Kept by FirmwareDownloaderCore: every library write bumps them, and the
+// application reports its own writes through notifyFlashWrite().
+
+#if FWDL_ENABLE_UPLOAD
+// esp_ota_set_boot_partition() rewrites otadata.
+static void bumpOtadata() {
+  Core::bumpPartition(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, NULL));
+}
+#endif
+
+void ESP32FirmwareDownloader::notifyFlashWrite(uint32_t address, uint32_t length) {
+  Core::bumpGeneration(address, length);
+}
+
+uint32_t ESP32FirmwareDownloader::getWriteGeneration(const char* label) {
+  const esp_partition_t* part = findPartitionByLabel(label);
+  return part ? Core::generationAt(part->address) : 0;
+}
+
+//////////////////////////////
+// Job Reporting
+//////////////////////////////
+// Status JSON for scheduler jobs, which FirmwareDownloaderCore runs. The
+// per-kind status endpoints (/snapshot/status, /pullclone/status,
+// /mcast/status) show the newest job of their kind; /jobs lists them all.
+
+typedef Core::Job Job;
+
+// JSON of job id, or of the newest job called name when id is 0. Unknown
+// jobs report state "none".
+static String jobStatusJson(uint32_t id, const char* name) {
+  char json[Core::JOB_JSON_MAX];
+  if (!Core::jobJson(json, sizeof(json), id, name)) json[0] = '\0';
+  return String(json);
+}
+
+// A core listing (partitions, jobs) as a String; empty when it does not fit.
+static const size_t LISTING_MAX = 4096;
+
+static String coreListing(size_t (*fill)(char *out, size_t outLen)) {
+  char *buf = (char*)malloc(LISTING_MAX);
+  if (!buf) return String();
+  String json = fill(buf, LISTING_MAX) ? String(buf) : String();
+  free(buf);
+  return json;
+}
+
+#if FWDL_ENABLE_HASHING || FWDL_ENABLE_MULTICAST || FWDL_ENABLE_BATCH
+//////////////////////////////
+// Hash Cache
+//////////////////////////////
+// SHA-256 of flash ranges keyed on (address, length, generation). A hit is
+// returned without touching flash; a generation change forces a recompute of
+// just that range. Each entry also keeps the CRC-32 of the range's first
+// sector, so a caller that cannot rely on generations can check the entry
+// with one sector read.
+
+static const int HASH_CACHE_SLOTS = 8;
+
+struct HashCacheEntry {
+  bool valid;
+  uint32_t address;
+  uint32_t length;
+  uint32_t gen;
+  uint32_t head;         // CRC-32 of the first sector (or of the whole range if shorter)
+  uint8_t sha[32];
+};
+
+static HashCacheEntry g_hashCache[HASH_CACHE_SLOTS];
+static int g_hashCacheNext = 0;
+static uint32_t g_hashCacheHits = 0;
+static uint32_t g_hashCacheMisses = 0;
+static portMUX_TYPE g_hashCacheMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void hashCachePut(uint32_t address, uint32_t length, uint32_t gen, uint32_t head, const uint8_t sha[32]) {
+  portENTER_CRITICAL(&g_hashCacheMux);
+  int slot = g_hashCacheNext;
+  for (int i = 0; i < HASH_CACHE_SLOTS; i++) {
+    if (g_hashCache[i].valid && g_hashCache[i].address == address && g_hashCache[i].length == length) {
+      slot = i;   // replace the outdated entry for this range
       break;
     }
-    it = esp_partition_next(it);
-  }
-  if (!inactive) {
-    Serial.println("Inactive partition not found!");
-    return false;
-  }
-  
-  uint8_t firstByte;
-  if (esp_flash_read(esp_flash_default_chip, &firstByte, inactive->address, 1) != ESP_OK) {
-    Serial.println("Error reading inactive partition!");
-    return false;
-  }
-  if (firstByte != ESP_IMAGE_HEADER_MAGIC) {
-    Serial.println("Inactive partition appears empty; proceeding with clone.");
-  } else {
-    Serial.println("Inactive partition appears valid; cloning anyway.");
-  }
-  
-  esp_ota_handle_t ota_handle;
-  esp_err_t err = esp_ota_begin(inactive, running->size, &ota_handle);
-  if (err != ESP_OK) {
-    Serial.printf("esp_ota_begin failed (%s)!\n", esp_err_to_name(err));
-    return false;
   }
-  
-  const size_t chunkSize = CHUNK_SIZE;
-  uint8_t buffer[chunkSize];
-  size_t bytesRead = 0;
-  size_t totalSize = running->size;
-  
-  Serial.printf("Cloning %u bytes from 0x%08X to 0x%08X...\n", totalSize, running->address, inactive->address);
-  
-  while (bytesRead < totalSize) {
-    size_t toRead = ((totalSize - bytesRead) < chunkSize) ? (totalSize - bytesRead) : chunkSize;
-    err = esp_flash_read(esp_flash_default_chip, buffer, running->address + bytesRead, toRead);
-    if (err != ESP_OK) {
-      Serial.printf("esp_flash_read failed at offset %u (%s)!\n", bytesRead, esp_err_to_name(err));
-      return false;
+  if (slot == g_hashCacheNext) g_hashCacheNext = (g_hashCacheNext + 1) % HASH_CACHE_SLOTS;
+  HashCacheEntry &e = g_hashCache[slot];
+  e.valid = true;
+  e.address = address;
+  e.length = length;
+  e.gen = gen;
+  e.head = head;
+  memcpy(e.sha, sha, 32);
+  portEXIT_CRITICAL(&g_hashCacheMux);
+}
+
+// Hash [address, address+length); sets *cached when served from the cache.
+// fresh skips the lookup for ranges whose writers may not report them; the
+// result still refreshes the cache.
+static bool hashFlashRange(uint32_t address, uint32_t length, uint8_t out[32], bool *cached,
+                           bool fresh = false) {
+  uint32_t gen = Core::generationFor(address, length);
+  portENTER_CRITICAL(&g_hashCacheMux);
+  for (int i = 0; i < HASH_CACHE_SLOTS && !fresh; i++) {
+    HashCacheEntry &e = g_hashCache[i];
+    if (e.valid && e.address == address && e.length == length && e.gen == gen) {
+      memcpy(out, e.sha, 32);
+      g_hashCacheHits++;
+      portEXIT_CRITICAL(&g_hashCacheMux);
+      if (cached) *cached = true;
+      return true;
     }
-    err = esp_ota_write(ota_handle, buffer, toRead);
-    if (err != ESP_OK) {
-      Serial.printf("esp_ota_write failed at offset %u (%s)!\n", bytesRead, esp_err_to_name(err));
-      return false;
+  }
+  g_hashCacheMisses++;
+  portEXIT_CRITICAL(&g_hashCacheMux);
+  if (cached) *cached = false;
+
+  uint8_t *buf = (uint8_t*)malloc(CHUNK_SIZE);
+  if (!buf) return false;
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  bool ok = true;
+  uint32_t head = 0;
+  for (uint32_t off = 0; off < length; off += CHUNK_SIZE) {
+    uint32_t n = (length - off < CHUNK_SIZE) ? length - off : CHUNK_SIZE;
+    if (Core::jobCancelled() || esp_flash_read(esp_flash_default_chip, buf, address + off, n) != ESP_OK) {
+      ok = false;
+      break;
     }
-    bytesRead += toRead;
-    Serial.printf("Cloned %u/%u bytes...\n", bytesRead, totalSize);
-    yield();
+    if (off == 0) head = esp_rom_crc32_le(0, buf, n);   // CHUNK_SIZE is one sector
+    mbedtls_sha256_update(&sha, buf, n);
     esp_task_wdt_reset();
   }
-  
-  err = esp_ota_end(ota_handle);
-  if (err != ESP_OK) {
-    Serial.printf("esp_ota_end failed (%s)!\n", esp_err_to_name(err));
-    return false;
-  }
-  
-  err = esp_ota_set_boot_partition(inactive);
-  if (err != ESP_OK) {
-    Serial.printf("esp_ota_set_boot_partition failed (%s)!\n", esp_err_to_name(err));
-    return false;
-  }
-  
-  Serial.println("Clone complete; inactive partition activated.");
+  mbedtls_sha256_finish(&sha, out);
+  mbedtls_sha256_free(&sha);
+  free(buf);
+  if (!ok) return false;
+
+  // Stored under the generation sampled before reading. Writers bump after
+  // their flash operation completes, so a write that overlapped this pass
+  // moves the generation past gen and the entry is never hit stale.
+  hashCachePut(address, length, gen, head, out);
   return true;
 }
+#endif  // FWDL_ENABLE_HASHING || FWDL_ENABLE_MULTICAST || FWDL_ENABLE_BATCH
 
-//////////////////////////
-// Streaming Callback Functions
-//////////////////////////
+#if FWDL_ENABLE_HASHING
+//////////////////////////////
+// Metadata Store
+//////////////////////////////
+// Optional "fwdl_meta" DATA partition holding, per partition, the generation,
+// SHA-256 and a CRC-32 per sector. It is split into two slots written
+// alternately; each slot is a header followed by the body:
+//   header: "FWMT" | version u16 | count u16 | seq u32 | body length u32 | SHA-256 of body
+//   body:   count x entry, then the CRC tables
+// The body is written before the header, so a torn write leaves the slot
+// without a valid root hash and the other slot is used. At boot APP entries
+// are trusted when their first sector (which carries the app description)
+// still matches; DATA entries are rebuilt lazily by the worker task, which
+// also re-hashes any partition whose generation moves and rewrites the store.
 
-size_t ESP32FirmwareDownloader::flashStreamCallback(uint8_t *buffer, size_t maxLen, size_t index) {
-  if (index >= g_flashSizeDirect) return 0;
-  size_t bytesToRead = ((g_flashSizeDirect - index) < maxLen) ? (g_flashSizeDirect - index) : maxLen;
-  esp_err_t err = esp_flash_read(esp_flash_default_chip, buffer, index, bytesToRead);
-  if (err != ESP_OK) {
-    Serial.printf("[DirectStream] Error at 0x%08X: %s\n", index, esp_err_to_name(err));
-    return 0;
-  }
-  static uint32_t lastPrinted = 0;
-  if (index - lastPrinted >= CHUNK_SIZE * 10) {
-    Serial.printf("[DirectStream] Streamed %u/%u bytes...\n", index + bytesToRead, g_flashSizeDirect);
-    lastPrinted = index;
+static const uint32_t META_MAGIC        = 0x544D5746;   // "FWMT"
+static const uint16_t META_VERSION      = 1;
+static const size_t   META_HEADER_SIZE  = 64;
+static const size_t   META_ENTRY_SIZE   = 56;
+static const uint32_t META_SETTLE_MS    = 3000;
+
+struct MetaEntry {
+  uint32_t address;
+  uint32_t size;
+  uint32_t sectors;
+  uint32_t gen;          // generation the tables below were computed at (0 = never)
+  uint8_t sha[32];
+  uint32_t *crc;
+  bool app;
+};
+
+static const esp_partition_t* g_metaPart = nullptr;
+static SemaphoreHandle_t g_metaLock = nullptr;
+static const int MAX_META_ENTRIES = 24;
+
+static MetaEntry g_metaEntries[MAX_META_ENTRIES];
+static int g_metaCount = 0;
+static uint32_t g_metaSeq = 0;
+static int g_metaSlot = -1;            // slot holding the latest committed store
+static bool g_metaDirty = false;
+static uint32_t g_metaCommits = 0;
+static uint32_t g_metaRebuilds = 0;
+static TaskHandle_t g_metaTask = nullptr;   // store worker, woken on every generation bump
+
+static uint32_t metaSlotSize() {
+  return (g_metaPart->size / 2) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+static size_t metaBodySize() {
+  size_t len = (size_t)g_metaCount * META_ENTRY_SIZE;
+  for (int i = 0; i < g_metaCount; i++) len += g_metaEntries[i].sectors * 4;
+  return len;
+}
+
+static MetaEntry* metaFind(uint32_t address) {
+  for (int i = 0; i < g_metaCount; i++) {
+    if (g_metaEntries[i].address == address) return &g_metaEntries[i];
   }
-  esp_task_wdt_reset();
-  return bytesToRead;
+  return nullptr;
 }
 
-size_t ESP32FirmwareDownloader::flashStreamCallbackBlanked(uint8_t *buffer, size_t maxLen, size_t index) {
-  if (index >= g_flashSizeDirect) return 0;
-  size_t bytesToRead = ((g_flashSizeDirect - index) < maxLen) ? (g_flashSizeDirect - index) : maxLen;
-  // Limit bytes to CHUNK_SIZE.
-  if (bytesToRead > CHUNK_SIZE) bytesToRead = CHUNK_SIZE;
-  uint8_t tempBuffer[CHUNK_SIZE];
-  esp_err_t err = esp_flash_read(esp_flash_default_chip, tempBuffer, index, bytesToRead);
-  if (err != ESP_OK) {
-    Serial.printf("[SecureStream] Error at 0x%08X: %s\n", index, esp_err_to_name(err));
-    return 0;
+static bool metaFresh(const MetaEntry &e) {
+  return e.gen != 0 && e.gen == Core::generationAt(e.address);
+}
+
+// Read and validate one slot; returns the body (caller frees) or nullptr.
+static uint8_t* metaReadSlot(int slot, uint32_t *seqOut, uint16_t *countOut, uint32_t *lenOut) {
+  uint8_t header[META_HEADER_SIZE];
+  uint32_t base = slot * metaSlotSize();
+  if (esp_partition_read(g_metaPart, base, header, sizeof(header)) != ESP_OK) return nullptr;
+  uint32_t bodyLen = readLE32(header + 12);
+  if (readLE32(header) != META_MAGIC || (header[4] | (header[5] << 8)) != META_VERSION ||
+      bodyLen > metaSlotSize() - META_HEADER_SIZE) {
+    return nullptr;
   }
-  // For each blank region, replace overlapping bytes with 0xFF.
-  for (int i = 0; i < _numBlankRegions; i++) {
-    uint32_t regionStart = _blankRegions[i].offset;
-    uint32_t regionEnd = regionStart + _blankRegions[i].length;
-    uint32_t chunkStart = index;
-    uint32_t chunkEnd = index + bytesToRead;
-    if (chunkEnd > regionStart && chunkStart < regionEnd) {
-      uint32_t overlapStart = (chunkStart > regionStart) ? chunkStart : regionStart;
-      uint32_t overlapEnd = (chunkEnd < regionEnd) ? chunkEnd : regionEnd;
-      uint32_t startInBuffer = overlapStart - chunkStart;
-      uint32_t overlapLen = overlapEnd - overlapStart;
-      for (uint32_t j = 0; j < overlapLen; j++) {
-        tempBuffer[startInBuffer + j] = 0xFF;
-      }
-      Serial.printf("[SecureStream] Applied blank region: %s (0x%08X - 0x%08X)\n",
-                    _blankRegions[i].description, regionStart, regionEnd);
-    }
-  }
-  memcpy(buffer, tempBuffer, bytesToRead);
-  static uint32_t lastPrinted = 0;
-  if (index - lastPrinted >= CHUNK_SIZE * 10) {
-    Serial.printf("[SecureStream] Streamed %u/%u bytes...\n", index + bytesToRead, g_flashSizeDirect);
-    lastPrinted = index;
+  uint8_t *body = (uint8_t*)malloc(bodyLen ? bodyLen : 1);
+  if (!body) return nullptr;
+  uint8_t digest[32];
+  if (esp_partition_read(g_metaPart, base + META_HEADER_SIZE, body, bodyLen) != ESP_OK) {
+    free(body);
+    return nullptr;
   }
-  esp_task_wdt_reset();
-  return bytesToRead;
+  sha256Of(body, bodyLen, digest);
+  if (memcmp(digest, header + 16, 32) != 0) {
+    free(body);
+    return nullptr;
+  }
+  *seqOut = readLE32(header + 8);
+  *countOut = header[6] | (header[7] << 8);
+  *lenOut = bodyLen;
+  return body;
 }
 
-size_t ESP32FirmwareDownloader::genericPartStreamCallback(uint8_t *buffer, size_t maxLen, size_t index) {
-  if (index >= g_genPartSize) return 0;
-  size_t bytesToRead = ((g_genPartSize - index) < maxLen) ? (g_genPartSize - index) : maxLen;
-  esp_err_t err = esp_flash_read(esp_flash_default_chip, buffer, g_genPartStart + index, bytesToRead);
-  if (err != ESP_OK) {
-    Serial.printf("[GenericStream] Error at 0x%08X: %s\n", g_genPartStart + index, esp_err_to_name(err));
-    return 0;
+// Serialize the entries into the slot not holding the latest store.
+static bool metaCommit() {
+  xSemaphoreTake(g_metaLock, portMAX_DELAY);
+  size_t bodyLen = metaBodySize();
+  uint8_t *body = (bodyLen + META_HEADER_SIZE <= metaSlotSize()) ? (uint8_t*)malloc(bodyLen) : nullptr;
+  if (!body) {
+    xSemaphoreGive(g_metaLock);
+    Serial.printf("[Meta] Cannot commit %u-byte store.\n", bodyLen);
+    return false;
   }
-  static uint32_t lastPrinted = 0;
-  if (index - lastPrinted >= CHUNK_SIZE * 10) {
-    Serial.printf("[GenericStream] Streamed %u/%u bytes...\n", index + bytesToRead, g_genPartSize);
-    lastPrinted = index;
+  uint8_t *crcOut = body + g_metaCount * META_ENTRY_SIZE;
+  for (int i = 0; i < g_metaCount; i++) {
+    const MetaEntry &e = g_metaEntries[i];
+    uint8_t *p = body + i * META_ENTRY_SIZE;
+    writeLE32(p, e.address);
+    writeLE32(p + 4, e.size);
+    writeLE32(p + 8, e.sectors);
+    writeLE32(p + 12, e.gen);
+    memcpy(p + 16, e.sha, 32);
+    writeLE32(p + 48, crcOut - body);
+    writeLE32(p + 52, 0);
+    memcpy(crcOut, e.crc, e.sectors * 4);
+    crcOut += e.sectors * 4;
   }
-  esp_task_wdt_reset();
-  return bytesToRead;
-}
+  g_metaDirty = false;
+  uint32_t seq = g_metaSeq + 1;
+  xSemaphoreGive(g_metaLock);
 
-//////////////////////////////
-// Blank Region Management
-//////////////////////////////
-void ESP32FirmwareDownloader::addBlankRegion(uint32_t offset, uint32_t length, const char* description) {
-  if (_numBlankRegions < MAX_BLANK_REGIONS) {
-    _blankRegions[_numBlankRegions].offset = offset;
-    _blankRegions[_numBlankRegions].length = length;
-    _blankRegions[_numBlankRegions].description = description;
-    _numBlankRegions++;
-    Serial.printf("[ESP32FirmwareDownloader] Added blank region: 0x%08X - 0x%08X (%s)\n", offset, offset+length, description);
-  } else {
-    Serial.println("[ESP32FirmwareDownloader] Maximum blank regions reached.");
+  uint8_t header[META_HEADER_SIZE];
+  memset(header, 0xFF, sizeof(header));
+  writeLE32(header, META_MAGIC);
+  header[4] = META_VERSION & 0xFF;
+  header[5] = META_VERSION >> 8;
+  header[6] = g_metaCount & 0xFF;
+  header[7] = g_metaCount >> 8;
+  writeLE32(header + 8, seq);
+  writeLE32(header + 12, bodyLen);
+  sha256Of(body, bodyLen, header + 16);
+
+  int slot = (g_metaSlot == 0) ? 1 : 0;
+  uint32_t base = slot * metaSlotSize();
+  uint32_t eraseLen = (META_HEADER_SIZE + bodyLen + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+  esp_err_t err = esp_partition_erase_range(g_metaPart, base, eraseLen);
+  Core::wearRecord(g_metaPart->address + base, eraseLen);
+  if (err == ESP_OK) err = esp_partition_write(g_metaPart, base + META_HEADER_SIZE, body, bodyLen);
+  if (err == ESP_OK) err = esp_partition_write(g_metaPart, base, header, sizeof(header));
+  Core::bumpGeneration(g_metaPart->address + base, eraseLen, false);
+  free(body);
+  if (err != ESP_OK) {
+    Serial.printf("[Meta] Commit to slot %d failed: %s\n", slot, esp_err_to_name(err));
+    g_metaDirty = true;
+    return false;
   }
+  g_metaSlot = slot;
+  g_metaSeq = seq;
+  g_metaCommits++;
+  Core::wearFlush();
+  Serial.printf("[Meta] Committed seq %u to slot %d (%u bytes).\n", seq, slot, bodyLen);
+  return true;
 }
 
-//////////////////////////
-// Constructor and Setters
-//////////////////////////
-ESP32FirmwareDownloader::ESP32FirmwareDownloader(const char* endpoint, const String &filename)
-  : _endpoint(endpoint),
-    _firmwareFilename(filename),
-    _blankOffset(0),
-    _blankLength(0)
-{
-  _instance = this;
-  _numBlankRegions = 0;
+// Recompute the SHA-256 and sector CRCs of one entry in a single pass.
+static bool metaRebuild(MetaEntry &e) {
+  uint32_t gen = Core::generationAt(e.address);
+  uint32_t *crc = (uint32_t*)malloc(e.sectors * 4);
+  uint8_t *buf = (uint8_t*)malloc(SECTOR_SIZE);
+  if (!crc || !buf) {
+    free(crc);
+    free(buf);
+    return false;
+  }
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  bool ok = true;
+  for (uint32_t i = 0; i < e.sectors && ok; i++) {
+    uint32_t n = (e.size - i * SECTOR_SIZE < SECTOR_SIZE) ? e.size - i * SECTOR_SIZE : SECTOR_SIZE;
+    ok = !Core::jobCancelled() && esp_flash_read(esp_flash_default_chip, buf, e.address + i * SECTOR_SIZE, n) == ESP_OK;
+    crc[i] = esp_rom_crc32_le(0, buf, n);
+    mbedtls_sha256_update(&sha, buf, n);
+    esp_task_wdt_reset();
+  }
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  free(buf);
+  if (!ok) {
+    free(crc);
+    return false;
+  }
+  xSemaphoreTake(g_metaLock, portMAX_DELAY);
+  free(e.crc);
+  e.crc = crc;
+  e.gen = gen;
+  memcpy(e.sha, digest, 32);
+  g_metaDirty = true;
+  g_metaRebuilds++;
+  xSemaphoreGive(g_metaLock);
+  hashCachePut(e.address, e.size, gen, crc[0], digest);
+  return true;
 }
 
-void ESP32FirmwareDownloader::setFilename(const String &filename) {
-  _firmwareFilename = filename;
+// Re-hash every stale entry and rewrite the store; runs as a low-priority job.
+static bool metaRebuildJob(void* arg) {
+  (void)arg;
+  int rebuilt = 0;
+  for (int i = 0; i < g_metaCount && !Core::jobCancelled(); i++) {
+    if (!metaFresh(g_metaEntries[i]) && metaRebuild(g_metaEntries[i])) rebuilt++;
+  }
+  if (g_metaDirty) metaCommit();
+  Core::jobMessage("%d partitions re-hashed", rebuilt);
+  return !Core::jobCancelled();
 }
 
-void ESP32FirmwareDownloader::setBlankRegion(uint32_t offset, uint32_t length) {
-  _blankOffset = offset;
-  _blankLength = length;
-  _numBlankRegions = 0;
-  addBlankRegion(offset, length, "manual");
+// Generation listener: every write outside the store's own commits.
+static void metaWake() {
+  if (g_metaTask) xTaskNotifyGive(g_metaTask);
 }
 
-bool ESP32FirmwareDownloader::autoSetUserDataBlank() {
-  const esp_partition_t* userPart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "userdata");
-  if (userPart != NULL) {
-    Serial.printf("[ESP32FirmwareDownloader] Found user data partition '%s' at 0x%08X, size: %u bytes\n",
-                  userPart->label, userPart->address, userPart->size);
-    _numBlankRegions = 0;
-    addBlankRegion(userPart->address, userPart->size, "userdata");
-    return true;
+static void metaTask(void* arg) {
+  (void)arg;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // Let bursts of writes (an upload in progress) settle first.
+    while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(META_SETTLE_MS)) > 0) {
+    }
+    // A rebuild still waiting in the queue picks up this change too.
+    if (!Core::jobActive("meta_rebuild", true)) {
+      Core::submitJob("meta_rebuild", Core::JOB_PRIO_LOW, metaRebuildJob, nullptr, nullptr, false);
+    }
   }
-  Serial.println("[ESP32FirmwareDownloader] No user data partition found with label 'userdata'.");
-  return false;
 }
 
-bool ESP32FirmwareDownloader::autoSetUserDataBlankAll() {
-  const char* labelsToBlank[] = {"nvs", "spiffs", "littlefs"};
-  bool found = false;
-  for (int i = 0; i < 3; i++) {
-    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, labelsToBlank[i]);
-    if (part) {
-      addBlankRegion(part->address, part->size, labelsToBlank[i]);
-      found = true;
+bool ESP32FirmwareDownloader::beginMetaStore(const char* label) {
+  if (g_metaPart) {
+    Serial.println("[Meta] Already started.");
+    return false;
+  }
+  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (!part || part->size < 2 * SECTOR_SIZE) {
+    Serial.printf("[Meta] No usable '%s' partition; persistent hashes disabled.\n", label);
+    return false;
+  }
+  g_metaPart = part;
+  g_metaLock = xSemaphoreCreateMutex();
+
+  // One entry per partition except the store itself.
+  g_metaCount = 0;
+  fwdl_partition_info_t page[8];
+  size_t total = 1;
+  for (size_t done = 0; done < total && g_metaCount < MAX_META_ENTRIES; ) {
+    total = fwdl_list_partitions(page, 8, done);
+    size_t n = total - done < 8 ? total - done : 8;
+    for (size_t i = 0; i < n && g_metaCount < MAX_META_ENTRIES; i++) {
+      if (page[i].address == part->address) continue;
+      MetaEntry &e = g_metaEntries[g_metaCount++];
+      memset(&e, 0, sizeof(e));
+      e.address = page[i].address;
+      e.size = page[i].size;
+      e.sectors = (e.size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+      e.crc = (uint32_t*)calloc(e.sectors, 4);
+      e.app = page[i].type == ESP_PARTITION_TYPE_APP;
     }
+    done += n;
   }
-  if (!found) {
-    Serial.println("[ESP32FirmwareDownloader] No NVS/Spiffs/LittleFS partitions found for blanking.");
+
+  // Pick the newest valid slot.
+  uint8_t *body = nullptr;
+  uint16_t count = 0;
+  uint32_t bodyLen = 0;
+  for (int slot = 0; slot < 2; slot++) {
+    uint32_t seq;
+    uint16_t n;
+    uint32_t len;
+    uint8_t *b = metaReadSlot(slot, &seq, &n, &len);
+    if (!b) continue;
+    if (body && seq <= g_metaSeq) {
+      free(b);
+      continue;
+    }
+    free(body);
+    body = b;
+    count = n;
+    bodyLen = len;
+    g_metaSeq = seq;
+    g_metaSlot = slot;
   }
-  return found;
-}
 
-////////////////////////////
-// HTTP Handlers
-////////////////////////////
+  int trusted = 0;
+  if (body) {
+    uint8_t *sector = (uint8_t*)malloc(SECTOR_SIZE);
+    for (uint16_t i = 0; i < count && (i + 1) * META_ENTRY_SIZE <= bodyLen; i++) {
+      const uint8_t *p = body + i * META_ENTRY_SIZE;
+      MetaEntry *e = metaFind(readLE32(p));
+      uint32_t crcOff = readLE32(p + 48);
+      if (!e || readLE32(p + 4) != e->size || readLE32(p + 8) != e->sectors ||
+          crcOff > bodyLen || e->sectors * 4 > bodyLen - crcOff) {
+        continue;   // partition table changed; rebuild this one
+      }
+      uint32_t storedGen = readLE32(p + 12);
+      memcpy(e->sha, p + 16, 32);
+      memcpy(e->crc, body + crcOff, e->sectors * 4);
+      bool ok = e->app && sector && storedGen != 0 &&
+                esp_flash_read(esp_flash_default_chip, sector, e->address, SECTOR_SIZE) == ESP_OK &&
+                esp_rom_crc32_le(0, sector, SECTOR_SIZE) == e->crc[0];
+      if (ok) {
+        e->gen = storedGen;
+        Core::seedGeneration(e->address, storedGen);
+        hashCachePut(e->address, e->size, storedGen, e->crc[0], e->sha);
+        trusted++;
+      } else {
+        Core::seedGeneration(e->address, storedGen + 1);
+      }
+    }
+    free(sector);
+    free(body);
+  }
+  Serial.printf("[Meta] Store '%s' seq %u: %d of %d partitions trusted, rest rebuild in background.\n",
+                label, g_metaSeq, trusted, g_metaCount);
 
-void ESP32FirmwareDownloader::handleDumpFlash(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Full flash dump request received.");
-  uint32_t flashSize = ESP.getFlashChipSize();
-  Serial.printf("[ESP32FirmwareDownloader] Flash size: %u bytes\n", flashSize);
-  g_flashSizeDirect = flashSize;
-  
-  AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream", flashStreamCallback);
-  response->addHeader("Content-Disposition", "attachment; filename=fullclone.bin");
-  Serial.println("[ESP32FirmwareDownloader] Streaming full flash dump...");
-  request->send(response);
+  if (xTaskCreate(metaTask, "fwdl_meta", 4096, nullptr, 1, &g_metaTask) != pdPASS) {
+    Serial.println("[Meta] Failed to start worker task.");
+    g_metaTask = nullptr;
+    return false;
+  }
+  Core::setGenerationListener(metaWake);
+  xTaskNotifyGive(g_metaTask);
+  return true;
 }
 
-void ESP32FirmwareDownloader::handleDumpFlashSecure(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Secure full flash dump request received.");
-  uint32_t flashSize = ESP.getFlashChipSize();
-  Serial.printf("[ESP32FirmwareDownloader] Flash size: %u bytes\n", flashSize);
-  g_flashSizeDirect = flashSize;
-  
-  AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream", flashStreamCallbackBlanked);
-  response->addHeader("Content-Disposition", "attachment; filename=fullclone_secure.bin");
-  Serial.println("[ESP32FirmwareDownloader] Streaming secure full flash dump...");
-  request->send(response);
-}
+#endif  // FWDL_ENABLE_HASHING
 
-void ESP32FirmwareDownloader::handleDownloadPartitionDirect(AsyncWebServerRequest *request) {
-  if (!request->hasParam("label")) {
-    request->send(400, "text/plain", "Missing 'label' parameter");
-    return;
+#if FWDL_ENABLE_UPLOAD || FWDL_ENABLE_COMPRESSION || FWDL_ENABLE_DEDUP
+static bool isErased(const uint8_t *buf, size_t len) {
+  const uint32_t *w = (const uint32_t*)buf;
+  for (size_t i = 0; i < len / 4; i++) {
+    if (w[i] != 0xFFFFFFFF) return false;
   }
-  String label = request->getParam("label")->value();
-  Serial.printf("[ESP32FirmwareDownloader] Direct partition download for label: %s\n", label.c_str());
-  
-  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
-  if (!part) {
-    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
+  return true;
+}
+#endif
+
+#if FWDL_ENABLE_UPLOAD || FWDL_ENABLE_MULTICAST
+// Destination ranges we never write: boot region, partition table, running
+// app, otadata, NVS keys and the live NVS partition ("nvs"). allowNvs admits
+// the live NVS for a labelled restore that reboots straight afterwards, so the
+// app's cached NVS state is not written back over the restored pages.
+static bool isProtectedDestination(uint32_t addr, uint32_t length, bool allowNvs = false) {
+  auto overlaps = [addr, length](const esp_partition_t* p) {
+    return p && addr < p->address + p->size && p->address < addr + length;
+  };
+  if (addr < PARTITION_TABLE_END) return true;
+  if (overlaps(esp_ota_get_running_partition())) return true;
+  if (overlaps(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, NULL))) return true;
+  if (overlaps(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS, NULL))) {
+    return true;
   }
-  if (!part) {
-    request->send(404, "text/plain", "Partition not found");
-    return;
+  if (!allowNvs && overlaps(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, "nvs"))) {
+    return true;
   }
-  Serial.printf("[ESP32FirmwareDownloader] Partition %s found, size %u bytes\n", part->label, part->size);
-  
-  g_genPartStart = part->address;
-  g_genPartSize  = part->size;
-  
-  AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream", genericPartStreamCallback);
-  response->addHeader("Content-Disposition", "attachment; filename=" + label + ".bin");
-  Serial.println("[ESP32FirmwareDownloader] Streaming generic partition...");
-  request->send(response);
+  return false;
 }
+#endif
 
-void ESP32FirmwareDownloader::handleDownloadBoot(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Bootloader download request received.");
-  AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream",
-    [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
-      if (index >= BOOTLOADER_SIZE) return 0;
-      size_t toRead = ((BOOTLOADER_SIZE - index) < maxLen) ? (BOOTLOADER_SIZE - index) : maxLen;
-      esp_err_t err = esp_flash_read(esp_flash_default_chip, buffer, BOOTLOADER_OFFSET + index, toRead);
-      if (err != ESP_OK) {
-        Serial.printf("[BootloaderStream] Error at 0x%08X: %s\n", BOOTLOADER_OFFSET + index, esp_err_to_name(err));
-        return 0;
-      }
-      return toRead;
-    });
-  response->addHeader("Content-Disposition", "attachment; filename=bootloader.bin");
-  Serial.println("[ESP32FirmwareDownloader] Streaming bootloader...");
-  request->send(response);
-}
+#if FWDL_ENABLE_UPLOAD
+// Result counters for copyFlashRange().
+struct CopyStats {
+  uint32_t sectors;
+  uint32_t skippedErased;   // source erased and destination already erased
+  uint32_t unchanged;       // destination already held the source content
+  uint32_t erased;          // destination sectors erased
+  uint32_t written;         // destination sectors programmed
+};
 
-void ESP32FirmwareDownloader::handleActivatePartition(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Activate partition request received.");
-  const esp_partition_t* current = esp_ota_get_running_partition();
-  const esp_partition_t* target = nullptr;
+// True when dst can become src by programming alone (flash bits only clear).
+static bool programmableOver(const uint8_t *dst, const uint8_t *src, size_t len) {
+  const uint32_t *d = (const uint32_t*)dst;
+  const uint32_t *s = (const uint32_t*)src;
+  for (size_t i = 0; i < len / 4; i++) {
+    if ((d[i] & s[i]) != s[i]) return false;
+  }
+  return true;
+}
+
+// Sector-wise copy between two sector-aligned flash ranges. Erased source
+// sectors and sectors the destination already matches are skipped, and a
+// destination sector is only erased when the new content cannot be
+// programmed over it. progress (optional) receives the bytes processed.
+static bool copyFlashRange(uint32_t srcAddr, uint32_t dstAddr, uint32_t length, CopyStats *stats,
+                           volatile uint32_t *progress) {
+  if ((srcAddr | dstAddr | length) % SECTOR_SIZE) {
+    Serial.println("[Copy] Addresses and length must be sector aligned.");
+    return false;
+  }
+  uint8_t *src = (uint8_t*)malloc(SECTOR_SIZE);
+  uint8_t *dst = (uint8_t*)malloc(SECTOR_SIZE);
+  if (!src || !dst) {
+    free(src);
+    free(dst);
+    Serial.println("[Copy] Out of memory.");
+    return false;
+  }
+  memset(stats, 0, sizeof(*stats));
+  bool ok = true;
+  for (uint32_t off = 0; off < length && ok; off += SECTOR_SIZE) {
+    if (Core::jobCancelled()) {
+      Serial.printf("[Copy] Cancelled at offset %u.\n", off);
+      ok = false;
+      break;
+    }
+    stats->sectors++;
+    esp_err_t err = esp_flash_read(esp_flash_default_chip, src, srcAddr + off, SECTOR_SIZE);
+    if (err == ESP_OK) err = esp_flash_read(esp_flash_default_chip, dst, dstAddr + off, SECTOR_SIZE);
+    if (err != ESP_OK) {
+      Serial.printf("[Copy] Read failed at offset %u (%s)!\n", off, esp_err_to_name(err));
+      ok = false;
+      break;
+    }
+    bool srcErased = isErased(src, SECTOR_SIZE);
+    if (memcmp(src, dst, SECTOR_SIZE) == 0) {
+      if (srcErased) stats->skippedErased++;
+      else stats->unchanged++;
+    } else {
+      if (!programmableOver(dst, src, SECTOR_SIZE)) {
+        err = esp_flash_erase_region(esp_flash_default_chip, dstAddr + off, SECTOR_SIZE);
+        Core::wearRecord(dstAddr + off, SECTOR_SIZE);
+        stats->erased++;
+      }
+      if (err == ESP_OK && !srcErased) {
+        err = esp_flash_write(esp_flash_default_chip, src, dstAddr + off, SECTOR_SIZE);
+        stats->written++;
+      }
+      Core::bumpGeneration(dstAddr + off, SECTOR_SIZE);
+      if (err != ESP_OK) {
+        Serial.printf("[Copy] Erase/write failed at 0x%08X (%s)!\n", dstAddr + off, esp_err_to_name(err));
+        ok = false;
+      }
+    }
+    if (progress) *progress = off + SECTOR_SIZE;
+    esp_task_wdt_reset();
+    yield();
+  }
+  free(src);
+  free(dst);
+  Serial.printf("[Copy] 0x%08X -> 0x%08X: %u sectors, %u erased-skipped, %u unchanged, %u erased, %u written\n",
+                srcAddr, dstAddr, stats->sectors, stats->skippedErased, stats->unchanged, stats->erased, stats->written);
+  return ok;
+}
+
+// True when the source bytes past length (up to srcLength) are all erased, so
+// copying only length bytes loses nothing.
+static bool sourceTailErased(uint32_t srcAddr, uint32_t length, uint32_t srcLength) {
+  if (srcLength <= length) return true;
+  uint8_t *buf = (uint8_t*)malloc(SECTOR_SIZE);
+  bool tailErased = buf != nullptr;
+  for (uint32_t off = length; off < srcLength && tailErased; off += SECTOR_SIZE) {
+    tailErased = esp_flash_read(esp_flash_default_chip, buf, srcAddr + off, SECTOR_SIZE) == ESP_OK &&
+                 isErased(buf, SECTOR_SIZE);
+  }
+  free(buf);
+  return tailErased;
+}
+
+static const esp_partition_t* findInactiveApp() {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  const esp_partition_t *inactive = nullptr;
+  while (it != NULL) {
+    const esp_partition_t *p = esp_partition_get(it);
+    if (p && running && (p->address != running->address)) {
+      inactive = p;
+      break;
+    }
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+  return inactive;
+}
+
+// Clone the active APP partition to the inactive APP partition. progress
+// (optional) receives the bytes processed.
+static bool cloneActiveToInactive(volatile uint32_t *progress) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (!running) {
+    Serial.println("Failed to get running partition!");
+    return false;
+  }
+  const esp_partition_t *inactive = findInactiveApp();
+  if (!inactive) {
+    Serial.println("Inactive partition not found!");
+    return false;
+  }
+  if (inactive->size < running->size) {
+    Serial.println("Inactive partition is smaller than the running one!");
+    return false;
+  }
+  if (isPartitionValid(inactive)) {
+    Serial.println("Inactive partition appears valid; cloning anyway.");
+  } else {
+    Serial.println("Inactive partition appears empty; proceeding with clone.");
+  }
+
+  Serial.printf("Cloning %u bytes from 0x%08X to 0x%08X...\n", running->size, running->address, inactive->address);
+  CopyStats stats;
+  if (!copyFlashRange(running->address, inactive->address, running->size, &stats, progress)) {
+    return false;
+  }
+
+  // esp_ota_set_boot_partition() verifies the copied image before selecting it.
+  esp_err_t err = esp_ota_set_boot_partition(inactive);
+  bumpOtadata();
+  if (err != ESP_OK) {
+    Serial.printf("esp_ota_set_boot_partition failed (%s)!\n", esp_err_to_name(err));
+    return false;
+  }
   
-  if (request->hasParam("label")) {
-    String label = request->getParam("label")->value();
-    target = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
-    if (!target) {
-      request->send(404, "text/plain", "Specified partition not found");
+  Serial.println("Clone complete; inactive partition activated.");
+  return true;
+}
+
+static bool cloneJob(void* arg) {
+  (void)arg;
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  Job* job = Core::currentJob();
+  job->total = running ? running->size : 0;
+  bool ok = cloneActiveToInactive(&job->done);
+  Core::jobMessage(ok ? "cloned and activated" : (Core::jobCancelled() ? "cancelled" : "clone failed"));
+  return ok;
+}
+#endif  // FWDL_ENABLE_UPLOAD
+
+//////////////////////////////
+// Normalized Dumps
+//////////////////////////////
+// ?normalize=1 canonicalizes structures that differ between identically
+// provisioned units, so equal devices produce byte-identical dumps:
+//   otadata   rewritten as the minimal entry selecting the same slot and state
+//   NVS       page sequence numbers renumbered by age, header CRCs recomputed
+//   PHY cal   "cal_*" blobs in the "phy" namespace (calibration, MAC) zeroed
+//             with their data and item CRCs recomputed
+//   coredump  treated as empty
+// Unlike blanking, the result is still a valid image. The changes are built as
+// a per-stream patch list when a normalized stream starts and applied in
+// readSource(), the same way blank regions are. NVS item placement itself is not reordered,
+// so units must have been provisioned by the same sequence of writes.
+
+static const uint32_t NVS_PAGE_ACTIVE    = 0xFFFFFFFE;
+static const uint32_t NVS_PAGE_FULL      = 0xFFFFFFFC;
+static const uint32_t NVS_PAGE_FREEING   = 0xFFFFFFF8;
+static const int      NVS_ENTRIES        = 126;
+static const size_t   NVS_ENTRY_SIZE     = 32;
+static const size_t   NVS_ENTRIES_OFFSET = 64;
+static const uint8_t  NVS_TYPE_U8        = 0x01;
+static const uint8_t  NVS_TYPE_BLOB      = 0x41;
+static const uint8_t  NVS_TYPE_BLOB_DATA = 0x42;
+static const uint32_t OTA_STATE_INVALID  = 3;
+static const uint32_t OTA_STATE_ABORTED  = 4;
+
+struct NormPatch {
+  uint32_t addr;
+  uint32_t len;
+  bool literal;          // copy bytes[] (len <= 32), otherwise fill
+  uint8_t fill;
+  uint8_t bytes[32];
+};
+
+struct NormalizePlan {
+  NormPatch* patches = nullptr;
+  int count = 0;
+  int capacity = 0;
+
+  ~NormalizePlan() { free(patches); }
+};
+
+static void normAdd(NormalizePlan &plan, uint32_t addr, uint32_t len, const uint8_t *bytes, uint8_t fill) {
+  if (plan.count == plan.capacity) {
+    int cap = plan.capacity ? plan.capacity * 2 : 32;
+    NormPatch *grown = (NormPatch*)realloc(plan.patches, cap * sizeof(NormPatch));
+    if (!grown) {
+      Serial.println("[Normalize] Out of memory; patch list truncated.");
       return;
     }
-    if (target->address == current->address) {
-      request->send(400, "text/plain", "Specified partition is already running");
-      return;
+    plan.patches = grown;
+    plan.capacity = cap;
+  }
+  NormPatch &p = plan.patches[plan.count++];
+  p.addr = addr;
+  p.len = len;
+  p.literal = bytes != nullptr;
+  p.fill = fill;
+  if (bytes) memcpy(p.bytes, bytes, len);
+}
+
+static uint32_t otaEntryCrc(uint32_t seq) {
+  return esp_rom_crc32_le(UINT32_MAX, (const uint8_t*)&seq, 4);
+}
+
+static void normOtadata(NormalizePlan &plan) {
+  const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, NULL);
+  if (!part) return;
+  int slots = 0;
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL) {
+    const esp_partition_t* p = esp_partition_get(it);
+    if (p->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MIN && p->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_MAX) slots++;
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+
+  // Winner: the valid, usable entry with the highest sequence (as the bootloader picks).
+  uint32_t bestSeq = 0, bestState = 0;
+  bool found = false;
+  for (int i = 0; i < 2; i++) {
+    uint8_t e[32];
+    if (esp_partition_read(part, i * SECTOR_SIZE, e, sizeof(e)) != ESP_OK) continue;
+    uint32_t seq = readLE32(e);
+    uint32_t state = readLE32(e + 24);
+    if (seq == UINT32_MAX || readLE32(e + 28) != otaEntryCrc(seq)) continue;
+    if (state == OTA_STATE_INVALID || state == OTA_STATE_ABORTED) continue;
+    if (!found || seq > bestSeq) {
+      bestSeq = seq;
+      bestState = state;
+      found = true;
     }
+  }
+  if (found && slots > 0) {
+    uint8_t e[32];
+    uint32_t seq = (bestSeq - 1) % slots + 1;
+    memset(e, 0xFF, sizeof(e));
+    writeLE32(e, seq);
+    writeLE32(e + 24, bestState);
+    writeLE32(e + 28, otaEntryCrc(seq));
+    normAdd(plan, part->address, sizeof(e), e, 0);
+    normAdd(plan, part->address + sizeof(e), SECTOR_SIZE - sizeof(e), nullptr, 0xFF);
   } else {
-    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
-    while (it != NULL) {
-      const esp_partition_t* p = esp_partition_get(it);
-      if (p && (p->address != current->address)) {
-        target = p;
-        break;
+    normAdd(plan, part->address, SECTOR_SIZE, nullptr, 0xFF);
+  }
+  normAdd(plan, part->address + SECTOR_SIZE, part->size - SECTOR_SIZE, nullptr, 0xFF);
+}
+
+static uint32_t nvsItemCrc(const uint8_t *item) {
+  uint32_t crc = esp_rom_crc32_le(0xFFFFFFFF, item, 4);
+  crc = esp_rom_crc32_le(crc, item + 8, 16);
+  return esp_rom_crc32_le(crc, item + 24, 8);
+}
+
+static inline bool nvsEntryWritten(const uint8_t *page, int i) {
+  return ((page[32 + i / 4] >> ((i % 4) * 2)) & 3) == 2;
+}
+
+static void normNvs(NormalizePlan &plan, const esp_partition_t* part, uint8_t *page) {
+  uint32_t pages = part->size / SECTOR_SIZE;
+  uint32_t *seqs = (uint32_t*)malloc(pages * sizeof(uint32_t));
+  uint32_t used = 0;
+  if (!seqs) return;
+  int phyIndex = -1;
+
+  // Pass 1: page sequence numbers and the "phy" namespace index.
+  for (uint32_t pg = 0; pg < pages; pg++) {
+    if (esp_partition_read(part, pg * SECTOR_SIZE, page, SECTOR_SIZE) != ESP_OK) continue;
+    uint32_t state = readLE32(page);
+    if (state != NVS_PAGE_ACTIVE && state != NVS_PAGE_FULL && state != NVS_PAGE_FREEING) continue;
+    seqs[used++] = readLE32(page + 4);
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+      const uint8_t *item = page + NVS_ENTRIES_OFFSET + i * NVS_ENTRY_SIZE;
+      if (nvsEntryWritten(page, i) && item[0] == 0 && item[1] == NVS_TYPE_U8 &&
+          strncmp((const char*)item + 8, "phy", 16) == 0) {
+        phyIndex = item[24];
       }
-      it = esp_partition_next(it);
     }
-    if (!target) {
-      request->send(500, "text/plain", "Inactive partition not found");
-      return;
+  }
+
+  // Pass 2: renumber pages by the rank of their sequence, zero calibration blobs.
+  for (uint32_t pg = 0; pg < pages; pg++) {
+    if (esp_partition_read(part, pg * SECTOR_SIZE, page, SECTOR_SIZE) != ESP_OK) continue;
+    uint32_t state = readLE32(page);
+    if (state != NVS_PAGE_ACTIVE && state != NVS_PAGE_FULL && state != NVS_PAGE_FREEING) continue;
+    uint32_t addr = part->address + pg * SECTOR_SIZE;
+    uint32_t seq = readLE32(page + 4);
+    uint32_t rank = 0;
+    for (uint32_t k = 0; k < used; k++) {
+      if (seqs[k] < seq) rank++;
+    }
+    if (rank != seq) {
+      uint8_t header[32];
+      memcpy(header, page, sizeof(header));
+      writeLE32(header + 4, rank);
+      writeLE32(header + 28, esp_rom_crc32_le(0xFFFFFFFF, header + 4, 24));
+      normAdd(plan, addr, sizeof(header), header, 0);
+    }
+    if (phyIndex < 0) continue;
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+      uint8_t *item = page + NVS_ENTRIES_OFFSET + i * NVS_ENTRY_SIZE;
+      if (!nvsEntryWritten(page, i) || item[0] != phyIndex || strncmp((const char*)item + 8, "cal_", 4) != 0) continue;
+      if (item[1] != NVS_TYPE_BLOB && item[1] != NVS_TYPE_BLOB_DATA) continue;
+      uint16_t size = item[24] | (item[25] << 8);
+      if (item[2] < 1 || size > (item[2] - 1) * NVS_ENTRY_SIZE || i + item[2] > NVS_ENTRIES) continue;
+      uint32_t dataCrc = 0xFFFFFFFF;
+      uint8_t zeros[32] = {0};
+      for (uint16_t done = 0; done < size; done += sizeof(zeros)) {
+        uint32_t n = (size - done < (int)sizeof(zeros)) ? size - done : sizeof(zeros);
+        dataCrc = esp_rom_crc32_le(dataCrc, zeros, n);
+      }
+      uint8_t fixed[32];
+      memcpy(fixed, item, sizeof(fixed));
+      writeLE32(fixed + 28, dataCrc);
+      writeLE32(fixed + 4, nvsItemCrc(fixed));
+      uint32_t itemAddr = addr + NVS_ENTRIES_OFFSET + i * NVS_ENTRY_SIZE;
+      normAdd(plan, itemAddr, sizeof(fixed), fixed, 0);
+      normAdd(plan, itemAddr + NVS_ENTRY_SIZE, size, nullptr, 0x00);
     }
   }
-  
-  if (!isPartitionValid(target)) {
-    request->send(400, "text/plain", "Partition appears empty/unavailable");
+  free(seqs);
+}
+
+// Rebuild a stream's patch list from the current flash contents. Each
+// normalized stream owns its plan; consistent mode rebuilds it before every
+// re-hash so re-read sectors are patched against what flash holds now.
+static void buildNormalizePlan(NormalizePlan &plan) {
+  plan.count = 0;
+  uint8_t *page = (uint8_t*)malloc(SECTOR_SIZE);
+  if (!page) {
+    Serial.println("[Normalize] Out of memory; dump left unnormalized.");
     return;
   }
-  
-  esp_err_t err = esp_ota_set_boot_partition(target);
+  normOtadata(plan);
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+  while (it != NULL) {
+    normNvs(plan, esp_partition_get(it), page);
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+  it = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, NULL);
+  while (it != NULL) {
+    const esp_partition_t* p = esp_partition_get(it);
+    normAdd(plan, p->address, p->size, nullptr, 0xFF);
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+  free(page);
+  Serial.printf("[Normalize] %d patches prepared.\n", plan.count);
+}
+
+// The plan for a request carrying ?normalize=1, or null without it.
+static std::shared_ptr<NormalizePlan> requestedNormalizePlan(AsyncWebServerRequest *request) {
+  if (!request->hasParam("normalize") || request->getParam("normalize")->value() == "0") return nullptr;
+  std::shared_ptr<NormalizePlan> plan = std::make_shared<NormalizePlan>();
+  buildNormalizePlan(*plan);
+  return plan;
+}
+
+static void applyNormalization(const NormalizePlan &plan, uint32_t addr, uint8_t *buffer, size_t len) {
+  for (int i = 0; i < plan.count; i++) {
+    const NormPatch &p = plan.patches[i];
+    if (p.addr >= addr + len || addr >= p.addr + p.len) continue;
+    uint32_t s = (p.addr > addr) ? p.addr : addr;
+    uint32_t e = (p.addr + p.len < addr + len) ? p.addr + p.len : addr + len;
+    if (p.literal) memcpy(buffer + (s - addr), p.bytes + (s - p.addr), e - s);
+    else memset(buffer + (s - addr), p.fill, e - s);
+  }
+}
+
+//////////////////////////
+// Streaming Callback Functions
+//////////////////////////
+
+ESP32FirmwareDownloader::FlashSource ESP32FirmwareDownloader::makeSource(uint32_t start, uint32_t length,
+                                                                         bool blanked, const char* tag) {
+  FlashSource src;
+  src.start = start;
+  src.length = length;
+  src.blanked = blanked;
+  src.normalize = nullptr;
+  src.tag = tag;
+  src.lastPrinted = 0;
+  return src;
+}
+
+size_t ESP32FirmwareDownloader::readSource(FlashSource &src, uint8_t *buffer, size_t maxLen, size_t index) {
+  if (index >= src.length) return 0;
+  size_t bytesToRead = ((src.length - index) < maxLen) ? (src.length - index) : maxLen;
+  uint32_t addr = src.start + index;
+  // Blank regions are replaced with 0xFF by the engine.
+  esp_err_t err = fwdl_read(addr, buffer, bytesToRead, src.blanked);
   if (err != ESP_OK) {
-    String errMsg = "Failed to set boot partition: ";
-    errMsg += esp_err_to_name(err);
-    request->send(500, "text/plain", errMsg);
-    return;
+    Serial.printf("[%s] Error at 0x%08X: %s\n", src.tag, addr, esp_err_to_name(err));
+    return 0;
   }
-  
-  String msg = "Partition ";
-  msg += target->label;
-  msg += " activated. Rebooting now...";
-  request->send(200, "text/plain", msg);
-  Serial.println("[ESP32FirmwareDownloader] Partition activated. Rebooting...");
-  delay(2000);
-  esp_restart();
+  if (src.normalize) {
+    applyNormalization(*src.normalize, addr, buffer, bytesToRead);
+  }
+  if (index - src.lastPrinted >= CHUNK_SIZE * 10) {
+    Serial.printf("[%s] Streamed %u/%u bytes...\n", src.tag, index + bytesToRead, src.length);
+    src.lastPrinted = index;
+  }
+  esp_task_wdt_reset();
+  return bytesToRead;
 }
 
-void ESP32FirmwareDownloader::handleClonePartition(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Clone partition request received.");
-  if (cloneActiveToInactive()) {
-    request->send(200, "text/plain", "Clone successful.");
-  } else {
-    request->send(500, "text/plain", "Clone failed.");
+//////////////////////////////
+// Stream Session Tracking
+//////////////////////////////
+// Slots, statistics and the watchdog live in FirmwareDownloaderCore; every
+// AsyncTCP-based transport registers its streams there with this close
+// callback.
+
+// Runs on the esp_timer task: arm AsyncTCP's own rx/ack timeouts so the
+// actual close happens on the TCP task that owns the connection.
+static void closeAsyncClient(void* owner) {
+  AsyncClient* client = (AsyncClient*)owner;
+  client->setRxTimeout(1);
+  client->setAckTimeout(1000);
+}
+
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginTrackedResponse(AsyncWebServerRequest *request, const char* tag,
+                                                                      size_t totalLen, AwsResponseFiller filler,
+                                                                      std::function<size_t()> sourceProgress) {
+  uint32_t id = 0;
+  int slot = Core::acquireSession(tag, totalLen, &id, closeAsyncClient, request->client());
+  if (slot < 0) {
+    request->send(503, "text/plain", "Too many active downloads");
+    return nullptr;
   }
+  request->onDisconnect([slot, id]() { Core::releaseSession(slot, id); });
+  return request->beginChunkedResponse("application/octet-stream",
+    [slot, id, filler, sourceProgress](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      size_t n = filler(buffer, maxLen, index);
+      if (n == RESPONSE_TRY_AGAIN) return n;   // paced stage, nothing produced yet
+      Core::noteSessionProgress(slot, id, sourceProgress ? sourceProgress() : index + n, index + n);
+      return n;
+    });
 }
 
-void ESP32FirmwareDownloader::handleRoot(AsyncWebServerRequest *request) {
-  Serial.println("[ESP32FirmwareDownloader] Sending FWDL root page with device metadata and partition map.");
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginSourceResponse(AsyncWebServerRequest *request,
+                                                                     const FlashSource &src) {
+  FlashSource state = src;
+  return beginTrackedResponse(request, src.tag, src.length,
+    [state](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+      // An unaligned start (only /dumprange produces one) reads up to the
+      // next sector boundary first; aligned streams keep their chunking.
+      uint32_t lead = (SECTOR_SIZE - state.start % SECTOR_SIZE) % SECTOR_SIZE;
+      if (index == 0 && lead && maxLen > lead) maxLen = lead;
+      return readSource(state, buffer, maxLen, index);
+    });
+}
 
-  const esp_partition_t* running = esp_ota_get_running_partition();
-  String chipModel = ESP.getChipModel();
-  String chipRevision = String(ESP.getChipRevision());
-  float flashMB = ESP.getFlashChipSize() / (1024.0 * 1024.0);
-  String cpuFreq = String(ESP.getCpuFreqMHz());
+void ESP32FirmwareDownloader::setStallPolicy(uint32_t minBytesPerSec, uint32_t stallSeconds, uint32_t idleTimeoutSeconds) {
+  Core::setStallPolicy(minBytesPerSec, stallSeconds, idleTimeoutSeconds);
+}
 
-  String htmlHeader = R"rawliteral(
-<html>
-  <head>
-    <title>ESP32 Firmware Download (FWDL)</title>
-    <style>
-      body { font-family: Arial, sans-serif; margin: 20px; }
-      table { border-collapse: collapse; width: 90%; }
-      th, td { border: 1px solid #ccc; padding: 8px; text-align: center; }
-      th { background-color: #f2f2f2; }
-      .highlight { background-color: #c0ffc0; }
-      .nav { margin-top: 20px; }
-      .nav a { margin-right: 10px; text-decoration: none; color: blue; }
-      .nav a:hover { text-decoration: underline; }
-    </style>
-    <script>
-      document.addEventListener("DOMContentLoaded", function() {
-        var table = document.querySelector("table");
-        if (table) {
-          table.addEventListener("mouseover", function(e) {
-            var target = e.target;
-            if (target && target.hasAttribute("data-index")) {
-              var idx = target.getAttribute("data-index");
-              var row = target.closest("tr");
-              if (row) {
-                var cells = row.querySelectorAll('[data-index="' + idx + '"]');
-                cells.forEach(function(cell) { cell.classList.add("highlight"); });
-              }
-            }
-          });
-          table.addEventListener("mouseout", function(e) {
-            var target = e.target;
-            if (target && target.hasAttribute("data-index")) {
-              var idx = target.getAttribute("data-index");
-              var row = target.closest("tr");
-              if (row) {
-                var cells = row.querySelectorAll('[data-index="' + idx + '"]');
-                cells.forEach(function(cell) { cell.classList.remove("highlight"); });
-              }
-            }
-          });
+ESP32FirmwareDownloader::StreamStats ESP32FirmwareDownloader::getStreamStats() {
+  return Core::streamStats();
+}
+
+//////////////////////////////
+// Consistent Dumps
+//////////////////////////////
+// With ?consistent=1 a dump records a CRC-32 for every sector of a DATA
+// partition as it streams. After the image it re-hashes those sectors and
+// appends a patch block re-sending each one that changed meanwhile:
+//   "FWPB" | round u32 | count u32 | sector size u32, then count x (address u32 | sector)
+// Rounds repeat (up to CONSISTENT_MAX_ROUNDS) until a re-hash finds no change;
+// the stream ends with "FWPE" | rounds u32 | resent u32 | unsettled u32.
+// Applying the blocks in order yields a point-in-time image. The image length
+// is sent in X-Image-Length so clients know where the patch section starts.
+// The re-hash runs on the TCP task, so it reads CONSISTENT_REHASH_SECTORS per
+// filler call and answers RESPONSE_TRY_AGAIN until it has covered them all.
+
+static const int      CONSISTENT_MAX_RANGES = 16;
+static const uint32_t CONSISTENT_MAX_ROUNDS = 3;
+static const uint32_t CONSISTENT_REHASH_SECTORS = 32;   // 128 KB read per filler call
+static const size_t   PATCH_HEADER_SIZE     = 16;
+
+enum ConsistentPhase { CD_IMAGE, CD_REHASH, CD_PATCH, CD_END, CD_DONE };
+
+struct TrackedRange {
+  uint32_t addr;      // absolute, sector aligned
+  uint32_t sectors;
+  uint32_t first;     // index of the first sector in crc[]
+};
+
+struct ESP32FirmwareDownloader::ConsistentDump {
+  FlashSource src;
+  ConsistentPhase phase;
+  TrackedRange ranges[CONSISTENT_MAX_RANGES];
+  int numRanges;
+  uint32_t numSectors;
+  uint32_t *crc;           // CRC of the sector as last sent
+  uint8_t *dirty;          // set by consistentRehash()
+  uint32_t cursor;         // next sector to re-hash (CD_REHASH) or to consider for patching
+  uint32_t changed;        // dirty sectors found by the current re-hash
+  uint32_t round;
+  uint32_t resent;
+  uint32_t unsettled;
+  uint8_t *pending;        // staged header/record awaiting buffer space
+  size_t pendingLen;
+  size_t pendingOff;
+
+  ~ConsistentDump() {
+    free(crc);
+    free(dirty);
+    free(pending);
+  }
+};
+
+// Fold freshly streamed bytes [addr, addr+len) into the per-sector CRCs.
+// Sectors arrive in order, so the running CRC equals the CRC of the whole sector.
+static void trackStreamed(TrackedRange *ranges, int numRanges, uint32_t *crc,
+                          const uint8_t *data, uint32_t addr, size_t len) {
+  for (int r = 0; r < numRanges; r++) {
+    uint32_t rs = ranges[r].addr;
+    uint32_t re = rs + ranges[r].sectors * SECTOR_SIZE;
+    uint32_t s = (addr > rs) ? addr : rs;
+    uint32_t e = (addr + len < re) ? addr + len : re;
+    while (s < e) {
+      uint32_t sectorEnd = (s / SECTOR_SIZE + 1) * SECTOR_SIZE;
+      uint32_t pieceEnd = (sectorEnd < e) ? sectorEnd : e;
+      uint32_t idx = ranges[r].first + (s - rs) / SECTOR_SIZE;
+      crc[idx] = esp_rom_crc32_le(crc[idx], data + (s - addr), pieceEnd - s);
+      s = pieceEnd;
+    }
+  }
+}
+
+// Absolute address of tracked sector idx.
+static uint32_t trackedAddress(const TrackedRange *ranges, int numRanges, uint32_t idx) {
+  for (int r = 0; r < numRanges; r++) {
+    if (idx < ranges[r].first + ranges[r].sectors) return ranges[r].addr + (idx - ranges[r].first) * SECTOR_SIZE;
+  }
+  return 0;
+}
+
+// Re-read the next CONSISTENT_REHASH_SECTORS tracked sectors from d.cursor,
+// marking and counting in d.changed those whose CRC moved. True once every
+// sector has been covered.
+bool ESP32FirmwareDownloader::consistentRehash(ConsistentDump &d) {
+  // NVS renumbering depends on every page, so a normalized dump re-plans first.
+  if (d.cursor == 0 && d.src.normalize) buildNormalizePlan(*d.src.normalize);
+  uint32_t end = d.cursor + CONSISTENT_REHASH_SECTORS;
+  if (end > d.numSectors) end = d.numSectors;
+  for (; d.cursor < end; d.cursor++) {
+    uint32_t index = trackedAddress(d.ranges, d.numRanges, d.cursor) - d.src.start;
+    if (readSource(d.src, d.pending, SECTOR_SIZE, index) != SECTOR_SIZE) continue;
+    d.dirty[d.cursor] = esp_rom_crc32_le(0, d.pending, SECTOR_SIZE) != d.crc[d.cursor];
+    if (d.dirty[d.cursor]) d.changed++;
+  }
+  return d.cursor >= d.numSectors;
+}
+
+size_t ESP32FirmwareDownloader::consistentFill(ConsistentDump &d, uint8_t *buffer, size_t maxLen, size_t index) {
+  while (true) {
+    if (d.pendingOff < d.pendingLen) {
+      size_t n = d.pendingLen - d.pendingOff;
+      if (n > maxLen) n = maxLen;
+      memcpy(buffer, d.pending + d.pendingOff, n);
+      d.pendingOff += n;
+      return n;
+    }
+    d.pendingLen = d.pendingOff = 0;
+
+    switch (d.phase) {
+      case CD_IMAGE: {
+        size_t n = readSource(d.src, buffer, maxLen, index);
+        if (n > 0) {
+          trackStreamed(d.ranges, d.numRanges, d.crc, buffer, d.src.start + index, n);
+          return n;
         }
-      });
-    </script>
-  </head>
-  <body>
+        if (index < d.src.length) return 0;    // read error ends the response
+        d.phase = CD_REHASH;
+        d.cursor = 0;
+        d.changed = 0;
+        break;
+      }
+
+      case CD_REHASH:
+        if (!consistentRehash(d)) return RESPONSE_TRY_AGAIN;
+        if (d.round >= CONSISTENT_MAX_ROUNDS || d.changed == 0) {
+          d.unsettled = d.changed;
+          d.phase = CD_END;
+          break;
+        }
+        d.round++;
+        d.cursor = 0;
+        d.phase = CD_PATCH;
+        memcpy(d.pending, "FWPB", 4);
+        writeLE32(d.pending + 4, d.round);
+        writeLE32(d.pending + 8, d.changed);
+        writeLE32(d.pending + 12, SECTOR_SIZE);
+        d.pendingLen = PATCH_HEADER_SIZE;
+        Serial.printf("[%s] Patch round %u: %u sectors changed during dump.\n", d.src.tag, d.round, d.changed);
+        break;
+
+      case CD_PATCH: {
+        while (d.cursor < d.numSectors && !d.dirty[d.cursor]) d.cursor++;
+        if (d.cursor >= d.numSectors) {
+          d.phase = CD_REHASH;
+          d.cursor = 0;
+          d.changed = 0;
+          break;
+        }
+        uint32_t addr = trackedAddress(d.ranges, d.numRanges, d.cursor);
+        writeLE32(d.pending, addr);
+        if (readSource(d.src, d.pending + 4, SECTOR_SIZE, addr - d.src.start) != SECTOR_SIZE) return 0;
+        d.crc[d.cursor] = esp_rom_crc32_le(0, d.pending + 4, SECTOR_SIZE);
+        d.dirty[d.cursor] = 0;
+        d.cursor++;
+        d.resent++;
+        d.pendingLen = 4 + SECTOR_SIZE;
+        break;
+      }
+
+      case CD_END:
+        memcpy(d.pending, "FWPE", 4);
+        writeLE32(d.pending + 4, d.round);
+        writeLE32(d.pending + 8, d.resent);
+        writeLE32(d.pending + 12, d.unsettled);
+        d.pendingLen = PATCH_HEADER_SIZE;
+        d.phase = CD_DONE;
+        Serial.printf("[%s] Consistent dump done: %u sectors re-sent in %u rounds, %u unsettled.\n",
+                      d.src.tag, d.resent, d.round, d.unsettled);
+        break;
+
+      case CD_DONE:
+        return 0;
+    }
+  }
+}
+
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginConsistentResponse(AsyncWebServerRequest *request,
+                                                                         const FlashSource &src) {
+  std::shared_ptr<ConsistentDump> d(new ConsistentDump());
+  d->src = src;
+  d->phase = CD_IMAGE;
+
+  // Track every DATA partition sector that lies inside the streamed region.
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL && d->numRanges < CONSISTENT_MAX_RANGES) {
+    const esp_partition_t *p = esp_partition_get(it);
+    uint32_t s = (p->address > src.start) ? p->address : src.start;
+    uint32_t e = (p->address + p->size < src.start + src.length) ? p->address + p->size : src.start + src.length;
+    s = (s + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    e = e / SECTOR_SIZE * SECTOR_SIZE;
+    if (e > s) {
+      TrackedRange &r = d->ranges[d->numRanges++];
+      r.addr = s;
+      r.sectors = (e - s) / SECTOR_SIZE;
+      r.first = d->numSectors;
+      d->numSectors += r.sectors;
+    }
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+
+  d->crc = (uint32_t*)calloc(d->numSectors ? d->numSectors : 1, sizeof(uint32_t));
+  d->dirty = (uint8_t*)calloc(d->numSectors ? d->numSectors : 1, 1);
+  d->pending = (uint8_t*)malloc(4 + SECTOR_SIZE);
+  if (!d->crc || !d->dirty || !d->pending) {
+    request->send(503, "text/plain", "Not enough memory for a consistent dump");
+    return nullptr;
+  }
+  Serial.printf("[%s] Consistent mode: tracking %u writable sectors in %d ranges.\n",
+                src.tag, d->numSectors, d->numRanges);
+
+  AsyncWebServerResponse *response = beginTrackedResponse(request, src.tag, src.length,
+    [d](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return consistentFill(*d, buffer, maxLen, index);
+    });
+  if (response) response->addHeader("X-Image-Length", String(src.length));
+  return response;
+}
+
+static bool wantsConsistent(AsyncWebServerRequest *request) {
+  return request->hasParam("consistent") && request->getParam("consistent")->value() != "0";
+}
+
+static bool wantsAdaptive(AsyncWebServerRequest *request) {
+  return request->hasParam("encoding") && request->getParam("encoding")->value() == "adaptive";
+}
+
+static bool wantsDedup(AsyncWebServerRequest *request) {
+  return request->hasParam("encoding") && request->getParam("encoding")->value() == "dedup";
+}
+
+#if FWDL_ENABLE_COMPRESSION
+//////////////////////////////
+// Adaptive Compression
+//////////////////////////////
+// ?encoding=adaptive wraps a dump in a block container:
+//   "FWZ1" | block size u32 | image length u32 | reserved u32
+// followed by records of  type u8 | reserved u8 | payload length u16 | payload:
+//   FWZ_ERASED  run length u32: that many all-0xFF blocks
+//   FWZ_STORED  the block as is
+//   FWZ_LZ4     the block in LZ4 block format (blocks are independent)
+//   FWZ_END     image length u32 | CRC-32 of the image
+// Erased blocks cost nothing but the erased check. Other blocks get a byte
+// entropy estimate from a 1-in-4 sample; high-entropy blocks (encrypted or
+// already compressed) are stored without trying, and a compressed block that
+// saves less than FWZ_MIN_SAVING bytes is stored too. A long erased stretch
+// goes out as consecutive FWZ_ERASED records of FWZ_MAX_RUN blocks, one per
+// filler call, rather than being scanned ahead on the TCP task.
+
+enum FwzRecord : uint8_t { FWZ_ERASED = 0, FWZ_STORED = 1, FWZ_LZ4 = 2, FWZ_END = 0xFF };
+
+static const size_t   FWZ_BLOCK_SIZE     = 4096;
+static const size_t   FWZ_RECORD_HEADER  = 4;
+static const uint32_t FWZ_MAX_RUN        = 8;      // erased blocks per run record: at most 32 KB read per call
+static const size_t   FWZ_MIN_SAVING     = 64;
+static const float    FWZ_ENTROPY_LIMIT  = 7.2f;   // bits/byte above which compression is skipped
+static const int      LZ_HASH_BITS       = 12;
+
+struct FwzStats {
+  uint32_t erasedBlocks;
+  uint32_t storedEntropy;    // skipped by the entropy check
+  uint32_t storedNoGain;     // compressed but not worth it
+  uint32_t lz4Blocks;
+  uint32_t rawBytes;
+  uint32_t encodedBytes;
+  uint32_t cpuUs;            // time spent classifying and compressing
+};
+
+static FwzStats g_fwzLast = {};     // most recently finished adaptive stream
+
+// Shannon entropy of every 4th byte, in bits per byte.
+static float sampleEntropy(const uint8_t *data, size_t len) {
+  uint16_t hist[256];
+  memset(hist, 0, sizeof(hist));
+  uint32_t n = 0;
+  for (size_t i = 0; i < len; i += 4, n++) hist[data[i]]++;
+  float h = 0;
+  for (int i = 0; i < 256; i++) {
+    if (!hist[i]) continue;
+    float p = (float)hist[i] / n;
+    h -= p * log2f(p);
+  }
+  return h;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static size_t lzPutLength(uint8_t *dst, size_t op, size_t len) {
+  while (len >= 255) {
+    dst[op++] = 255;
+    len -= 255;
+  }
+  dst[op++] = (uint8_t)len;
+  return op;
+}
+
+// Greedy LZ4 block compressor. Returns the compressed size, or 0 when the
+// output would exceed dstCap.
+static size_t lz4CompressBlock(const uint8_t *src, size_t len, uint8_t *dst, size_t dstCap, uint16_t *table) {
+  const size_t MIN_MATCH = 4, LAST_LITERALS = 5, MF_LIMIT = 12;
+  memset(table, 0, sizeof(uint16_t) << LZ_HASH_BITS);
+  size_t ip = 0, anchor = 0, op = 0;
+  if (len > MF_LIMIT) {
+    const size_t matchLimit = len - LAST_LITERALS;
+    while (ip + MF_LIMIT <= len) {
+      uint32_t seq = read32(src + ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      size_t ref = table[h];
+      table[h] = (uint16_t)ip;
+      if (ref >= ip || read32(src + ref) != seq) {
+        ip++;
+        continue;
+      }
+      size_t mlen = MIN_MATCH;
+      while (ip + mlen < matchLimit && src[ref + mlen] == src[ip + mlen]) mlen++;
+      size_t litLen = ip - anchor;
+      if (op + 1 + litLen / 255 + 1 + litLen + 2 + mlen / 255 + 1 > dstCap) return 0;
+      size_t ml = mlen - MIN_MATCH;
+      size_t token = op++;
+      dst[token] = (uint8_t)(((litLen >= 15) ? 15 : litLen) << 4 | ((ml >= 15) ? 15 : ml));
+      if (litLen >= 15) op = lzPutLength(dst, op, litLen - 15);
+      memcpy(dst + op, src + anchor, litLen);
+      op += litLen;
+      size_t offset = ip - ref;
+      dst[op++] = offset & 0xFF;
+      dst[op++] = offset >> 8;
+      if (ml >= 15) op = lzPutLength(dst, op, ml - 15);
+      ip += mlen;
+      anchor = ip;
+    }
+  }
+  size_t litLen = len - anchor;
+  if (op + 1 + litLen / 255 + 1 + litLen > dstCap) return 0;
+  dst[op++] = (uint8_t)(((litLen >= 15) ? 15 : litLen) << 4);
+  if (litLen >= 15) op = lzPutLength(dst, op, litLen - 15);
+  memcpy(dst + op, src + anchor, litLen);
+  return op + litLen;
+}
+
+struct ESP32FirmwareDownloader::AdaptiveStream {
+  FlashSource src;
+  uint32_t pos;             // image bytes consumed
+  uint32_t erasedRun;
+  uint32_t crc;
+  bool headerSent;
+  bool ended;
+  uint8_t *block;
+  uint16_t *table;
+  uint8_t *pending;         // staged records: a run record plus one block record
+  size_t pendingLen;
+  size_t pendingOff;
+  FwzStats stats;
+
+  ~AdaptiveStream() {
+    free(block);
+    free(table);
+    free(pending);
+  }
+};
+
+static const size_t FWZ_PENDING_SIZE = 2 * FWZ_RECORD_HEADER + 4 + FWZ_BLOCK_SIZE;
+
+static size_t fwzRecord(uint8_t *p, uint8_t type, uint16_t payloadLen) {
+  p[0] = type;
+  p[1] = 0;
+  p[2] = payloadLen & 0xFF;
+  p[3] = payloadLen >> 8;
+  return FWZ_RECORD_HEADER;
+}
+
+static void fwzStageRun(uint8_t *pending, size_t &pendingLen, uint32_t &run, FwzStats &stats) {
+  pendingLen += fwzRecord(pending + pendingLen, FWZ_ERASED, 4);
+  writeLE32(pending + pendingLen, run);
+  pendingLen += 4;
+  stats.erasedBlocks += run;
+  run = 0;
+}
+
+size_t ESP32FirmwareDownloader::adaptiveFill(AdaptiveStream &a, uint8_t *buffer, size_t maxLen, size_t index) {
+  (void)index;
+  while (true) {
+    if (a.pendingOff < a.pendingLen) {
+      size_t n = a.pendingLen - a.pendingOff;
+      if (n > maxLen) n = maxLen;
+      memcpy(buffer, a.pending + a.pendingOff, n);
+      a.pendingOff += n;
+      a.stats.encodedBytes += n;
+      return n;
+    }
+    a.pendingLen = a.pendingOff = 0;
+
+    if (!a.headerSent) {
+      memcpy(a.pending, "FWZ1", 4);
+      writeLE32(a.pending + 4, FWZ_BLOCK_SIZE);
+      writeLE32(a.pending + 8, a.src.length);
+      writeLE32(a.pending + 12, 0);
+      a.pendingLen = 16;
+      a.headerSent = true;
+      continue;
+    }
+
+    if (a.pos < a.src.length) {
+      size_t want = (a.src.length - a.pos < FWZ_BLOCK_SIZE) ? a.src.length - a.pos : FWZ_BLOCK_SIZE;
+      size_t n = readSource(a.src, a.block, want, a.pos);
+      if (n != want) return 0;    // read error ends the response
+      a.pos += n;
+      a.crc = esp_rom_crc32_le(a.crc, a.block, n);
+      a.stats.rawBytes += n;
+
+      int64_t t0 = esp_timer_get_time();
+      if (n == FWZ_BLOCK_SIZE && isErased(a.block, n)) {
+        a.erasedRun++;
+        if (a.erasedRun >= FWZ_MAX_RUN) fwzStageRun(a.pending, a.pendingLen, a.erasedRun, a.stats);
+        a.stats.cpuUs += esp_timer_get_time() - t0;
+        continue;
+      }
+      if (a.erasedRun) fwzStageRun(a.pending, a.pendingLen, a.erasedRun, a.stats);
+
+      uint8_t *rec = a.pending + a.pendingLen;
+      size_t packed = 0;
+      if (sampleEntropy(a.block, n) >= FWZ_ENTROPY_LIMIT) {
+        a.stats.storedEntropy++;
+      } else if (n > FWZ_MIN_SAVING) {
+        packed = lz4CompressBlock(a.block, n, rec + FWZ_RECORD_HEADER, n - FWZ_MIN_SAVING, a.table);
+        if (packed) a.stats.lz4Blocks++;
+        else a.stats.storedNoGain++;
+      } else {
+        a.stats.storedNoGain++;
+      }
+      if (packed) {
+        a.pendingLen += fwzRecord(rec, FWZ_LZ4, packed) + packed;
+      } else {
+        fwzRecord(rec, FWZ_STORED, n);
+        memcpy(rec + FWZ_RECORD_HEADER, a.block, n);
+        a.pendingLen += FWZ_RECORD_HEADER + n;
+      }
+      a.stats.cpuUs += esp_timer_get_time() - t0;
+      continue;
+    }
+
+    if (a.erasedRun) {
+      fwzStageRun(a.pending, a.pendingLen, a.erasedRun, a.stats);
+      continue;
+    }
+    if (a.ended) return 0;
+    a.ended = true;
+    a.pendingLen = fwzRecord(a.pending, FWZ_END, 8);
+    writeLE32(a.pending + 4, a.src.length);
+    writeLE32(a.pending + 8, a.crc);
+    a.pendingLen += 8;
+    const FwzStats &st = a.stats;
+    Serial.printf("[%s] Adaptive: %u -> %u bytes; blocks erased %u, lz4 %u, stored %u (entropy) + %u (no gain); %u ms CPU\n",
+                  a.src.tag, st.rawBytes, st.encodedBytes + (uint32_t)a.pendingLen, st.erasedBlocks, st.lz4Blocks,
+                  st.storedEntropy, st.storedNoGain, st.cpuUs / 1000);
+    g_fwzLast = st;
+    g_fwzLast.encodedBytes += a.pendingLen;
+  }
+}
+
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginAdaptiveResponse(AsyncWebServerRequest *request,
+                                                                       const FlashSource &src) {
+  std::shared_ptr<AdaptiveStream> a(new AdaptiveStream());
+  a->src = src;
+  a->block = (uint8_t*)malloc(FWZ_BLOCK_SIZE);
+  a->table = (uint16_t*)malloc(sizeof(uint16_t) << LZ_HASH_BITS);
+  a->pending = (uint8_t*)malloc(FWZ_PENDING_SIZE);
+  if (!a->block || !a->table || !a->pending) {
+    request->send(503, "text/plain", "Not enough memory for adaptive encoding");
+    return nullptr;
+  }
+  AsyncWebServerResponse *response = beginTrackedResponse(request, src.tag, src.length,
+    [a](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return adaptiveFill(*a, buffer, maxLen, index);
+    },
+    [a]() -> size_t { return a->pos; });
+  if (response) {
+    response->addHeader("X-Encoding", "fwz1");
+    response->addHeader("X-Image-Length", String(src.length));
+  }
+  return response;
+}
+#endif  // FWDL_ENABLE_COMPRESSION
+
+//////////////////////////////
+// Export Formats
+//////////////////////////////
+// ?format=uf2 or ?format=ihex re-encodes a dump for flashing stations that
+// don't take raw images. Records are generated one sector at a time straight
+// into a staging buffer; the target address of every record is the flash
+// address it was read from, so a partition dump lands at its partition offset.
+//
+// UF2: 512-byte blocks carrying 256 payload bytes each, with the family ID of
+// the chip (flag 0x2000) so UF2 tools can tell ESP32 variants apart.
+// Intel HEX: 16-byte type 00 records below type 04 extended linear address
+// records, terminated by a type 01 record.
+
+enum ExportFormat : uint8_t { EXPORT_RAW = 0, EXPORT_UF2 = 1, EXPORT_IHEX = 2 };
+
+static uint8_t requestedFormat(AsyncWebServerRequest *request) {
+  if (!request->hasParam("format")) return EXPORT_RAW;
+  String f = request->getParam("format")->value();
+  if (f == "uf2") return EXPORT_UF2;
+  if (f == "ihex" || f == "hex") return EXPORT_IHEX;
+  if (f == "bin" || f == "raw") return EXPORT_RAW;
+  return 0xFF;
+}
+
+// Download file name for a dump: the base name plus the extension of the
+// requested format.
+static String dumpFileName(AsyncWebServerRequest *request, const String &base) {
+  switch (requestedFormat(request)) {
+    case EXPORT_UF2:  return base + ".uf2";
+    case EXPORT_IHEX: return base + ".hex";
+    default:          return base + ".bin";
+  }
+}
+
+#if FWDL_ENABLE_EXPORT
+static const uint32_t UF2_MAGIC_START0   = 0x0A324655;
+static const uint32_t UF2_MAGIC_START1   = 0x9E5D5157;
+static const uint32_t UF2_MAGIC_END      = 0x0AB16F30;
+static const uint32_t UF2_FLAG_FAMILY_ID = 0x00002000;
+static const size_t   UF2_BLOCK_SIZE     = 512;
+static const size_t   UF2_PAYLOAD        = 256;
+static const size_t   UF2_DATA_AREA      = 476;
+
+#if defined(CONFIG_IDF_TARGET_ESP32S2)
+static const uint32_t UF2_FAMILY_ID = 0xbfdd4eee;
+#elif defined(CONFIG_IDF_TARGET_ESP32S3)
+static const uint32_t UF2_FAMILY_ID = 0xc47e5767;
+#elif defined(CONFIG_IDF_TARGET_ESP32C3)
+static const uint32_t UF2_FAMILY_ID = 0xd42ba06c;
+#elif defined(CONFIG_IDF_TARGET_ESP32C6)
+static const uint32_t UF2_FAMILY_ID = 0x540ddf62;
+#elif defined(CONFIG_IDF_TARGET_ESP32H2)
+static const uint32_t UF2_FAMILY_ID = 0x332726f6;
+#else
+static const uint32_t UF2_FAMILY_ID = 0x1c5f21b0;   // ESP32
+#endif
+
+static const size_t IHEX_DATA_BYTES = 16;
+static const size_t IHEX_DATA_LINE  = 1 + 8 + 2 * IHEX_DATA_BYTES + 2 + 2;   // ":LLAAAATT" data CC CRLF
+static const size_t IHEX_ELA_LINE   = 1 + 8 + 4 + 2 + 2;
+// One sector, unaligned at worst: 257 data records, two address records and EOF.
+static const size_t IHEX_PENDING_SIZE = (SECTOR_SIZE / IHEX_DATA_BYTES + 1) * IHEX_DATA_LINE +
+                                        2 * IHEX_ELA_LINE + IHEX_ELA_LINE;
+static const size_t UF2_PENDING_SIZE  = (SECTOR_SIZE / UF2_PAYLOAD + 1) * UF2_BLOCK_SIZE;
+
+static const char HEX_UPPER[] = "0123456789ABCDEF";
+
+struct ExportStats {
+  uint8_t format;
+  uint32_t rawBytes;
+  uint32_t encodedBytes;
+  uint32_t cpuUs;            // time spent encoding
+  uint32_t wallMs;           // first to last filler call
+};
+
+static ExportStats g_exportLast = {};   // most recently finished export stream
+
+static const char* exportFormatName(uint8_t format) {
+  switch (format) {
+    case EXPORT_UF2:  return "uf2";
+    case EXPORT_IHEX: return "ihex";
+    default:          return "bin";
+  }
+}
+
+// UF2 payloads are cut at 256-byte aligned addresses, so an unaligned start
+// costs one short block at each end rather than one per sector.
+static uint32_t uf2BlockCount(uint32_t start, uint32_t length) {
+  if (!length) return 0;
+  return (start + length - 1) / UF2_PAYLOAD - start / UF2_PAYLOAD + 1;
+}
+
+// Two hex digits for b; sum accumulates the record checksum.
+static inline char* ihexByte(char *p, uint8_t b, uint8_t &sum) {
+  p[0] = HEX_UPPER[b >> 4];
+  p[1] = HEX_UPPER[b & 0x0F];
+  sum += b;
+  return p + 2;
+}
+
+static size_t ihexRecord(char *out, uint8_t type, uint16_t addr, const uint8_t *data, size_t len) {
+  char *p = out;
+  uint8_t sum = 0;
+  *p++ = ':';
+  p = ihexByte(p, (uint8_t)len, sum);
+  p = ihexByte(p, addr >> 8, sum);
+  p = ihexByte(p, addr & 0xFF, sum);
+  p = ihexByte(p, type, sum);
+  for (size_t i = 0; i < len; i++) p = ihexByte(p, data[i], sum);
+  uint8_t check = (uint8_t)(0x100 - sum);
+  p[0] = HEX_UPPER[check >> 4];
+  p[1] = HEX_UPPER[check & 0x0F];
+  p += 2;
+  *p++ = '\r';
+  *p++ = '\n';
+  return p - out;
+}
+
+struct ESP32FirmwareDownloader::ExportStream {
+  FlashSource src;
+  uint8_t format;
+  uint32_t pos;             // image bytes consumed
+  uint32_t blockNo;         // UF2 block counter
+  uint32_t numBlocks;
+  uint32_t upper;           // current upper 16 address bits (IHEX)
+  bool upperSent;
+  bool ended;
+  uint8_t *block;
+  uint8_t *pending;
+  size_t pendingLen;
+  size_t pendingOff;
+  int64_t startUs;
+  ExportStats stats;
+
+  ~ExportStream() {
+    free(block);
+    free(pending);
+  }
+};
+
+size_t ESP32FirmwareDownloader::exportFill(ExportStream &e, uint8_t *buffer, size_t maxLen, size_t index) {
+  (void)index;
+  while (true) {
+    if (e.pendingOff < e.pendingLen) {
+      size_t n = e.pendingLen - e.pendingOff;
+      if (n > maxLen) n = maxLen;
+      memcpy(buffer, e.pending + e.pendingOff, n);
+      e.pendingOff += n;
+      e.stats.encodedBytes += n;
+      return n;
+    }
+    e.pendingLen = e.pendingOff = 0;
+    if (!e.startUs) e.startUs = esp_timer_get_time();
+
+    if (e.pos < e.src.length) {
+      // Whole sectors from the first boundary on.
+      uint32_t addr = e.src.start + e.pos;
+      size_t want = SECTOR_SIZE - addr % SECTOR_SIZE;
+      if (want > e.src.length - e.pos) want = e.src.length - e.pos;
+      size_t n = readSource(e.src, e.block, want, e.pos);
+      if (n != want) return 0;    // read error ends the response
+      e.pos += n;
+      e.stats.rawBytes += n;
+
+      int64_t t0 = esp_timer_get_time();
+      uint8_t *out = e.pending;
+      size_t off = 0;
+      if (e.format == EXPORT_UF2) {
+        while (off < n) {
+          size_t len = UF2_PAYLOAD - (addr + off) % UF2_PAYLOAD;
+          if (len > n - off) len = n - off;
+          writeLE32(out + 0, UF2_MAGIC_START0);
+          writeLE32(out + 4, UF2_MAGIC_START1);
+          writeLE32(out + 8, UF2_FLAG_FAMILY_ID);
+          writeLE32(out + 12, addr + off);
+          writeLE32(out + 16, len);
+          writeLE32(out + 20, e.blockNo++);
+          writeLE32(out + 24, e.numBlocks);
+          writeLE32(out + 28, UF2_FAMILY_ID);
+          memcpy(out + 32, e.block + off, len);
+          memset(out + 32 + len, 0, UF2_DATA_AREA - len);
+          writeLE32(out + UF2_BLOCK_SIZE - 4, UF2_MAGIC_END);
+          out += UF2_BLOCK_SIZE;
+          off += len;
+        }
+      } else {
+        char *p = (char*)out;
+        while (off < n) {
+          uint32_t a = addr + off;
+          if (!e.upperSent || (a >> 16) != e.upper) {
+            e.upper = a >> 16;
+            e.upperSent = true;
+            uint8_t ela[2] = { (uint8_t)(e.upper >> 8), (uint8_t)(e.upper & 0xFF) };
+            p += ihexRecord(p, 0x04, 0, ela, 2);
+          }
+          // Records never straddle a 64 KB boundary.
+          size_t len = IHEX_DATA_BYTES - (a % IHEX_DATA_BYTES);
+          if (len > n - off) len = n - off;
+          p += ihexRecord(p, 0x00, a & 0xFFFF, e.block + off, len);
+          off += len;
+        }
+        out = (uint8_t*)p;
+      }
+      e.pendingLen = out - e.pending;
+      e.stats.cpuUs += esp_timer_get_time() - t0;
+      continue;
+    }
+
+    if (e.ended) return 0;
+    e.ended = true;
+    if (e.format == EXPORT_IHEX) e.pendingLen = ihexRecord((char*)e.pending, 0x01, 0, nullptr, 0);
+    ExportStats &st = e.stats;
+    st.wallMs = (uint32_t)((esp_timer_get_time() - e.startUs) / 1000);
+    uint32_t encoded = st.encodedBytes + (uint32_t)e.pendingLen;
+    Serial.printf("[%s] Export %s: %u -> %u bytes in %u ms (%u KB/s raw), %u ms encoding\n",
+                  e.src.tag, exportFormatName(e.format), st.rawBytes, encoded, st.wallMs,
+                  st.wallMs ? (uint32_t)((uint64_t)st.rawBytes / st.wallMs) : 0, st.cpuUs / 1000);
+    g_exportLast = st;
+    g_exportLast.encodedBytes = encoded;
+  }
+}
+
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginExportResponse(AsyncWebServerRequest *request,
+                                                                     const FlashSource &src, uint8_t format) {
+  std::shared_ptr<ExportStream> e(new ExportStream());
+  e->src = src;
+  e->format = format;
+  e->numBlocks = uf2BlockCount(src.start, src.length);
+  e->stats.format = format;
+  e->block = (uint8_t*)malloc(SECTOR_SIZE);
+  e->pending = (uint8_t*)malloc(format == EXPORT_UF2 ? UF2_PENDING_SIZE : IHEX_PENDING_SIZE);
+  if (!e->block || !e->pending) {
+    request->send(503, "text/plain", "Not enough memory for export");
+    return nullptr;
+  }
+  AsyncWebServerResponse *response = beginTrackedResponse(request, src.tag, src.length,
+    [e](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return exportFill(*e, buffer, maxLen, index);
+    },
+    [e]() -> size_t { return e->pos; });
+  if (response) {
+    if (format == EXPORT_IHEX) response->setContentType("text/plain");
+    else response->addHeader("X-Encoded-Length", String(uf2BlockCount(src.start, src.length) * UF2_BLOCK_SIZE));
+    response->addHeader("X-Image-Length", String(src.length));
+  }
+  return response;
+}
+
+#endif  // FWDL_ENABLE_EXPORT
+
+#if FWDL_ENABLE_DEDUP
+//////////////////////////////
+// Dedup Archives
+//////////////////////////////
+// ?encoding=dedup (or /archive) sends every 4 KB sector at most once per
+// stream, and not at all when the client already holds it:
+//   "FWDA" | sector size u32 | image length u32 | start address u32
+// followed by records of  type u8 | reserved u8 | payload length u16 | payload:
+//   DA_DATA    the sector as is (the last one may be short)
+//   DA_ERASED  run length u32: that many all-0xFF sectors
+//   DA_COPY    sector index u32: same bytes as an earlier sector of this stream
+//   DA_KNOWN   SHA-256 of the sector: the client has it in its store
+//   DA_END     image length u32 | CRC-32 of the image | data, copy, known sector counts u32
+// Two hashes are used. In-stream duplicates are found through a CRC-32
+// table and confirmed by comparing against the earlier sector, so a COPY is
+// exact and costs no SHA-256. SHA-256 is computed only when the client posted
+// a known list (32-byte digests, see handleArchive()). The list is kept as
+// sorted 64-bit prefixes, and a KNOWN record carries the full digest for the
+// client to confirm.
+
+enum DedupRecord : uint8_t { DA_DATA = 0, DA_ERASED = 1, DA_COPY = 2, DA_KNOWN = 3, DA_END = 0xFF };
+
+static const size_t   DA_RECORD_HEADER   = 4;
+static const uint32_t DA_MAX_RUN         = 8;      // erased sectors per run record, as FWZ_MAX_RUN
+static const size_t   DA_MAX_SEEN        = 4096;   // sectors remembered per stream (16 MB of flash)
+static const size_t   DA_MAX_KNOWN       = 4096;   // client-known digests accepted
+static const int      DA_MAX_PROBES      = 4;      // CRC matches compared per sector
+static const size_t   DA_PENDING_SIZE    = 2 * DA_RECORD_HEADER + 4 + SECTOR_SIZE;
+
+struct DedupStats {
+  uint32_t sectors;
+  uint32_t dataSectors;
+  uint32_t erasedSectors;
+  uint32_t copySectors;
+  uint32_t knownSectors;
+  uint32_t rawBytes;
+  uint32_t encodedBytes;
+  uint32_t cpuUs;
+};
+
+static DedupStats g_dedupLast = {};   // most recently finished dedup stream
+
+// Body of a POST /archive: the known digests, reduced to prefixes as they arrive.
+struct KnownUpload {
+  uint8_t partial[32];
+  size_t partialLen;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t keys[1];
+};
+
+static uint64_t digestKey(const uint8_t *sha) {
+  uint64_t k = 0;
+  for (int i = 0; i < 8; i++) k = (k << 8) | sha[i];
+  return k;
+}
+
+struct ESP32FirmwareDownloader::DedupStream {
+  FlashSource src;
+  FlashSource probe;        // second cursor for comparing against earlier sectors
+  uint32_t pos;
+  uint32_t erasedRun;
+  uint32_t crc;
+  bool headerSent;
+  bool ended;
+  uint8_t *block;
+  uint8_t *cmp;
+  uint32_t *seenCrc;        // open-addressed CRC -> sector index + 1
+  uint32_t *seenIndex;
+  size_t seenSize;          // table slots (power of two)
+  size_t seenCount;
+  uint64_t *known;          // sorted digest prefixes
+  uint32_t numKnown;
+  uint8_t *pending;
+  size_t pendingLen;
+  size_t pendingOff;
+  DedupStats stats;
+
+  ~DedupStream() {
+    free(block);
+    free(cmp);
+    free(seenCrc);
+    free(seenIndex);
+    free(known);
+    free(pending);
+  }
+};
+
+static size_t daRecord(uint8_t *p, uint8_t type, uint16_t payloadLen) {
+  p[0] = type;
+  p[1] = 0;
+  p[2] = payloadLen & 0xFF;
+  p[3] = payloadLen >> 8;
+  return DA_RECORD_HEADER;
+}
+
+static bool knownHas(const uint64_t *keys, uint32_t n, uint64_t key) {
+  uint32_t lo = 0, hi = n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (keys[mid] < key) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < n && keys[lo] == key;
+}
+
+// Earlier full sector with the same bytes as d.block, or -1.
+int32_t ESP32FirmwareDownloader::dedupFind(DedupStream &d, uint32_t crc) {
+  if (!d.seenSize) return -1;
+  size_t mask = d.seenSize - 1;
+  int probes = 0;
+  for (size_t i = crc & mask; d.seenIndex[i] && probes < DA_MAX_PROBES; i = (i + 1) & mask) {
+    if (d.seenCrc[i] != crc) continue;
+    probes++;
+    uint32_t index = d.seenIndex[i] - 1;
+    if (readSource(d.probe, d.cmp, SECTOR_SIZE, index * SECTOR_SIZE) == SECTOR_SIZE &&
+        memcmp(d.cmp, d.block, SECTOR_SIZE) == 0) {
+      return (int32_t)index;
+    }
+  }
+  return -1;
+}
+
+static void dedupRemember(uint32_t *seenCrc, uint32_t *seenIndex, size_t seenSize, size_t &seenCount,
+                          uint32_t crc, uint32_t index) {
+  // Keep the table at most 3/4 full so probe chains stay short.
+  if (!seenSize || seenCount * 4 >= seenSize * 3) return;
+  size_t mask = seenSize - 1;
+  size_t i = crc & mask;
+  while (seenIndex[i]) i = (i + 1) & mask;
+  seenCrc[i] = crc;
+  seenIndex[i] = index + 1;
+  seenCount++;
+}
+
+static void dedupStageRun(uint8_t *pending, size_t &pendingLen, uint32_t &run, DedupStats &stats) {
+  pendingLen += daRecord(pending + pendingLen, DA_ERASED, 4);
+  writeLE32(pending + pendingLen, run);
+  pendingLen += 4;
+  stats.erasedSectors += run;
+  run = 0;
+}
+
+size_t ESP32FirmwareDownloader::dedupFill(DedupStream &d, uint8_t *buffer, size_t maxLen, size_t index) {
+  (void)index;
+  while (true) {
+    if (d.pendingOff < d.pendingLen) {
+      size_t n = d.pendingLen - d.pendingOff;
+      if (n > maxLen) n = maxLen;
+      memcpy(buffer, d.pending + d.pendingOff, n);
+      d.pendingOff += n;
+      d.stats.encodedBytes += n;
+      return n;
+    }
+    d.pendingLen = d.pendingOff = 0;
+
+    if (!d.headerSent) {
+      memcpy(d.pending, "FWDA", 4);
+      writeLE32(d.pending + 4, SECTOR_SIZE);
+      writeLE32(d.pending + 8, d.src.length);
+      writeLE32(d.pending + 12, d.src.start);
+      d.pendingLen = 16;
+      d.headerSent = true;
+      continue;
+    }
+
+    if (d.pos < d.src.length) {
+      uint32_t sector = d.pos / SECTOR_SIZE;
+      size_t want = (d.src.length - d.pos < SECTOR_SIZE) ? d.src.length - d.pos : SECTOR_SIZE;
+      size_t n = readSource(d.src, d.block, want, d.pos);
+      if (n != want) return 0;    // read error ends the response
+      d.pos += n;
+      d.crc = esp_rom_crc32_le(d.crc, d.block, n);
+      d.stats.rawBytes += n;
+      d.stats.sectors++;
+
+      int64_t t0 = esp_timer_get_time();
+      if (n == SECTOR_SIZE && isErased(d.block, n)) {
+        d.erasedRun++;
+        if (d.erasedRun >= DA_MAX_RUN) dedupStageRun(d.pending, d.pendingLen, d.erasedRun, d.stats);
+        d.stats.cpuUs += esp_timer_get_time() - t0;
+        continue;
+      }
+      if (d.erasedRun) dedupStageRun(d.pending, d.pendingLen, d.erasedRun, d.stats);
+
+      uint8_t *rec = d.pending + d.pendingLen;
+      uint32_t crc = esp_rom_crc32_le(0, d.block, n);
+      int32_t earlier = (n == SECTOR_SIZE) ? dedupFind(d, crc) : -1;
+      if (earlier >= 0) {
+        d.pendingLen += daRecord(rec, DA_COPY, 4);
+        writeLE32(d.pending + d.pendingLen, (uint32_t)earlier);
+        d.pendingLen += 4;
+        d.stats.copySectors++;
+      } else {
+        uint8_t sha[32];
+        bool known = false;
+        if (d.numKnown) {
+          sha256Of(d.block, n, sha);
+          known = knownHas(d.known, d.numKnown, digestKey(sha));
+        }
+        if (known) {
+          d.pendingLen += daRecord(rec, DA_KNOWN, 32);
+          memcpy(d.pending + d.pendingLen, sha, 32);
+          d.pendingLen += 32;
+          d.stats.knownSectors++;
+        } else {
+          d.pendingLen += daRecord(rec, DA_DATA, n);
+          memcpy(d.pending + d.pendingLen, d.block, n);
+          d.pendingLen += n;
+          d.stats.dataSectors++;
+        }
+        if (n == SECTOR_SIZE) dedupRemember(d.seenCrc, d.seenIndex, d.seenSize, d.seenCount, crc, sector);
+      }
+      d.stats.cpuUs += esp_timer_get_time() - t0;
+      continue;
+    }
+
+    if (d.erasedRun) {
+      dedupStageRun(d.pending, d.pendingLen, d.erasedRun, d.stats);
+      continue;
+    }
+    if (d.ended) return 0;
+    d.ended = true;
+    d.pendingLen = daRecord(d.pending, DA_END, 20);
+    writeLE32(d.pending + 4, d.src.length);
+    writeLE32(d.pending + 8, d.crc);
+    writeLE32(d.pending + 12, d.stats.dataSectors);
+    writeLE32(d.pending + 16, d.stats.copySectors);
+    writeLE32(d.pending + 20, d.stats.knownSectors);
+    d.pendingLen += 20;
+    const DedupStats &st = d.stats;
+    Serial.printf("[%s] Dedup: %u -> %u bytes; sectors data %u, copy %u, known %u, erased %u; %u ms CPU\n",
+                  d.src.tag, st.rawBytes, st.encodedBytes + (uint32_t)d.pendingLen, st.dataSectors,
+                  st.copySectors, st.knownSectors, st.erasedSectors, st.cpuUs / 1000);
+    g_dedupLast = st;
+    g_dedupLast.encodedBytes += d.pendingLen;
+  }
+}
+
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginDedupResponse(AsyncWebServerRequest *request,
+                                                                    const FlashSource &src) {
+  std::shared_ptr<DedupStream> d(new DedupStream());
+  d->src = src;
+  d->probe = src;
+  d->probe.tag = "DedupProbe";
+  d->block = (uint8_t*)malloc(SECTOR_SIZE);
+  d->cmp = (uint8_t*)malloc(SECTOR_SIZE);
+  d->pending = (uint8_t*)malloc(DA_PENDING_SIZE);
+  if (!d->block || !d->cmp || !d->pending) {
+    request->send(503, "text/plain", "Not enough memory for dedup encoding");
+    return nullptr;
+  }
+  // Room for every sector of the source at 3/4 load, halved until it fits.
+  size_t sectors = (src.length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (sectors > DA_MAX_SEEN) sectors = DA_MAX_SEEN;
+  size_t slots = 16;
+  while (slots * 3 < sectors * 4) slots <<= 1;
+  for (; slots >= 16 && !d->seenIndex; slots >>= 1) {
+    d->seenCrc = (uint32_t*)malloc(slots * sizeof(uint32_t));
+    d->seenIndex = (uint32_t*)calloc(slots, sizeof(uint32_t));
+    if (!d->seenCrc || !d->seenIndex) {
+      free(d->seenCrc);
+      free(d->seenIndex);
+      d->seenCrc = d->seenIndex = nullptr;
+    } else {
+      d->seenSize = slots;
+    }
+  }
+
+  const KnownUpload *upload = (const KnownUpload*)request->_tempObject;
+  if (upload && upload->count) {
+    d->known = (uint64_t*)malloc(upload->count * sizeof(uint64_t));
+    if (d->known) {
+      memcpy(d->known, upload->keys, upload->count * sizeof(uint64_t));
+      std::sort(d->known, d->known + upload->count);
+      d->numKnown = upload->count;
+    }
+  }
+  Serial.printf("[%s] Dedup: %u table slots, %u known digests.\n", src.tag, (unsigned)d->seenSize, d->numKnown);
+
+  AsyncWebServerResponse *response = beginTrackedResponse(request, src.tag, src.length,
+    [d](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return dedupFill(*d, buffer, maxLen, index);
+    },
+    [d]() -> size_t { return d->pos; });
+  if (response) {
+    response->addHeader("X-Encoding", "fwda");
+    response->addHeader("X-Image-Length", String(src.length));
+  }
+  return response;
+}
+#endif  // FWDL_ENABLE_DEDUP
+
+// Pick the stream stage for a dump from its query: plain, consistent,
+// adaptive, dedup or an export format, optionally normalized.
+AsyncWebServerResponse* ESP32FirmwareDownloader::beginDumpResponse(AsyncWebServerRequest *request,
+                                                                   const FlashSource &src, bool dedup) {
+  bool consistent = wantsConsistent(request);
+  bool adaptive = wantsAdaptive(request);
+  dedup = dedup || wantsDedup(request);
+  uint8_t format = requestedFormat(request);
+  if (consistent && adaptive) {
+    request->send(400, "text/plain", "consistent and encoding=adaptive cannot be combined");
+    return nullptr;
+  }
+  if (format == 0xFF) {
+    request->send(400, "text/plain", "format must be bin, uf2 or ihex");
+    return nullptr;
+  }
+  if (format != EXPORT_RAW && (consistent || adaptive || dedup)) {
+    request->send(400, "text/plain", "format cannot be combined with consistent or encoding");
+    return nullptr;
+  }
+  if (dedup && (consistent || adaptive)) {
+    request->send(400, "text/plain", "dedup cannot be combined with consistent or encoding=adaptive");
+    return nullptr;
+  }
+  const char* disabled = nullptr;
+  if (!FWDL_ENABLE_COMPRESSION && adaptive) disabled = "encoding=adaptive";
+  if (!FWDL_ENABLE_DEDUP && dedup) disabled = "encoding=dedup";
+  if (!FWDL_ENABLE_EXPORT && format != EXPORT_RAW) disabled = "format=uf2/ihex";
+  if (disabled) {
+    request->send(501, "text/plain", String(disabled) + " is not built into this firmware");
+    return nullptr;
+  }
+  FlashSource stream = src;
+  stream.normalize = requestedNormalizePlan(request);
+  AsyncWebServerResponse *response;
+  if (consistent) response = beginConsistentResponse(request, stream);
+#if FWDL_ENABLE_COMPRESSION
+  else if (adaptive) response = beginAdaptiveResponse(request, stream);
+#endif
+#if FWDL_ENABLE_DEDUP
+  else if (dedup) response = beginDedupResponse(request, stream);
+#endif
+#if FWDL_ENABLE_EXPORT
+  else if (format != EXPORT_RAW) response = beginExportResponse(request, stream, format);
+#endif
+  else response = beginSourceResponse(request, stream);
+  if (response && stream.normalize) response->addHeader("X-Normalized", "1");
+  return response;
+}
+
+//////////////////////////////
+// Blank Region Management
+//////////////////////////////
+void ESP32FirmwareDownloader::addBlankRegion(uint32_t offset, uint32_t length, const char* description) {
+  if (fwdl_add_blank_region(offset, length, description)) {
+    Serial.printf("[ESP32FirmwareDownloader] Added blank region: 0x%08X - 0x%08X (%s)\n", offset, offset+length, description);
+  } else {
+    Serial.println("[ESP32FirmwareDownloader] Maximum blank regions reached.");
+  }
+}
+
+//////////////////////////////
+// Protected Regions
+//////////////////////////////
+void ESP32FirmwareDownloader::addProtectedRegion(uint32_t offset, uint32_t length, const char* description) {
+  if (fwdl_add_protected_region(offset, length, description)) {
+    Serial.printf("[ESP32FirmwareDownloader] Added protected region: 0x%08X - 0x%08X (%s)\n", offset, offset+length, description);
+  } else {
+    Serial.println("[ESP32FirmwareDownloader] Maximum protected regions reached.");
+  }
+}
+
+// Why [offset, offset+length) may not be read, or nullptr when it may.
+const char* ESP32FirmwareDownloader::rangeDenied(uint32_t offset, uint32_t length) {
+  return fwdl_range_denied(offset, length);
+}
+
+//////////////////////////
+// Constructor and Setters
+//////////////////////////
+ESP32FirmwareDownloader::ESP32FirmwareDownloader(const char* endpoint, const String &filename)
+  : _endpoint(endpoint),
+    _firmwareFilename(filename),
+    _blankOffset(0),
+    _blankLength(0)
+{
+  _instance = this;
+  fwdl_clear_blank_regions();
+}
+
+void ESP32FirmwareDownloader::setFilename(const String &filename) {
+  _firmwareFilename = filename;
+}
+
+void ESP32FirmwareDownloader::setBlankRegion(uint32_t offset, uint32_t length) {
+  _blankOffset = offset;
+  _blankLength = length;
+  fwdl_clear_blank_regions();
+  addBlankRegion(offset, length, "manual");
+}
+
+bool ESP32FirmwareDownloader::autoSetUserDataBlank() {
+  const esp_partition_t* userPart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "userdata");
+  if (userPart != NULL) {
+    Serial.printf("[ESP32FirmwareDownloader] Found user data partition '%s' at 0x%08X, size: %u bytes\n",
+                  userPart->label, userPart->address, userPart->size);
+    fwdl_clear_blank_regions();
+    addBlankRegion(userPart->address, userPart->size, "userdata");
+    return true;
+  }
+  Serial.println("[ESP32FirmwareDownloader] No user data partition found with label 'userdata'.");
+  return false;
+}
+
+bool ESP32FirmwareDownloader::autoSetUserDataBlankAll() {
+  const char* labelsToBlank[] = {"nvs", "spiffs", "littlefs"};
+  bool found = false;
+  for (int i = 0; i < 3; i++) {
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, labelsToBlank[i]);
+    if (part) {
+      addBlankRegion(part->address, part->size, labelsToBlank[i]);
+      found = true;
+    }
+  }
+  if (!found) {
+    Serial.println("[ESP32FirmwareDownloader] No NVS/Spiffs/LittleFS partitions found for blanking.");
+  }
+  return found;
+}
+
+////////////////////////////
+// HTTP Handlers
+////////////////////////////
+
+// Strong ETag for a download: the SHA-256 of the flash range plus a token for
+// every query option that changes the bytes sent (none when request is null,
+// for handlers that always send the raw range). The request path never
+// hashes: the digest must already be in the cache and its first sector must
+// still match, which catches an image written without notifyFlashWrite() (an
+// app update always rewrites the header and app description). On a miss a
+// low-priority job hashes the range and this response goes out without an
+// ETag. Only APP partitions and the boot region get one; DATA partitions
+// change under the application without notice, so no cheap check holds.
+// Builds without FWDL_ENABLE_HASHING send no ETag.
+#if FWDL_ENABLE_HASHING
+struct EtagHashArgs {
+  uint32_t address;
+  uint32_t length;
+};
+
+static bool etagHashJob(void* arg) {
+  const EtagHashArgs *a = (const EtagHashArgs*)arg;
+  uint8_t digest[32];
+  Core::jobMessage("hashing 0x%08X + %u", a->address, a->length);
+  return hashFlashRange(a->address, a->length, digest, nullptr, true);
+}
+
+// Cached digest of [address, address+length) whose first sector still matches.
+static bool verifiedCachedDigest(uint32_t address, uint32_t length, uint8_t out[32]) {
+  uint32_t gen = Core::generationFor(address, length);
+  uint32_t head = 0;
+  bool found = false;
+  portENTER_CRITICAL(&g_hashCacheMux);
+  for (int i = 0; i < HASH_CACHE_SLOTS && !found; i++) {
+    const HashCacheEntry &e = g_hashCache[i];
+    if (e.valid && e.address == address && e.length == length && e.gen == gen) {
+      memcpy(out, e.sha, 32);
+      head = e.head;
+      found = true;
+    }
+  }
+  portEXIT_CRITICAL(&g_hashCacheMux);
+  if (!found) return false;
+  uint32_t n = (length < SECTOR_SIZE) ? length : SECTOR_SIZE;
+  uint8_t *sector = (uint8_t*)malloc(n);
+  bool ok = sector && esp_flash_read(esp_flash_default_chip, sector, address, n) == ESP_OK &&
+            esp_rom_crc32_le(0, sector, n) == head;
+  free(sector);
+  return ok;
+}
+#endif
+
+static String downloadEtag(AsyncWebServerRequest *request, uint32_t address, uint32_t length) {
+#if !FWDL_ENABLE_HASHING
+  (void)request;
+  (void)address;
+  (void)length;
+  return String();
+#else
+  uint8_t digest[32];
+  if (!verifiedCachedDigest(address, length, digest)) {
+    if (!Core::jobActive("etag", true)) {
+      EtagHashArgs *args = new EtagHashArgs{ address, length };
+      if (!Core::submitJob("etag", Core::JOB_PRIO_LOW, etagHashJob, args, [](void* p) { delete (EtagHashArgs*)p; },
+                           false)) {
+        delete args;
+      }
+    }
+    return String();
+  }
+  char hex[65];
+  toHex(digest, sizeof(digest), hex);
+  String etag = "\"";
+  etag += hex;
+  if (!request) {
+    etag += "\"";
+    return etag;
+  }
+  if (request->hasParam("normalize") && request->getParam("normalize")->value() != "0") etag += "-n";
+  if (wantsConsistent(request)) etag += "-c";
+  // Fixed tokens only; raw parameter values never reach the header.
+  if (wantsAdaptive(request)) etag += "-adaptive";
+  if (wantsDedup(request)) etag += "-dedup";
+  uint8_t format = requestedFormat(request);
+  if (format == EXPORT_UF2) etag += "-uf2";
+  if (format == EXPORT_IHEX) etag += "-ihex";
+  etag += "\"";
+  return etag;
+#endif
+}
+
+// If-None-Match uses the weak comparison: W/ prefixes are ignored.
+static bool etagMatches(AsyncWebServerRequest *request, const String &etag) {
+  if (!etag.length() || !request->hasHeader("If-None-Match")) return false;
+  String list = request->getHeader("If-None-Match")->value();
+  int pos = 0;
+  while (pos < (int)list.length()) {
+    int comma = list.indexOf(',', pos);
+    if (comma < 0) comma = list.length();
+    String tag = list.substring(pos, comma);
+    tag.trim();
+    if (tag.startsWith("W/")) tag = tag.substring(2);
+    if (tag == "*" || tag == etag) return true;
+    pos = comma + 1;
+  }
+  return false;
+}
+
+// Answers 304 when the client already holds etag; returns true if it did.
+static bool sendNotModified(AsyncWebServerRequest *request, const String &etag, const char* tag) {
+  if (!etagMatches(request, etag)) return false;
+  Serial.printf("[%s] Not modified (%s), 304.\n", tag, etag.c_str());
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+  return true;
+}
+
+void ESP32FirmwareDownloader::handleDumpFlash(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Full flash dump request received.");
+  uint32_t flashSize = fwdl_flash_size();
+  Serial.printf("[ESP32FirmwareDownloader] Flash size: %u bytes\n", flashSize);
+  
+  FlashSource src = makeSource(0, flashSize, false, "DirectStream");
+  AsyncWebServerResponse *response = beginDumpResponse(request, src);
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=" + dumpFileName(request, "fullclone"));
+  Serial.println("[ESP32FirmwareDownloader] Streaming full flash dump...");
+  request->send(response);
+}
+
+void ESP32FirmwareDownloader::handleDumpFlashSecure(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Secure full flash dump request received.");
+  uint32_t flashSize = fwdl_flash_size();
+  Serial.printf("[ESP32FirmwareDownloader] Flash size: %u bytes\n", flashSize);
+  
+  FlashSource src = makeSource(0, flashSize, true, "SecureStream");
+  AsyncWebServerResponse *response = beginDumpResponse(request, src);
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=" + dumpFileName(request, "fullclone_secure"));
+  Serial.println("[ESP32FirmwareDownloader] Streaming secure full flash dump...");
+  request->send(response);
+}
+
+#if FWDL_ENABLE_DEDUP
+// Collects a POST /archive body of 32-byte SHA-256 digests into a KnownUpload
+// in request->_tempObject (freed by the server). Digests may span chunks.
+void ESP32FirmwareDownloader::handleArchiveBody(AsyncWebServerRequest *request, uint8_t *data, size_t len,
+                                                size_t index, size_t total) {
+  if (index == 0) {
+    uint32_t capacity = total / 32;
+    if (capacity > DA_MAX_KNOWN) capacity = DA_MAX_KNOWN;
+    size_t bytes = sizeof(KnownUpload) + (capacity ? capacity - 1 : 0) * sizeof(uint64_t);
+    KnownUpload *upload = (KnownUpload*)malloc(bytes);
+    if (!upload) return;
+    upload->partialLen = 0;
+    upload->count = 0;
+    upload->capacity = capacity;
+    request->_tempObject = upload;
+  }
+  KnownUpload *upload = (KnownUpload*)request->_tempObject;
+  if (!upload) return;
+  for (size_t i = 0; i < len && upload->count < upload->capacity; i++) {
+    upload->partial[upload->partialLen++] = data[i];
+    if (upload->partialLen == 32) {
+      upload->keys[upload->count++] = digestKey(upload->partial);
+      upload->partialLen = 0;
+    }
+  }
+}
+
+// GET or POST /archive[?label=x][&secure=1]: a dedup archive of a partition or
+// the whole flash. The POST body lists digests the client already stores.
+void ESP32FirmwareDownloader::handleArchive(AsyncWebServerRequest *request) {
+  const KnownUpload *upload = (const KnownUpload*)request->_tempObject;
+  if (request->method() == HTTP_POST && request->contentLength() && !upload) {
+    request->send(503, "text/plain", "Not enough memory for the known list");
+    return;
+  }
+  if (request->contentLength() % 32 != 0) {
+    request->send(400, "text/plain", "Body must be a sequence of 32-byte SHA-256 digests");
+    return;
+  }
+  bool secure = request->hasParam("secure") && request->getParam("secure")->value() == "1";
+  String name = secure ? "fullclone_secure" : "fullclone";
+  FlashSource src;
+  if (request->hasParam("label")) {
+    name = request->getParam("label")->value();
+    const esp_partition_t* part = findPartitionByLabel(name.c_str());
+    if (!part) {
+      request->send(404, "text/plain", "Partition not found");
+      return;
+    }
+    const char* denied = rangeDenied(part->address, part->size);
+    if (denied) {
+      request->send(403, "text/plain", String("Protected: ") + denied);
+      return;
+    }
+    src = makeSource(part->address, part->size, secure, "ArchiveStream");
+  } else {
+    src = makeSource(0, fwdl_flash_size(), secure, "ArchiveStream");
+  }
+  Serial.printf("[ESP32FirmwareDownloader] Archive of %s (%u bytes), %u known digests offered.\n",
+                name.c_str(), src.length, upload ? upload->count : 0);
+
+  AsyncWebServerResponse *response = beginDumpResponse(request, src, true);
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=" + name + ".fwda");
+  request->send(response);
+}
+#endif  // FWDL_ENABLE_DEDUP
+
+void ESP32FirmwareDownloader::handleDownloadPartitionDirect(AsyncWebServerRequest *request) {
+  if (!request->hasParam("label")) {
+    request->send(400, "text/plain", "Missing 'label' parameter");
+    return;
+  }
+  String label = request->getParam("label")->value();
+  Serial.printf("[ESP32FirmwareDownloader] Direct partition download for label: %s\n", label.c_str());
+  
+  const esp_partition_t* part = findPartitionByLabel(label.c_str());
+  if (!part) {
+    request->send(404, "text/plain", "Partition not found");
+    return;
+  }
+  Serial.printf("[ESP32FirmwareDownloader] Partition %s found, size %u bytes\n", part->label, part->size);
+  const char* denied = rangeDenied(part->address, part->size);
+  if (denied) {
+    request->send(403, "text/plain", String("Protected: ") + denied);
+    return;
+  }
+  
+  String etag;
+  if (part->type == ESP_PARTITION_TYPE_APP) etag = downloadEtag(request, part->address, part->size);
+  Serial.printf("[ESP32FirmwareDownloader] ETag %s\n", etag.length() ? etag.c_str() : "(none)");
+  if (sendNotModified(request, etag, "GenericStream")) return;
+
+  FlashSource src = makeSource(part->address, part->size, false, "GenericStream");
+  AsyncWebServerResponse* response = beginDumpResponse(request, src);
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=" + dumpFileName(request, label));
+  if (etag.length()) {
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+  }
+  Serial.println("[ESP32FirmwareDownloader] Streaming generic partition...");
+  request->send(response);
+}
+
+void ESP32FirmwareDownloader::handleDownloadBoot(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Bootloader download request received.");
+  // Always the raw bytes, whatever the query asks for, so the tag has no suffixes.
+  String etag = downloadEtag(nullptr, BOOTLOADER_OFFSET, BOOTLOADER_SIZE);
+  if (sendNotModified(request, etag, "BootloaderStream")) return;
+  AsyncWebServerResponse* response = beginSourceResponse(request,
+                                                         makeSource(BOOTLOADER_OFFSET, BOOTLOADER_SIZE, false, "BootloaderStream"));
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=bootloader.bin");
+  if (etag.length()) {
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+  }
+  Serial.println("[ESP32FirmwareDownloader] Streaming bootloader...");
+  request->send(response);
+}
+
+#if FWDL_ENABLE_UPLOAD
+void ESP32FirmwareDownloader::handleActivatePartition(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Activate partition request received.");
+  const esp_partition_t* current = esp_ota_get_running_partition();
+  const esp_partition_t* target = nullptr;
+  
+  if (request->hasParam("label")) {
+    String label = request->getParam("label")->value();
+    target = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
+    if (!target) {
+      request->send(404, "text/plain", "Specified partition not found");
+      return;
+    }
+    if (target->address == current->address) {
+      request->send(400, "text/plain", "Specified partition is already running");
+      return;
+    }
+  } else {
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+    while (it != NULL) {
+      const esp_partition_t* p = esp_partition_get(it);
+      if (p && (p->address != current->address)) {
+        target = p;
+        break;
+      }
+      it = esp_partition_next(it);
+    }
+    if (!target) {
+      request->send(500, "text/plain", "Inactive partition not found");
+      return;
+    }
+  }
+  
+  if (!isPartitionValid(target)) {
+    request->send(400, "text/plain", "Partition appears empty/unavailable");
+    return;
+  }
+  
+  esp_err_t err = esp_ota_set_boot_partition(target);
+  bumpOtadata();
+  if (err != ESP_OK) {
+    String errMsg = "Failed to set boot partition: ";
+    errMsg += esp_err_to_name(err);
+    request->send(500, "text/plain", errMsg);
+    return;
+  }
+  
+  String msg = "Partition ";
+  msg += target->label;
+  msg += " activated. Rebooting now...";
+  request->send(200, "text/plain", msg);
+  Serial.println("[ESP32FirmwareDownloader] Partition activated. Rebooting...");
+  delay(2000);
+  Core::wearFlush(true);
+  esp_restart();
+}
+
+// The copy runs as a job; poll /jobs?id= for the outcome.
+void ESP32FirmwareDownloader::handleClonePartition(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Clone partition request received.");
+  if (Core::jobActive("clone")) {
+    request->send(409, "application/json", jobStatusJson(0, "clone"));
+    return;
+  }
+  uint32_t id = Core::submitJob("clone", Core::JOB_PRIO_HIGH, cloneJob, nullptr, nullptr, true, true);
+  if (!id) {
+    request->send(503, "text/plain", "Job queue full");
+    return;
+  }
+  request->send(202, "application/json", jobStatusJson(id, nullptr));
+}
+#endif  // FWDL_ENABLE_UPLOAD
+
+#if FWDL_ENABLE_UI
+void ESP32FirmwareDownloader::handleRoot(AsyncWebServerRequest *request) {
+  Serial.println("[ESP32FirmwareDownloader] Sending FWDL root page with device metadata and partition map.");
+
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  String chipModel = ESP.getChipModel();
+  String chipRevision = String(ESP.getChipRevision());
+  float flashMB = fwdl_flash_size() / (1024.0 * 1024.0);
+  String cpuFreq = String(ESP.getCpuFreqMHz());
+
+  String htmlHeader = R"rawliteral(
+<html>
+  <head>
+    <title>ESP32 Firmware Download (FWDL)</title>
+    <style>
+      body { font-family: Arial, sans-serif; margin: 20px; }
+      table { border-collapse: collapse; width: 90%; }
+      th, td { border: 1px solid #ccc; padding: 8px; text-align: center; }
+      th { background-color: #f2f2f2; }
+      .highlight { background-color: #c0ffc0; }
+      .nav { margin-top: 20px; }
+      .nav a { margin-right: 10px; text-decoration: none; color: blue; }
+      .nav a:hover { text-decoration: underline; }
+    </style>
+    <script>
+      document.addEventListener("DOMContentLoaded", function() {
+        var table = document.querySelector("table");
+        if (table) {
+          table.addEventListener("mouseover", function(e) {
+            var target = e.target;
+            if (target && target.hasAttribute("data-index")) {
+              var idx = target.getAttribute("data-index");
+              var row = target.closest("tr");
+              if (row) {
+                var cells = row.querySelectorAll('[data-index="' + idx + '"]');
+                cells.forEach(function(cell) { cell.classList.add("highlight"); });
+              }
+            }
+          });
+          table.addEventListener("mouseout", function(e) {
+            var target = e.target;
+            if (target && target.hasAttribute("data-index")) {
+              var idx = target.getAttribute("data-index");
+              var row = target.closest("tr");
+              if (row) {
+                var cells = row.querySelectorAll('[data-index="' + idx + '"]');
+                cells.forEach(function(cell) { cell.classList.remove("highlight"); });
+              }
+            }
+          });
+        }
+      });
+    </script>
+  </head>
+  <body>
     <h1>ESP32 Firmware Download (FWDL)</h1>
     <h2>Device Information</h2>
     <ul>
-      <li>Chip Model: )rawliteral" + chipModel + R"rawliteral(</li>
-      <li>Chip Revision: )rawliteral" + chipRevision + R"rawliteral(</li>
-      <li>Flash Size: )rawliteral" + String(flashMB, 2) + R"rawliteral( MB</li>
-      <li>CPU Frequency: )rawliteral" + cpuFreq + R"rawliteral( MHz</li>
-    </ul>
-    <h2>Partition Map</h2>
-    <table>
-      <tr>
-        <th>Type</th>
-        <th>Label</th>
-        <th>Address</th>
-        <th>Size (bytes)</th>
-        <th>Download</th>
-        <th>Activate</th>
-        <th>Upload</th>
-      </tr>
+      <li>Chip Model: )rawliteral" + chipModel + R"rawliteral(</li>
+      <li>Chip Revision: )rawliteral" + chipRevision + R"rawliteral(</li>
+      <li>Flash Size: )rawliteral" + String(flashMB, 2) + R"rawliteral( MB</li>
+      <li>CPU Frequency: )rawliteral" + cpuFreq + R"rawliteral( MHz</li>
+    </ul>
+    <h2>Partition Map</h2>
+    <table>
+      <tr>
+        <th>Type</th>
+        <th>Label</th>
+        <th>Address</th>
+        <th>Size (bytes)</th>
+        <th>Download</th>
+)rawliteral";
+#if FWDL_ENABLE_UPLOAD
+  htmlHeader += "        <th>Activate</th>\n        <th>Upload</th>\n";
+#endif
+  htmlHeader += "      </tr>\n";
+
+  String rows = "";
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL) {
+    const esp_partition_t* p = esp_partition_get(it);
+    bool isRunning = (running && (p->address == running->address));
+    String rowStyle = isRunning ? " style=\"background-color:yellow;\"" : "";
+    String displayLabel = String(p->label);
+    if (isRunning) displayLabel += " (running)";
+    char addrStr[20];
+    sprintf(addrStr, "0x%08X", p->address);
+
+    rows += "<tr" + rowStyle + ">";
+    rows += "<td>APP</td>";
+    rows += "<td>" + displayLabel + "</td>";
+    rows += "<td>" + String(addrStr) + "</td>";
+    rows += "<td>" + String(p->size) + "</td>";
+    rows += "<td><a href=\"/downloaddirect?label=" + String(p->label) + "\">Download</a></td>";
+#if FWDL_ENABLE_UPLOAD
+    if (!isRunning) {
+      if (isPartitionValid(p)) {
+        rows += "<td><button onclick=\"location.href='/activate?label=" + String(p->label) + "'\">Activate</button></td>";
+      } else {
+        rows += "<td><button disabled title=\"Partition unavailable\">Activate</button></td>";
+      }
+      rows += "<td><form method='POST' action='/upload' enctype='multipart/form-data' style='display:inline;'>"
+              "<input type='hidden' name='label' value='" + String(p->label) + "'>"
+              "<input type='file' name='file' style='width:150px;' onchange='checkAppImage(this, " + String(p->size) + ")'>"
+              "<input type='submit' value='Upload'>"
+              "</form></td>";
+    } else {
+      rows += "<td>N/A</td><td>N/A</td>";
+    }
+#endif
+    rows += "</tr>";
+    it = esp_partition_next(it);
+  }
+
+  it = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL) {
+    const esp_partition_t* p = esp_partition_get(it);
+    char addrStr[20];
+    sprintf(addrStr, "0x%08X", p->address);
+    rows += "<tr>";
+    rows += "<td>DATA</td>";
+    rows += "<td>" + String(p->label) + "</td>";
+    rows += "<td>" + String(addrStr) + "</td>";
+    rows += "<td>" + String(p->size) + "</td>";
+    rows += "<td><a href=\"/downloaddirect?label=" + String(p->label) + "\">Download</a></td>";
+#if FWDL_ENABLE_UPLOAD
+    rows += "<td>N/A</td>";
+    rows += "<td><form method='POST' action='/upload' enctype='multipart/form-data' style='display:inline;'>"
+            "<input type='hidden' name='label' value='" + String(p->label) + "'>"
+            "<input type='file' name='file' style='width:150px;' onchange='checkFileSize(this, " + String(p->size) + ")'>"
+            "<input type='submit' value='Upload'>"
+            "</form></td>";
+#endif
+    rows += "</tr>";
+    it = esp_partition_next(it);
+  }
+
+  String htmlFooter = R"rawliteral(
+    </table>
+    <h2>Global Download Links</h2>
+    <ul>
+      <li><a href="/dumpflash">Full Flash Dump</a></li>
+      <li><a href="/dumpflash_secure">Secure Full Flash Dump</a></li>
+      <li><a href="/downloadboot">Bootloader Download</a></li>
+      <li>Generic Download: /downloaddirect?label=YourPartitionLabel</li>
+      <li><a href="/fwdl/stats">Streaming Session Stats</a></li>
+      <li><a href="/partitions">Partition Table</a></li>
+      <li><a href="/jobs">Background Jobs</a></li>
+)rawliteral";
+#if FWDL_ENABLE_UPLOAD
+  // /clone answers 202 with the queued job; follow it on /jobs?id= until it ends.
+  htmlFooter += "      <li><a href=\"/clone\" onclick=\"return startClone()\">Clone Active APP Partition</a> "
+                "<span id=\"cloneStatus\"></span></li>\n";
+#endif
+#if FWDL_ENABLE_DEDUP
+  htmlFooter += "      <li><a href=\"/archive\">Dedup Archive (full flash)</a></li>\n";
+#endif
+#if FWDL_ENABLE_DIAGNOSTICS
+  htmlFooter += "      <li><a href=\"/coredump?summary=1\">Core Dump Summary</a></li>\n";
+  htmlFooter += "      <li><a href=\"/wear\">Flash Wear</a></li>\n";
+#endif
+  htmlFooter += "    </ul>\n";
+#if FWDL_ENABLE_UPLOAD
+  htmlFooter += R"rawliteral(    <script>
+      function showClone(job) {
+        var text = job.state;
+        if (job.total) text += " " + Math.floor(100 * job.done / job.total) + "%";
+        if (job.message) text += ": " + job.message;
+        document.getElementById("cloneStatus").textContent = text;
+        if (job.running) setTimeout(function() { pollClone(job.id); }, 1000);
+      }
+      function pollClone(id) {
+        fetch("/jobs?id=" + id).then(function(r) { return r.json(); }).then(showClone)
+          .catch(function() { document.getElementById("cloneStatus").textContent = "status unavailable"; });
+      }
+      function startClone() {
+        document.getElementById("cloneStatus").textContent = "queued";
+        fetch("/clone").then(function(r) {
+          if (r.status == 503) throw new Error("job queue full");
+          return r.json();
+        }).then(showClone).catch(function(e) { document.getElementById("cloneStatus").textContent = e.message; });
+        return false;
+      }
+    </script>
 )rawliteral";
+#endif
+  htmlFooter += "  </body>\n</html>\n";
+
+  String fullHtml = htmlHeader + rows + htmlFooter;
+  request->send(200, "text/html", fullHtml);
+}
+#endif  // FWDL_ENABLE_UI
+
+void ESP32FirmwareDownloader::handleStreamStats(AsyncWebServerRequest *request) {
+  StreamStats st = getStreamStats();
+  Core::StallPolicy policy = Core::stallPolicy();
+
+  String json = "{";
+  json += "\"active\":" + String(Core::activeSessions());
+  json += ",\"maxSessions\":" + String(Core::MAX_SESSIONS);
+  json += ",\"started\":" + String(st.started);
+  json += ",\"completed\":" + String(st.completed);
+  json += ",\"rejected\":" + String(st.rejected);
+  json += ",\"stalled\":" + String(st.stalled);
+  json += ",\"idle\":" + String(st.idle);
+  json += ",\"sourceBytes\":" + String(st.sourceBytes);
+  json += ",\"wireBytes\":" + String(st.wireBytes);
+  json += ",\"minBytesPerSec\":" + String(policy.minBytesPerSec);
+  json += ",\"stallMs\":" + String(policy.stallMs);
+  json += ",\"idleTimeoutMs\":" + String(policy.idleTimeoutMs);
+#if FWDL_ENABLE_COMPRESSION
+  json += ",\"adaptive\":{\"rawBytes\":" + String(g_fwzLast.rawBytes);
+  json += ",\"encodedBytes\":" + String(g_fwzLast.encodedBytes);
+  json += ",\"erasedBlocks\":" + String(g_fwzLast.erasedBlocks);
+  json += ",\"lz4Blocks\":" + String(g_fwzLast.lz4Blocks);
+  json += ",\"storedEntropy\":" + String(g_fwzLast.storedEntropy);
+  json += ",\"storedNoGain\":" + String(g_fwzLast.storedNoGain);
+  json += ",\"cpuUs\":" + String(g_fwzLast.cpuUs) + "}";
+#endif
+#if FWDL_ENABLE_EXPORT
+  json += ",\"export\":{\"format\":\"" + String(exportFormatName(g_exportLast.format)) + "\"";
+  json += ",\"rawBytes\":" + String(g_exportLast.rawBytes);
+  json += ",\"encodedBytes\":" + String(g_exportLast.encodedBytes);
+  json += ",\"cpuUs\":" + String(g_exportLast.cpuUs);
+  json += ",\"wallMs\":" + String(g_exportLast.wallMs) + "}";
+#endif
+#if FWDL_ENABLE_DEDUP
+  json += ",\"dedup\":{\"rawBytes\":" + String(g_dedupLast.rawBytes);
+  json += ",\"encodedBytes\":" + String(g_dedupLast.encodedBytes);
+  json += ",\"sectors\":" + String(g_dedupLast.sectors);
+  json += ",\"dataSectors\":" + String(g_dedupLast.dataSectors);
+  json += ",\"copySectors\":" + String(g_dedupLast.copySectors);
+  json += ",\"knownSectors\":" + String(g_dedupLast.knownSectors);
+  json += ",\"erasedSectors\":" + String(g_dedupLast.erasedSectors);
+  json += ",\"cpuUs\":" + String(g_dedupLast.cpuUs) + "}";
+#endif
+  json += "}";
+  request->send(200, "application/json", json);
+}
+
+//////////////////////////////
+// Upload Sink
+//////////////////////////////
+// Sequential writer into an APP (via OTA) or DATA (erase + write) partition:
+// FirmwareDownloaderCore::uploadBegin() and friends, shared by the HTTP upload
+// handler, the binary transports and the esp_http_server adapter.
+
+typedef Core::Upload UploadSink;
+
+#if FWDL_ENABLE_UPLOAD
+static bool sinkIsApp(const UploadSink &sink) {
+  return sink.target && sink.target->type == ESP_PARTITION_TYPE_APP;
+}
+
+//////////////////////////////
+// Upload Handler
+//////////////////////////////
+void ESP32FirmwareDownloader::handleUploadBinary(AsyncWebServerRequest *request,
+    const String &filename, size_t index, uint8_t *data, size_t len, bool final) {
+  // Retrieve target partition label.
+  String label = "";
+  if (request->hasParam("label", true)) {
+    label = request->getParam("label", true)->value();
+  } else {
+    Serial.println("[Upload] Missing 'label' parameter");
+    request->send(400, "text/plain", "Missing 'label' parameter");
+    return;
+  }
+
+  static UploadSink sink = {nullptr, 0, 0, false};
+
+  if (index == 0) {
+    if (sink.active) {
+      Serial.println("[Upload] Upload already started, ignoring new start.");
+      return;
+    }
+    const esp_partition_t* target = findPartitionByLabel(label.c_str());
+    if (!target) {
+      Serial.printf("[Upload] Target partition '%s' not found!\n", label.c_str());
+      request->send(404, "text/plain", "Target partition not found");
+      return;
+    }
+    esp_err_t err = Core::uploadBegin(sink, target);
+    if (err == ESP_ERR_INVALID_ARG) {
+      request->send(400, "text/plain", "Cannot update active partition");
+      return;
+    } else if (err != ESP_OK) {
+      request->send(500, "text/plain", sinkIsApp(sink) ? "OTA update failed to begin" : "Erase partition failed");
+      return;
+    }
+  }
+
+  if (!sink.active) {
+    Serial.println("[Upload] No upload in progress.");
+    return;
+  }
+
+  if (Core::uploadWrite(sink, data, len) != ESP_OK) {
+    Core::uploadAbort(sink);
+    request->send(500, "text/plain", "Write failed");
+    return;
+  }
+
+  if (final) {
+    bool isApp = sinkIsApp(sink);
+    if (Core::uploadEnd(sink, isApp) != ESP_OK) {
+      request->send(500, "text/plain", "Upload failed to finalize");
+      return;
+    }
+    if (!isApp) {
+      request->send(200, "text/plain", "Upload complete for DATA partition");
+      return;
+    }
+    Serial.println("[Upload] OTA update complete. Rebooting...");
+    request->send(200, "text/plain", "Upload complete, device will reboot");
+    delay(2000);
+    Core::wearFlush(true);
+    esp_restart();
+  }
+}
+#endif  // FWDL_ENABLE_UPLOAD
+
+//////////////////////////////
+// Transfer Requests
+//////////////////////////////
+// Source selection shared by the binary transports (raw TCP, serial).
+
+// Same values as FirmwareDownloaderCore::Mode and ::Status.
+enum XferMode : uint8_t {
+  XFER_MODE_FULL      = FirmwareDownloaderCore::MODE_FULL,
+  XFER_MODE_SECURE    = FirmwareDownloaderCore::MODE_SECURE,
+  XFER_MODE_PARTITION = FirmwareDownloaderCore::MODE_PARTITION,
+  XFER_MODE_RANGE     = FirmwareDownloaderCore::MODE_RANGE
+};
+
+enum XferStatus : uint8_t {
+  XFER_OK           = FirmwareDownloaderCore::OK,
+  XFER_BAD_REQUEST  = FirmwareDownloaderCore::BAD_REQUEST,
+  XFER_NOT_FOUND    = FirmwareDownloaderCore::NOT_FOUND,
+  XFER_OUT_OF_RANGE = FirmwareDownloaderCore::OUT_OF_RANGE,
+  XFER_UNSUPPORTED  = FirmwareDownloaderCore::UNSUPPORTED,
+  XFER_BUSY         = FirmwareDownloaderCore::BUSY,
+  XFER_SEQUENCE     = FirmwareDownloaderCore::SEQUENCE,    // upload data out of order
+  XFER_IO_ERROR     = FirmwareDownloaderCore::IO_ERROR,
+  XFER_FORBIDDEN    = FirmwareDownloaderCore::FORBIDDEN    // touches a protected region
+};
+
+#if FWDL_ENABLE_WEBSOCKET || FWDL_ENABLE_BATCH
+// Minimal lookup of "key": value in a flat JSON object. Copies the string or
+// number literal into out; returns false when the key is absent.
+static bool jsonGet(const char* json, const char* key, char* out, size_t outLen) {
+  char pattern[24];
+  snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+  const char* p = strstr(json, pattern);
+  if (!p) return false;
+  p += strlen(pattern);
+  while (*p == ' ' || *p == ':') p++;
+  size_t n = 0;
+  if (*p == '"') {
+    p++;
+    while (*p && *p != '"' && n + 1 < outLen) out[n++] = *p++;
+  } else {
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && n + 1 < outLen) out[n++] = *p++;
+  }
+  out[n] = '\0';
+  return true;
+}
+#endif
+
+#if FWDL_ENABLE_WEBSOCKET
+static uint32_t jsonGetU32(const char* json, const char* key, uint32_t def) {
+  char buf[16];
+  if (!jsonGet(json, key, buf, sizeof(buf))) return def;
+  return (uint32_t)strtoul(buf, nullptr, 0);
+}
+
+static uint8_t xferModeFromName(const char* name) {
+  if (!strcmp(name, "full"))      return XFER_MODE_FULL;
+  if (!strcmp(name, "secure"))    return XFER_MODE_SECURE;
+  if (!strcmp(name, "partition")) return XFER_MODE_PARTITION;
+  if (!strcmp(name, "range"))     return XFER_MODE_RANGE;
+  return 0xFF;
+}
+
+static const char* xferStatusName(uint8_t status) {
+  return fwdl_status_name((fwdl_status_t)status);
+}
+#endif
+
+uint8_t ESP32FirmwareDownloader::resolveSource(uint8_t mode, uint32_t offset, uint32_t length, const char* label,
+                                               const char* tag, FlashSource &out) {
+  fwdl_stream_t s;
+  uint8_t status = fwdl_stream_open(&s, (fwdl_mode_t)mode, offset, length, label);
+  if (status != FWDL_OK) return status;
+  out = makeSource(s.start, s.length, s.blanked, tag);
+  return XFER_OK;
+}
+
+#if FWDL_ENABLE_RAW_TCP
+//////////////////////////////
+// Raw TCP Dump Server
+//////////////////////////////
+// Wire format (little-endian):
+//   request  (32 B): "FWDQ" | ver u8 | mode u8 | compression u8 | rsvd u8 | offset u32 | length u32 | label[16]
+//   response (16 B): "FWDR" | status u8 | compression u8 | rsvd u16 | start u32 | length u32
+//   payload  (length B), then trailer (36 B): "FWDT" | SHA-256 of the payload
+// compression 1 (FWDL_ENABLE_COMPRESSION) makes the payload the FWZ1 stream
+// of ?encoding=adaptive. length is then the image length, the payload runs to
+// the FWZ_END record, and the trailer hashes the payload as sent; the
+// decoded image is checked by the CRC-32 in FWZ_END.
+static const uint8_t RAW_PROTO_VERSION = 1;
+static const uint8_t RAW_COMPRESSION_FWZ = 1;
+static const size_t  RAW_REQUEST_SIZE  = 32;
+static const size_t  RAW_HEADER_SIZE   = 16;
+static const size_t  RAW_TRAILER_SIZE  = 36;
+static const size_t  RAW_MIN_SEND      = 1024;   // wait for acks rather than queue tiny segments
+
+enum RawPhase : uint8_t {
+  RAW_PHASE_REQUEST,
+  RAW_PHASE_DATA,
+  RAW_PHASE_TRAILER,
+  RAW_PHASE_DONE
+};
+
+struct ESP32FirmwareDownloader::RawConn {
+  AsyncClient* client;
+  RawPhase phase;
+  uint8_t request[RAW_REQUEST_SIZE];
+  size_t requestLen;
+  FlashSource src;
+  size_t sent;                         // payload bytes queued so far
+  uint8_t pending[RAW_TRAILER_SIZE];   // header or trailer waiting for send space
+  size_t pendingLen;
+  size_t pendingOff;
+  mbedtls_sha256_context sha;
+  int slot;
+  uint32_t sessionId;
+#if FWDL_ENABLE_COMPRESSION
+  AdaptiveStream* fwz;                 // set for compression 1
+#endif
+  uint8_t buffer[CHUNK_SIZE];
+};
+
+bool ESP32FirmwareDownloader::beginRawServer(uint16_t port) {
+  if (_rawServer) {
+    Serial.println("[RawServer] Already running.");
+    return false;
+  }
+  _rawServer = new AsyncServer(port);
+  _rawServer->onClient(handleRawClient, nullptr);
+  _rawServer->setNoDelay(true);
+  _rawServer->begin();
+  Serial.printf("[RawServer] Listening on TCP port %u\n", port);
+  return true;
+}
+
+void ESP32FirmwareDownloader::handleRawClient(void* arg, AsyncClient* client) {
+  (void)arg;
+  RawConn* conn = new RawConn();
+  conn->client = client;
+  conn->phase = RAW_PHASE_REQUEST;
+  conn->requestLen = 0;
+  conn->sent = 0;
+  conn->pendingLen = 0;
+  conn->pendingOff = 0;
+  conn->slot = -1;
+  conn->sessionId = 0;
+#if FWDL_ENABLE_COMPRESSION
+  conn->fwz = nullptr;
+#endif
+  mbedtls_sha256_init(&conn->sha);
+  Serial.printf("[RawServer] Client connected from %s\n", client->remoteIP().toString().c_str());
+
+  client->onData([](void* arg, AsyncClient* c, void* data, size_t len) {
+    RawConn* conn = (RawConn*)arg;
+    if (conn->phase != RAW_PHASE_REQUEST) return;   // ignore anything after the request
+    size_t take = RAW_REQUEST_SIZE - conn->requestLen;
+    if (len < take) take = len;
+    memcpy(conn->request + conn->requestLen, data, take);
+    conn->requestLen += take;
+    if (conn->requestLen == RAW_REQUEST_SIZE) {
+      rawHandleRequest(conn);
+    }
+  }, conn);
+  client->onAck([](void* arg, AsyncClient* c, size_t len, uint32_t time) {
+    rawPump((RawConn*)arg);
+  }, conn);
+  client->onPoll([](void* arg, AsyncClient* c) {
+    rawPump((RawConn*)arg);
+  }, conn);
+  client->onTimeout([](void* arg, AsyncClient* c, uint32_t time) {
+    c->close();
+  }, conn);
+  client->onDisconnect([](void* arg, AsyncClient* c) {
+    RawConn* conn = (RawConn*)arg;
+    if (conn->slot >= 0) {
+      Core::releaseSession(conn->slot, conn->sessionId);
+    }
+    mbedtls_sha256_free(&conn->sha);
+#if FWDL_ENABLE_COMPRESSION
+    delete conn->fwz;
+#endif
+    delete conn;
+    delete c;
+  }, conn);
+}
+
+static void rawWriteHeader(uint8_t *h, uint8_t status, uint8_t compression, uint32_t start, uint32_t length) {
+  memcpy(h, "FWDR", 4);
+  h[4] = status;
+  h[5] = compression;
+  h[6] = 0;
+  h[7] = 0;
+  writeLE32(h + 8, start);
+  writeLE32(h + 12, length);
+}
+
+void ESP32FirmwareDownloader::rawHandleRequest(RawConn* conn) {
+  const uint8_t *r = conn->request;
+  uint8_t status = XFER_OK;
+  uint8_t mode = r[5];
+  uint8_t compression = r[6];
+
+#if FWDL_ENABLE_COMPRESSION
+  bool compressible = compression == RAW_COMPRESSION_FWZ;
+#else
+  bool compressible = false;
+#endif
+  if (memcmp(r, "FWDQ", 4) != 0 || r[4] != RAW_PROTO_VERSION) {
+    status = XFER_BAD_REQUEST;
+  } else if (compression != 0 && !compressible) {
+    status = XFER_UNSUPPORTED;
+  } else {
+    char label[17];
+    memcpy(label, r + 16, 16);
+    label[16] = '\0';
+    status = resolveSource(mode, readLE32(r + 8), readLE32(r + 12), label, "RawStream", conn->src);
+  }
+
+#if FWDL_ENABLE_COMPRESSION
+  if (status == XFER_OK && compression == RAW_COMPRESSION_FWZ) {
+    AdaptiveStream* a = new AdaptiveStream();
+    a->src = conn->src;
+    a->block = (uint8_t*)malloc(FWZ_BLOCK_SIZE);
+    a->table = (uint16_t*)malloc(sizeof(uint16_t) << LZ_HASH_BITS);
+    a->pending = (uint8_t*)malloc(FWZ_PENDING_SIZE);
+    conn->fwz = a;
+    if (!a->block || !a->table || !a->pending) status = XFER_BUSY;   // no memory for the encoder
+  }
+#endif
+  if (status == XFER_OK) {
+    conn->slot = Core::acquireSession("RawStream", conn->src.length, &conn->sessionId, closeAsyncClient,
+                                       conn->client);
+    if (conn->slot < 0) status = XFER_BUSY;
+  }
+
+  conn->pendingLen = RAW_HEADER_SIZE;
+  conn->pendingOff = 0;
+  if (status != XFER_OK) {
+    Serial.printf("[RawServer] Rejecting request (mode %u): status %u\n", mode, status);
+    rawWriteHeader(conn->pending, status, 0, 0, 0);
+    conn->phase = RAW_PHASE_TRAILER;   // nothing follows the header
+  } else {
+    Serial.printf("[RawServer] Streaming 0x%08X + %u bytes (mode %u, compression %u)\n",
+                  conn->src.start, conn->src.length, mode, compression);
+    rawWriteHeader(conn->pending, status, compression, conn->src.start, conn->src.length);
+    mbedtls_sha256_starts(&conn->sha, 0);
+    conn->phase = RAW_PHASE_DATA;
+  }
+  rawPump(conn);
+}
+
+// Fill the TCP send buffer as far as it goes. Called on request, ack and poll.
+void ESP32FirmwareDownloader::rawPump(RawConn* conn) {
+  AsyncClient* client = conn->client;
+  if (conn->phase == RAW_PHASE_REQUEST || conn->phase == RAW_PHASE_DONE) return;
+
+  bool queued = false;
+  while (true) {
+    if (conn->pendingOff < conn->pendingLen) {
+      size_t n = client->add((const char*)conn->pending + conn->pendingOff, conn->pendingLen - conn->pendingOff);
+      conn->pendingOff += n;
+      if (n) queued = true;
+      if (conn->pendingOff < conn->pendingLen) break;
+      continue;
+    }
+    if (conn->phase == RAW_PHASE_DATA) {
+      size_t space = client->space();
+      size_t n = 0;
+      bool finished;
+      uint32_t sourceBytes;
+#if FWDL_ENABLE_COMPRESSION
+      if (conn->fwz) {
+        // The encoded length is not known up front, so the stream is done
+        // once adaptiveFill() has nothing left after FWZ_END.
+        if (space < RAW_MIN_SEND) break;
+        n = adaptiveFill(*conn->fwz, conn->buffer, space < CHUNK_SIZE ? space : CHUNK_SIZE, conn->sent);
+        finished = n == 0 && conn->fwz->ended;
+        sourceBytes = conn->fwz->pos;
+      } else
+#endif
+      {
+        size_t remaining = conn->src.length - conn->sent;
+        finished = remaining == 0;
+        if (!finished) {
+          if (space < RAW_MIN_SEND && remaining > space) break;
+          size_t want = remaining;
+          if (want > space) want = space;
+          if (want > CHUNK_SIZE) want = CHUNK_SIZE;
+          n = readSource(conn->src, conn->buffer, want, conn->sent);
+        }
+        sourceBytes = conn->sent + n;
+      }
+      if (finished) {
+        memcpy(conn->pending, "FWDT", 4);
+        mbedtls_sha256_finish(&conn->sha, conn->pending + 4);
+        conn->pendingLen = RAW_TRAILER_SIZE;
+        conn->pendingOff = 0;
+        conn->phase = RAW_PHASE_TRAILER;
+        continue;
+      }
+      if (n == 0) {
+        Serial.println("[RawServer] Flash read failed; closing connection.");
+        conn->phase = RAW_PHASE_DONE;
+        client->close(true);
+        return;
+      }
+      mbedtls_sha256_update(&conn->sha, conn->buffer, n);
+      client->add((const char*)conn->buffer, n);
+      conn->sent += n;
+      queued = true;
+      Core::noteSessionProgress(conn->slot, conn->sessionId, sourceBytes, conn->sent);
+      continue;
+    }
+    // Trailer (or error header) fully queued.
+    conn->phase = RAW_PHASE_DONE;
+    client->send();
+    Serial.printf("[RawServer] Transfer finished (%u payload bytes).\n", conn->sent);
+    client->close();   // lwIP flushes queued data before FIN
+    return;
+  }
+  if (queued) client->send();
+}
+#endif  // FWDL_ENABLE_RAW_TCP
+
+#if FWDL_ENABLE_SERIAL
+//////////////////////////////
+// Serial (UART) Transport
+//////////////////////////////
+// Frames are SLIP-encoded (END 0xC0, ESC 0xDB) and carry
+//   type u8 | seq u16 | payload | CRC-32 (LE) over type..payload
+// Every frame is wrapped in END bytes on both sides, so stray debug text on a
+// shared port becomes a short garbage frame that fails its CRC and is dropped.
+//
+// Reads are go-back-N: the device keeps up to SERIAL_WINDOW data frames in
+// flight; the host acknowledges the next offset it expects. Uploads are the
+// reverse: each UPLOAD_DATA frame is acknowledged with the next offset the
+// device expects, so the host may also pipeline a window of frames.
+
+static const uint8_t  SLIP_END     = 0xC0;
+static const uint8_t  SLIP_ESC     = 0xDB;
+static const uint8_t  SLIP_ESC_END = 0xDC;
+static const uint8_t  SLIP_ESC_ESC = 0xDD;
+
+static const uint8_t  SERIAL_PROTO_VERSION = 1;
+static const size_t   SERIAL_DATA_SIZE     = CHUNK_SIZE;                // data bytes per frame
+static const size_t   SERIAL_PAYLOAD_MAX   = SERIAL_DATA_SIZE + 4;      // offset + data
+static const size_t   SERIAL_FRAME_MAX     = 3 + SERIAL_PAYLOAD_MAX + 4;
+static const uint8_t  SERIAL_WINDOW        = 4;
+static const uint8_t  SERIAL_MAX_RETRIES   = 10;
+static const uint32_t SERIAL_BAUD_CONFIRM_MS = 2000;
+static const uint32_t SERIAL_IDLE_WAIT_MS  = 100;   // UART wait between bytes; bounds the baud revert check
+static const uint32_t SERIAL_PUMP_WAIT_MS  = 2;     // ... while a read is sending data frames
+
+enum SerialFrameType : uint8_t {
+  SF_HELLO        = 0x01,   // -> HELLO_ACK
+  SF_SET_BAUD     = 0x02,   // baud u32 -> STATUS, then switch
+  SF_READ         = 0x10,   // mode u8 | offset u32 | length u32 | label[16]
+  SF_DATA         = 0x11,   // device -> host: offset u32 | data
+  SF_DATA_ACK     = 0x12,   // host -> device: next expected offset u32
+  SF_ABORT        = 0x13,
+  SF_UPLOAD_BEGIN = 0x20,   // label[16] | size u32
+  SF_UPLOAD_DATA  = 0x21,   // offset u32 | data
+  SF_UPLOAD_END   = 0x22,   // activate u8
+  SF_REBOOT       = 0x30,
+  SF_LIST         = 0x40,
+  SF_STATUS       = 0x80,   // status u8 | value u32
+  SF_HELLO_ACK    = 0x81,   // version u8 | window u8 | maxData u16 | maxBaud u32
+  SF_READ_INFO    = 0x90,   // status u8 | start u32 | length u32
+  SF_READ_DONE    = 0x91,   // SHA-256 of the payload
+  SF_LIST_REPLY   = 0xC0    // n x (label[16] | type u8 | subtype u8 | address u32 | size u32)
+};
+
+// Frame writer: owns the escape buffer so a whole frame goes out in one write.
+struct SerialFramer {
+  HardwareSerial* port;
+  uint8_t tx[2 * SERIAL_FRAME_MAX + 2];
+};
+
+struct ESP32FirmwareDownloader::SerialLink {
+  HardwareSerial* port;
+  SerialFramer framer;
+  uint32_t maxBaud;
+  uint32_t baud;
+  uint32_t prevBaud;
+  uint32_t baudSwitchMs;          // non-zero while a new baud awaits confirmation
+
+  uint8_t rx[SERIAL_FRAME_MAX];
+  size_t rxLen;
+  bool rxEscape;
+  bool rxOverflow;
+  uint8_t data[SERIAL_PAYLOAD_MAX];
+
+  // Read (device -> host) state.
+  bool reading;
+  FlashSource src;
+  uint32_t ackedOffset;
+  uint32_t nextOffset;
+  uint32_t hashedOffset;
+  uint32_t lastAckMs;
+  uint8_t retries;
+  bool rewound;                   // already went back for the current ack
+  mbedtls_sha256_context sha;
+
+  // Upload (host -> device) state.
+  UploadSink sink;
+
+  uint32_t badFrames;
+  uint32_t retransmits;
+};
+
+static size_t slipPut(uint8_t *out, size_t n, uint8_t b) {
+  if (b == SLIP_END) {
+    out[n++] = SLIP_ESC;
+    out[n++] = SLIP_ESC_END;
+  } else if (b == SLIP_ESC) {
+    out[n++] = SLIP_ESC;
+    out[n++] = SLIP_ESC_ESC;
+  } else {
+    out[n++] = b;
+  }
+  return n;
+}
+
+bool ESP32FirmwareDownloader::beginSerialTransport(HardwareSerial &port, uint32_t maxBaud) {
+  if (_serialLink) {
+    Serial.println("[SerialLink] Already running.");
+    return false;
+  }
+  SerialLink* link = new SerialLink();
+  link->port = &port;
+  link->framer.port = &port;
+  link->maxBaud = maxBaud;
+  link->baud = port.baudRate();
+  link->prevBaud = link->baud;
+  link->baudSwitchMs = 0;
+  link->rxLen = 0;
+  link->rxEscape = false;
+  link->rxOverflow = false;
+  link->reading = false;
+  link->sink = {nullptr, 0, 0, false};
+  link->badFrames = 0;
+  link->retransmits = 0;
+  mbedtls_sha256_init(&link->sha);
+  _serialLink = link;
+  if (xTaskCreate(serialTask, "fwdl_serial", 6144, link, 1, nullptr) != pdPASS) {
+    Serial.println("[SerialLink] Failed to start task.");
+    mbedtls_sha256_free(&link->sha);
+    delete link;
+    _serialLink = nullptr;
+    return false;
+  }
+  return true;
+}
+
+static void serialSendFrame(SerialFramer &framer, uint8_t type, uint16_t seq,
+                            const uint8_t *payload, size_t len) {
+  uint8_t head[3] = { type, (uint8_t)(seq & 0xFF), (uint8_t)(seq >> 8) };
+  uint32_t crc = esp_rom_crc32_le(0, head, sizeof(head));
+  if (len) crc = esp_rom_crc32_le(crc, payload, len);
+  uint8_t crcBytes[4];
+  writeLE32(crcBytes, crc);
+
+  uint8_t *out = framer.tx;
+  size_t n = 0;
+  out[n++] = SLIP_END;
+  for (size_t i = 0; i < sizeof(head); i++) n = slipPut(out, n, head[i]);
+  for (size_t i = 0; i < len; i++) n = slipPut(out, n, payload[i]);
+  for (size_t i = 0; i < sizeof(crcBytes); i++) n = slipPut(out, n, crcBytes[i]);
+  out[n++] = SLIP_END;
+  // One write per frame keeps it contiguous with respect to other writers.
+  framer.port->write(out, n);
+}
+
+static void serialSendStatus(SerialFramer &framer, uint16_t seq, uint8_t status, uint32_t value) {
+  uint8_t p[5];
+  p[0] = status;
+  writeLE32(p + 1, value);
+  serialSendFrame(framer, SF_STATUS, seq, p, sizeof(p));
+}
+
+void ESP32FirmwareDownloader::serialTask(void* arg) {
+  SerialLink* link = (SerialLink*)arg;
+  Serial.printf("[SerialLink] Serial transport ready at %u baud (max %u).\n", link->baud, link->maxBaud);
+  uint32_t waitMs = 0;
+  for (;;) {
+    // Sleep in the UART driver until a byte arrives, then drain what is
+    // buffered. A running read waits only briefly so the pump keeps sending.
+    uint32_t wantMs = link->reading ? SERIAL_PUMP_WAIT_MS : SERIAL_IDLE_WAIT_MS;
+    if (wantMs != waitMs) {
+      link->port->setTimeout(wantMs);
+      waitMs = wantMs;
+    }
+    uint8_t first;
+    bool haveFirst = link->port->readBytes(&first, 1) == 1;
+    while (haveFirst || link->port->available() > 0) {
+      uint8_t b = haveFirst ? first : (uint8_t)link->port->read();
+      haveFirst = false;
+      if (b == SLIP_END) {
+        if (link->rxLen >= 7 && !link->rxOverflow) {
+          size_t bodyLen = link->rxLen - 4;
+          uint32_t crc = esp_rom_crc32_le(0, link->rx, bodyLen);
+          if (crc == readLE32(link->rx + bodyLen)) {
+            link->baudSwitchMs = 0;   // any valid frame confirms the current baud
+            uint16_t seq = link->rx[1] | (link->rx[2] << 8);
+            serialDispatch(link, link->rx[0], seq, link->rx + 3, bodyLen - 3);
+          } else {
+            link->badFrames++;
+          }
+        } else if (link->rxLen > 0) {
+          link->badFrames++;
+        }
+        link->rxLen = 0;
+        link->rxEscape = false;
+        link->rxOverflow = false;
+        continue;
+      }
+      if (link->rxEscape) {
+        b = (b == SLIP_ESC_END) ? SLIP_END : (b == SLIP_ESC_ESC) ? SLIP_ESC : b;
+        link->rxEscape = false;
+      } else if (b == SLIP_ESC) {
+        link->rxEscape = true;
+        continue;
+      }
+      if (link->rxLen < SERIAL_FRAME_MAX) {
+        link->rx[link->rxLen++] = b;
+      } else {
+        link->rxOverflow = true;
+      }
+    }
+
+    // Revert an unconfirmed baud change so the host can always reconnect.
+    if (link->baudSwitchMs && (millis() - link->baudSwitchMs) >= SERIAL_BAUD_CONFIRM_MS) {
+      Serial.printf("[SerialLink] Baud %u not confirmed; reverting to %u.\n", link->baud, link->prevBaud);
+      link->baud = link->prevBaud;
+      link->port->updateBaudRate(link->baud);
+      link->baudSwitchMs = 0;
+    }
+
+    if (link->reading) serialPumpRead(link);
+  }
+}
+
+// Send data frames until the window is full; go back to the last acked offset
+// when acknowledgements stop arriving.
+void ESP32FirmwareDownloader::serialPumpRead(SerialLink* link) {
+  uint32_t now = millis();
+  uint32_t windowBytes = SERIAL_WINDOW * SERIAL_DATA_SIZE;
+  // Twice the time the window takes on the wire at 10 bits per byte, plus slack.
+  uint32_t ackTimeoutMs = (uint32_t)((uint64_t)windowBytes * 20 * 1000 / link->baud) + 200;
+
+  if (link->nextOffset > link->ackedOffset && (now - link->lastAckMs) >= ackTimeoutMs) {
+    if (++link->retries > SERIAL_MAX_RETRIES) {
+      Serial.println("[SerialLink] Host stopped acknowledging; aborting read.");
+      link->reading = false;
+      return;
+    }
+    link->retransmits++;
+    link->nextOffset = link->ackedOffset;
+    link->lastAckMs = now;
+  }
+
+  while (link->nextOffset < link->src.length && link->nextOffset - link->ackedOffset < windowBytes) {
+    uint32_t off = link->nextOffset;
+    size_t n = readSource(link->src, link->data + 4, SERIAL_DATA_SIZE, off);
+    if (n == 0) {
+      serialSendStatus(link->framer, 0, XFER_IO_ERROR, off);
+      link->reading = false;
+      return;
+    }
+    if (off == link->hashedOffset) {
+      mbedtls_sha256_update(&link->sha, link->data + 4, n);
+      link->hashedOffset += n;
+    }
+    writeLE32(link->data, off);
+    serialSendFrame(link->framer, SF_DATA, (uint16_t)(off / SERIAL_DATA_SIZE), link->data, n + 4);
+    link->nextOffset += n;
+  }
+
+  if (link->ackedOffset >= link->src.length) {
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&link->sha, digest);
+    serialSendFrame(link->framer, SF_READ_DONE, 0, digest, sizeof(digest));
+    Serial.printf("[SerialLink] Read complete (%u bytes, %u retransmits, %u bad frames).\n",
+                  link->src.length, link->retransmits, link->badFrames);
+    link->reading = false;
+  }
+}
+
+void ESP32FirmwareDownloader::serialDispatch(SerialLink* link, uint8_t type, uint16_t seq,
+                                             const uint8_t *payload, size_t len) {
+  switch (type) {
+    case SF_HELLO: {
+      uint8_t p[8];
+      p[0] = SERIAL_PROTO_VERSION;
+      p[1] = SERIAL_WINDOW;
+      p[2] = SERIAL_DATA_SIZE & 0xFF;
+      p[3] = SERIAL_DATA_SIZE >> 8;
+      writeLE32(p + 4, link->maxBaud);
+      serialSendFrame(link->framer, SF_HELLO_ACK, seq, p, sizeof(p));
+      break;
+    }
+    case SF_SET_BAUD: {
+      if (len < 4) { serialSendStatus(link->framer, seq, XFER_BAD_REQUEST, 0); break; }
+      uint32_t baud = readLE32(payload);
+      if (baud < 9600 || baud > link->maxBaud) {
+        serialSendStatus(link->framer, seq, XFER_UNSUPPORTED, link->maxBaud);
+        break;
+      }
+      serialSendStatus(link->framer, seq, XFER_OK, baud);
+      link->port->flush();   // the acknowledgement goes out at the old rate
+      link->prevBaud = link->baud;
+      link->baud = baud;
+      link->port->updateBaudRate(baud);
+      link->baudSwitchMs = millis();
+      if (link->baudSwitchMs == 0) link->baudSwitchMs = 1;
+      break;
+    }
+    case SF_READ: {
+      if (len < 25) { serialSendStatus(link->framer, seq, XFER_BAD_REQUEST, 0); break; }
+      char label[17];
+      memcpy(label, payload + 9, 16);
+      label[16] = '\0';
+      uint8_t status = link->sink.active ? XFER_BUSY
+                     : resolveSource(payload[0], readLE32(payload + 1), readLE32(payload + 5), label,
+                                     "SerialStream", link->src);
+      uint8_t p[9];
+      p[0] = status;
+      writeLE32(p + 1, status == XFER_OK ? link->src.start : 0);
+      writeLE32(p + 5, status == XFER_OK ? link->src.length : 0);
+      serialSendFrame(link->framer, SF_READ_INFO, seq, p, sizeof(p));
+      if (status == XFER_OK) {
+        mbedtls_sha256_starts(&link->sha, 0);
+        link->ackedOffset = 0;
+        link->nextOffset = 0;
+        link->hashedOffset = 0;
+        link->retries = 0;
+        link->rewound = false;
+        link->lastAckMs = millis();
+        link->reading = true;
+      }
+      break;
+    }
+    case SF_DATA_ACK: {
+      if (!link->reading || len < 4) break;
+      uint32_t acked = readLE32(payload);
+      if (acked > link->ackedOffset && acked <= link->nextOffset) {
+        link->ackedOffset = acked;
+        link->lastAckMs = millis();
+        link->retries = 0;
+        link->rewound = false;
+      } else if (acked == link->ackedOffset && link->nextOffset > acked && !link->rewound) {
+        // Duplicate ack: the host saw a gap; resend from there right away.
+        link->retransmits++;
+        link->nextOffset = acked;
+        link->rewound = true;
+      }
+      break;
+    }
+    case SF_ABORT:
+      link->reading = false;
+      Core::uploadAbort(link->sink);
+      serialSendStatus(link->framer, seq, XFER_OK, 0);
+      break;
+    case SF_UPLOAD_BEGIN: {
+#if FWDL_ENABLE_UPLOAD
+      if (len < 20) { serialSendStatus(link->framer, seq, XFER_BAD_REQUEST, 0); break; }
+      if (link->reading || link->sink.active) { serialSendStatus(link->framer, seq, XFER_BUSY, 0); break; }
+      char label[17];
+      memcpy(label, payload, 16);
+      label[16] = '\0';
+      uint32_t size = readLE32(payload + 16);
+      const esp_partition_t* target = findPartitionByLabel(label);
+      if (!target) { serialSendStatus(link->framer, seq, XFER_NOT_FOUND, 0); break; }
+      if (size > target->size) { serialSendStatus(link->framer, seq, XFER_OUT_OF_RANGE, target->size); break; }
+      esp_err_t err = Core::uploadBegin(link->sink, target);
+      serialSendStatus(link->framer, seq, err == ESP_OK ? XFER_OK : err == ESP_ERR_INVALID_ARG ? XFER_BAD_REQUEST : XFER_IO_ERROR, 0);
+#else
+      serialSendStatus(link->framer, seq, XFER_UNSUPPORTED, 0);
+#endif
+      break;
+    }
+    case SF_UPLOAD_DATA: {
+      if (!link->sink.active || len < 4) { serialSendStatus(link->framer, seq, XFER_BAD_REQUEST, 0); break; }
+      uint32_t off = readLE32(payload);
+      if (off == link->sink.written) {
+        if (Core::uploadWrite(link->sink, payload + 4, len - 4) != ESP_OK) {
+          Core::uploadAbort(link->sink);
+          serialSendStatus(link->framer, seq, XFER_IO_ERROR, off);
+          break;
+        }
+        serialSendStatus(link->framer, seq, XFER_OK, link->sink.written);
+      } else if (off < link->sink.written) {
+        serialSendStatus(link->framer, seq, XFER_OK, link->sink.written);        // duplicate, already written
+      } else {
+        serialSendStatus(link->framer, seq, XFER_SEQUENCE, link->sink.written);  // gap: host rewinds
+      }
+      esp_task_wdt_reset();
+      break;
+    }
+    case SF_UPLOAD_END: {
+      bool activate = len > 0 && payload[0];
+      uint32_t written = link->sink.written;
+      esp_err_t err = Core::uploadEnd(link->sink, activate);
+      serialSendStatus(link->framer, seq, err == ESP_OK ? XFER_OK : XFER_IO_ERROR, written);
+      break;
+    }
+    case SF_REBOOT:
+      serialSendStatus(link->framer, seq, XFER_OK, 0);
+      link->port->flush();
+      delay(100);
+      Core::wearFlush(true);
+      esp_restart();
+      break;
+    case SF_LIST: {
+      size_t n = 0;
+      const esp_partition_type_t types[2] = { ESP_PARTITION_TYPE_APP, ESP_PARTITION_TYPE_DATA };
+      for (int t = 0; t < 2; t++) {
+        esp_partition_iterator_t it = esp_partition_find(types[t], ESP_PARTITION_SUBTYPE_ANY, NULL);
+        while (it != NULL && n + 26 <= sizeof(link->data)) {
+          const esp_partition_t* p = esp_partition_get(it);
+          memset(link->data + n, 0, 16);
+          strncpy((char*)link->data + n, p->label, 16);
+          link->data[n + 16] = (uint8_t)p->type;
+          link->data[n + 17] = (uint8_t)p->subtype;
+          writeLE32(link->data + n + 18, p->address);
+          writeLE32(link->data + n + 22, p->size);
+          n += 26;
+          it = esp_partition_next(it);
+        }
+        if (it) esp_partition_iterator_release(it);
+      }
+      serialSendFrame(link->framer, SF_LIST_REPLY, seq, link->data, n);
+      break;
+    }
+    default:
+      serialSendStatus(link->framer, seq, XFER_UNSUPPORTED, type);
+      break;
+  }
+}
+#endif  // FWDL_ENABLE_SERIAL
+
+#if FWDL_ENABLE_WEBSOCKET
+//////////////////////////////
+// WebSocket Transport
+//////////////////////////////
+// Text messages (client -> device):
+//   {"op":"read","mode":"partition","label":"ota_0"}   also full|secure|range (+offset, length)
+//   {"op":"credit","n":4}                              allow n more binary frames
+//   {"op":"upload","label":"ota_1","size":N,"activate":1}
+//   {"op":"finish"}   {"op":"abort"}
+// Binary frames carry offset u32 (LE) | data, in both directions. The device
+// only sends while it holds credits (capped at WS_MAX_CREDITS), so at most that
+// many frames are ever queued in RAM. Uploads are acknowledged with
+// {"ev":"ack","offset":next,"credit":k} granting the client the same window.
+
+static const uint32_t WS_MAX_CREDITS = 8;
+static const size_t   WS_FRAME_DATA  = CHUNK_SIZE;
+
+struct ESP32FirmwareDownloader::WsConn {
+  bool inUse;
+  uint32_t clientId;
+  bool reading;
+  FlashSource src;
+  uint32_t offset;
+  uint32_t credits;
+  mbedtls_sha256_context sha;
+  int slot;
+  uint32_t sessionId;
+  UploadSink sink;
+  bool activate;
+  uint8_t rx[WS_FRAME_DATA + 4];    // reassembly of fragmented binary messages
+  size_t rxFill;                    // bytes of the current message in rx
+  bool rxDropped;                   // current message overflowed rx; ignore the rest
+};
+
+static uint8_t g_wsScratch[WS_FRAME_DATA + 4];
+
+static void wsSendEvent(AsyncWebSocketClient *client, const String &json) {
+  client->text(json);
+}
+
+static void wsSendError(AsyncWebSocketClient *client, const char* msg) {
+  wsSendEvent(client, String("{\"ev\":\"error\",\"msg\":\"") + msg + "\"}");
+}
+
+void ESP32FirmwareDownloader::handleWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+                                            void *arg, uint8_t *data, size_t len) {
+  WsConn* conn = nullptr;
+  for (int i = 0; i < MAX_WS_CONNS; i++) {
+    if (_wsConns[i] && _wsConns[i]->inUse && _wsConns[i]->clientId == client->id()) conn = _wsConns[i];
+  }
+
+  if (type == WS_EVT_CONNECT) {
+    for (int i = 0; i < MAX_WS_CONNS && !conn; i++) {
+      if (!_wsConns[i]) _wsConns[i] = new WsConn();
+      if (!_wsConns[i]->inUse) {
+        conn = _wsConns[i];
+        conn->inUse = true;
+        conn->clientId = client->id();
+        conn->reading = false;
+        conn->slot = -1;
+        conn->sink = {nullptr, 0, 0, false};
+        conn->rxFill = 0;
+        conn->rxDropped = false;
+        mbedtls_sha256_init(&conn->sha);
+      }
+    }
+    if (!conn) {
+      Serial.println("[WebSocket] Too many clients; closing.");
+      client->close(1013, "busy");
+      return;
+    }
+    Serial.printf("[WebSocket] Client #%u connected.\n", client->id());
+    return;
+  }
+
+  if (!conn) return;
+
+  if (type == WS_EVT_DISCONNECT) {
+    Serial.printf("[WebSocket] Client #%u disconnected.\n", client->id());
+    wsEndRead(conn);
+    Core::uploadAbort(conn->sink);
+    mbedtls_sha256_free(&conn->sha);
+    conn->inUse = false;
+    return;
+  }
+
+  if (type != WS_EVT_DATA) return;
+  AwsFrameInfo *info = (AwsFrameInfo*)arg;
+  if (info->message_opcode == WS_TEXT) {
+    if (info->num != 0 || info->index != 0 || !info->final || info->len != len || len > 255) {
+      wsSendError(client, "text message too large or fragmented");
+      return;
+    }
+    char msg[256];
+    memcpy(msg, data, len);
+    msg[len] = '\0';
+    wsHandleText(conn, client, msg);
+  } else if (info->message_opcode == WS_BINARY) {
+    // A message may span several frames and info->index restarts at every
+    // frame, so the fill offset is tracked per connection.
+    if (info->num == 0 && info->index == 0) {
+      conn->rxFill = 0;
+      conn->rxDropped = false;
+    }
+    if (conn->rxDropped) return;
+    if (info->len > sizeof(conn->rx) || len > sizeof(conn->rx) - conn->rxFill) {
+      conn->rxDropped = true;
+      wsSendError(client, "binary message too large");
+      return;
+    }
+    memcpy(conn->rx + conn->rxFill, data, len);
+    conn->rxFill += len;
+    if (info->final && info->index + len == info->len) {
+      wsHandleBinary(conn, client, conn->rx, conn->rxFill);
+      conn->rxFill = 0;
+    }
+  }
+}
+
+void ESP32FirmwareDownloader::wsEndRead(WsConn* conn) {
+  if (conn->slot >= 0) {
+    Core::releaseSession(conn->slot, conn->sessionId);
+    conn->slot = -1;
+  }
+  conn->reading = false;
+}
+
+void ESP32FirmwareDownloader::wsHandleText(WsConn* conn, AsyncWebSocketClient *client, const char* msg) {
+  char op[16];
+  if (!jsonGet(msg, "op", op, sizeof(op))) {
+    wsSendError(client, "missing op");
+    return;
+  }
+
+  if (!strcmp(op, "read")) {
+    if (conn->reading || conn->sink.active) {
+      wsSendError(client, "busy");
+      return;
+    }
+    char modeName[16] = "partition";
+    char label[17] = "";
+    jsonGet(msg, "mode", modeName, sizeof(modeName));
+    jsonGet(msg, "label", label, sizeof(label));
+    uint8_t status = resolveSource(xferModeFromName(modeName), jsonGetU32(msg, "offset", 0),
+                                   jsonGetU32(msg, "length", 0), label, "WsStream", conn->src);
+    if (status == XFER_OK) {
+      conn->slot = Core::acquireSession("WsStream", conn->src.length, &conn->sessionId, closeAsyncClient,
+                                         client->client());
+      if (conn->slot < 0) status = XFER_BUSY;
+    }
+    if (status != XFER_OK) {
+      wsSendError(client, xferStatusName(status));
+      return;
+    }
+    conn->reading = true;
+    conn->offset = 0;
+    conn->credits = 0;
+    mbedtls_sha256_starts(&conn->sha, 0);
+    wsSendEvent(client, "{\"ev\":\"start\",\"start\":" + String(conn->src.start) +
+                        ",\"length\":" + String(conn->src.length) +
+                        ",\"frame\":" + String((uint32_t)WS_FRAME_DATA) +
+                        ",\"maxCredits\":" + String(WS_MAX_CREDITS) + "}");
+  } else if (!strcmp(op, "credit")) {
+    uint32_t n = jsonGetU32(msg, "n", 1);
+    conn->credits += n;
+    if (conn->credits > WS_MAX_CREDITS) conn->credits = WS_MAX_CREDITS;
+    wsPump(conn, client);
+  } else if (!strcmp(op, "upload")) {
+#if FWDL_ENABLE_UPLOAD
+    if (conn->reading || conn->sink.active) {
+      wsSendError(client, "busy");
+      return;
+    }
+    char label[17] = "";
+    jsonGet(msg, "label", label, sizeof(label));
+    const esp_partition_t* target = findPartitionByLabel(label);
+    if (!target) {
+      wsSendError(client, "not found");
+      return;
+    }
+    if (jsonGetU32(msg, "size", 0) > target->size) {
+      wsSendError(client, "out of range");
+      return;
+    }
+    conn->activate = jsonGetU32(msg, "activate", 0) != 0;
+    esp_err_t err = Core::uploadBegin(conn->sink, target);
+    if (err != ESP_OK) {
+      wsSendError(client, esp_err_to_name(err));
+      return;
+    }
+    wsSendEvent(client, "{\"ev\":\"ack\",\"offset\":0,\"credit\":" + String(WS_MAX_CREDITS) +
+                        ",\"frame\":" + String((uint32_t)WS_FRAME_DATA) + "}");
+#else
+    wsSendError(client, "unsupported");
+#endif
+  } else if (!strcmp(op, "finish")) {
+    uint32_t written = conn->sink.written;
+    esp_err_t err = Core::uploadEnd(conn->sink, conn->activate);
+    if (err != ESP_OK) {
+      wsSendError(client, esp_err_to_name(err));
+      return;
+    }
+    wsSendEvent(client, "{\"ev\":\"uploaded\",\"bytes\":" + String(written) + "}");
+  } else if (!strcmp(op, "abort")) {
+    wsEndRead(conn);
+    Core::uploadAbort(conn->sink);
+    wsSendEvent(client, "{\"ev\":\"aborted\"}");
+  } else {
+    wsSendError(client, "unknown op");
+  }
+}
+
+void ESP32FirmwareDownloader::wsHandleBinary(WsConn* conn, AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  if (!conn->sink.active || len < 4) {
+    wsSendError(client, "no upload in progress");
+    return;
+  }
+  uint32_t off = readLE32(data);
+  if (off == conn->sink.written) {
+    if (Core::uploadWrite(conn->sink, data + 4, len - 4) != ESP_OK) {
+      Core::uploadAbort(conn->sink);
+      wsSendError(client, "write failed");
+      return;
+    }
+  } else if (off > conn->sink.written) {
+    wsSendEvent(client, "{\"ev\":\"rewind\",\"offset\":" + String(conn->sink.written) + "}");
+    return;
+  }
+  wsSendEvent(client, "{\"ev\":\"ack\",\"offset\":" + String(conn->sink.written) + ",\"credit\":1}");
+}
+
+// Send binary frames while credits last.
+void ESP32FirmwareDownloader::wsPump(WsConn* conn, AsyncWebSocketClient *client) {
+  while (conn->reading && conn->credits > 0 && conn->offset < conn->src.length) {
+    size_t n = readSource(conn->src, g_wsScratch + 4, WS_FRAME_DATA, conn->offset);
+    if (n == 0) {
+      wsSendError(client, "flash read failed");
+      wsEndRead(conn);
+      return;
+    }
+    writeLE32(g_wsScratch, conn->offset);
+    mbedtls_sha256_update(&conn->sha, g_wsScratch + 4, n);
+    client->binary(g_wsScratch, n + 4);
+    conn->offset += n;
+    conn->credits--;
+    Core::noteSessionProgress(conn->slot, conn->sessionId, conn->offset, conn->offset);
+  }
+  if (conn->reading && conn->offset >= conn->src.length) {
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&conn->sha, digest);
+    char hex[65];
+    for (int i = 0; i < 32; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+    wsSendEvent(client, "{\"ev\":\"done\",\"length\":" + String(conn->src.length) +
+                        ",\"sha256\":\"" + String(hex) + "\"}");
+    wsEndRead(conn);
+  }
+}
+#endif  // FWDL_ENABLE_WEBSOCKET
+
+#if FWDL_ENABLE_PULLCLONE
+//////////////////////////////
+// Pull Clone (device-to-device)
+//////////////////////////////
+// GET /pullclone?url=http://peer/downloaddirect?label=ota_0[&label=ota_1][&sha256=hex][&activate=1][&reboot=1]
+// The HTTP client task receives into a stream buffer while a writer task drains
+// it into the OTA sink, so network receive and flash writes overlap.
+
+static const size_t PULL_PIPE_SIZE = 16 * 1024;
+
+struct PullArgs {
+  String url;
+  char sha256[65];
+  const esp_partition_t* target;
+  bool activate;
+  bool reboot;
+};
+
+struct PullPipe {
+  StreamBufferHandle_t buffer;
+  UploadSink sink;
+  mbedtls_sha256_context sha;
+  volatile bool eof;
+  volatile bool failed;
+  volatile uint32_t *progress;
+  TaskHandle_t owner;
+  uint8_t chunk[CHUNK_SIZE];
+};
+
+
+// Print/Stream adapter handed to HTTPClient::writeToStream(), which already
+// decodes chunked transfer encoding.
+class PipelineWriter : public Stream {
+public:
+  explicit PipelineWriter(PullPipe* pipe) : _pipe(pipe) {}
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t *buf, size_t len) override {
+    size_t sent = 0;
+    while (sent < len && !_pipe->failed) {
+      if (Core::jobCancelled()) {
+        _pipe->failed = true;
+        break;
+      }
+      sent += xStreamBufferSend(_pipe->buffer, buf + sent, len - sent, pdMS_TO_TICKS(100));
+    }
+    return sent;
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+private:
+  PullPipe* _pipe;
+};
+
+static void pullWriterTask(void* arg) {
+  PullPipe* pipe = (PullPipe*)arg;
+  for (;;) {
+    bool eof = pipe->eof;   // sampled first: if set, everything is already buffered
+    size_t n = xStreamBufferReceive(pipe->buffer, pipe->chunk, sizeof(pipe->chunk), pdMS_TO_TICKS(100));
+    if (n > 0) {
+      if (!pipe->failed) {
+        mbedtls_sha256_update(&pipe->sha, pipe->chunk, n);
+        if (Core::uploadWrite(pipe->sink, pipe->chunk, n) != ESP_OK) {
+          pipe->failed = true;
+        } else if (pipe->progress) {
+          *pipe->progress += n;
+        }
+      }
+      continue;
+    }
+    if (eof) break;
+  }
+  xTaskNotifyGive(pipe->owner);
+  vTaskDelete(NULL);
+}
+
+// Fetch args->url into args->target through the upload sink; shared by
+// /pullclone and batch jobs. progress receives bytes written, total the
+// expected length. Returns false with reason set on failure.
+static bool pullImage(const PullArgs *args, volatile uint32_t *progress, volatile uint32_t *total,
+                      char *reason, size_t reasonLen) {
+  const esp_partition_t* target = args->target;
+  HTTPClient http;
+  Serial.printf("[PullClone] Fetching %s into '%s'...\n", args->url.c_str(), target->label);
+
+  if (!http.begin(args->url)) {
+    snprintf(reason, reasonLen, "invalid url");
+    return false;
+  }
+  int code = http.GET();
+  if (code != HTTP_CODE_OK) {
+    http.end();
+    snprintf(reason, reasonLen, "peer returned %d", code);
+    return false;
+  }
+  int contentLength = http.getSize();   // -1 for chunked responses
+  if (contentLength > 0 && (uint32_t)contentLength > target->size) {
+    http.end();
+    snprintf(reason, reasonLen, "image (%d bytes) larger than '%s'", contentLength, target->label);
+    return false;
+  }
+  if (total) *total = contentLength > 0 ? (uint32_t)contentLength : target->size;
+
+  PullPipe* pipe = new PullPipe();
+  pipe->eof = false;
+  pipe->failed = false;
+  pipe->progress = progress;
+  pipe->owner = xTaskGetCurrentTaskHandle();
+  pipe->sink = {nullptr, 0, 0, false};
+  mbedtls_sha256_init(&pipe->sha);
+  mbedtls_sha256_starts(&pipe->sha, 0);
+  pipe->buffer = xStreamBufferCreate(PULL_PIPE_SIZE, 1);
+
+  bool ok = false;
+  if (!pipe->buffer) {
+    snprintf(reason, reasonLen, "out of memory");
+  } else if (Core::uploadBegin(pipe->sink, target) != ESP_OK) {
+    snprintf(reason, reasonLen, "cannot open '%s' for writing", target->label);
+  } else if (xTaskCreate(pullWriterTask, "fwdl_pullw", 4096, pipe, 1, nullptr) != pdPASS) {
+    Core::uploadAbort(pipe->sink);
+    snprintf(reason, reasonLen, "failed to start writer");
+  } else {
+    PipelineWriter writer(pipe);
+    int received = http.writeToStream(&writer);
+    pipe->eof = true;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint8_t digest[32];
+    char digestHex[65];
+    mbedtls_sha256_finish(&pipe->sha, digest);
+    toHex(digest, sizeof(digest), digestHex);
+
+    if (Core::jobCancelled()) {
+      snprintf(reason, reasonLen, "cancelled after %u bytes", pipe->sink.written);
+    } else if (received < 0) {
+      snprintf(reason, reasonLen, "receive failed: %s", HTTPClient::errorToString(received).c_str());
+    } else if (pipe->failed) {
+      snprintf(reason, reasonLen, "flash write failed");
+    } else if (contentLength > 0 && pipe->sink.written != (uint32_t)contentLength) {
+      snprintf(reason, reasonLen, "short image: %u of %d bytes", pipe->sink.written, contentLength);
+    } else if (args->sha256[0] && strcasecmp(args->sha256, digestHex) != 0) {
+      snprintf(reason, reasonLen, "digest mismatch (got %.16s...)", digestHex);
+    } else if (Core::uploadEnd(pipe->sink, args->activate) != ESP_OK) {
+      snprintf(reason, reasonLen, "image rejected on finalize");
+    } else {
+      ok = true;
+      snprintf(reason, reasonLen, "%u bytes into %s%s, sha256 %.16s...", pipe->sink.written, target->label,
+               args->activate ? " (activated)" : "", digestHex);
+    }
+    if (!ok) Core::uploadAbort(pipe->sink);
+  }
+  http.end();
+  if (pipe->buffer) vStreamBufferDelete(pipe->buffer);
+  mbedtls_sha256_free(&pipe->sha);
+  delete pipe;
+  return ok;
+}
+
+static bool pullCloneJob(void* arg) {
+  PullArgs* args = (PullArgs*)arg;
+  Job* job = Core::currentJob();
+  bool ok = pullImage(args, &job->done, &job->total, job->message, sizeof(job->message));
+  job->rebootAfter = ok && args->activate && args->reboot;
+  return ok;
+}
+
+void ESP32FirmwareDownloader::handlePullClone(AsyncWebServerRequest *request) {
+  if (!request->hasParam("url")) {
+    request->send(400, "text/plain", "Missing 'url' parameter");
+    return;
+  }
+  const esp_partition_t* target = nullptr;
+  if (request->hasParam("label")) {
+    target = findPartitionByLabel(request->getParam("label")->value().c_str());
+  } else {
+    target = esp_ota_get_next_update_partition(NULL);
+  }
+  if (!target) {
+    request->send(404, "text/plain", "Target partition not found");
+    return;
+  }
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  if (running && target->address == running->address) {
+    request->send(400, "text/plain", "Cannot update active partition");
+    return;
+  }
+
+  String sha;
+  if (request->hasParam("sha256")) {
+    sha = request->getParam("sha256")->value();
+    if (sha.length() != 64) {
+      request->send(400, "text/plain", "sha256 must be 64 hex characters");
+      return;
+    }
+  }
+  PullArgs* args = new PullArgs();
+  args->url = request->getParam("url")->value();
+  strncpy(args->sha256, sha.c_str(), sizeof(args->sha256));
+  args->target = target;
+  args->activate = request->hasParam("activate") && request->getParam("activate")->value() != "0";
+  args->reboot = request->hasParam("reboot") && request->getParam("reboot")->value() != "0";
+
+  uint32_t id = Core::submitJob("pullclone", Core::JOB_PRIO_NORMAL, pullCloneJob, args,
+                                [](void* p) { delete (PullArgs*)p; }, true, true);
+  if (!id) {
+    delete args;
+    request->send(503, "text/plain", "Job queue full");
+    return;
+  }
+  request->send(202, "application/json", jobStatusJson(id, nullptr));
+}
+
+void ESP32FirmwareDownloader::handlePullCloneStatus(AsyncWebServerRequest *request) {
+  request->send(200, "application/json", jobStatusJson(0, "pullclone"));
+}
+#endif  // FWDL_ENABLE_PULLCLONE
+
+#if FWDL_ENABLE_MULTICAST
+//////////////////////////////
+// Multicast Distribution
+//////////////////////////////
+// Packets start with a 16-byte header (little-endian):
+//   "FWMC" | type u8 | flags u8 | session u16 | seq u32 | arg u32
+// ANNOUNCE  seq 0, arg total bytes; payload blockSize u16 | rsvd u16 | sha256[32] | label[16]
+// DATA      seq block index, arg total bytes; payload block data
+// END       seq pass number, arg total blocks (receivers answer with NACK or COMPLETE)
+// NACK      seq first block, arg bit count; payload bitmap of missing blocks (unicast to sender)
+// COMPLETE  arg status (0 = verified)                                         (unicast to sender)
+// The sender repeats passes over NACKed blocks until MCAST_QUIET_ROUNDS END
+// rounds bring no NACKs. Receivers write each block at its offset, so repairs
+// can arrive in any order.
+
+static const size_t   MCAST_HEADER_SIZE   = 16;
+static const size_t   MCAST_BLOCK_SIZE    = 1024;
+static const size_t   MCAST_PACKET_MAX    = MCAST_HEADER_SIZE + MCAST_BLOCK_SIZE;
+static const uint32_t MCAST_NACK_BITS     = 256;
+static const uint8_t  MCAST_MAX_PASSES    = 20;
+static const uint8_t  MCAST_QUIET_ROUNDS  = 3;
+static const uint32_t MCAST_ROUND_WAIT_MS = 500;
+static const uint8_t  MCAST_MAX_NACKS     = 8;     // per END, per receiver
+static const int      MCAST_MAX_RECEIVERS = 256;   // distinct COMPLETE reports tracked
+
+enum McastType : uint8_t {
+  MC_ANNOUNCE = 0x01,
+  MC_DATA     = 0x02,
+  MC_END      = 0x03,
+  MC_NACK     = 0x10,
+  MC_COMPLETE = 0x11
+};
+
+static void mcastHeader(uint8_t *p, uint8_t type, uint16_t session, uint32_t seq, uint32_t arg) {
+  memcpy(p, "FWMC", 4);
+  p[4] = type;
+  p[5] = 0;
+  p[6] = session & 0xFF;
+  p[7] = session >> 8;
+  writeLE32(p + 8, seq);
+  writeLE32(p + 12, arg);
+}
+
+static inline bool bitGet(const uint8_t *map, uint32_t i) { return map[i >> 3] & (1 << (i & 7)); }
+static inline void bitSet(uint8_t *map, uint32_t i) { map[i >> 3] |= (1 << (i & 7)); }
+static inline void bitClear(uint8_t *map, uint32_t i) { map[i >> 3] &= ~(1 << (i & 7)); }
+
+// Sender state.
+struct McastSender {
+  AsyncUDP udp;
+  IPAddress group;
+  uint16_t port;
+  uint16_t replyPort;         // port the socket is bound to (port + 1)
+  uint32_t bytesPerSec;
+  const esp_partition_t* part;
+  uint16_t session;
+  uint32_t blocks;
+  uint8_t *resend;            // blocks NACKed since the last pass; guarded by lock
+  uint32_t nacks;
+  uint32_t completes;
+  uint32_t completeIps[MCAST_MAX_RECEIVERS];
+  uint32_t repairBlocks;
+  portMUX_TYPE lock;
+};
+
+static McastSender* g_mcastTx = nullptr;
+
+static void mcastSendPacket(McastSender* tx, const uint8_t *pkt, size_t len) {
+  tx->udp.writeTo(pkt, len, tx->group, tx->port);
+}
+
+bool ESP32FirmwareDownloader::beginMulticastSend(const char* label, uint32_t kbytesPerSec, IPAddress group, uint16_t port) {
+  if (Core::jobActive("mcast_send")) {
+    Serial.println("[Multicast] A send is already queued or running.");
+    return false;
+  }
+  const esp_partition_t* part = findPartitionByLabel(label);
+  if (!part) {
+    Serial.printf("[Multicast] Partition '%s' not found.\n", label);
+    return false;
+  }
+  if (!g_mcastTx) {
+    g_mcastTx = new McastSender();
+    g_mcastTx->lock = portMUX_INITIALIZER_UNLOCKED;
+    g_mcastTx->replyPort = 0;
+    g_mcastTx->udp.onPacket([](AsyncUDPPacket &packet) {
+      McastSender* tx = g_mcastTx;
+      const uint8_t *p = packet.data();
+      size_t len = packet.length();
+      if (!tx || len < MCAST_HEADER_SIZE || memcmp(p, "FWMC", 4) != 0) return;
+      uint16_t session = p[6] | (p[7] << 8);
+      uint32_t seq = readLE32(p + 8);
+      uint32_t arg = readLE32(p + 12);
+      if (p[4] == MC_NACK) {
+        uint32_t bits = arg;
+        if (bits > (len - MCAST_HEADER_SIZE) * 8) bits = (len - MCAST_HEADER_SIZE) * 8;
+        // mcastSendJob frees resend under the same lock.
+        portENTER_CRITICAL(&tx->lock);
+        if (session == tx->session && tx->resend) {
+          for (uint32_t i = 0; i < bits && seq + i < tx->blocks; i++) {
+            if (bitGet(p + MCAST_HEADER_SIZE, i)) bitSet(tx->resend, seq + i);
+          }
+          tx->nacks++;
+        }
+        portEXIT_CRITICAL(&tx->lock);
+      } else if (p[4] == MC_COMPLETE) {
+        portENTER_CRITICAL(&tx->lock);
+        bool live = session == tx->session && tx->resend;
+        portEXIT_CRITICAL(&tx->lock);
+        if (!live) return;
+        uint32_t ip = (uint32_t)packet.remoteIP();
+        for (uint32_t i = 0; i < tx->completes; i++) {
+          if (tx->completeIps[i] == ip) return;
+        }
+        Serial.printf("[Multicast] %s reports %s.\n", packet.remoteIP().toString().c_str(),
+                      arg == 0 ? "complete" : "failure");
+        if (tx->completes < MCAST_MAX_RECEIVERS) tx->completeIps[tx->completes++] = ip;
+      }
+    });
+  }
+  // Replies come back to the port we send from; rebind when the port changes.
+  if (g_mcastTx->replyPort != (uint16_t)(port + 1)) {
+    g_mcastTx->udp.close();
+    g_mcastTx->replyPort = 0;
+    if (!g_mcastTx->udp.listen(port + 1)) {
+      Serial.println("[Multicast] Failed to bind sender socket.");
+      return false;
+    }
+    g_mcastTx->replyPort = port + 1;
+  }
+  McastSender* tx = g_mcastTx;
+  tx->group = group;
+  tx->port = port;
+  tx->bytesPerSec = kbytesPerSec * 1024;
+  tx->part = part;
+  tx->session = (uint16_t)(esp_random() & 0xFFFF);
+  tx->blocks = (part->size + MCAST_BLOCK_SIZE - 1) / MCAST_BLOCK_SIZE;
+  tx->nacks = 0;
+  tx->completes = 0;
+  tx->repairBlocks = 0;
+  // Low priority: a send is paced for minutes and must not hold up flash maintenance.
+  return Core::submitJob("mcast_send", Core::JOB_PRIO_LOW, mcastSendJob, tx, nullptr) != 0;
+}
+
+bool ESP32FirmwareDownloader::mcastSendJob(void* arg) {
+  McastSender* tx = (McastSender*)arg;
+  const esp_partition_t* part = tx->part;
+  Job* job = Core::currentJob();
+  job->total = part->size;
+  uint8_t *pkt = (uint8_t*)malloc(MCAST_PACKET_MAX);
+  uint8_t *pending = (uint8_t*)calloc((tx->blocks + 7) / 8, 1);
+  tx->resend = (uint8_t*)calloc((tx->blocks + 7) / 8, 1);
+  if (!pkt || !pending || !tx->resend) {
+    free(pkt);
+    free(pending);
+    free(tx->resend);
+    tx->resend = nullptr;
+    Core::jobMessage("out of memory");
+    return false;
+  }
+
+  // Digest of the image, announced so receivers can verify before activating.
+  // Served from the hash cache when the partition is unchanged since last time.
+  FlashSource src = makeSource(part->address, part->size, false, "McastSend");
+  uint8_t announce[MCAST_HEADER_SIZE + 52];
+  mcastHeader(announce, MC_ANNOUNCE, tx->session, 0, part->size);
+  announce[16] = MCAST_BLOCK_SIZE & 0xFF;
+  announce[17] = MCAST_BLOCK_SIZE >> 8;
+  announce[18] = 0;
+  announce[19] = 0;
+  if (!hashFlashRange(part->address, part->size, announce + 20, nullptr)) {
+    free(pkt);
+    free(pending);
+    free(tx->resend);
+    tx->resend = nullptr;
+    Core::jobMessage("hashing '%s' failed", part->label);
+    return false;
+  }
+  memset(announce + 52, 0, 16);
+  strncpy((char*)announce + 52, part->label, 16);
+
+  Serial.printf("[Multicast] Session %04X: %u bytes of '%s' to %s:%u at %u KB/s\n", tx->session, part->size,
+                part->label, tx->group.toString().c_str(), tx->port, tx->bytesPerSec / 1024);
+  for (int i = 0; i < 3; i++) {
+    mcastSendPacket(tx, announce, sizeof(announce));
+    delay(200);
+  }
+
+  memset(pending, 0xFF, (tx->blocks + 7) / 8);   // first pass: everything
+  uint32_t sentBytes = 0;
+  uint32_t rateStart = millis();
+  uint8_t quietRounds = 0;
+  uint8_t pass = 0;
+  bool ok = true;
+  for (pass = 1; pass <= MCAST_MAX_PASSES && quietRounds < MCAST_QUIET_ROUNDS; pass++) {
+    uint32_t sentThisPass = 0;
+    for (uint32_t b = 0; b < tx->blocks; b++) {
+      if (!bitGet(pending, b)) continue;
+      if (Core::jobCancelled()) {
+        ok = false;
+        break;
+      }
+      uint32_t off = b * MCAST_BLOCK_SIZE;
+      size_t n = readSource(src, pkt + MCAST_HEADER_SIZE, MCAST_BLOCK_SIZE, off);
+      if (n == 0) {
+        ok = false;
+        break;
+      }
+      mcastHeader(pkt, MC_DATA, tx->session, b, part->size);
+      mcastSendPacket(tx, pkt, MCAST_HEADER_SIZE + n);
+      sentBytes += n;
+      sentThisPass++;
+      if (pass == 1) job->done = off + n;
+      // Pace to the configured rate.
+      while ((millis() - rateStart) < (uint32_t)((uint64_t)sentBytes * 1000 / tx->bytesPerSec)) {
+        vTaskDelay(1);
+      }
+      if ((b & 63) == 0) mcastSendPacket(tx, announce, sizeof(announce));   // late joiners
+    }
+    if (!ok) break;
+    if (pass > 1) tx->repairBlocks += sentThisPass;
+
+    // Ask receivers for gaps and collect NACKs for the next pass.
+    uint32_t nacksBefore = tx->nacks;
+    uint8_t endPkt[MCAST_HEADER_SIZE];
+    mcastHeader(endPkt, MC_END, tx->session, pass, tx->blocks);
+    mcastSendPacket(tx, endPkt, sizeof(endPkt));
+    delay(MCAST_ROUND_WAIT_MS);
+
+    portENTER_CRITICAL(&tx->lock);
+    memcpy(pending, tx->resend, (tx->blocks + 7) / 8);
+    memset(tx->resend, 0, (tx->blocks + 7) / 8);
+    portEXIT_CRITICAL(&tx->lock);
+    quietRounds = (tx->nacks == nacksBefore) ? quietRounds + 1 : 0;
+    Core::jobMessage("pass %u, %u NACKs, %u complete", pass, tx->nacks, tx->completes);
+  }
+
+  portENTER_CRITICAL(&tx->lock);
+  free(tx->resend);
+  tx->resend = nullptr;
+  portEXIT_CRITICAL(&tx->lock);
+  free(pending);
+  free(pkt);
+  if (!ok) {
+    Core::jobMessage(Core::jobCancelled() ? "cancelled in pass %u" : "flash read failed in pass %u", pass);
+    return false;
+  }
+  Core::jobMessage("%u passes, %u repair blocks, %u NACKs, %u receivers complete",
+                   pass - 1, tx->repairBlocks, tx->nacks, tx->completes);
+  return quietRounds >= MCAST_QUIET_ROUNDS;
+}
+
+// Receiver state. Packets are copied into a queue by the UDP callback and
+// written to flash on a separate task so erase/write latency never stalls
+// the network stack.
+struct McastPacket {
+  uint32_t fromIp;
+  uint16_t fromPort;
+  uint16_t len;
+  uint8_t data[MCAST_PACKET_MAX];
+};
+
+struct McastReceiver {
+  AsyncUDP udp;
+  QueueHandle_t queue;
+  const char* label;
+  bool activate;
+  uint16_t session;
+  bool active;                // a session is being received
+  bool finished;              // current session completed (ok or not)
+  uint32_t total;
+  uint32_t blocks;
+  uint32_t received;
+  uint8_t *have;
+  uint8_t sha[32];
+  UploadSink sink;
+  McastPacket pkt;            // task-side working copy
+};
+
+static McastReceiver* g_mcastRx = nullptr;
+
+static void mcastReply(McastReceiver* rx, uint8_t type, uint32_t seq, uint32_t arg,
+                       const uint8_t *payload, size_t len) {
+  uint8_t out[MCAST_HEADER_SIZE + MCAST_NACK_BITS / 8];
+  mcastHeader(out, type, rx->session, seq, arg);
+  if (len) memcpy(out + MCAST_HEADER_SIZE, payload, len);
+  rx->udp.writeTo(out, MCAST_HEADER_SIZE + len, IPAddress(rx->pkt.fromIp), rx->pkt.fromPort);
+}
+
+// Read back what was written and compare with the announced digest.
+static bool mcastVerify(McastReceiver* rx) {
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  uint8_t *buf = rx->pkt.data;   // reuse the packet buffer
+  bool ok = true;
+  for (uint32_t off = 0; off < rx->total && ok; off += MCAST_BLOCK_SIZE) {
+    size_t n = (rx->total - off < MCAST_BLOCK_SIZE) ? rx->total - off : MCAST_BLOCK_SIZE;
+    ok = esp_partition_read(rx->sink.target, off, buf, n) == ESP_OK;
+    if (ok) mbedtls_sha256_update(&sha, buf, n);
+  }
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  return ok && memcmp(digest, rx->sha, sizeof(digest)) == 0;
+}
+
+static void mcastHandleAnnounce(McastReceiver* rx, uint16_t session, const uint8_t *p, size_t len) {
+  if (len < MCAST_HEADER_SIZE + 52) return;
+  if (rx->session == session && (rx->active || rx->finished)) return;
+  if (rx->active) {
+    Serial.printf("[Multicast] Dropping session %04X for new session %04X.\n", rx->session, session);
+    Core::uploadAbort(rx->sink);
+    rx->active = false;
+  }
+  uint32_t total = readLE32(p + 12);
+  uint16_t blockSize = p[16] | (p[17] << 8);
+  char hint[17];
+  memcpy(hint, p + 52, 16);
+  hint[16] = '\0';
+
+  // ANNOUNCE is unauthenticated, so its label hint may only pick another OTA
+  // app slot. DATA partitions are written only when named to
+  // beginMulticastReceive().
+  const esp_partition_t* target = nullptr;
+  if (rx->label) {
+    target = findPartitionByLabel(rx->label);
+  } else {
+    const esp_partition_t* hinted = findPartitionByLabel(hint);
+    bool otaSlot = hinted && hinted->type == ESP_PARTITION_TYPE_APP &&
+                   hinted->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MIN &&
+                   hinted->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_MAX;
+    target = otaSlot ? hinted : esp_ota_get_next_update_partition(NULL);
+  }
+  rx->session = session;
+  rx->finished = true;   // ignore this session unless it starts cleanly below
+  if (blockSize != MCAST_BLOCK_SIZE || !target || total > target->size) {
+    Serial.printf("[Multicast] Cannot accept session %04X (%u bytes, block %u).\n", session, total, blockSize);
+    return;
+  }
+  // The sink erases the whole DATA partition, so check all of it.
+  if (isProtectedDestination(target->address, target->size)) {
+    Serial.printf("[Multicast] Refusing session %04X into protected '%s'.\n", session, target->label);
+    return;
+  }
+  free(rx->have);
+  rx->blocks = (total + MCAST_BLOCK_SIZE - 1) / MCAST_BLOCK_SIZE;
+  rx->have = (uint8_t*)calloc((rx->blocks + 7) / 8, 1);
+  if (!rx->have || Core::uploadBegin(rx->sink, target) != ESP_OK) {
+    Serial.printf("[Multicast] Cannot open '%s' for session %04X.\n", target->label, session);
+    return;
+  }
+  memcpy(rx->sha, p + 20, 32);
+  rx->total = total;
+  rx->received = 0;
+  rx->active = true;
+  rx->finished = false;
+  Serial.printf("[Multicast] Receiving session %04X: %u bytes into '%s'.\n", session, total, target->label);
+}
+
+static void mcastFinish(McastReceiver* rx) {
+  rx->active = false;
+  rx->finished = true;
+  bool ok = mcastVerify(rx);
+  if (ok) {
+    ok = Core::uploadEnd(rx->sink, rx->activate) == ESP_OK;
+  } else {
+    Serial.println("[Multicast] Digest mismatch; discarding image.");
+    Core::uploadAbort(rx->sink);
+  }
+  Serial.printf("[Multicast] Session %04X %s.\n", rx->session, ok ? "complete" : "failed");
+  mcastReply(rx, MC_COMPLETE, 0, ok ? 0 : 1, nullptr, 0);
+  if (ok && rx->activate) {
+    Serial.println("[Multicast] Rebooting into the received image...");
+    delay(2000);
+    Core::wearFlush(true);
+    esp_restart();
+  }
+}
+
+static void mcastReceiveTask(void* arg) {
+  McastReceiver* rx = (McastReceiver*)arg;
+  for (;;) {
+    if (xQueueReceive(rx->queue, &rx->pkt, portMAX_DELAY) != pdTRUE) continue;
+    const uint8_t *p = rx->pkt.data;
+    size_t len = rx->pkt.len;
+    uint8_t type = p[4];
+    uint16_t session = p[6] | (p[7] << 8);
+    uint32_t seq = readLE32(p + 8);
+
+    if (type == MC_ANNOUNCE) {
+      mcastHandleAnnounce(rx, session, p, len);
+      continue;
+    }
+    if (session != rx->session) continue;
+    if (type == MC_END && rx->finished) {
+      mcastReply(rx, MC_COMPLETE, 0, 0, nullptr, 0);   // sender missed our earlier report
+      continue;
+    }
+    if (!rx->active) continue;
+
+    if (type == MC_DATA && seq < rx->blocks && !bitGet(rx->have, seq)) {
+      size_t n = len - MCAST_HEADER_SIZE;
+      uint32_t off = seq * MCAST_BLOCK_SIZE;
+      if (n == 0 || n > rx->total - off) continue;
+      if (Core::uploadWriteAt(rx->sink, off, p + MCAST_HEADER_SIZE, n) != ESP_OK) {
+        Core::uploadAbort(rx->sink);
+        rx->active = false;
+        rx->finished = true;
+        mcastReply(rx, MC_COMPLETE, 0, 2, nullptr, 0);
+        continue;
+      }
+      bitSet(rx->have, seq);
+      rx->received++;
+      if (rx->received == rx->blocks) mcastFinish(rx);
+    } else if (type == MC_END) {
+      // Report missing blocks in bitmap windows.
+      uint8_t nacks = 0;
+      uint8_t bitmap[MCAST_NACK_BITS / 8];
+      for (uint32_t base = 0; base < rx->blocks && nacks < MCAST_MAX_NACKS; base += MCAST_NACK_BITS) {
+        memset(bitmap, 0, sizeof(bitmap));
+        bool any = false;
+        for (uint32_t i = 0; i < MCAST_NACK_BITS && base + i < rx->blocks; i++) {
+          if (!bitGet(rx->have, base + i)) {
+            bitSet(bitmap, i);
+            any = true;
+          }
+        }
+        if (any) {
+          mcastReply(rx, MC_NACK, base, MCAST_NACK_BITS, bitmap, sizeof(bitmap));
+          nacks++;
+        }
+      }
+      Serial.printf("[Multicast] Pass %u: %u/%u blocks, sent %u NACKs.\n", seq, rx->received, rx->blocks, nacks);
+    }
+  }
+}
+
+bool ESP32FirmwareDownloader::beginMulticastReceive(const char* label, bool activate, IPAddress group, uint16_t port) {
+  if (g_mcastRx) {
+    Serial.println("[Multicast] Receiver already running.");
+    return false;
+  }
+  McastReceiver* rx = new McastReceiver();
+  rx->label = label;
+  rx->activate = activate;
+  rx->session = 0;
+  rx->active = false;
+  rx->finished = false;
+  rx->have = nullptr;
+  rx->sink = {nullptr, 0, 0, false};
+  rx->queue = xQueueCreate(16, sizeof(McastPacket));
+  if (!rx->queue || !rx->udp.listenMulticast(group, port)) {
+    Serial.println("[Multicast] Failed to join group.");
+    if (rx->queue) vQueueDelete(rx->queue);
+    delete rx;
+    return false;
+  }
+  g_mcastRx = rx;
+  rx->udp.onPacket([](AsyncUDPPacket &packet) {
+    McastReceiver* rx = g_mcastRx;
+    size_t len = packet.length();
+    if (len < MCAST_HEADER_SIZE || len > MCAST_PACKET_MAX || memcmp(packet.data(), "FWMC", 4) != 0) return;
+    static McastPacket staging;   // UDP callbacks are serialized on one task
+    staging.fromIp = (uint32_t)packet.remoteIP();
+    staging.fromPort = packet.remotePort();
+    staging.len = len;
+    memcpy(staging.data, packet.data(), len);
+    xQueueSend(rx->queue, &staging, 0);   // a full queue drops the packet; NACKs repair it
+  });
+  if (xTaskCreate(mcastReceiveTask, "fwdl_mcastrx", 4096, rx, 1, nullptr) != pdPASS) {
+    Serial.println("[Multicast] Failed to start receiver task.");
+    rx->udp.close();
+    g_mcastRx = nullptr;
+    vQueueDelete(rx->queue);
+    delete rx;
+    return false;
+  }
+  Serial.printf("[Multicast] Listening on %s:%u\n", group.toString().c_str(), port);
+  return true;
+}
+
+void ESP32FirmwareDownloader::handleMulticastSend(AsyncWebServerRequest *request) {
+  if (!request->hasParam("label")) {
+    request->send(400, "text/plain", "Missing 'label' parameter");
+    return;
+  }
+  uint32_t rate = request->hasParam("rate") ? request->getParam("rate")->value().toInt() : 400;
+  if (rate == 0) rate = 400;
+  if (!_instance || !_instance->beginMulticastSend(request->getParam("label")->value().c_str(), rate)) {
+    request->send(409, "application/json", jobStatusJson(0, "mcast_send"));
+    return;
+  }
+  request->send(202, "application/json", jobStatusJson(0, "mcast_send"));
+}
+
+void ESP32FirmwareDownloader::handleMulticastStatus(AsyncWebServerRequest *request) {
+  request->send(200, "application/json", jobStatusJson(0, "mcast_send"));
+}
+#endif  // FWDL_ENABLE_MULTICAST
+
+#if FWDL_ENABLE_UPLOAD
+//////////////////////////////
+// Snapshot / Restore
+//////////////////////////////
+// GET /snapshot?src=nvs&dst=nvs_backup      (restore: /snapshot?src=nvs_backup&dst=nvs)
+// GET /snapshot?srcaddr=0x9000&dstaddr=0x3F0000&length=0x6000   raw sector-aligned ranges
+// Runs as a background job over copyFlashRange(); poll /snapshot/status.
+
+struct SnapshotArgs {
+  uint32_t srcAddr;
+  uint32_t dstAddr;
+  uint32_t length;
+  uint32_t srcLength;        // source may be longer if its tail is erased
+  char srcName[17];
+  char dstName[17];
+  bool reboot;
+};
+
+
+static bool snapshotJob(void* arg) {
+  SnapshotArgs* a = (SnapshotArgs*)arg;
+  Job* job = Core::currentJob();
+  uint32_t startMs = millis();
+  job->total = a->length;
+
+  // Refuse to truncate real data when the source is larger than the destination.
+  if (!sourceTailErased(a->srcAddr, a->length, a->srcLength)) {
+    Core::jobMessage("%s does not fit in %s", a->srcName, a->dstName);
+    return false;
+  }
+
+  CopyStats stats;
+  bool ok = copyFlashRange(a->srcAddr, a->dstAddr, a->length, &stats, &job->done);
+  job->rebootAfter = ok && a->reboot;
+  Core::jobMessage("%s -> %s: %u sectors in %u ms (%u skipped erased, %u unchanged, %u written)",
+                   a->srcName, a->dstName, stats.sectors, millis() - startMs, stats.skippedErased, stats.unchanged,
+                   stats.written);
+  return ok;
+}
+
+void ESP32FirmwareDownloader::handleSnapshot(AsyncWebServerRequest *request) {
+  SnapshotArgs a;
+  a.reboot = request->hasParam("reboot") && request->getParam("reboot")->value() != "0";
+  bool labelled = false;
+  if (request->hasParam("src") && request->hasParam("dst")) {
+    String srcLabel = request->getParam("src")->value();
+    String dstLabel = request->getParam("dst")->value();
+    const esp_partition_t* src = findPartitionByLabel(srcLabel.c_str());
+    const esp_partition_t* dst = findPartitionByLabel(dstLabel.c_str());
+    if (!src || !dst) {
+      request->send(404, "text/plain", "Partition not found");
+      return;
+    }
+    if (src->type != ESP_PARTITION_TYPE_DATA || dst->type != ESP_PARTITION_TYPE_DATA) {
+      request->send(400, "text/plain", "Snapshots copy DATA partitions; use /clone for APP");
+      return;
+    }
+    a.srcAddr = src->address;
+    a.dstAddr = dst->address;
+    a.srcLength = src->size;
+    a.length = (src->size < dst->size) ? src->size : dst->size;
+    strncpy(a.srcName, src->label, sizeof(a.srcName));
+    strncpy(a.dstName, dst->label, sizeof(a.dstName));
+    labelled = true;
+  } else if (request->hasParam("srcaddr") && request->hasParam("dstaddr") && request->hasParam("length")) {
+    a.srcAddr = strtoul(request->getParam("srcaddr")->value().c_str(), nullptr, 0);
+    a.dstAddr = strtoul(request->getParam("dstaddr")->value().c_str(), nullptr, 0);
+    a.length = strtoul(request->getParam("length")->value().c_str(), nullptr, 0);
+    a.srcLength = a.length;
+    uint32_t flashSize = fwdl_flash_size();
+    if (a.length == 0 || (a.srcAddr | a.dstAddr | a.length) % SECTOR_SIZE ||
+        a.srcAddr > flashSize || a.length > flashSize - a.srcAddr ||
+        a.dstAddr > flashSize || a.length > flashSize - a.dstAddr ||
+        (a.srcAddr < a.dstAddr + a.length && a.dstAddr < a.srcAddr + a.length)) {
+      request->send(400, "text/plain", "Ranges must be sector aligned, inside flash and not overlap");
+      return;
+    }
+    snprintf(a.srcName, sizeof(a.srcName), "0x%08X", a.srcAddr);
+    snprintf(a.dstName, sizeof(a.dstName), "0x%08X", a.dstAddr);
+  } else {
+    request->send(400, "text/plain", "Need src & dst labels, or srcaddr, dstaddr & length");
+    return;
+  }
+  if (a.srcAddr == a.dstAddr) {
+    request->send(400, "text/plain", "Source and destination are the same");
+    return;
+  }
+  if (isProtectedDestination(a.dstAddr, a.length, labelled && a.reboot)) {
+    request->send(403, "text/plain", "Destination is protected (NVS only by label with reboot=1)");
+    return;
+  }
+
+  SnapshotArgs* args = new SnapshotArgs(a);
+  uint32_t id = Core::submitJob("snapshot", Core::JOB_PRIO_NORMAL, snapshotJob, args,
+                                [](void* p) { delete (SnapshotArgs*)p; }, true, true);
+  if (!id) {
+    delete args;
+    request->send(503, "text/plain", "Job queue full");
+    return;
+  }
+  request->send(202, "application/json", jobStatusJson(id, nullptr));
+}
+
+void ESP32FirmwareDownloader::handleSnapshotStatus(AsyncWebServerRequest *request) {
+  request->send(200, "application/json", jobStatusJson(0, "snapshot"));
+}
+#endif  // FWDL_ENABLE_UPLOAD
+
+#if FWDL_ENABLE_HASHING
+//////////////////////////////
+// Hash Endpoint
+//////////////////////////////
+// GET /hash?label=ota_0  or  /hash?offset=0x10000&length=0x1000
+// SHA-256 from the generation-keyed cache; recomputed only after a write.
+
+void ESP32FirmwareDownloader::handleHash(AsyncWebServerRequest *request) {
+  uint32_t address, length;
+  String label;
+  if (request->hasParam("label")) {
+    label = request->getParam("label")->value();
+    const esp_partition_t* part = findPartitionByLabel(label.c_str());
+    if (!part) {
+      request->send(404, "text/plain", "Partition not found");
+      return;
+    }
+    address = part->address;
+    length = part->size;
+  } else if (request->hasParam("offset") && request->hasParam("length")) {
+    address = strtoul(request->getParam("offset")->value().c_str(), nullptr, 0);
+    length = strtoul(request->getParam("length")->value().c_str(), nullptr, 0);
+    uint32_t flashSize = fwdl_flash_size();
+    if (length == 0 || address > flashSize || length > flashSize - address) {
+      request->send(400, "text/plain", "Range outside flash");
+      return;
+    }
+  } else {
+    request->send(400, "text/plain", "Need label, or offset & length");
+    return;
+  }
+
+  uint32_t startMs = millis();
+  uint8_t digest[32];
+  bool cached = false;
+  if (!hashFlashRange(address, length, digest, &cached)) {
+    request->send(500, "text/plain", "Flash read failed");
+    return;
+  }
+  char hex[65];
+  toHex(digest, sizeof(digest), hex);
+
+  String json = "{";
+  if (label.length()) json += "\"label\":\"" + label + "\",";
+  json += "\"address\":" + String(address);
+  json += ",\"length\":" + String(length);
+  json += ",\"generation\":" + String(Core::generationFor(address, length));
+  json += ",\"sha256\":\"" + String(hex) + "\"";
+  json += ",\"cached\":" + String(cached ? "true" : "false");
+  json += ",\"ms\":" + String(millis() - startMs);
+  json += ",\"cacheHits\":" + String(g_hashCacheHits);
+  json += ",\"cacheMisses\":" + String(g_hashCacheMisses);
+  json += "}";
+  request->send(200, "application/json", json);
+}
+
+// GET /meta — state of the persistent hash store.
+void ESP32FirmwareDownloader::handleMeta(AsyncWebServerRequest *request) {
+  if (!g_metaPart) {
+    request->send(404, "text/plain", "Metadata store not enabled");
+    return;
+  }
+  xSemaphoreTake(g_metaLock, portMAX_DELAY);
+  String json = "{";
+  json += "\"partition\":\"" + String(g_metaPart->label) + "\"";
+  json += ",\"slot\":" + String(g_metaSlot);
+  json += ",\"seq\":" + String(g_metaSeq);
+  json += ",\"commits\":" + String(g_metaCommits);
+  json += ",\"rebuilds\":" + String(g_metaRebuilds);
+  json += ",\"entries\":[";
+  for (int i = 0; i < g_metaCount; i++) {
+    const MetaEntry &e = g_metaEntries[i];
+    char hex[65];
+    toHex(e.sha, sizeof(e.sha), hex);
+    if (i) json += ",";
+    json += "{\"address\":" + String(e.address);
+    json += ",\"size\":" + String(e.size);
+    json += ",\"generation\":" + String(e.gen);
+    json += ",\"fresh\":" + String(metaFresh(e) ? "true" : "false");
+    json += ",\"sha256\":\"" + String(hex) + "\"}";
+  }
+  json += "]}";
+  xSemaphoreGive(g_metaLock);
+  request->send(200, "application/json", json);
+}
+
+// GET /sectorcrc?label=ota_0 — per-sector CRC-32 table from the store, for
+// host-side delta and verification. 503 while the partition is being rebuilt.
+void ESP32FirmwareDownloader::handleSectorCrc(AsyncWebServerRequest *request) {
+  if (!g_metaPart) {
+    request->send(404, "text/plain", "Metadata store not enabled");
+    return;
+  }
+  if (!request->hasParam("label")) {
+    request->send(400, "text/plain", "Missing 'label' parameter");
+    return;
+  }
+  const esp_partition_t* part = findPartitionByLabel(request->getParam("label")->value().c_str());
+  MetaEntry* e = part ? metaFind(part->address) : nullptr;
+  if (!e) {
+    request->send(404, "text/plain", "Partition not found");
+    return;
+  }
+  xSemaphoreTake(g_metaLock, portMAX_DELAY);
+  if (!metaFresh(*e)) {
+    xSemaphoreGive(g_metaLock);
+    metaWake();
+    AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Rebuilding sector table");
+    response->addHeader("Retry-After", "5");
+    request->send(response);
+    return;
+  }
+  String json;
+  json.reserve(96 + e->sectors * 8);
+  json = "{\"label\":\"" + String(part->label) + "\"";
+  json += ",\"generation\":" + String(e->gen);
+  json += ",\"sectorSize\":" + String(SECTOR_SIZE);
+  json += ",\"crc32\":\"";
+  char word[9];
+  for (uint32_t i = 0; i < e->sectors; i++) {
+    snprintf(word, sizeof(word), "%08x", e->crc[i]);
+    json += word;
+  }
+  json += "\"}";
+  xSemaphoreGive(g_metaLock);
+  request->send(200, "application/json", json);
+}
+#endif  // FWDL_ENABLE_HASHING
+
+#if FWDL_ENABLE_DIAGNOSTICS
+// GET /wear — erase counters as per-partition totals and a heatmap: one
+// character per sector, 64 sectors (256 KB) per row. '.' is never erased by
+// the library, '1'..'9' is floor(log2(count)) + 1, so '1' is one erase and '9'
+// is 256 or more.
+void ESP32FirmwareDownloader::handleWear(AsyncWebServerRequest *request) {
+  Core::WearInfo wear;
+  if (!Core::wearInfo(wear)) {
+    request->send(503, "text/plain", "Not enough memory for wear counters");
+    return;
+  }
+  uint32_t total = 0, hottest = 0, hottestCount = 0;
+  for (uint32_t s = 0; s < wear.sectors; s++) {
+    total += wear.counts[s];
+    if (wear.counts[s] > hottestCount) {
+      hottestCount = wear.counts[s];
+      hottest = s;
+    }
+  }
+  String json = "{\"sectorSize\":" + String(SECTOR_SIZE);
+  json += ",\"sectors\":" + String(wear.sectors);
+  json += ",\"totalErases\":" + String(total);
+  json += ",\"sinceBoot\":" + String(wear.sinceBoot);
+  json += ",\"maxErases\":" + String(hottestCount);
+  json += ",\"hottestAddress\":" + String(hottest * SECTOR_SIZE);
+  json += ",\"pending\":" + String(wear.pending ? "true" : "false");
+  json += ",\"partitions\":[";
+  bool first = true;
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL) {
+    const esp_partition_t *p = esp_partition_get(it);
+    uint32_t erases = 0, maxErases = 0;
+    for (uint32_t s = p->address / SECTOR_SIZE; s < (p->address + p->size) / SECTOR_SIZE && s < wear.sectors; s++) {
+      erases += wear.counts[s];
+      if (wear.counts[s] > maxErases) maxErases = wear.counts[s];
+    }
+    if (!first) json += ",";
+    first = false;
+    json += "{\"label\":\"" + String(p->label) + "\"";
+    json += ",\"address\":" + String(p->address);
+    json += ",\"size\":" + String(p->size);
+    json += ",\"erases\":" + String(erases);
+    json += ",\"max\":" + String(maxErases) + "}";
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+  json += "],\"heatmap\":[";
+  char row[65];
+  for (uint32_t s = 0; s < wear.sectors; s += 64) {
+    int n = 0;
+    for (; n < 64 && s + n < wear.sectors; n++) {
+      uint16_t c = wear.counts[s + n];
+      int level = 0;
+      while (c && level < 9) {
+        level++;
+        c >>= 1;
+      }
+      row[n] = level ? '0' + level : '.';
+    }
+    row[n] = '\0';
+    if (s) json += ",";
+    json += "\"" + String(row) + "\"";
+  }
+  json += "]}";
+  request->send(200, "application/json", json);
+}
+#endif  // FWDL_ENABLE_DIAGNOSTICS
+
+#if FWDL_ENABLE_DIAGNOSTICS
+//////////////////////////////
+// Core Dumps
+//////////////////////////////
+// The coredump partition holds at most one image: a small header whose first
+// word is the used length (0xFFFFFFFF when empty), the ELF core file, and a
+// checksum of everything before it. That is a CRC-32, or a SHA-256 with
+// CONFIG_ESP_COREDUMP_CHECKSUM_SHA256. /coredump streams only the used
+// length. The summary is read from flash one ELF header or note at a time:
+// each task's handle and PC come from its PRSTATUS note, and the name from
+// the TCB copy in the memory segments. ESP-IDF's own summary adds the
+// exception cause and backtrace when it is built in.
+
+static const uint32_t COREDUMP_MIN_LENGTH = 64;
+static const uint32_t COREDUMP_MAX_TASKS  = 32;
+static const uint32_t COREDUMP_MAX_PHDRS  = 64;
+static const uint32_t ELF_PT_LOAD         = 1;
+static const uint32_t ELF_PT_NOTE         = 4;
+static const uint32_t ELF_NT_PRSTATUS     = 1;
+static const uint32_t PRSTATUS_PID_OFFSET = 24;    // task handle
+static const uint32_t PRSTATUS_REG_OFFSET = 72;    // register block; PC first on Xtensa and RISC-V
+
+#ifdef CONFIG_ESP_COREDUMP_CHECKSUM_SHA256
+static const uint8_t COREDUMP_CHECKSUM_LEN = 32;
+#else
+static const uint8_t COREDUMP_CHECKSUM_LEN = 4;
+#endif
+
+struct CoreDumpInfo {
+  const esp_partition_t* part;
+  uint32_t length;          // used bytes, 0 when the partition is empty
+  uint32_t version;
+  uint32_t elfOffset;       // ELF header offset in the image, 0 if not found
+  uint8_t checksum[32];     // as stored
+  bool checksumValid;
+  uint8_t sha[32];          // of the whole used image; /coredump/erase must quote it
+};
+
+struct CoreTask {
+  uint32_t handle;
+  uint32_t pc;
+  char name[16];
+};
+
+// Read len bytes at image offset off, refusing anything past the used length.
+static bool coreRead(const CoreDumpInfo &info, uint32_t off, void *buf, size_t len) {
+  if (off > info.length || len > info.length - off) return false;
+  return esp_partition_read(info.part, off, buf, len) == ESP_OK;
+}
+
+// Find the partition and the used length, then checksum the image in one pass.
+static bool coredumpScan(CoreDumpInfo &info) {
+  memset(&info, 0, sizeof(info));
+  info.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, NULL);
+  if (!info.part) return false;
+  uint8_t head[COREDUMP_MIN_LENGTH];
+  if (esp_partition_read(info.part, 0, head, sizeof(head)) != ESP_OK) return false;
+  uint32_t length = readLE32(head);
+  if (length < COREDUMP_MIN_LENGTH || length > info.part->size) return true;   // empty or torn
+  info.length = length;
+  info.version = readLE32(head + 4);
+  for (uint32_t off = 8; off + 4 <= sizeof(head); off += 4) {
+    if (head[off] == 0x7F && head[off + 1] == 'E' && head[off + 2] == 'L' && head[off + 3] == 'F') {
+      info.elfOffset = off;
+      break;
+    }
+  }
+
+  uint32_t covered = length - COREDUMP_CHECKSUM_LEN;
+  uint8_t *buf = (uint8_t*)malloc(SECTOR_SIZE);
+  if (!buf) return false;
+  uint32_t crc = 0;
+  mbedtls_sha256_context sha, covering;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_init(&covering);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_starts(&covering, 0);
+  bool ok = true;
+  for (uint32_t off = 0; off < length && ok; off += SECTOR_SIZE) {
+    uint32_t n = (length - off < SECTOR_SIZE) ? length - off : SECTOR_SIZE;
+    ok = esp_partition_read(info.part, off, buf, n) == ESP_OK;
+    if (!ok) break;
+    mbedtls_sha256_update(&sha, buf, n);
+    if (off < covered) {
+      uint32_t c = (covered - off < n) ? covered - off : n;
+      crc = esp_rom_crc32_le(crc, buf, c);
+      mbedtls_sha256_update(&covering, buf, c);
+    }
+  }
+  mbedtls_sha256_finish(&sha, info.sha);
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&covering, digest);
+  mbedtls_sha256_free(&sha);
+  mbedtls_sha256_free(&covering);
+  free(buf);
+  if (!ok || !coreRead(info, covered, info.checksum, COREDUMP_CHECKSUM_LEN)) return false;
+  if (COREDUMP_CHECKSUM_LEN == 4) info.checksumValid = readLE32(info.checksum) == crc;
+  else info.checksumValid = memcmp(info.checksum, digest, 32) == 0;
+  return true;
+}
+
+// Tasks recorded in the ELF core file; returns how many were found.
+static uint32_t coredumpTasks(const CoreDumpInfo &info, CoreTask *tasks, uint32_t maxTasks) {
+  if (!info.elfOffset) return 0;
+  uint32_t base = info.elfOffset;
+  uint8_t ehdr[52];
+  if (!coreRead(info, base, ehdr, sizeof(ehdr))) return 0;
+  uint32_t phoff = readLE32(ehdr + 28);
+  uint16_t phentsize = ehdr[42] | (ehdr[43] << 8);
+  uint16_t phnum = ehdr[44] | (ehdr[45] << 8);
+  if (phentsize != 32 || phnum > COREDUMP_MAX_PHDRS) return 0;
+
+  uint32_t count = 0;
+  uint8_t ph[32];
+  for (uint16_t i = 0; i < phnum; i++) {
+    if (!coreRead(info, base + phoff + i * 32, ph, sizeof(ph)) || readLE32(ph) != ELF_PT_NOTE) continue;
+    // Sizes come from flash; do the arithmetic in 64 bits and stay inside the image.
+    uint64_t off = (uint64_t)base + readLE32(ph + 4);
+    uint64_t end = off + readLE32(ph + 16);
+    if (end > info.length) end = info.length;
+    while (off + 12 <= end && count < maxTasks) {
+      uint8_t nhdr[12];
+      char name[8] = {0};
+      if (!coreRead(info, (uint32_t)off, nhdr, sizeof(nhdr))) break;
+      uint32_t namesz = readLE32(nhdr), descsz = readLE32(nhdr + 4), type = readLE32(nhdr + 8);
+      uint64_t desc = off + 12 + ((namesz + 3ull) & ~3ull);
+      uint64_t next = desc + ((descsz + 3ull) & ~3ull);
+      if (next <= off || next > end) break;   // corrupt note sizes
+      if (namesz == 5 && coreRead(info, (uint32_t)off + 12, name, 5) && strcmp(name, "CORE") == 0 &&
+          type == ELF_NT_PRSTATUS && descsz >= PRSTATUS_REG_OFFSET + 4) {
+        uint8_t word[4];
+        CoreTask &t = tasks[count];
+        memset(&t, 0, sizeof(t));
+        if (coreRead(info, (uint32_t)desc + PRSTATUS_PID_OFFSET, word, 4)) t.handle = readLE32(word);
+        if (coreRead(info, (uint32_t)desc + PRSTATUS_REG_OFFSET, word, 4)) t.pc = readLE32(word);
+        count++;
+      }
+      off = next;
+    }
+  }
+
+  // Names live in the TCBs, which the memory segments carry verbatim.
+  const uint32_t nameOffset = offsetof(StaticTask_t, ucDummy7);
+  for (uint16_t i = 0; i < phnum; i++) {
+    if (!coreRead(info, base + phoff + i * 32, ph, sizeof(ph)) || readLE32(ph) != ELF_PT_LOAD) continue;
+    uint32_t fileOff = readLE32(ph + 4), vaddr = readLE32(ph + 8), filesz = readLE32(ph + 16);
+    for (uint32_t t = 0; t < count; t++) {
+      CoreTask &task = tasks[t];
+      if (task.name[0] || task.handle < vaddr || task.handle - vaddr + nameOffset + 16 > filesz) continue;
+      if (coreRead(info, base + fileOff + (task.handle - vaddr) + nameOffset, task.name, 16)) {
+        task.name[15] = '\0';
+        for (char *c = task.name; *c; c++) {
+          if (*c < 0x20 || *c > 0x7E || *c == '"' || *c == '\\') *c = '?';
+        }
+      }
+    }
+  }
+  return count;
+}
+
+static const char* exceptionName(uint32_t cause) {
+#if defined(__XTENSA__)
+  switch (cause) {
+    case 0:  return "IllegalInstruction";
+    case 2:  return "InstructionFetchError";
+    case 3:  return "LoadStoreError";
+    case 6:  return "IntegerDivideByZero";
+    case 9:  return "LoadStoreAlignment";
+    case 20: return "InstFetchProhibited";
+    case 28: return "LoadProhibited";
+    case 29: return "StoreProhibited";
+    default: return "";
+  }
+#else
+  switch (cause) {
+    case 1:  return "InstructionAccessFault";
+    case 2:  return "IllegalInstruction";
+    case 3:  return "Breakpoint";
+    case 4:  return "LoadAddressMisaligned";
+    case 5:  return "LoadAccessFault";
+    case 6:  return "StoreAddressMisaligned";
+    case 7:  return "StoreAccessFault";
+    default: return "";
+  }
+#endif
+}
+
+static String hexWord(uint32_t v) {
+  char buf[11];
+  snprintf(buf, sizeof(buf), "0x%08x", v);
+  return String(buf);
+}
+
+static String coredumpSummaryJson(const CoreDumpInfo &info) {
+  char hex[65];
+  String json = "{\"present\":true";
+  json += ",\"address\":" + String(info.part->address);
+  json += ",\"length\":" + String(info.length);
+  json += ",\"version\":" + String(info.version);
+  json += ",\"format\":\"" + String(info.elfOffset ? "elf" : "binary") + "\"";
+  toHex(info.checksum, COREDUMP_CHECKSUM_LEN, hex);
+  json += ",\"checksum\":\"" + String(hex) + "\"";
+  json += ",\"checksumValid\":" + String(info.checksumValid ? "true" : "false");
+  toHex(info.sha, sizeof(info.sha), hex);
+  json += ",\"sha256\":\"" + String(hex) + "\"";
+
+#if COREDUMP_HAS_SUMMARY
+  esp_core_dump_summary_t *summary = (esp_core_dump_summary_t*)malloc(sizeof(esp_core_dump_summary_t));
+  if (summary && info.checksumValid && esp_core_dump_get_summary(summary) == ESP_OK) {
+    summary->exc_task[sizeof(summary->exc_task) - 1] = '\0';
+    json += ",\"exception\":{\"task\":\"" + String(summary->exc_task) + "\"";
+    json += ",\"tcb\":\"" + hexWord(summary->exc_tcb) + "\"";
+    json += ",\"pc\":\"" + hexWord(summary->exc_pc) + "\"";
+  #if defined(__XTENSA__)
+    json += ",\"cause\":" + String(summary->ex_info.exc_cause);
+    json += ",\"causeName\":\"" + String(exceptionName(summary->ex_info.exc_cause)) + "\"";
+    json += ",\"vaddr\":\"" + hexWord(summary->ex_info.exc_vaddr) + "\"";
+    json += ",\"backtraceCorrupted\":" + String(summary->exc_bt_info.corrupted ? "true" : "false");
+    json += ",\"backtrace\":[";
+    for (uint32_t i = 0; i < summary->exc_bt_info.depth && i < 16; i++) {
+      if (i) json += ",";
+      json += "\"" + hexWord(summary->exc_bt_info.bt[i]) + "\"";
+    }
+    json += "]";
+  #else
+    json += ",\"cause\":" + String(summary->ex_info.mcause);
+    json += ",\"causeName\":\"" + String(exceptionName(summary->ex_info.mcause)) + "\"";
+    json += ",\"vaddr\":\"" + hexWord(summary->ex_info.mtval) + "\"";
+    json += ",\"ra\":\"" + hexWord(summary->ex_info.ra) + "\"";
+    json += ",\"sp\":\"" + hexWord(summary->ex_info.sp) + "\"";
+  #endif
+    json += ",\"appElfSha256\":\"" + String((const char*)summary->app_elf_sha256) + "\"}";
+  }
+  free(summary);
+#else
+  (void)exceptionName;
+  (void)hexWord;
+#endif
+
+  // Task records are only walked in an image whose checksum holds.
+  CoreTask *tasks = info.checksumValid ? (CoreTask*)malloc(COREDUMP_MAX_TASKS * sizeof(CoreTask)) : nullptr;
+  uint32_t n = tasks ? coredumpTasks(info, tasks, COREDUMP_MAX_TASKS) : 0;
+  json += ",\"tasks\":[";
+  for (uint32_t i = 0; i < n; i++) {
+    if (i) json += ",";
+    json += "{\"name\":\"" + String(tasks[i].name) + "\"";
+    json += ",\"handle\":\"" + hexWord(tasks[i].handle) + "\"";
+    json += ",\"pc\":\"" + hexWord(tasks[i].pc) + "\"}";
+  }
+  json += "]}";
+  free(tasks);
+  return json;
+}
+
+// GET /coredump — the used part of the coredump partition, with its checksum
+// in headers. ?summary=1 answers the decoded summary as JSON instead.
+void ESP32FirmwareDownloader::handleCoreDump(AsyncWebServerRequest *request) {
+  CoreDumpInfo info;
+  if (!coredumpScan(info)) {
+    request->send(info.part ? 500 : 404, "text/plain", info.part ? "Core dump read failed" : "No coredump partition");
+    return;
+  }
+  bool summary = request->hasParam("summary") && request->getParam("summary")->value() == "1";
+  if (!info.length) {
+    if (summary) request->send(200, "application/json", "{\"present\":false}");
+    else request->send(404, "text/plain", "No core dump stored");
+    return;
+  }
+  Serial.printf("[CoreDump] Image of %u bytes at 0x%08X, checksum %s.\n", info.length, info.part->address,
+                info.checksumValid ? "valid" : "INVALID");
+  if (summary) {
+    request->send(200, "application/json", coredumpSummaryJson(info));
+    return;
+  }
+
+  char hex[65];
+  FlashSource src = makeSource(info.part->address, info.length, false, "CoreDump");
+  AsyncWebServerResponse *response = beginSourceResponse(request, src);
+  if (!response) return;
+  toHex(info.checksum, COREDUMP_CHECKSUM_LEN, hex);
+  response->addHeader("X-Coredump-Checksum", hex);
+  response->addHeader("X-Coredump-Checksum-Valid", info.checksumValid ? "1" : "0");
+  toHex(info.sha, sizeof(info.sha), hex);
+  response->addHeader("X-Coredump-SHA256", hex);
+  response->addHeader("Content-Disposition", "attachment; filename=coredump.bin");
+  request->send(response);
+}
+
+// GET /coredump/erase?sha256=<X-Coredump-SHA256> — frees the slot, but only if
+// it still holds the image the client downloaded. Only the used sectors are
+// erased: an empty length word is what marks the partition as free.
+void ESP32FirmwareDownloader::handleCoreDumpErase(AsyncWebServerRequest *request) {
+  if (!request->hasParam("sha256")) {
+    request->send(400, "text/plain", "Missing 'sha256' parameter");
+    return;
+  }
+  CoreDumpInfo info;
+  if (!coredumpScan(info) || !info.length) {
+    request->send(404, "text/plain", "No core dump stored");
+    return;
+  }
+  char hex[65];
+  toHex(info.sha, sizeof(info.sha), hex);
+  if (!request->getParam("sha256")->value().equalsIgnoreCase(hex)) {
+    request->send(409, "text/plain", "Core dump changed since it was downloaded");
+    return;
+  }
+  uint32_t eraseLen = (info.length + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+  esp_err_t err = esp_partition_erase_range(info.part, 0, eraseLen);
+  Core::bumpPartition(info.part);
+  Core::wearRecord(info.part->address, eraseLen);
+  Core::wearFlush();
+  if (err != ESP_OK) {
+    request->send(500, "text/plain", String("Erase failed: ") + esp_err_to_name(err));
+    return;
+  }
+  Serial.printf("[CoreDump] Erased %u bytes.\n", eraseLen);
+  request->send(200, "application/json", "{\"erased\":" + String(eraseLen) + "}");
+}
+#endif  // FWDL_ENABLE_DIAGNOSTICS
+
+#if FWDL_ENABLE_DIAGNOSTICS
+//////////////////////////////
+// RAM Dumps
+//////////////////////////////
+// /ramdump stays off until enableRamDump() is called, because it exposes live
+// memory, keys and credentials included. The body is
+//   "FWRM" | version u8 | region count u8 | reserved u16
+//   count x (name char[4] | address u32 | length u32 | flags u32)
+// followed by the bytes of each region in table order. Memory is copied while
+// the application keeps running, so a region is smeared over the transfer
+// time, not frozen. The heap summary (?heap=1) is a JSON text region built
+// when the request arrives. Reads are paced to rate= KB/s: once the filler is
+// ahead of its budget it answers RESPONSE_TRY_AGAIN, so each call copies at
+// most RAM_MAX_FILL bytes and the TCP task and cache are never held for long.
+
+static const uint8_t  RAM_DUMP_VERSION    = 1;
+static const int      RAM_MAX_REGIONS     = 4;
+static const uint32_t RAM_REGION_SUMMARY  = 1;      // flags: JSON built at request time, not memory
+static const uint32_t RAM_DEFAULT_KBPS    = 256;
+static const size_t   RAM_MAX_FILL        = 2048;   // bytes copied per filler call
+static const size_t   RAM_HEAP_MAX_TASKS  = 24;
+static const size_t   RAM_HEAP_MAX_BLOCKS = 256;
+
+static bool g_ramDumpEnabled = false;
+
+struct RamRegion {
+  char name[4];
+  uint32_t address;
+  uint32_t length;
+  uint32_t flags;
+};
+
+struct RamDump {
+  RamRegion regions[RAM_MAX_REGIONS];
+  int count;
+  uint8_t header[8 + 16 * RAM_MAX_REGIONS];
+  size_t headerLen;
+  String heap;
+  uint32_t bytesPerSec;     // 0: unpaced
+  uint32_t startMs;
+  size_t total;
+};
+
+// Address range of a named region on this chip; false if it has none.
+static bool ramRegion(const String &name, RamRegion &r) {
+  memset(&r, 0, sizeof(r));
+  if (name == "dram") {
+    memcpy(r.name, "DRAM", 4);
+    r.address = SOC_DRAM_LOW;
+    r.length = SOC_DRAM_HIGH - SOC_DRAM_LOW;
+    return true;
+  }
+#ifdef SOC_RTC_DRAM_LOW
+  if (name == "rtc") {
+    memcpy(r.name, "RTCD", 4);
+    r.address = SOC_RTC_DRAM_LOW;
+    r.length = SOC_RTC_DRAM_HIGH - SOC_RTC_DRAM_LOW;
+    return true;
+  }
+#endif
+#if (defined(CONFIG_IDF_TARGET_ESP32) || defined(CONFIG_IDF_TARGET_ESP32S2)) && defined(SOC_EXTRAM_DATA_LOW)
+  // These chips map PSRAM at the start of the external data window. Check
+  // that the PSRAM heap really lives there before reading through it.
+  if (name == "psram" && psramFound()) {
+    uint32_t size = ESP.getPsramSize();
+    if (size > SOC_EXTRAM_DATA_HIGH - SOC_EXTRAM_DATA_LOW) size = SOC_EXTRAM_DATA_HIGH - SOC_EXTRAM_DATA_LOW;
+    void *probe = heap_caps_malloc(16, MALLOC_CAP_SPIRAM);
+    uintptr_t at = (uintptr_t)probe;
+    bool mapped = probe && at >= SOC_EXTRAM_DATA_LOW && at < SOC_EXTRAM_DATA_LOW + size;
+    heap_caps_free(probe);
+    if (!mapped) return false;
+    memcpy(r.name, "PSRM", 4);
+    r.address = SOC_EXTRAM_DATA_LOW;
+    r.length = size;
+    return true;
+  }
+#endif
+  return false;
+}
+
+static String heapInfoJson(uint32_t caps) {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, caps);
+  String json = "{\"free\":" + String((uint32_t)info.total_free_bytes);
+  json += ",\"allocated\":" + String((uint32_t)info.total_allocated_bytes);
+  json += ",\"largestFree\":" + String((uint32_t)info.largest_free_block);
+  json += ",\"minFree\":" + String((uint32_t)info.minimum_free_bytes);
+  json += ",\"allocatedBlocks\":" + String((uint32_t)info.allocated_blocks);
+  json += ",\"freeBlocks\":" + String((uint32_t)info.free_blocks) + "}";
+  return json;
+}
+
+// Heap totals per capability. With CONFIG_HEAP_TASK_TRACKING, also live bytes
+// and blocks per allocating task (the finest attribution IDF keeps outside
+// heap tracing builds) and a histogram of block sizes.
+static String ramHeapSummary() {
+  String json = "{\"internal\":" + heapInfoJson(MALLOC_CAP_INTERNAL);
+  if (psramFound()) json += ",\"psram\":" + heapInfoJson(MALLOC_CAP_SPIRAM);
+#if RAMDUMP_HAS_TASK_INFO
+  heap_task_totals_t *totals = (heap_task_totals_t*)calloc(RAM_HEAP_MAX_TASKS, sizeof(heap_task_totals_t));
+  heap_task_block_t *blocks = (heap_task_block_t*)calloc(RAM_HEAP_MAX_BLOCKS, sizeof(heap_task_block_t));
+  if (totals && blocks) {
+    size_t numTotals = 0, numBlocks = 0;
+    heap_task_info_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.caps[0] = MALLOC_CAP_INTERNAL;
+    params.mask[0] = MALLOC_CAP_INTERNAL;
+    params.caps[1] = MALLOC_CAP_SPIRAM;
+    params.mask[1] = MALLOC_CAP_SPIRAM;
+    params.totals = totals;
+    params.num_totals = &numTotals;
+    params.max_totals = RAM_HEAP_MAX_TASKS;
+    params.blocks = blocks;
+    params.num_blocks = &numBlocks;
+    params.max_blocks = RAM_HEAP_MAX_BLOCKS;
+    heap_caps_get_per_task_info(&params);
+    json += ",\"tasks\":[";
+    for (size_t i = 0; i < numTotals; i++) {
+      char handle[11];
+      snprintf(handle, sizeof(handle), "0x%08x", (uint32_t)(uintptr_t)totals[i].task);
+      if (i) json += ",";
+      json += "{\"task\":\"" + String(handle) + "\"";
+      json += ",\"internalBytes\":" + String((uint32_t)totals[i].size[0]);
+      json += ",\"internalBlocks\":" + String((uint32_t)totals[i].count[0]);
+      json += ",\"psramBytes\":" + String((uint32_t)totals[i].size[1]);
+      json += ",\"psramBlocks\":" + String((uint32_t)totals[i].count[1]) + "}";
+    }
+    // Power-of-two buckets: [0] up to 16 bytes, [1] up to 32, ... [11] over 16 KB.
+    uint32_t buckets[12] = {0};
+    for (size_t i = 0; i < numBlocks; i++) {
+      int b = 0;
+      while (b < 11 && blocks[i].size > (16u << b)) b++;
+      buckets[b]++;
+    }
+    json += "],\"blocksSampled\":" + String((uint32_t)numBlocks);
+    json += ",\"blockSizes\":[";
+    for (int b = 0; b < 12; b++) json += (b ? "," : "") + String(buckets[b]);
+    json += "]";
+  }
+  free(totals);
+  free(blocks);
+#endif
+  json += "}";
+  return json;
+}
+
+static size_t ramDumpFill(RamDump &d, uint8_t *buffer, size_t maxLen, size_t index) {
+  if (index >= d.total) return 0;
+  if (index == 0) d.startMs = millis();
+  if (maxLen > RAM_MAX_FILL) maxLen = RAM_MAX_FILL;
+  if (d.bytesPerSec) {
+    uint64_t allowed = (uint64_t)(millis() - d.startMs) * d.bytesPerSec / 1000 + RAM_MAX_FILL;
+    if (index >= allowed) return RESPONSE_TRY_AGAIN;
+    if (maxLen > allowed - index) maxLen = allowed - index;
+  }
+  size_t n = 0;
+  while (n < maxLen && index + n < d.total) {
+    size_t pos = index + n;
+    size_t chunk;
+    if (pos < d.headerLen) {
+      chunk = d.headerLen - pos;
+      if (chunk > maxLen - n) chunk = maxLen - n;
+      memcpy(buffer + n, d.header + pos, chunk);
+    } else {
+      size_t off = pos - d.headerLen;
+      int i = 0;
+      while (off >= d.regions[i].length) off -= d.regions[i++].length;
+      const RamRegion &r = d.regions[i];
+      chunk = r.length - off;
+      if (chunk > maxLen - n) chunk = maxLen - n;
+      const uint8_t *from = (r.flags & RAM_REGION_SUMMARY) ? (const uint8_t*)d.heap.c_str()
+                                                             : (const uint8_t*)(uintptr_t)r.address;
+      memcpy(buffer + n, from + off, chunk);
+    }
+    n += chunk;
+  }
+  return n;
+}
+
+void ESP32FirmwareDownloader::enableRamDump(bool enable) {
+  g_ramDumpEnabled = enable;
+  Serial.printf("[RamDump] /ramdump %s.\n", enable ? "enabled" : "disabled");
+}
+
+// GET /ramdump?regions=dram,psram,rtc&heap=1&rate=256 (KB/s, 0 unpaced).
+void ESP32FirmwareDownloader::handleRamDump(AsyncWebServerRequest *request) {
+  if (!g_ramDumpEnabled) {
+    request->send(403, "text/plain", "RAM dump disabled; call enableRamDump()");
+    return;
+  }
+  std::shared_ptr<RamDump> d(new RamDump());
+  d->count = 0;
+  String list = request->hasParam("regions") ? request->getParam("regions")->value() : String("dram");
+  bool heap = request->hasParam("heap") && request->getParam("heap")->value() == "1";
+  int pos = 0;
+  while (pos < (int)list.length()) {
+    int comma = list.indexOf(',', pos);
+    if (comma < 0) comma = list.length();
+    String name = list.substring(pos, comma);
+    name.trim();
+    pos = comma + 1;
+    if (!name.length()) continue;
+    if (d->count >= RAM_MAX_REGIONS - (heap ? 1 : 0) || !ramRegion(name, d->regions[d->count])) {
+      request->send(400, "text/plain", "Unknown or unavailable region: " + name);
+      return;
+    }
+    d->count++;
+  }
+  if (heap) {
+    d->heap = ramHeapSummary();
+    RamRegion &r = d->regions[d->count++];
+    memset(&r, 0, sizeof(r));
+    memcpy(r.name, "HEAP", 4);
+    r.length = d->heap.length();
+    r.flags = RAM_REGION_SUMMARY;
+  }
+  if (!d->count) {
+    request->send(400, "text/plain", "No regions selected");
+    return;
+  }
+
+  uint32_t kbps = request->hasParam("rate") ? request->getParam("rate")->value().toInt() : RAM_DEFAULT_KBPS;
+  d->bytesPerSec = kbps * 1024;
+  uint32_t floor = Core::stallPolicy().minBytesPerSec;
+  if (d->bytesPerSec && d->bytesPerSec < floor) {
+    // Slower than the stall policy allows would get the session closed.
+    d->bytesPerSec = floor;
+  }
+  uint8_t *h = d->header;
+  memcpy(h, "FWRM", 4);
+  h[4] = RAM_DUMP_VERSION;
+  h[5] = d->count;
+  h[6] = h[7] = 0;
+  d->headerLen = 8;
+  d->total = 0;
+  for (int i = 0; i < d->count; i++) {
+    const RamRegion &r = d->regions[i];
+    memcpy(h + d->headerLen, r.name, 4);
+    writeLE32(h + d->headerLen + 4, r.address);
+    writeLE32(h + d->headerLen + 8, r.length);
+    writeLE32(h + d->headerLen + 12, r.flags);
+    d->headerLen += 16;
+    d->total += r.length;
+    Serial.printf("[RamDump] %.4s 0x%08X, %u bytes.\n", r.name, r.address, r.length);
+  }
+  d->total += d->headerLen;
+  Serial.printf("[RamDump] Streaming %u bytes at %u B/s%s.\n", (unsigned)d->total, d->bytesPerSec,
+                d->bytesPerSec ? "" : " (unpaced)");
+
+  AsyncWebServerResponse *response = beginTrackedResponse(request, "RamDump", d->total,
+    [d](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return ramDumpFill(*d, buffer, maxLen, index);
+    });
+  if (!response) return;
+  response->addHeader("Content-Disposition", "attachment; filename=ramdump.fwrm");
+  request->send(response);
+}
+#endif  // FWDL_ENABLE_DIAGNOSTICS
+
+//////////////////////////////
+// Range Dumps
+//////////////////////////////
+// GET /dumprange?offset=0x3F0000&length=64K
+// GET /dumprange?around=0x400d1234&length=64K     sector-aligned window around a flash offset or mapped address
+// GET /dumprange?label=nvs&offset=0x1000&length=4K offset relative to a partition
+// Sizes and offsets take decimal, 0x hex, or K/M/s (sector) suffixes. Streams
+// through the same pipeline as the other dumps (consistent, adaptive, normalize).
+
+// Parse "65536", "0x10000", "64K", "64KB", "1M" or "16s" (sectors).
+static bool parseSize(const String &text, uint32_t *out) {
+  const char* str = text.c_str();
+  char* end = nullptr;
+  if (*str == '-') return false;
+  unsigned long long v = strtoull(str, &end, 0);
+  if (end == str || v > UINT32_MAX) return false;   // keeps the suffix multiply in range
+  switch (*end) {
+    case 'k': case 'K': v *= 1024; end++; break;
+    case 'm': case 'M': v *= 1024 * 1024; end++; break;
+    case 's': case 'S': v *= SECTOR_SIZE; end++; break;
+    default: break;
+  }
+  if (*end == 'i' || *end == 'I') end++;
+  if (*end == 'b' || *end == 'B') end++;
+  if (*end != '\0' || v > UINT32_MAX) return false;
+  *out = (uint32_t)v;
+  return true;
+}
+
+void ESP32FirmwareDownloader::handleDumpRange(AsyncWebServerRequest *request) {
+  uint32_t flashSize = fwdl_flash_size();
+  uint32_t base = 0, limit = flashSize;
+  if (request->hasParam("label")) {
+    const esp_partition_t* part = findPartitionByLabel(request->getParam("label")->value().c_str());
+    if (!part) {
+      request->send(404, "text/plain", "Partition not found");
+      return;
+    }
+    base = part->address;
+    limit = part->size;
+  }
+  if (request->hasHeader("Range") || request->hasParam("ranges")) {
+    sendMultiRange(request, base, limit);
+    return;
+  }
+
+  uint32_t offset = 0, length = 0, around = 0;
+  bool hasLength = request->hasParam("length");
+  if (hasLength && !parseSize(request->getParam("length")->value(), &length)) {
+    request->send(400, "text/plain", "Bad 'length'");
+    return;
+  }
+  if (request->hasParam("around")) {
+    if (!parseSize(request->getParam("around")->value(), &around)) {
+      request->send(400, "text/plain", "Bad 'around'");
+      return;
+    }
+    if (!hasLength) length = 64 * 1024;
+    // A crash PC or rodata pointer is a cache-mapped address; translate it
+    // to the flash offset it was mapped from.
+    if (around >= 0x3C000000) {
+      size_t phys = spi_flash_cache2phys((const void*)(uintptr_t)around);
+      if (phys == SPI_FLASH_CACHE2PHYS_FAIL) {
+        request->send(416, "text/plain", "'around' is not a flash-mapped address");
+        return;
+      }
+      around = phys;
+    }
+    uint32_t rel = around - base;
+    if (around < base || rel >= limit) {
+      request->send(416, "text/plain", "'around' outside flash/partition");
+      return;
+    }
+    length = (length + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    if (length > limit) length = limit / SECTOR_SIZE * SECTOR_SIZE;
+    offset = (rel > length / 2) ? (rel - length / 2) / SECTOR_SIZE * SECTOR_SIZE : 0;
+    if (offset > limit - length) offset = (limit - length) / SECTOR_SIZE * SECTOR_SIZE;
+  } else {
+    if (!request->hasParam("offset") || !hasLength) {
+      request->send(400, "text/plain", "Need offset & length, or around");
+      return;
+    }
+    if (!parseSize(request->getParam("offset")->value(), &offset)) {
+      request->send(400, "text/plain", "Bad 'offset'");
+      return;
+    }
+  }
+  if (length == 0 || offset >= limit || length > limit - offset) {
+    request->send(416, "text/plain", "Range outside flash/partition");
+    return;
+  }
+  uint32_t start = base + offset;
+  const char* denied = rangeDenied(start, length);
+  if (denied) {
+    request->send(403, "text/plain", String("Protected: ") + denied);
+    return;
+  }
 
-  String rows = "";
-  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
-  while (it != NULL) {
-    const esp_partition_t* p = esp_partition_get(it);
-    bool isRunning = (running && (p->address == running->address));
-    String rowStyle = isRunning ? " style=\"background-color:yellow;\"" : "";
-    String displayLabel = String(p->label);
-    if (isRunning) displayLabel += " (running)";
-    char addrStr[20];
-    sprintf(addrStr, "0x%08X", p->address);
+  Serial.printf("[ESP32FirmwareDownloader] Range dump 0x%08X + %u bytes\n", start, length);
+  AsyncWebServerResponse *response = beginDumpResponse(request, makeSource(start, length, false, "RangeStream"));
+  if (!response) return;
+  char disposition[64];
+  snprintf(disposition, sizeof(disposition), "attachment; filename=range_%08x_%u.bin", start, length);
+  response->addHeader("Content-Disposition", disposition);
+  response->addHeader("X-Range-Start", String(start));
+  response->addHeader("X-Range-Length", String(length));
+  request->send(response);
+}
 
-    rows += "<tr" + rowStyle + ">";
-    rows += "<td>APP</td>";
-    rows += "<td>" + displayLabel + "</td>";
-    rows += "<td>" + String(addrStr) + "</td>";
-    rows += "<td>" + String(p->size) + "</td>";
-    rows += "<td><a href=\"/downloaddirect?label=" + String(p->label) + "\">Download</a></td>";
-    if (!isRunning) {
-      if (isPartitionValid(p)) {
-        rows += "<td><button onclick=\"location.href='/activate?label=" + String(p->label) + "'\">Activate</button></td>";
+//////////////////////////////
+// Multi-Range Responses
+//////////////////////////////
+// /dumprange with an HTTP Range header ("bytes=0-31,4096-4127,-512") or
+// ranges=off:len,off:len (same units as /dumprange). Ranges are sorted and
+// overlapping or touching ones merged; several ranges are answered as
+// 206 multipart/byteranges, a single one as a plain 206. Data is served
+// through a one-sector cache so small ranges in the same sector share a
+// flash read. Offsets are partition-relative when label= is given.
+
+static const int    MAX_MULTI_RANGES    = 64;
+
+struct ByteRange {
+  uint32_t start;
+  uint32_t length;
+};
+
+enum MultiPhase : uint8_t { MR_PART_HEADER, MR_PART_DATA, MR_CLOSE, MR_DONE };
+
+struct ESP32FirmwareDownloader::MultiRange {
+  FlashSource src;          // whole flash; reads go through readSource()
+  uint32_t base;            // added to range offsets
+  uint32_t total;           // size reported in Content-Range
+  ByteRange ranges[MAX_MULTI_RANGES];
+  int count;
+  int part;
+  uint32_t partOff;
+  MultiPhase phase;
+  uint8_t *cache;
+  uint32_t cacheAddr;       // UINT32_MAX when empty
+  uint32_t flashReads;
+  char boundary[24];        // random per response so flash data cannot mimic it
+  char pending[160];
+  size_t pendingLen;
+  size_t pendingOff;
+
+  ~MultiRange() {
+    free(cache);
+  }
+};
+
+// Parse an HTTP "bytes=" set or an "off:len,..." list. Returns the number of
+// ranges, -1 on syntax errors and -2 when a range is unsatisfiable.
+static int parseRanges(const String &spec, bool httpSyntax, uint32_t total, ByteRange *out) {
+  String list = spec;
+  if (httpSyntax) {
+    if (!list.startsWith("bytes=")) return -1;
+    list = list.substring(6);
+  }
+  int count = 0;
+  int from = 0;
+  while (from <= (int)list.length()) {
+    int comma = list.indexOf(',', from);
+    String item = list.substring(from, comma < 0 ? list.length() : comma);
+    item.trim();
+    from = (comma < 0) ? list.length() + 1 : comma + 1;
+    if (item.length() == 0) continue;
+    if (count == MAX_MULTI_RANGES) return -1;
+    uint32_t start, length;
+    if (httpSyntax) {
+      int dash = item.indexOf('-');
+      if (dash < 0) return -1;
+      String first = item.substring(0, dash);
+      String last = item.substring(dash + 1);
+      uint32_t a, b;
+      if (first.length() == 0) {                  // suffix: last N bytes
+        if (!parseSize(last, &b) || b == 0) return -2;
+        if (b > total) b = total;
+        start = total - b;
+        length = b;
       } else {
-        rows += "<td><button disabled title=\"Partition unavailable\">Activate</button></td>";
+        if (!parseSize(first, &a) || a >= total) return -2;
+        if (last.length() == 0) b = total - 1;
+        else if (!parseSize(last, &b) || b < a) return -1;
+        if (b >= total) b = total - 1;
+        start = a;
+        length = b - a + 1;
       }
-      rows += "<td><form method='POST' action='/upload' enctype='multipart/form-data' style='display:inline;'>"
-              "<input type='hidden' name='label' value='" + String(p->label) + "'>"
-              "<input type='file' name='file' style='width:150px;' onchange='checkAppImage(this, " + String(p->size) + ")'>"
-              "<input type='submit' value='Upload'>"
-              "</form></td>";
     } else {
-      rows += "<td>N/A</td><td>N/A</td>";
+      int colon = item.indexOf(':');
+      if (colon < 0 || !parseSize(item.substring(0, colon), &start) ||
+          !parseSize(item.substring(colon + 1), &length)) {
+        return -1;
+      }
+      if (length == 0 || start >= total || length > total - start) return -2;
     }
-    rows += "</tr>";
-    it = esp_partition_next(it);
+    out[count].start = start;
+    out[count].length = length;
+    count++;
   }
+  return count;
+}
 
-  it = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, NULL);
-  while (it != NULL) {
-    const esp_partition_t* p = esp_partition_get(it);
-    char addrStr[20];
-    sprintf(addrStr, "0x%08X", p->address);
-    rows += "<tr>";
-    rows += "<td>DATA</td>";
-    rows += "<td>" + String(p->label) + "</td>";
-    rows += "<td>" + String(addrStr) + "</td>";
-    rows += "<td>" + String(p->size) + "</td>";
-    rows += "<td><a href=\"/downloaddirect?label=" + String(p->label) + "\">Download</a></td>";
-    rows += "<td>N/A</td>";
-    rows += "<td><form method='POST' action='/upload' enctype='multipart/form-data' style='display:inline;'>"
-            "<input type='hidden' name='label' value='" + String(p->label) + "'>"
-            "<input type='file' name='file' style='width:150px;' onchange='checkFileSize(this, " + String(p->size) + ")'>"
-            "<input type='submit' value='Upload'>"
-            "</form></td>";
-    rows += "</tr>";
-    it = esp_partition_next(it);
+// Sort by start and merge overlapping or touching ranges; returns the new count.
+static int coalesceRanges(ByteRange *r, int count) {
+  for (int i = 1; i < count; i++) {
+    ByteRange key = r[i];
+    int j = i - 1;
+    while (j >= 0 && r[j].start > key.start) {
+      r[j + 1] = r[j];
+      j--;
+    }
+    r[j + 1] = key;
+  }
+  int out = 0;
+  for (int i = 0; i < count; i++) {
+    if (out > 0 && r[i].start <= r[out - 1].start + r[out - 1].length) {
+      uint32_t end = r[i].start + r[i].length;
+      uint32_t prevEnd = r[out - 1].start + r[out - 1].length;
+      if (end > prevEnd) r[out - 1].length = end - r[out - 1].start;
+    } else {
+      r[out++] = r[i];
+    }
   }
+  return out;
+}
 
-  String htmlFooter = R"rawliteral(
-    </table>
-    <h2>Global Download Links</h2>
-    <ul>
-      <li><a href="/dumpflash">Full Flash Dump</a></li>
-      <li><a href="/dumpflash_secure">Secure Full Flash Dump</a></li>
-      <li><a href="/downloadboot">Bootloader Download</a></li>
-      <li><a href="/clone">Clone Active APP Partition</a></li>
-      <li>Generic Download: /downloaddirect?label=YourPartitionLabel</li>
-    </ul>
-  </body>
-</html>
-)rawliteral";
+size_t ESP32FirmwareDownloader::multiRangeFill(MultiRange &m, uint8_t *buffer, size_t maxLen) {
+  while (true) {
+    if (m.pendingOff < m.pendingLen) {
+      size_t n = m.pendingLen - m.pendingOff;
+      if (n > maxLen) n = maxLen;
+      memcpy(buffer, m.pending + m.pendingOff, n);
+      m.pendingOff += n;
+      return n;
+    }
+    m.pendingLen = m.pendingOff = 0;
 
-  String fullHtml = htmlHeader + rows + htmlFooter;
-  request->send(200, "text/html", fullHtml);
+    switch (m.phase) {
+      case MR_PART_HEADER: {
+        const ByteRange &r = m.ranges[m.part];
+        int n = snprintf(m.pending, sizeof(m.pending),
+                         "%s--%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %u-%u/%u\r\n\r\n",
+                         m.part ? "\r\n" : "", m.boundary, r.start, r.start + r.length - 1, m.total);
+        m.pendingLen = (n > 0) ? n : 0;
+        m.partOff = 0;
+        m.phase = MR_PART_DATA;
+        break;
+      }
+
+      case MR_PART_DATA: {
+        const ByteRange &r = m.ranges[m.part];
+        if (m.partOff >= r.length) {
+          m.part++;
+          m.phase = (m.part < m.count) ? MR_PART_HEADER : MR_CLOSE;
+          break;
+        }
+        uint32_t addr = m.base + r.start + m.partOff;
+        uint32_t sector = addr / SECTOR_SIZE * SECTOR_SIZE;
+        if (m.cacheAddr != sector) {
+          if (readSource(m.src, m.cache, SECTOR_SIZE, sector) != SECTOR_SIZE) return 0;
+          m.cacheAddr = sector;
+          m.flashReads++;
+        }
+        size_t n = sector + SECTOR_SIZE - addr;
+        if (n > r.length - m.partOff) n = r.length - m.partOff;
+        if (n > maxLen) n = maxLen;
+        memcpy(buffer, m.cache + (addr - sector), n);
+        m.partOff += n;
+        return n;
+      }
+
+      case MR_CLOSE: {
+        int n = snprintf(m.pending, sizeof(m.pending), "\r\n--%s--\r\n", m.boundary);
+        m.pendingLen = (n > 0) ? n : 0;
+        m.phase = MR_DONE;
+        Serial.printf("[MultiRange] %d parts served with %u sector reads.\n", m.count, m.flashReads);
+        break;
+      }
+
+      case MR_DONE:
+        return 0;
+    }
+  }
+}
+
+void ESP32FirmwareDownloader::sendMultiRange(AsyncWebServerRequest *request, uint32_t base, uint32_t limit) {
+  std::shared_ptr<MultiRange> m(new MultiRange());
+  bool http = request->hasHeader("Range");
+  String spec = http ? request->getHeader("Range")->value() : request->getParam("ranges")->value();
+  int count = parseRanges(spec, http, limit, m->ranges);
+  if (count == -2) {
+    AsyncWebServerResponse *response = request->beginResponse(416, "text/plain", "Range not satisfiable");
+    response->addHeader("Content-Range", "bytes */" + String(limit));
+    request->send(response);
+    return;
+  }
+  if (count <= 0) {
+    request->send(400, "text/plain", "Bad range list (at most 64 ranges)");
+    return;
+  }
+  count = coalesceRanges(m->ranges, count);
+  for (int i = 0; i < count; i++) {
+    const char* denied = rangeDenied(base + m->ranges[i].start, m->ranges[i].length);
+    if (denied) {
+      request->send(403, "text/plain", String("Protected: ") + denied);
+      return;
+    }
+  }
+
+  if (count == 1) {
+    const ByteRange &r = m->ranges[0];
+    AsyncWebServerResponse *response = beginDumpResponse(request, makeSource(base + r.start, r.length, false, "RangeStream"));
+    if (!response) return;
+    response->setCode(206);
+    char contentRange[64];
+    snprintf(contentRange, sizeof(contentRange), "bytes %u-%u/%u", r.start, r.start + r.length - 1, limit);
+    response->addHeader("Content-Range", contentRange);
+    request->send(response);
+    return;
+  }
+
+  m->src = makeSource(0, fwdl_flash_size(), false, "MultiRange");
+  m->src.normalize = requestedNormalizePlan(request);
+  m->base = base;
+  m->total = limit;
+  m->count = count;
+  m->phase = MR_PART_HEADER;
+  m->cacheAddr = UINT32_MAX;
+  snprintf(m->boundary, sizeof(m->boundary), "fwdl-%08x%08x", esp_random(), esp_random());
+  m->cache = (uint8_t*)malloc(SECTOR_SIZE);
+  if (!m->cache) {
+    request->send(503, "text/plain", "Not enough memory");
+    return;
+  }
+  uint32_t payload = 0;
+  for (int i = 0; i < count; i++) payload += m->ranges[i].length;
+  Serial.printf("[MultiRange] %d ranges (%u bytes) after coalescing.\n", count, payload);
+
+  AsyncWebServerResponse *response = beginTrackedResponse(request, "MultiRange", payload,
+    [m](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      (void)index;
+      return multiRangeFill(*m, buffer, maxLen);
+    });
+  if (!response) return;
+  response->setCode(206);
+  response->setContentType(String("multipart/byteranges; boundary=") + m->boundary);
+  request->send(response);
 }
 
+#if FWDL_ENABLE_BATCH
 //////////////////////////////
-// Upload Handler
+// Batch Jobs
 //////////////////////////////
-void ESP32FirmwareDownloader::handleUploadBinary(AsyncWebServerRequest *request,
-    const String &filename, size_t index, uint8_t *data, size_t len, bool final) {
-  // Retrieve target partition label.
-  String label = "";
-  if (request->hasParam("label", true)) {
-    label = request->getParam("label", true)->value();
-  } else {
-    Serial.println("[Upload] Missing 'label' parameter");
-    request->send(400, "text/plain", "Missing 'label' parameter");
-    return;
+// POST /jobs with a JSON list of steps, run in order as one background job:
+//   {"steps":[{"op":"hash","label":"ota_0"},
+//             {"op":"snapshot","src":"nvs","dst":"nvs_backup"},
+//             {"op":"pull","url":"http://host/fw.bin","label":"ota_1","sha256":"..."},
+//             {"op":"verify","label":"ota_1","sha256":"..."},      (or "against":"ota_0")
+//             {"op":"activate","label":"ota_1"},
+//             {"op":"reboot"}]}
+// Other ops: "clone" (running app to the inactive slot). Every step is
+// validated before anything runs; the first failing step skips the rest.
+// GET /jobs/status reports the job and each step. Steps reuse the snapshot,
+// pull-clone and activate code, and hashes go through the generation-keyed
+// cache, so hashing a partition twice in one batch reads it once.
+
+static const int    MAX_BATCH_STEPS = 16;
+static const size_t MAX_BATCH_BODY  = 4096;
+
+enum BatchOp : uint8_t {
+  BATCH_HASH, BATCH_VERIFY, BATCH_SNAPSHOT, BATCH_PULL, BATCH_CLONE, BATCH_ACTIVATE, BATCH_REBOOT
+};
+
+enum BatchState : uint8_t { STEP_PENDING, STEP_RUNNING, STEP_DONE, STEP_FAILED, STEP_SKIPPED };
+
+struct BatchStep {
+  uint8_t op;
+  volatile uint8_t state;
+  const esp_partition_t* part;     // hash/verify/pull/activate target, snapshot source
+  const esp_partition_t* other;    // snapshot destination, verify reference
+  char sha256[65];
+  uint32_t length;                 // verify: bytes to hash, 0 for the whole partition or app image
+  String url;
+  volatile uint32_t done;
+  volatile uint32_t total;
+  uint32_t ms;
+  char message[80];
+};
+
+static BatchStep g_batchSteps[MAX_BATCH_STEPS];
+static int g_numBatchSteps = 0;
+static volatile int g_batchCurrent = -1;
+
+static const char* batchOpName(uint8_t op) {
+  switch (op) {
+    case BATCH_HASH:     return "hash";
+    case BATCH_VERIFY:   return "verify";
+    case BATCH_SNAPSHOT: return "snapshot";
+    case BATCH_PULL:     return "pull";
+    case BATCH_CLONE:    return "clone";
+    case BATCH_ACTIVATE: return "activate";
+    default:             return "reboot";
   }
+}
 
-  // Try to find APP partition first.
-  const esp_partition_t* target = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
-  // Static variables for APP OTA update.
-  static esp_ota_handle_t ota_handle = 0;
-  static bool otaStarted = false;
-  
-  // For DATA partitions.
-  static bool dataUpdateStarted = false;
-  static uint32_t dataOffset = 0;
+static uint8_t batchOpFromName(const char* name) {
+  for (uint8_t op = BATCH_HASH; op <= BATCH_REBOOT; op++) {
+    if (!strcmp(name, batchOpName(op))) return op;
+  }
+  return 0xFF;
+}
 
-  if (!target) {
-    target = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label.c_str());
-    if (!target) {
-      Serial.printf("[Upload] Target partition '%s' not found!\n", label.c_str());
-      request->send(404, "text/plain", "Target partition not found");
-      return;
+static const char* batchStateName(uint8_t state) {
+  switch (state) {
+    case STEP_PENDING: return "pending";
+    case STEP_RUNNING: return "running";
+    case STEP_DONE:    return "done";
+    case STEP_FAILED:  return "failed";
+    default:           return "skipped";
+  }
+}
+
+// Validate one step object and fill in step. Returns an error or nullptr.
+static const char* parseBatchStep(const char* obj, bool last, BatchStep &step) {
+  char op[16], label[20], other[20];
+  if (!jsonGet(obj, "op", op, sizeof(op))) return "step without op";
+  step.op = batchOpFromName(op);
+  step.state = STEP_PENDING;
+  step.part = step.other = nullptr;
+  step.sha256[0] = '\0';
+  step.length = 0;
+  step.url = "";
+  step.done = step.total = step.ms = 0;
+  step.message[0] = '\0';
+  bool hasLabel = jsonGet(obj, "label", label, sizeof(label));
+  if (hasLabel) step.part = findPartitionByLabel(label);
+  char sha[72];
+  if (jsonGet(obj, "sha256", sha, sizeof(sha))) {
+    if (strlen(sha) != 64) return "sha256 must be 64 hex characters";
+    memcpy(step.sha256, sha, sizeof(step.sha256));
+  }
+  switch (step.op) {
+    case BATCH_HASH:
+      if (!step.part) return "hash needs an existing label";
+      break;
+    case BATCH_VERIFY:
+      if (!step.part) return "verify needs an existing label";
+      if (jsonGet(obj, "against", other, sizeof(other))) step.other = findPartitionByLabel(other);
+      if (!step.other && !step.sha256[0]) return "verify needs sha256 or an existing 'against' label";
+      if (jsonGet(obj, "length", other, sizeof(other)) &&
+          (!parseSize(String(other), &step.length) || step.length == 0 || step.length > step.part->size)) {
+        return "verify length must be 1..partition size";
+      }
+      break;
+#if FWDL_ENABLE_UPLOAD
+    case BATCH_SNAPSHOT:
+      if (!jsonGet(obj, "src", label, sizeof(label)) || !jsonGet(obj, "dst", other, sizeof(other))) {
+        return "snapshot needs src and dst";
+      }
+      step.part = findPartitionByLabel(label);
+      step.other = findPartitionByLabel(other);
+      if (!step.part || !step.other) return "snapshot partition not found";
+      if (step.part->type != ESP_PARTITION_TYPE_DATA || step.other->type != ESP_PARTITION_TYPE_DATA ||
+          step.part == step.other) {
+        return "snapshot copies between two DATA partitions";
+      }
+      if (isProtectedDestination(step.other->address, step.other->size)) return "snapshot destination is protected";
+      break;
+#if FWDL_ENABLE_PULLCLONE
+    case BATCH_PULL: {
+      char url[192];
+      if (!jsonGet(obj, "url", url, sizeof(url))) return "pull needs url";
+      step.url = url;
+      if (!hasLabel) step.part = esp_ota_get_next_update_partition(NULL);
+      if (!step.part) return "pull target not found";
+      const esp_partition_t* running = esp_ota_get_running_partition();
+      if (running && step.part->address == running->address) return "cannot pull into the running app";
+      if (isProtectedDestination(step.part->address, step.part->size)) return "pull target is protected";
+      break;
     }
-    if (index == 0) {
-      dataUpdateStarted = true;
-      dataOffset = 0;
-      Serial.printf("[Upload] Erasing DATA partition '%s' (size: %u bytes)...\n", label.c_str(), target->size);
-      esp_err_t err = esp_partition_erase_range(target, 0, target->size);
-      if (err != ESP_OK) {
-        Serial.printf("[Upload] Erase failed: %s\n", esp_err_to_name(err));
-        request->send(500, "text/plain", "Erase partition failed");
-        dataUpdateStarted = false;
-        return;
+#endif
+    case BATCH_CLONE:
+      if (!findInactiveApp()) return "no inactive app partition";
+      break;
+    case BATCH_ACTIVATE:
+      if (!hasLabel) step.part = findInactiveApp();
+      if (!step.part || step.part->type != ESP_PARTITION_TYPE_APP) return "activate needs an APP partition";
+      break;
+#endif  // FWDL_ENABLE_UPLOAD
+#if !FWDL_ENABLE_UPLOAD || !FWDL_ENABLE_PULLCLONE
+    case BATCH_PULL:
+#endif
+#if !FWDL_ENABLE_UPLOAD
+    case BATCH_SNAPSHOT:
+    case BATCH_CLONE:
+    case BATCH_ACTIVATE:
+#endif
+#if !FWDL_ENABLE_UPLOAD || !FWDL_ENABLE_PULLCLONE
+      return "op not built into this firmware";
+#endif
+    case BATCH_REBOOT:
+      if (!last) return "reboot must be the last step";
+      break;
+    default:
+      return "unknown op";
+  }
+  return nullptr;
+}
+
+static bool runBatchStep(BatchStep &step) {
+  switch (step.op) {
+    case BATCH_HASH: {
+      uint8_t digest[32];
+      bool cached = false;
+      step.total = step.part->size;
+      if (!hashFlashRange(step.part->address, step.part->size, digest, &cached)) {
+        snprintf(step.message, sizeof(step.message), "flash read failed");
+        return false;
       }
+      toHex(digest, sizeof(digest), step.message);
+      step.done = step.total;
+      return true;
     }
-    esp_err_t err = esp_partition_write(target, dataOffset, data, len);
-    if (err != ESP_OK) {
-      Serial.printf("[Upload] esp_partition_write failed at offset %u: %s\n", dataOffset, esp_err_to_name(err));
-      return;
+    case BATCH_VERIFY: {
+      // Read back from flash rather than trusting the cache. A sha256 covers
+      // what was written, not the erased tail: hash the given length, or the
+      // image length of an APP partition.
+      uint32_t length = step.length ? step.length : step.part->size;
+      if (!step.length && step.sha256[0] && step.part->type == ESP_PARTITION_TYPE_APP) {
+        esp_partition_pos_t pos = { step.part->address, step.part->size };
+        esp_image_metadata_t meta;
+        if (esp_image_get_metadata(&pos, &meta) != ESP_OK || meta.image_len > step.part->size) {
+          snprintf(step.message, sizeof(step.message), "no valid app image in %s; give length", step.part->label);
+          return false;
+        }
+        length = meta.image_len;
+      }
+      if (step.other && step.other->size < length) length = step.other->size;
+      step.total = length;
+      uint8_t digest[32], expected[32];
+      char hex[65];
+      if (!hashFlashRange(step.part->address, length, digest, nullptr, true)) {
+        snprintf(step.message, sizeof(step.message), "flash read failed");
+        return false;
+      }
+      toHex(digest, sizeof(digest), hex);
+      if (step.other) {
+        if (!hashFlashRange(step.other->address, length, expected, nullptr, true)) {
+          snprintf(step.message, sizeof(step.message), "flash read failed");
+          return false;
+        }
+        step.done = step.total;
+        bool same = memcmp(digest, expected, sizeof(digest)) == 0;
+        snprintf(step.message, sizeof(step.message), "%s %s %s", step.part->label, same ? "matches" : "differs from",
+                 step.other->label);
+        return same;
+      }
+      step.done = step.total;
+      bool same = strcasecmp(hex, step.sha256) == 0;
+      snprintf(step.message, sizeof(step.message), same ? "sha256 matches" : "sha256 mismatch (got %.16s...)", hex);
+      return same;
     }
-    dataOffset += len;
-    if (final) {
-      Serial.printf("[Upload] DATA partition '%s' update complete.\n", label.c_str());
-      request->send(200, "text/plain", "Upload complete for DATA partition");
-      dataUpdateStarted = false;
+#if FWDL_ENABLE_UPLOAD
+    case BATCH_SNAPSHOT: {
+      uint32_t length = (step.part->size < step.other->size) ? step.part->size : step.other->size;
+      step.total = length;
+      if (!sourceTailErased(step.part->address, length, step.part->size)) {
+        snprintf(step.message, sizeof(step.message), "%s does not fit in %s", step.part->label, step.other->label);
+        return false;
+      }
+      CopyStats stats;
+      bool ok = copyFlashRange(step.part->address, step.other->address, length, &stats, &step.done);
+      snprintf(step.message, sizeof(step.message), "%s -> %s: %u unchanged, %u written", step.part->label,
+               step.other->label, stats.unchanged, stats.written);
+      return ok;
+    }
+#if FWDL_ENABLE_PULLCLONE
+    case BATCH_PULL: {
+      PullArgs args;
+      args.url = step.url;
+      strncpy(args.sha256, step.sha256, sizeof(args.sha256));
+      args.target = step.part;
+      args.activate = false;
+      args.reboot = false;
+      return pullImage(&args, &step.done, &step.total, step.message, sizeof(step.message));
     }
+#endif
+    case BATCH_CLONE: {
+      const esp_partition_t* running = esp_ota_get_running_partition();
+      step.total = running ? running->size : 0;
+      bool ok = cloneActiveToInactive(&step.done);
+      step.done = step.total;
+      snprintf(step.message, sizeof(step.message), ok ? "cloned and activated" : "clone failed");
+      return ok;
+    }
+    case BATCH_ACTIVATE: {
+      if (!isPartitionValid(step.part)) {
+        snprintf(step.message, sizeof(step.message), "%s appears empty", step.part->label);
+        return false;
+      }
+      esp_err_t err = esp_ota_set_boot_partition(step.part);
+      bumpOtadata();
+      snprintf(step.message, sizeof(step.message), "%s: %s", step.part->label, esp_err_to_name(err));
+      return err == ESP_OK;
+    }
+#endif  // FWDL_ENABLE_UPLOAD
+    default:
+      snprintf(step.message, sizeof(step.message), "rebooting");
+      return true;
+  }
+}
+
+static bool batchJob(void* arg) {
+  (void)arg;
+  Job* job = Core::currentJob();
+  job->total = g_numBatchSteps;
+  int failed = -1;
+  for (int i = 0; i < g_numBatchSteps; i++) {
+    BatchStep &step = g_batchSteps[i];
+    if (failed >= 0 || Core::jobCancelled()) {
+      step.state = STEP_SKIPPED;
+      continue;
+    }
+    g_batchCurrent = i;
+    step.state = STEP_RUNNING;
+    uint32_t startMs = millis();
+    Serial.printf("[Batch] Step %d/%d: %s\n", i + 1, g_numBatchSteps, batchOpName(step.op));
+    bool ok = runBatchStep(step);
+    step.ms = millis() - startMs;
+    step.state = ok ? STEP_DONE : STEP_FAILED;
+    Serial.printf("[Batch] Step %d %s in %u ms: %s\n", i + 1, ok ? "done" : "failed", step.ms, step.message);
+    if (!ok) failed = i;
+    job->done = i + 1;
+  }
+  g_batchCurrent = -1;
+  if (failed >= 0) {
+    Core::jobMessage("step %d (%s) failed: %s", failed + 1, batchOpName(g_batchSteps[failed].op),
+                     g_batchSteps[failed].message);
+    return false;
+  }
+  if (Core::jobCancelled()) {
+    Core::jobMessage("cancelled after %u of %d steps", job->done, g_numBatchSteps);
+    return false;
+  }
+  Core::jobMessage("%d steps", g_numBatchSteps);
+  job->rebootAfter = g_batchSteps[g_numBatchSteps - 1].op == BATCH_REBOOT;
+  return true;
+}
+
+static String batchJson() {
+  String json = jobStatusJson(0, "batch");
+  json.remove(json.length() - 1);
+  json += ",\"step\":" + String(g_batchCurrent + 1);
+  json += ",\"steps\":[";
+  for (int i = 0; i < g_numBatchSteps; i++) {
+    const BatchStep &step = g_batchSteps[i];
+    if (i) json += ",";
+    json += "{\"op\":\"" + String(batchOpName(step.op)) + "\"";
+    json += ",\"state\":\"" + String(batchStateName(step.state)) + "\"";
+    json += ",\"done\":" + String(step.done);
+    json += ",\"total\":" + String(step.total);
+    json += ",\"ms\":" + String(step.ms);
+    json += ",\"message\":\"" + String(step.message) + "\"}";
+  }
+  json += "]}";
+  return json;
+}
+
+// Collects the POST body into request->_tempObject (freed by the server).
+void ESP32FirmwareDownloader::handleJobsBody(AsyncWebServerRequest *request, uint8_t *data, size_t len,
+                                             size_t index, size_t total) {
+  if (total > MAX_BATCH_BODY) return;
+  if (index == 0) {
+    request->_tempObject = malloc(total + 1);
+    if (!request->_tempObject) return;
+    ((char*)request->_tempObject)[total] = '\0';
+  }
+  if (request->_tempObject) memcpy((char*)request->_tempObject + index, data, len);
+}
+
+void ESP32FirmwareDownloader::handleJobs(AsyncWebServerRequest *request) {
+  if (Core::jobActive("batch")) {
+    request->send(409, "application/json", batchJson());
     return;
   }
-  
-  // For APP partitions, disallow updating the active partition.
-  const esp_partition_t* running = esp_ota_get_running_partition();
-  if (running && target->address == running->address) {
-    Serial.printf("[Upload] Cannot update active partition '%s'.\n", label.c_str());
-    request->send(400, "text/plain", "Cannot update active partition");
+  const char* body = (const char*)request->_tempObject;
+  if (!body) {
+    request->send(request->contentLength() > MAX_BATCH_BODY ? 413 : 400, "text/plain", "Expected a JSON body");
     return;
   }
-  
-  // APP OTA update.
-  if (index == 0) {
-    if (otaStarted) {
-      Serial.println("[Upload] OTA update already started, ignoring new start.");
+  const char* p = strchr(body, '[');
+  if (!p) {
+    request->send(400, "text/plain", "Expected a list of steps");
+    return;
+  }
+  // Steps are flat objects; each is copied out so jsonGet() only sees its own keys.
+  BatchStep *steps = g_batchSteps;    // free while no batch runs
+  int count = 0;
+  g_numBatchSteps = 0;
+  char obj[384];
+  while ((p = strchr(p, '{')) != nullptr) {
+    const char* end = strchr(p, '}');
+    if (!end || (size_t)(end - p + 1) >= sizeof(obj)) {
+      request->send(400, "text/plain", "Malformed step");
       return;
     }
-    otaStarted = true;
-    Serial.printf("[Upload] Beginning OTA update for partition '%s' (size: %u bytes)...\n", label.c_str(), target->size);
-    esp_err_t err = esp_ota_begin(target, target->size, &ota_handle);
-    if (err != ESP_OK) {
-      Serial.printf("[Upload] esp_ota_begin failed: %s\n", esp_err_to_name(err));
-      ota_handle = 0;
-      otaStarted = false;
-      request->send(500, "text/plain", "OTA update failed to begin");
+    if (count == MAX_BATCH_STEPS) {
+      request->send(400, "text/plain", "Too many steps");
       return;
     }
+    memcpy(obj, p, end - p + 1);
+    obj[end - p + 1] = '\0';
+    p = end + 1;
+    const char* err = parseBatchStep(obj, strchr(p, '{') == nullptr, steps[count]);
+    if (err) {
+      request->send(400, "text/plain", String("Step ") + String(count + 1) + ": " + err);
+      return;
+    }
+    count++;
   }
-  
-  if (ota_handle == 0) {
-    Serial.println("[Upload] OTA handle not available.");
+  if (count == 0) {
+    request->send(400, "text/plain", "No steps");
     return;
   }
-  
-  esp_err_t err = esp_ota_write(ota_handle, data, len);
-  if (err != ESP_OK) {
-    Serial.printf("[Upload] esp_ota_write failed at index %u: %s\n", index, esp_err_to_name(err));
+  g_numBatchSteps = count;
+  g_batchCurrent = -1;
+  if (!Core::submitJob("batch", Core::JOB_PRIO_NORMAL, batchJob, nullptr, nullptr, true, true)) {
+    request->send(503, "text/plain", "Job queue full");
     return;
   }
-  
-  if (final) {
-    Serial.println("[Upload] Finalizing OTA update...");
-    err = esp_ota_end(ota_handle);
-    if (err != ESP_OK) {
-      Serial.printf("[Upload] esp_ota_end failed: %s\n", esp_err_to_name(err));
-      return;
-    }
-    err = esp_ota_set_boot_partition(target);
-    if (err != ESP_OK) {
-      Serial.printf("[Upload] esp_ota_set_boot_partition failed: %s\n", esp_err_to_name(err));
-      return;
-    }
-    Serial.println("[Upload] OTA update complete. Rebooting...");
-    request->send(200, "text/plain", "Upload complete, device will reboot");
-    ota_handle = 0;
-    otaStarted = false;
-    delay(2000);
-    esp_restart();
+  request->send(202, "application/json", batchJson());
+}
+
+void ESP32FirmwareDownloader::handleJobsStatus(AsyncWebServerRequest *request) {
+  request->send(200, "application/json", batchJson());
+}
+#endif  // FWDL_ENABLE_BATCH
+
+// GET /partitions — the partition table with write generations.
+void ESP32FirmwareDownloader::handleListPartitions(AsyncWebServerRequest *request) {
+  String json = coreListing(Core::partitionsJson);
+  if (!json.length()) {
+    request->send(500, "text/plain", "Listing does not fit");
+    return;
+  }
+  request->send(200, "application/json", json);
+}
+
+// GET /jobs — every queued, running and remembered job, newest first.
+// GET /jobs?id=N — one job.
+void ESP32FirmwareDownloader::handleJobList(AsyncWebServerRequest *request) {
+  if (request->hasParam("id")) {
+    uint32_t id = strtoul(request->getParam("id")->value().c_str(), nullptr, 0);
+    Job job;
+    bool found = Core::findJob(id, nullptr, job);
+    request->send(found ? 200 : 404, "application/json", jobStatusJson(id, nullptr));
+    return;
+  }
+  String json = coreListing([](char *out, size_t outLen) { return Core::jobsJson(out, outLen); });
+  if (!json.length()) {
+    request->send(500, "text/plain", "Listing does not fit");
+    return;
+  }
+  request->send(200, "application/json", json);
+}
+
+// GET /jobs/cancel?id=N
+void ESP32FirmwareDownloader::handleJobCancel(AsyncWebServerRequest *request) {
+  if (!request->hasParam("id")) {
+    request->send(400, "text/plain", "Missing 'id' parameter");
+    return;
   }
+  uint32_t id = strtoul(request->getParam("id")->value().c_str(), nullptr, 0);
+  if (!Core::cancelJob(id)) {
+    request->send(404, "text/plain", "No such queued or running job");
+    return;
+  }
+  request->send(202, "application/json", jobStatusJson(id, nullptr));
 }
 
 ////////////////////////////
@@ -692,15 +6349,60 @@ bool ESP32FirmwareDownloader::attachAll(AsyncWebServer &server, bool eraseUserDa
   ok &= attach(server, eraseUserData);
   server.on("/downloadboot", HTTP_GET, handleDownloadBoot);
   server.on("/downloaddirect", HTTP_GET, handleDownloadPartitionDirect);
+  server.on("/dumpflash_secure", HTTP_GET, handleDumpFlashSecure);
+  server.on("/dumprange", HTTP_GET, handleDumpRange);
+  server.on("/fwdl/stats", HTTP_GET, handleStreamStats);
+  server.on("/partitions", HTTP_GET, handleListPartitions);
+  server.on("/jobs/cancel", HTTP_GET, handleJobCancel);
+#if FWDL_ENABLE_BATCH
+  server.on("/jobs/status", HTTP_GET, handleJobsStatus);
+  server.on("/jobs", HTTP_POST, handleJobs, nullptr, handleJobsBody);
+#endif
+  server.on("/jobs", HTTP_GET, handleJobList);
+#if FWDL_ENABLE_UI
+  server.on("/FWDL", HTTP_GET, handleRoot);
+#endif
+#if FWDL_ENABLE_UPLOAD
   server.on("/activate", HTTP_GET, handleActivatePartition);
   server.on("/clone", HTTP_GET, handleClonePartition);
-  server.on("/FWDL", HTTP_GET, handleRoot);
-  server.on("/dumpflash_secure", HTTP_GET, handleDumpFlashSecure);
+  server.on("/snapshot/status", HTTP_GET, handleSnapshotStatus);
+  server.on("/snapshot", HTTP_GET, handleSnapshot);
   server.on("/upload", HTTP_POST,
     [](AsyncWebServerRequest *request) {
       request->send(200, "text/plain", "Upload complete");
     },
     handleUploadBinary
   );
+#endif
+#if FWDL_ENABLE_PULLCLONE
+  server.on("/pullclone/status", HTTP_GET, handlePullCloneStatus);
+  server.on("/pullclone", HTTP_GET, handlePullClone);
+#endif
+#if FWDL_ENABLE_MULTICAST
+  server.on("/mcast/send", HTTP_GET, handleMulticastSend);
+  server.on("/mcast/status", HTTP_GET, handleMulticastStatus);
+#endif
+#if FWDL_ENABLE_HASHING
+  server.on("/hash", HTTP_GET, handleHash);
+  server.on("/meta", HTTP_GET, handleMeta);
+  server.on("/sectorcrc", HTTP_GET, handleSectorCrc);
+#endif
+#if FWDL_ENABLE_DIAGNOSTICS
+  server.on("/wear", HTTP_GET, handleWear);
+  server.on("/coredump/erase", HTTP_GET, handleCoreDumpErase);
+  server.on("/coredump", HTTP_GET, handleCoreDump);
+  server.on("/ramdump", HTTP_GET, handleRamDump);
+#endif
+#if FWDL_ENABLE_DEDUP
+  server.on("/archive", HTTP_GET, handleArchive);
+  server.on("/archive", HTTP_POST, handleArchive, nullptr, handleArchiveBody);
+#endif
+#if FWDL_ENABLE_WEBSOCKET
+  if (!_ws) {
+    _ws = new AsyncWebSocket("/fwdl/ws");
+    _ws->onEvent(handleWsEvent);
+  }
+  server.addHandler(_ws);
+#endif
   return ok;
 }
@@ -4,6 +4,11 @@
 
 #include <Arduino.h>
 #include <ESPAsyncWebServer.h>
+#include <memory>
+#include "FirmwareDownloaderConfig.h"   // FWDL_ENABLE_* feature selection
+#include "FirmwareDownloaderCore.h"     // sessions, generations, jobs
+
+struct NormalizePlan;   // per-stream ?normalize=1 patch list
 
 class ESP32FirmwareDownloader {
 public:
@@ -25,29 +30,159 @@ public:
   bool autoSetUserDataBlank();
   bool autoSetUserDataBlankAll();
 
+  // Refuse range and partition reads that touch this region. NVS key and
+  // eFuse emulation partitions are always protected.
+  void addProtectedRegion(uint32_t offset, uint32_t length, const char* description);
+
+  // Stall/idle watchdog for streaming downloads. A session that stays below
+  // minBytesPerSec for stallSeconds, or produces nothing for
+  // idleTimeoutSeconds, is closed and its slot reclaimed. 0 disables a check.
+  void setStallPolicy(uint32_t minBytesPerSec, uint32_t stallSeconds, uint32_t idleTimeoutSeconds);
+
+#if FWDL_ENABLE_DIAGNOSTICS
+  // Opt in to /ramdump, which streams live DRAM, PSRAM and RTC memory. Off by
+  // default: memory holds keys and credentials that flash dumps blank.
+  void enableRamDump(bool enable = true);
+#endif
+
+  // Streaming session counters (also served at /fwdl/stats), across every
+  // transport including the esp_http_server adapter.
+  typedef FirmwareDownloaderCore::StreamStats StreamStats;
+  static StreamStats getStreamStats();
+
+#if FWDL_ENABLE_RAW_TCP
+  // Optional raw TCP dump service: a tiny binary protocol (see README) that
+  // streams the same sources as the HTTP endpoints without HTTP framing.
+  bool beginRawServer(uint16_t port = 8023);
+#endif
+
+#if FWDL_ENABLE_SERIAL
+  // Optional serial transport: SLIP-framed binary protocol with per-frame
+  // CRC, windowed acks and baud negotiation up to maxBaud. The port must
+  // already be started at its base baud (ideally with a >= 8 KB RX buffer).
+  bool beginSerialTransport(HardwareSerial &port, uint32_t maxBaud = 2000000);
+#endif
+
+#if FWDL_ENABLE_MULTICAST
+  // UDP multicast distribution. The sender streams a local partition to a
+  // group in sequence-numbered blocks and repeats passes for blocks that
+  // receivers NACK; receivers write blocks straight into OTA (or the DATA
+  // partition named by label), verify the SHA-256 and optionally activate.
+  // Without a label the sender's hint can only choose an OTA app slot.
+  bool beginMulticastSend(const char* label, uint32_t kbytesPerSec = 400,
+                          IPAddress group = IPAddress(239, 255, 70, 68), uint16_t port = 5768);
+  bool beginMulticastReceive(const char* label = nullptr, bool activate = false,
+                             IPAddress group = IPAddress(239, 255, 70, 68), uint16_t port = 5768);
+#endif
+
+  // Flash write generations. The library bumps a per-partition counter after
+  // every write it performs; call notifyFlashWrite() from application write
+  // paths (NVS commit, filesystem flush), after the write has completed, so
+  // cached hashes stay exact.
+  static void notifyFlashWrite(uint32_t address, uint32_t length);
+  static uint32_t getWriteGeneration(const char* label);
+
+#if FWDL_ENABLE_HASHING
+  // Optional persistent hash store in a DATA partition (default "fwdl_meta",
+  // at least two sectors). Keeps per-sector CRC-32 tables, partition SHA-256s
+  // and generations across reboots so /hash and /sectorcrc answer at once.
+  bool beginMetaStore(const char* label = "fwdl_meta");
+#endif
+
 private:
   const char* _endpoint;
   String _firmwareFilename;
   uint32_t _blankOffset;
   uint32_t _blankLength;
 
-  // Support for multiple blank regions.
-  static const int MAX_BLANK_REGIONS = 4;
-  struct BlankRegion {
-    uint32_t offset;
-    uint32_t length;
-    const char* description;
-  };
-  static BlankRegion _blankRegions[MAX_BLANK_REGIONS];
-  static int _numBlankRegions;
+  // Blank and protected regions live in the C engine (fwdl.h).
+  static const char* rangeDenied(uint32_t offset, uint32_t length);
 
   // Single-instance pointer.
   static ESP32FirmwareDownloader* _instance;
 
-  // Callback functions for streaming.
-  static size_t flashStreamCallback(uint8_t *buffer, size_t maxLen, size_t index);
-  static size_t flashStreamCallbackBlanked(uint8_t *buffer, size_t maxLen, size_t index);
-  static size_t genericPartStreamCallback(uint8_t *buffer, size_t maxLen, size_t index);
+  // A flash region to stream. Every transport (HTTP, raw TCP) reads through
+  // readSource() so blanking and progress logging behave the same everywhere.
+  struct FlashSource {
+    uint32_t start;        // absolute flash address
+    uint32_t length;
+    bool blanked;          // apply blank regions (secure dump)
+    std::shared_ptr<NormalizePlan> normalize;  // canonicalize volatile structures, null when off
+    const char* tag;       // log prefix
+    uint32_t lastPrinted;
+  };
+  static FlashSource makeSource(uint32_t start, uint32_t length, bool blanked, const char* tag);
+  static size_t readSource(FlashSource &src, uint8_t *buffer, size_t maxLen, size_t index);
+  static uint8_t resolveSource(uint8_t mode, uint32_t offset, uint32_t length, const char* label,
+                               const char* tag, FlashSource &out);
+
+  // Session tracking for streaming responses.
+  // sourceProgress reports flash bytes consumed for encoded stages whose
+  // output length differs from totalLen; the watchdog measures that.
+  static AsyncWebServerResponse* beginTrackedResponse(AsyncWebServerRequest *request, const char* tag,
+                                                     size_t totalLen, AwsResponseFiller filler,
+                                                     std::function<size_t()> sourceProgress = nullptr);
+  static AsyncWebServerResponse* beginSourceResponse(AsyncWebServerRequest *request, const FlashSource &src);
+
+  // Consistent dumps: image followed by patch blocks for sectors that changed mid-stream.
+  struct ConsistentDump;
+  static AsyncWebServerResponse* beginConsistentResponse(AsyncWebServerRequest *request, const FlashSource &src);
+  static size_t consistentFill(ConsistentDump &d, uint8_t *buffer, size_t maxLen, size_t index);
+  static bool consistentRehash(ConsistentDump &d);
+
+  // Adaptive block compression (?encoding=adaptive).
+  struct AdaptiveStream;
+  static AsyncWebServerResponse* beginAdaptiveResponse(AsyncWebServerRequest *request, const FlashSource &src);
+  static size_t adaptiveFill(AdaptiveStream &a, uint8_t *buffer, size_t maxLen, size_t index);
+  // UF2 / Intel HEX export (?format=).
+  struct ExportStream;
+  static AsyncWebServerResponse* beginExportResponse(AsyncWebServerRequest *request, const FlashSource &src,
+                                                     uint8_t format);
+  static size_t exportFill(ExportStream &e, uint8_t *buffer, size_t maxLen, size_t index);
+  // Dedup archives (?encoding=dedup, /archive).
+  struct DedupStream;
+  static AsyncWebServerResponse* beginDedupResponse(AsyncWebServerRequest *request, const FlashSource &src);
+  static size_t dedupFill(DedupStream &d, uint8_t *buffer, size_t maxLen, size_t index);
+  static int32_t dedupFind(DedupStream &d, uint32_t crc);
+  static AsyncWebServerResponse* beginDumpResponse(AsyncWebServerRequest *request, const FlashSource &src,
+                                                   bool dedup = false);
+
+#if FWDL_ENABLE_RAW_TCP
+  // Raw TCP dump server.
+  struct RawConn;
+  static AsyncServer* _rawServer;
+  static void handleRawClient(void* arg, AsyncClient* client);
+  static void rawHandleRequest(RawConn* conn);
+  static void rawPump(RawConn* conn);
+#endif
+
+#if FWDL_ENABLE_SERIAL
+  // Serial transport.
+  struct SerialLink;
+  static SerialLink* _serialLink;
+  static void serialTask(void* arg);
+  static void serialDispatch(SerialLink* link, uint8_t type, uint16_t seq, const uint8_t *payload, size_t len);
+  static void serialPumpRead(SerialLink* link);
+#endif
+
+#if FWDL_ENABLE_WEBSOCKET
+  // WebSocket transport (/fwdl/ws).
+  struct WsConn;
+  static const int MAX_WS_CONNS = 2;
+  static AsyncWebSocket* _ws;
+  static WsConn* _wsConns[MAX_WS_CONNS];
+  static void handleWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+                            void *arg, uint8_t *data, size_t len);
+  static void wsHandleText(WsConn* conn, AsyncWebSocketClient *client, const char* msg);
+  static void wsHandleBinary(WsConn* conn, AsyncWebSocketClient *client, const uint8_t *data, size_t len);
+  static void wsPump(WsConn* conn, AsyncWebSocketClient *client);
+  static void wsEndRead(WsConn* conn);
+#endif
+
+#if FWDL_ENABLE_MULTICAST
+  // Multicast sender task (reads through readSource()).
+  static bool mcastSendJob(void* arg);
+#endif
 
   // HTTP endpoint handlers.
   static void handleDumpFlash(AsyncWebServerRequest *request);
@@ -59,6 +194,33 @@ private:
   static void handleListPartitions(AsyncWebServerRequest *request);
   static void handleRoot(AsyncWebServerRequest *request);
   static void handleHexDump(AsyncWebServerRequest *request);
+  static void handleStreamStats(AsyncWebServerRequest *request);
+  static void handlePullClone(AsyncWebServerRequest *request);
+  static void handlePullCloneStatus(AsyncWebServerRequest *request);
+  static void handleMulticastSend(AsyncWebServerRequest *request);
+  static void handleMulticastStatus(AsyncWebServerRequest *request);
+  static void handleSnapshot(AsyncWebServerRequest *request);
+  static void handleSnapshotStatus(AsyncWebServerRequest *request);
+  static void handleHash(AsyncWebServerRequest *request);
+  static void handleJobs(AsyncWebServerRequest *request);
+  static void handleJobsBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+  static void handleJobsStatus(AsyncWebServerRequest *request);
+  static void handleJobList(AsyncWebServerRequest *request);
+  static void handleJobCancel(AsyncWebServerRequest *request);
+  static void handleMeta(AsyncWebServerRequest *request);
+  static void handleSectorCrc(AsyncWebServerRequest *request);
+  static void handleWear(AsyncWebServerRequest *request);
+  static void handleCoreDump(AsyncWebServerRequest *request);
+  static void handleCoreDumpErase(AsyncWebServerRequest *request);
+  static void handleRamDump(AsyncWebServerRequest *request);
+  static void handleDumpRange(AsyncWebServerRequest *request);
+  static void handleArchive(AsyncWebServerRequest *request);
+  static void handleArchiveBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+
+  // Multi-range responses (multipart/byteranges) for /dumprange.
+  struct MultiRange;
+  static void sendMultiRange(AsyncWebServerRequest *request, uint32_t base, uint32_t limit);
+  static size_t multiRangeFill(MultiRange &m, uint8_t *buffer, size_t maxLen);
   static void handleUploadBinary(AsyncWebServerRequest *request,
                                  const String &filename,
                                  size_t index,
@@ -0,0 +1,81 @@
+#ifndef FIRMWAREDOWNLOADERCONFIG_H
+#define FIRMWAREDOWNLOADERCONFIG_H
+#pragma once
+
+// Compile-time feature selection. Each FWDL_ENABLE_* defaults to 1; set it to
+// 0 (build flag, e.g. -DFWDL_ENABLE_UI=0, or by editing this file) to leave
+// the feature out of the build entirely: its code, tables, buffers and
+// includes are not compiled, its routes are not registered, and its public
+// methods are not declared. Query options of a disabled feature (e.g.
+// ?encoding=adaptive) answer 501.
+//
+// -DFWDL_MINIMAL flips every default to 0, leaving the plain dump endpoints
+// (/dumpflash, /dumpflash_secure, /downloaddirect, /downloadboot, /dumprange),
+// /partitions, /jobs and /fwdl/stats. Features can then be turned back on one
+// by one.
+//
+// The C engine (fwdl.h) and FirmwareDownloaderCore are always built.
+
+#ifdef FWDL_MINIMAL
+  #define FWDL_FEATURE_DEFAULT 0
+#else
+  #define FWDL_FEATURE_DEFAULT 1
+#endif
+
+// The /FWDL page.
+#ifndef FWDL_ENABLE_UI
+  #define FWDL_ENABLE_UI FWDL_FEATURE_DEFAULT
+#endif
+
+// Flash writes over HTTP (/upload, /activate, /clone, /snapshot) and the
+// upload operations of the serial and WebSocket transports, and batch write
+// steps (snapshot, pull, clone, activate).
+#ifndef FWDL_ENABLE_UPLOAD
+  #define FWDL_ENABLE_UPLOAD FWDL_FEATURE_DEFAULT
+#endif
+
+// Transports.
+#ifndef FWDL_ENABLE_RAW_TCP
+  #define FWDL_ENABLE_RAW_TCP FWDL_FEATURE_DEFAULT      // beginRawServer()
+#endif
+#ifndef FWDL_ENABLE_SERIAL
+  #define FWDL_ENABLE_SERIAL FWDL_FEATURE_DEFAULT       // beginSerialTransport()
+#endif
+#ifndef FWDL_ENABLE_WEBSOCKET
+  #define FWDL_ENABLE_WEBSOCKET FWDL_FEATURE_DEFAULT    // /fwdl/ws
+#endif
+#ifndef FWDL_ENABLE_MULTICAST
+  #define FWDL_ENABLE_MULTICAST FWDL_FEATURE_DEFAULT    // beginMulticastSend/Receive(), /mcast/*
+#endif
+#ifndef FWDL_ENABLE_PULLCLONE
+  #define FWDL_ENABLE_PULLCLONE FWDL_FEATURE_DEFAULT    // /pullclone (HTTPClient)
+#endif
+
+// Formats and compression.
+#ifndef FWDL_ENABLE_COMPRESSION
+  #define FWDL_ENABLE_COMPRESSION FWDL_FEATURE_DEFAULT  // ?encoding=adaptive
+#endif
+#ifndef FWDL_ENABLE_EXPORT
+  #define FWDL_ENABLE_EXPORT FWDL_FEATURE_DEFAULT       // ?format=uf2|ihex
+#endif
+#ifndef FWDL_ENABLE_DEDUP
+  #define FWDL_ENABLE_DEDUP FWDL_FEATURE_DEFAULT        // ?encoding=dedup, /archive
+#endif
+
+// /hash, /sectorcrc, /meta, beginMetaStore() and ETags on downloads. The hash
+// cache itself stays wherever another enabled feature hashes flash.
+#ifndef FWDL_ENABLE_HASHING
+  #define FWDL_ENABLE_HASHING FWDL_FEATURE_DEFAULT
+#endif
+
+// /coredump, /ramdump (enableRamDump()) and /wear. Erase counting continues.
+#ifndef FWDL_ENABLE_DIAGNOSTICS
+  #define FWDL_ENABLE_DIAGNOSTICS FWDL_FEATURE_DEFAULT
+#endif
+
+// POST /jobs batches.
+#ifndef FWDL_ENABLE_BATCH
+  #define FWDL_ENABLE_BATCH FWDL_FEATURE_DEFAULT
+#endif
+
+#endif
@@ -0,0 +1,1097 @@
+// FirmwareDownloaderCore: the state and operations every front end shares,
+// without Arduino or web server types; see FirmwareDownloaderCore.h. Front
+// ends that run a request on their own task (esp_http_server) loop over
+// readStream()/writeUpload(); the AsyncWebServer front end and its binary
+// transports call the lower-level session, sink and job functions.
+
+#include "FirmwareDownloaderCore.h"
+#include "FirmwareDownloaderConfig.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"      // esp_restart()
+#include "esp_timer.h"       // Session watchdog timer, millisecond clock
+#include <esp_task_wdt.h>    // esp_task_wdt_reset()
+#include "nvs.h"             // Wear counters and job history
+
+typedef FirmwareDownloaderCore Core;
+
+static const char* TAG_SESSION = "FWDL-session";
+static const char* TAG_WEAR    = "FWDL-wear";
+static const char* TAG_JOB     = "FWDL-job";
+
+static const uint32_t SECTOR_SIZE        = FWDL_SECTOR_SIZE;
+static const uint32_t PROGRESS_LOG_BYTES = 10 * FWDL_SECTOR_SIZE;
+static const char*    FWDL_NVS_NAMESPACE = "fwdl";   // wear counters and the job history
+
+static uint32_t nowMs() {
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+//////////////////////////////
+// Write Generations
+//////////////////////////////
+// Bumped by the library's own writers (upload sink, copy, OTA selection) and
+// by the application through ESP32FirmwareDownloader::notifyFlashWrite().
+
+static const int MAX_GEN_PARTITIONS = 24;
+
+struct PartitionGen {
+  uint32_t address;
+  uint32_t size;
+  uint32_t gen;
+};
+
+static PartitionGen g_partGens[MAX_GEN_PARTITIONS];
+static int g_numPartGens = -1;          // -1 until the partition table is scanned
+static uint32_t g_flashGen = 1;         // bumped by every write anywhere
+static portMUX_TYPE g_genMux = portMUX_INITIALIZER_UNLOCKED;
+static Core::GenerationListener g_genListener = nullptr;   // persistent store, woken on every bump
+
+static void initGenerations() {
+  if (g_numPartGens >= 0) return;
+  PartitionGen found[MAX_GEN_PARTITIONS];
+  int count = 0;
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL && count < MAX_GEN_PARTITIONS) {
+    const esp_partition_t *p = esp_partition_get(it);
+    found[count].address = p->address;
+    found[count].size = p->size;
+    found[count].gen = 1;
+    count++;
+    it = esp_partition_next(it);
+  }
+  if (it) esp_partition_iterator_release(it);
+  portENTER_CRITICAL(&g_genMux);
+  if (g_numPartGens < 0) {
+    memcpy(g_partGens, found, sizeof(PartitionGen) * count);
+    g_numPartGens = count;
+  }
+  portEXIT_CRITICAL(&g_genMux);
+}
+
+void FirmwareDownloaderCore::bumpGeneration(uint32_t address, uint32_t length, bool notifyStore) {
+  initGenerations();
+  portENTER_CRITICAL(&g_genMux);
+  g_flashGen++;
+  for (int i = 0; i < g_numPartGens; i++) {
+    PartitionGen &g = g_partGens[i];
+    if (address < g.address + g.size && g.address < address + length) g.gen++;
+  }
+  portEXIT_CRITICAL(&g_genMux);
+  if (notifyStore && g_genListener) g_genListener();
+}
+
+void FirmwareDownloaderCore::bumpPartition(const esp_partition_t* part) {
+  if (part) bumpGeneration(part->address, part->size);
+}
+
+uint32_t FirmwareDownloaderCore::generationAt(uint32_t address) {
+  initGenerations();
+  uint32_t gen = 0;
+  portENTER_CRITICAL(&g_genMux);
+  for (int i = 0; i < g_numPartGens; i++) {
+    if (g_partGens[i].address == address) {
+      gen = g_partGens[i].gen;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&g_genMux);
+  return gen;
+}
+
+uint32_t FirmwareDownloaderCore::generationFor(uint32_t address, uint32_t length) {
+  initGenerations();
+  uint32_t gen = 0;
+  portENTER_CRITICAL(&g_genMux);
+  gen = g_flashGen;
+  for (int i = 0; i < g_numPartGens; i++) {
+    const PartitionGen &g = g_partGens[i];
+    if (address >= g.address && address + length <= g.address + g.size) {
+      gen = g.gen;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&g_genMux);
+  return gen;
+}
+
+void FirmwareDownloaderCore::seedGeneration(uint32_t address, uint32_t gen) {
+  initGenerations();
+  portENTER_CRITICAL(&g_genMux);
+  for (int i = 0; i < g_numPartGens; i++) {
+    if (g_partGens[i].address == address) g_partGens[i].gen = gen;
+  }
+  portEXIT_CRITICAL(&g_genMux);
+}
+
+void FirmwareDownloaderCore::setGenerationListener(GenerationListener listener) {
+  g_genListener = listener;
+}
+
+// Our own NVS bookkeeping (wear counters, job history): invalidate cached NVS
+// hashes without queuing a store rebuild.
+static void bumpNvsGeneration() {
+  const esp_partition_t* nvs = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS,
+                                                        NULL);
+  if (nvs) Core::bumpGeneration(nvs->address, nvs->size, false);
+}
+
+//////////////////////////////
+// Wear Accounting
+//////////////////////////////
+// One 16-bit erase counter per flash sector, bumped by every erase the
+// library issues: the upload sink (the whole target partition), the copy
+// routine (only sectors that can't be programmed over) and hash store commits.
+// Erases done inside ESP-IDF (otadata, NVS) and by the application are not
+// seen. Counters are kept in RAM and written to NVS (namespace "fwdl", key
+// "wear") as runs of equal counts, at most once per WEAR_FLUSH_MS, and before
+// the library reboots. Erases in that window are lost on an unplanned reset.
+
+static const uint32_t WEAR_FLUSH_MS  = 60000;
+static const size_t   WEAR_MAX_RUNS  = 1024;     // 6 KB blob
+static const size_t   WEAR_RUN_SIZE  = 6;        // first sector u16 | sectors u16 | count u16
+
+static uint16_t* g_wear = nullptr;            // per-sector erase counts
+static uint32_t g_wearSectors = 0;
+static bool g_wearDirty = false;
+static uint32_t g_wearFlushedMs = 0;
+static uint32_t g_wearErases = 0;             // sector erases recorded since boot
+static portMUX_TYPE g_wearMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t g_wearFlushLock = nullptr;   // one NVS write at a time; set with g_wear
+
+// Allocate the table and load the persisted counts; false without memory.
+static bool wearInit() {
+  if (g_wear) return true;
+  uint32_t sectors = fwdl_flash_size() / SECTOR_SIZE;
+  uint16_t *table = (uint16_t*)calloc(sectors, sizeof(uint16_t));
+  SemaphoreHandle_t flushLock = table ? xSemaphoreCreateMutex() : nullptr;
+  if (!flushLock) {
+    free(table);
+    return false;
+  }
+  nvs_handle_t handle;
+  if (nvs_open(FWDL_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+    size_t len = 0;
+    uint8_t *runs = nullptr;
+    if (nvs_get_blob(handle, "wear", nullptr, &len) == ESP_OK && len) runs = (uint8_t*)malloc(len);
+    if (runs && nvs_get_blob(handle, "wear", runs, &len) == ESP_OK) {
+      for (size_t off = 0; off + WEAR_RUN_SIZE <= len; off += WEAR_RUN_SIZE) {
+        uint32_t first = runs[off] | (runs[off + 1] << 8);
+        uint32_t count = runs[off + 2] | (runs[off + 3] << 8);
+        uint16_t value = runs[off + 4] | (runs[off + 5] << 8);
+        for (uint32_t s = first; s < first + count && s < sectors; s++) table[s] = value;
+      }
+      ESP_LOGI(TAG_WEAR, "Restored %u runs.", (unsigned)(len / WEAR_RUN_SIZE));
+    }
+    free(runs);
+    nvs_close(handle);
+  }
+  portENTER_CRITICAL(&g_wearMux);
+  if (!g_wear) {
+    g_wearFlushLock = flushLock;
+    g_wear = table;
+    g_wearSectors = sectors;
+    table = nullptr;
+    flushLock = nullptr;
+  }
+  portEXIT_CRITICAL(&g_wearMux);
+  free(table);
+  if (flushLock) vSemaphoreDelete(flushLock);
+  return true;
+}
+
+void FirmwareDownloaderCore::wearRecord(uint32_t address, uint32_t length) {
+  if (!length || !wearInit()) return;
+  uint32_t first = address / SECTOR_SIZE;
+  uint32_t last = (address + length - 1) / SECTOR_SIZE;
+  portENTER_CRITICAL(&g_wearMux);
+  for (uint32_t s = first; s <= last && s < g_wearSectors; s++) {
+    if (g_wear[s] != 0xFFFF) g_wear[s]++;
+    g_wearErases++;
+  }
+  g_wearDirty = true;
+  portEXIT_CRITICAL(&g_wearMux);
+}
+
+// Called where a library operation ends and before reboots, from jobs,
+// uploads and the serial and multicast tasks alike, hence g_wearFlushLock.
+void FirmwareDownloaderCore::wearFlush(bool force) {
+  if (!g_wear) return;
+  xSemaphoreTake(g_wearFlushLock, portMAX_DELAY);
+  if (!g_wearDirty || (!force && g_wearFlushedMs && nowMs() - g_wearFlushedMs < WEAR_FLUSH_MS)) {
+    xSemaphoreGive(g_wearFlushLock);
+    return;
+  }
+  uint8_t *runs = (uint8_t*)malloc(WEAR_MAX_RUNS * WEAR_RUN_SIZE);
+  if (!runs) {
+    xSemaphoreGive(g_wearFlushLock);
+    return;
+  }
+  size_t n = 0;
+  portENTER_CRITICAL(&g_wearMux);
+  g_wearDirty = false;
+  for (uint32_t s = 0; s < g_wearSectors;) {
+    uint32_t end = s + 1;
+    uint16_t value = g_wear[s];
+    while (end < g_wearSectors && end - s < 0xFFFF && g_wear[end] == value) end++;
+    // Out of runs: the last one covers the rest at its highest count, so
+    // fragmented tables over-report rather than lose erases.
+    if (n == WEAR_MAX_RUNS - 1) {
+      for (end = s; end < g_wearSectors; end++) if (g_wear[end] > value) value = g_wear[end];
+    }
+    if (value) {
+      uint8_t *r = runs + n * WEAR_RUN_SIZE;
+      r[0] = s & 0xFF; r[1] = s >> 8;
+      r[2] = (end - s) & 0xFF; r[3] = (end - s) >> 8;
+      r[4] = value & 0xFF; r[5] = value >> 8;
+      n++;
+    }
+    s = end;
+  }
+  portEXIT_CRITICAL(&g_wearMux);
+
+  nvs_handle_t handle;
+  if (nvs_open(FWDL_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+    if (nvs_set_blob(handle, "wear", runs, n * WEAR_RUN_SIZE) == ESP_OK) nvs_commit(handle);
+    nvs_close(handle);
+    bumpNvsGeneration();
+    ESP_LOGI(TAG_WEAR, "Persisted %u runs.", (unsigned)n);
+  } else {
+    portENTER_CRITICAL(&g_wearMux);
+    g_wearDirty = true;
+    portEXIT_CRITICAL(&g_wearMux);
+  }
+  g_wearFlushedMs = nowMs();
+  xSemaphoreGive(g_wearFlushLock);
+  free(runs);
+}
+
+bool FirmwareDownloaderCore::wearInfo(WearInfo &out) {
+  if (!wearInit()) return false;
+  portENTER_CRITICAL(&g_wearMux);
+  out.counts = g_wear;
+  out.sectors = g_wearSectors;
+  out.sinceBoot = g_wearErases;
+  out.pending = g_wearDirty;
+  portEXIT_CRITICAL(&g_wearMux);
+  return true;
+}
+
+//////////////////////////////
+// Job Scheduler
+//////////////////////////////
+// Long flash operations (clone, snapshot, pull, multicast send, batches, hash
+// store rebuilds) run as jobs. A bounded table holds queued, running and
+// recently finished jobs. Up to JOB_WORKERS worker tasks take queued jobs,
+// highest priority first and in submission order within a priority. Workers
+// are created on demand and exit when the queue is empty. A job function runs
+// on a worker and reports through currentJob(). Copy, hash and transfer loops
+// poll jobCancelled(), so a cancel takes effect at the next sector. Job
+// outcomes are persisted to NVS: the result of a job that ended in a reboot
+// stays visible, and a job cut short by a reset shows as interrupted.
+
+static const int      MAX_QUEUED_JOBS = 6;
+static const int      JOB_WORKERS     = 2;
+static const uint32_t JOB_STACK_SIZE  = 8192;   // pull (HTTP client) is the deepest
+
+typedef Core::Job Job;
+
+// NVS image of a job.
+struct JobRecord {
+  uint32_t id;
+  uint8_t state;
+  uint8_t priority;
+  uint16_t reserved;
+  uint32_t done;
+  uint32_t total;
+  uint32_t elapsedMs;
+  char name[16];
+  char message[64];
+};
+
+static Job g_jobs[Core::MAX_JOBS];
+static SemaphoreHandle_t g_jobLock = nullptr;
+static uint32_t g_nextJobId = 1;
+static int g_jobWorkers = 0;
+static TaskHandle_t g_workerTasks[JOB_WORKERS];
+static Job* g_workerJobs[JOB_WORKERS];
+
+static bool jobFinished(const Job &job) {
+  return job.id && job.state >= Core::JOB_DONE;
+}
+
+static uint32_t jobElapsed(const Job &job) {
+  if (job.state == Core::JOB_QUEUED) return 0;
+  return (job.state == Core::JOB_RUNNING ? nowMs() : job.endMs) - job.startMs;
+}
+
+// Write every persistent job to NVS. Called by workers outside the lock.
+static void jobsPersist() {
+  JobRecord *records = (JobRecord*)calloc(Core::MAX_JOBS, sizeof(JobRecord));
+  if (!records) return;
+  int n = 0;
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  for (int i = 0; i < Core::MAX_JOBS; i++) {
+    const Job &job = g_jobs[i];
+    if (!job.id || !job.persist || job.state == Core::JOB_QUEUED) continue;
+    JobRecord &r = records[n++];
+    r.id = job.id;
+    r.state = job.state;
+    r.priority = job.priority;
+    r.done = job.done;
+    r.total = job.total;
+    r.elapsedMs = jobElapsed(job);
+    strncpy(r.name, job.name, sizeof(r.name) - 1);
+    strncpy(r.message, job.message, sizeof(r.message) - 1);
+  }
+  xSemaphoreGive(g_jobLock);
+
+  nvs_handle_t handle;
+  if (nvs_open(FWDL_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+    if (nvs_set_blob(handle, "jobs", records, n * sizeof(JobRecord)) == ESP_OK) nvs_commit(handle);
+    nvs_close(handle);
+    bumpNvsGeneration();
+  }
+  free(records);
+}
+
+// Create the lock and restore the persisted history; safe to call repeatedly.
+static void jobsInit() {
+  if (g_jobLock) return;
+  g_jobLock = xSemaphoreCreateMutex();
+  JobRecord *records = (JobRecord*)calloc(Core::MAX_JOBS, sizeof(JobRecord));
+  nvs_handle_t handle;
+  size_t len = Core::MAX_JOBS * sizeof(JobRecord);
+  if (records && nvs_open(FWDL_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+    if (nvs_get_blob(handle, "jobs", records, &len) != ESP_OK) len = 0;
+    nvs_close(handle);
+    for (size_t i = 0; i < len / sizeof(JobRecord); i++) {
+      const JobRecord &r = records[i];
+      Job &job = g_jobs[i];
+      memset(&job, 0, sizeof(job));
+      job.id = r.id;
+      // Anything that was still running when we went down did not finish.
+      bool unfinished = r.state == Core::JOB_RUNNING || r.state == Core::JOB_QUEUED;
+      job.state = unfinished ? (uint8_t)Core::JOB_INTERRUPTED : r.state;
+      job.priority = r.priority;
+      job.persist = true;
+      job.done = r.done;
+      job.total = r.total;
+      job.endMs = r.elapsedMs;   // startMs 0: elapsed survives the reboot
+      memcpy(job.name, r.name, sizeof(r.name));
+      job.name[sizeof(job.name) - 1] = '\0';
+      memcpy(job.message, r.message, sizeof(r.message));
+      job.message[sizeof(r.message) - 1] = '\0';
+      if (r.id >= g_nextJobId) g_nextJobId = r.id + 1;
+    }
+    if (len) ESP_LOGI(TAG_JOB, "Restored %u job records.", (unsigned)(len / sizeof(JobRecord)));
+  }
+  free(records);
+}
+
+Job* FirmwareDownloaderCore::currentJob() {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (int i = 0; i < JOB_WORKERS; i++) {
+    if (g_workerTasks[i] == self) return g_workerJobs[i];
+  }
+  return nullptr;
+}
+
+bool FirmwareDownloaderCore::jobCancelled() {
+  Job* job = currentJob();
+  return job && job->cancel;
+}
+
+void FirmwareDownloaderCore::jobMessage(const char* fmt, ...) {
+  Job* job = currentJob();
+  if (!job) return;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(job->message, sizeof(job->message), fmt, args);
+  va_end(args);
+}
+
+// Whether job must wait: a job of the same kind, or for a writer any other
+// writer, is running. Caller holds g_jobLock.
+static bool jobBlocked(const Job &job) {
+  for (int i = 0; i < Core::MAX_JOBS; i++) {
+    const Job &r = g_jobs[i];
+    if (!r.id || r.state != Core::JOB_RUNNING) continue;
+    if (!strcmp(r.name, job.name) || (job.writer && r.writer)) return true;
+  }
+  return false;
+}
+
+static void jobWorker(void* arg) {
+  int slot = (int)(intptr_t)arg;
+  for (;;) {
+    xSemaphoreTake(g_jobLock, portMAX_DELAY);
+    // Jobs of the same kind never run side by side, and neither do two flash
+    // writers (clone, pull and snapshot can target the same slot); the worker
+    // finishing the running one picks up the next.
+    Job* job = nullptr;
+    for (int i = 0; i < Core::MAX_JOBS; i++) {
+      Job &j = g_jobs[i];
+      if (!j.id || j.state != Core::JOB_QUEUED || jobBlocked(j)) continue;
+      if (!job || j.priority > job->priority || (j.priority == job->priority && j.id < job->id)) job = &j;
+    }
+    if (!job) {
+      g_workerTasks[slot] = nullptr;
+      g_jobWorkers--;
+      xSemaphoreGive(g_jobLock);
+      vTaskDelete(NULL);
+      return;
+    }
+    job->state = Core::JOB_RUNNING;
+    job->startMs = nowMs();
+    snprintf(job->message, sizeof(job->message), "running");
+    g_workerJobs[slot] = job;
+    // A running job keeps its slot, but listings, submitJob() and the other
+    // workers touch it under the lock, so log from copies.
+    uint32_t id = job->id;
+    bool persist = job->persist;
+    char name[sizeof(job->name)];
+    memcpy(name, job->name, sizeof(name));
+    Core::JobFn run = job->run;
+    void* runArg = job->arg;
+    Core::JobDispose dispose = job->dispose;
+    xSemaphoreGive(g_jobLock);
+    if (persist) jobsPersist();
+
+    ESP_LOGI(TAG_JOB, "#%u %s started.", (unsigned)id, name);
+    bool ok = run(runArg);
+    if (dispose) dispose(runArg);
+
+    xSemaphoreTake(g_jobLock, portMAX_DELAY);
+    job->state = job->cancel ? Core::JOB_CANCELLED : (ok ? Core::JOB_DONE : Core::JOB_FAILED);
+    job->endMs = nowMs();
+    job->run = nullptr;
+    job->arg = nullptr;
+    g_workerJobs[slot] = nullptr;
+    bool reboot = ok && !job->cancel && job->rebootAfter;
+    uint8_t state = job->state;
+    uint32_t elapsed = job->endMs - job->startMs;
+    char message[sizeof(job->message)];
+    memcpy(message, job->message, sizeof(message));
+    xSemaphoreGive(g_jobLock);
+    ESP_LOGI(TAG_JOB, "#%u %s %s in %u ms: %s", (unsigned)id, name,
+             state == Core::JOB_DONE ? "finished" : (state == Core::JOB_CANCELLED ? "cancelled" : "failed"),
+             (unsigned)elapsed, message);
+    if (persist) {
+      jobsPersist();
+    } else {
+      // Housekeeping jobs free their slot so they never push history out.
+      xSemaphoreTake(g_jobLock, portMAX_DELAY);
+      if (job->id == id) job->id = 0;
+      xSemaphoreGive(g_jobLock);
+    }
+    Core::wearFlush(reboot);
+    if (reboot) {
+      ESP_LOGI(TAG_JOB, "Rebooting...");
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      esp_restart();
+    }
+  }
+}
+
+uint32_t FirmwareDownloaderCore::submitJob(const char* name, uint8_t priority, JobFn run, void* arg,
+                                           JobDispose dispose, bool persist, bool writer) {
+  jobsInit();
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  int queued = 0;
+  Job* slot = nullptr;
+  Job* oldest = nullptr;
+  for (int i = 0; i < MAX_JOBS; i++) {
+    Job &j = g_jobs[i];
+    if (!j.id) {
+      if (!slot) slot = &j;
+      continue;
+    }
+    if (j.state == JOB_QUEUED) queued++;
+    if (jobFinished(j) && (!oldest || j.id < oldest->id)) oldest = &j;
+  }
+  if (!slot) slot = oldest;   // evict the oldest finished job when the table is full
+  if (queued >= MAX_QUEUED_JOBS || !slot) {
+    xSemaphoreGive(g_jobLock);
+    ESP_LOGW(TAG_JOB, "Queue full; %s rejected.", name);
+    return 0;
+  }
+  memset(slot, 0, sizeof(*slot));
+  slot->id = g_nextJobId++;
+  slot->state = JOB_QUEUED;
+  slot->priority = priority;
+  slot->persist = persist;
+  slot->writer = writer;
+  strncpy(slot->name, name, sizeof(slot->name) - 1);
+  snprintf(slot->message, sizeof(slot->message), "queued");
+  slot->run = run;
+  slot->arg = arg;
+  slot->dispose = dispose;
+  uint32_t id = slot->id;
+
+  if (g_jobWorkers < JOB_WORKERS) {
+    for (int w = 0; w < JOB_WORKERS; w++) {
+      if (g_workerTasks[w]) continue;
+      if (xTaskCreate(jobWorker, "fwdl_job", JOB_STACK_SIZE, (void*)(intptr_t)w, 1, &g_workerTasks[w]) == pdPASS) {
+        g_jobWorkers++;
+      } else {
+        g_workerTasks[w] = nullptr;
+        ESP_LOGE(TAG_JOB, "Failed to start a worker.");
+      }
+      break;
+    }
+  }
+  xSemaphoreGive(g_jobLock);
+  return id;
+}
+
+bool FirmwareDownloaderCore::jobActive(const char* name, bool queuedOnly) {
+  jobsInit();
+  bool active = false;
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_JOBS && !active; i++) {
+    const Job &j = g_jobs[i];
+    active = j.id && (j.state == JOB_QUEUED || (!queuedOnly && j.state == JOB_RUNNING)) && !strcmp(j.name, name);
+  }
+  xSemaphoreGive(g_jobLock);
+  return active;
+}
+
+bool FirmwareDownloaderCore::cancelJob(uint32_t id) {
+  jobsInit();
+  JobDispose dispose = nullptr;
+  void* arg = nullptr;
+  bool found = false;
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_JOBS; i++) {
+    Job &j = g_jobs[i];
+    if (j.id != id || jobFinished(j)) continue;
+    found = true;
+    j.cancel = true;
+    if (j.state == JOB_QUEUED) {
+      j.state = JOB_CANCELLED;
+      j.startMs = j.endMs = nowMs();
+      snprintf(j.message, sizeof(j.message), "cancelled before start");
+      dispose = j.dispose;
+      arg = j.arg;
+      j.run = nullptr;
+      j.arg = nullptr;
+    }
+  }
+  xSemaphoreGive(g_jobLock);
+  if (dispose) dispose(arg);
+  return found;
+}
+
+bool FirmwareDownloaderCore::findJob(uint32_t id, const char* name, Job &out) {
+  jobsInit();
+  memset(&out, 0, sizeof(out));
+  out.state = 0xFF;
+  if (name) strncpy(out.name, name, sizeof(out.name) - 1);
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_JOBS; i++) {
+    const Job &j = g_jobs[i];
+    if (!j.id) continue;
+    bool match = id ? j.id == id : (name && !strcmp(j.name, name));
+    if (match && (id || out.state == 0xFF || j.id > out.id)) out = j;
+  }
+  xSemaphoreGive(g_jobLock);
+  return out.state != 0xFF;
+}
+
+int FirmwareDownloaderCore::listJobs(Job *out, int max) {
+  jobsInit();
+  int n = 0;
+  xSemaphoreTake(g_jobLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_JOBS && n < max; i++) {
+    if (g_jobs[i].id) out[n++] = g_jobs[i];
+  }
+  xSemaphoreGive(g_jobLock);
+  for (int i = 1; i < n; i++) {
+    for (int k = i; k > 0 && out[k].id > out[k - 1].id; k--) {
+      Job t = out[k];
+      out[k] = out[k - 1];
+      out[k - 1] = t;
+    }
+  }
+  return n;
+}
+
+int FirmwareDownloaderCore::jobWorkers() {
+  return g_jobWorkers;
+}
+
+const char* FirmwareDownloaderCore::jobStateName(uint8_t state) {
+  switch (state) {
+    case JOB_QUEUED:      return "queued";
+    case JOB_RUNNING:     return "running";
+    case JOB_DONE:        return "done";
+    case JOB_FAILED:      return "failed";
+    case JOB_CANCELLED:   return "cancelled";
+    case JOB_INTERRUPTED: return "interrupted";
+    default:              return "none";
+  }
+}
+
+//////////////////////////////
+// Stream Session Tracking
+//////////////////////////////
+
+static const uint32_t WATCHDOG_INTERVAL_MS   = 1000;
+static const uint32_t WATCHDOG_LOCK_WAIT_MS  = 10;       // esp_timer task: never block on the lock
+
+struct StreamSession {
+  bool inUse;
+  uint32_t id;              // distinguishes reuse of the same slot
+  Core::SessionClose close; // asks the transport to close; null: never closed by the watchdog
+  void* owner;
+  const char* tag;
+  size_t totalLen;
+  size_t bytesSent;         // source bytes consumed; what the watchdog measures
+  size_t wireBytes;         // bytes handed to the socket (encoded streams differ)
+  uint32_t startMs;
+  uint32_t lastActivityMs;  // last time the stream produced data
+  uint32_t tickMs;          // watchdog sample point
+  size_t tickBytes;
+  uint32_t slowSinceMs;     // 0 while at/above the minimum throughput
+  bool terminating;
+};
+
+static StreamSession g_sessions[Core::MAX_SESSIONS];
+static uint32_t g_nextSessionId = 1;
+static SemaphoreHandle_t g_sessionLock = nullptr;
+static esp_timer_handle_t g_watchdogTimer = nullptr;
+static Core::StreamStats g_streamStats = {0, 0, 0, 0, 0, 0, 0};
+
+// Watchdog policy (see setStallPolicy()).
+static uint32_t g_minBytesPerSec = 0;
+static uint32_t g_stallMs        = 10000;
+static uint32_t g_idleTimeoutMs  = 60000;
+
+// Periodic check of every live session. Termination goes through the
+// session's close callback, which for AsyncTCP arms the connection's own
+// rx/ack timeouts so the actual close happens on the task that owns it. The
+// timer task is shared with the rest of the system, so a busy lock skips this
+// tick and logging waits until the lock is released.
+static void sessionWatchdog(void* arg) {
+  (void)arg;
+  if (!g_sessionLock) return;
+  struct Closed {
+    const char* tag;
+    uint32_t id;
+    bool idle;
+    uint32_t forMs;
+    uint32_t rate;
+  } closed[Core::MAX_SESSIONS];
+  int numClosed = 0;
+  uint32_t now = nowMs();
+  if (xSemaphoreTake(g_sessionLock, pdMS_TO_TICKS(WATCHDOG_LOCK_WAIT_MS)) != pdTRUE) return;
+  for (int i = 0; i < Core::MAX_SESSIONS; i++) {
+    StreamSession &s = g_sessions[i];
+    if (!s.inUse || s.terminating || !s.close) continue;
+
+    uint32_t elapsed = now - s.tickMs;
+    uint32_t rate = elapsed ? (uint32_t)(((uint64_t)(s.bytesSent - s.tickBytes) * 1000) / elapsed) : 0;
+    s.tickMs = now;
+    s.tickBytes = s.bytesSent;
+
+    bool terminate = false;
+    if (g_idleTimeoutMs && (now - s.lastActivityMs) >= g_idleTimeoutMs) {
+      closed[numClosed++] = {s.tag, s.id, true, now - s.lastActivityMs, 0};
+      g_streamStats.idle++;
+      terminate = true;
+    } else if (g_minBytesPerSec && s.bytesSent < s.totalLen && rate < g_minBytesPerSec) {
+      if (s.slowSinceMs == 0) {
+        s.slowSinceMs = now;
+      } else if ((now - s.slowSinceMs) >= g_stallMs) {
+        closed[numClosed++] = {s.tag, s.id, false, now - s.slowSinceMs, rate};
+        g_streamStats.stalled++;
+        terminate = true;
+      }
+    } else {
+      s.slowSinceMs = 0;
+    }
+
+    if (terminate) {
+      s.terminating = true;
+      s.close(s.owner);
+    }
+  }
+  xSemaphoreGive(g_sessionLock);
+
+  for (int i = 0; i < numClosed; i++) {
+    const Closed &c = closed[i];
+    if (c.idle) {
+      ESP_LOGW(TAG_SESSION, "%s #%u idle for %u ms; closing.", c.tag, (unsigned)c.id, (unsigned)c.forMs);
+    } else {
+      ESP_LOGW(TAG_SESSION, "%s #%u below %u B/s for %u ms (now %u B/s); closing.", c.tag, (unsigned)c.id,
+               (unsigned)g_minBytesPerSec, (unsigned)c.forMs, (unsigned)c.rate);
+    }
+  }
+}
+
+static void ensureSessionWatchdog() {
+  if (!g_sessionLock) {
+    g_sessionLock = xSemaphoreCreateMutex();
+  }
+  if (!g_watchdogTimer) {
+    esp_timer_create_args_t args = {};
+    args.callback = &sessionWatchdog;
+    args.name = "fwdl_wdog";
+    if (esp_timer_create(&args, &g_watchdogTimer) == ESP_OK) {
+      esp_timer_start_periodic(g_watchdogTimer, WATCHDOG_INTERVAL_MS * 1000ULL);
+    } else {
+      ESP_LOGE(TAG_SESSION, "Failed to create session watchdog timer.");
+      g_watchdogTimer = nullptr;
+    }
+  }
+}
+
+int FirmwareDownloaderCore::acquireSession(const char* tag, size_t totalLen, uint32_t *idOut, SessionClose close,
+                                           void* owner) {
+  ensureSessionWatchdog();
+  int slot = -1;
+  xSemaphoreTake(g_sessionLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (!g_sessions[i].inUse) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot >= 0) {
+    StreamSession &s = g_sessions[slot];
+    uint32_t now = nowMs();
+    s.inUse = true;
+    s.id = g_nextSessionId++;
+    s.close = close;
+    s.owner = owner;
+    s.tag = tag;
+    s.totalLen = totalLen;
+    s.bytesSent = 0;
+    s.wireBytes = 0;
+    s.startMs = now;
+    s.lastActivityMs = now;
+    s.tickMs = now;
+    s.tickBytes = 0;
+    s.slowSinceMs = 0;
+    s.terminating = false;
+    *idOut = s.id;
+    g_streamStats.started++;
+  } else {
+    g_streamStats.rejected++;
+  }
+  xSemaphoreGive(g_sessionLock);
+  if (slot < 0) ESP_LOGW(TAG_SESSION, "Rejecting %s: all %d session slots busy.", tag, MAX_SESSIONS);
+  return slot;
+}
+
+void FirmwareDownloaderCore::releaseSession(int slot, uint32_t id) {
+  xSemaphoreTake(g_sessionLock, portMAX_DELAY);
+  StreamSession &s = g_sessions[slot];
+  if (s.inUse && s.id == id) {
+    if (!s.terminating && s.bytesSent >= s.totalLen) {
+      g_streamStats.completed++;
+    }
+    g_streamStats.sourceBytes += s.bytesSent;
+    g_streamStats.wireBytes += s.wireBytes;
+    ESP_LOGI(TAG_SESSION, "%s #%u closed after %u/%u bytes (%u on the wire) in %u ms", s.tag, (unsigned)s.id,
+             (unsigned)s.bytesSent, (unsigned)s.totalLen, (unsigned)s.wireBytes, (unsigned)(nowMs() - s.startMs));
+    s.inUse = false;
+    s.close = nullptr;
+    s.owner = nullptr;
+  }
+  xSemaphoreGive(g_sessionLock);
+}
+
+void FirmwareDownloaderCore::noteSessionProgress(int slot, uint32_t id, size_t sourceBytes, size_t wireBytes) {
+  xSemaphoreTake(g_sessionLock, portMAX_DELAY);
+  StreamSession &s = g_sessions[slot];
+  if (s.inUse && s.id == id) {
+    if (wireBytes > s.wireBytes) {
+      s.wireBytes = wireBytes;
+      s.lastActivityMs = nowMs();
+    }
+    if (sourceBytes > s.bytesSent) s.bytesSent = sourceBytes;
+  }
+  xSemaphoreGive(g_sessionLock);
+}
+
+void FirmwareDownloaderCore::setStallPolicy(uint32_t minBytesPerSec, uint32_t stallSeconds,
+                                            uint32_t idleTimeoutSeconds) {
+  g_minBytesPerSec = minBytesPerSec;
+  g_stallMs = stallSeconds * 1000;
+  g_idleTimeoutMs = idleTimeoutSeconds * 1000;
+  ESP_LOGI(TAG_SESSION, "Stall policy: min %u B/s for %u s, idle timeout %u s", (unsigned)minBytesPerSec,
+           (unsigned)stallSeconds, (unsigned)idleTimeoutSeconds);
+}
+
+Core::StallPolicy FirmwareDownloaderCore::stallPolicy() {
+  StallPolicy policy = {g_minBytesPerSec, g_stallMs, g_idleTimeoutMs};
+  return policy;
+}
+
+Core::StreamStats FirmwareDownloaderCore::streamStats() {
+  StreamStats copy;
+  if (g_sessionLock) xSemaphoreTake(g_sessionLock, portMAX_DELAY);
+  copy = g_streamStats;
+  if (g_sessionLock) xSemaphoreGive(g_sessionLock);
+  return copy;
+}
+
+int FirmwareDownloaderCore::activeSessions() {
+  int active = 0;
+  if (g_sessionLock) xSemaphoreTake(g_sessionLock, portMAX_DELAY);
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (g_sessions[i].inUse) active++;
+  }
+  if (g_sessionLock) xSemaphoreGive(g_sessionLock);
+  return active;
+}
+
+//////////////////////////////
+// Upload Sink
+//////////////////////////////
+// Sequential writer into an APP (via OTA) or DATA (erase + write) partition.
+// Shared by the HTTP upload handler, the binary transports and the httpd
+// adapter.
+
+#if FWDL_ENABLE_UPLOAD || FWDL_ENABLE_MULTICAST || FWDL_ENABLE_PULLCLONE
+static const char* TAG_UPLOAD = "FWDL-upload";
+
+// The engine reports each erase and write once it has returned, so a hash
+// that overlapped it is stored under an outdated generation.
+static void onEngineFlash(uint32_t address, uint32_t length, bool erase) {
+  Core::bumpGeneration(address, length);
+  if (erase) Core::wearRecord(address, length);
+}
+
+esp_err_t FirmwareDownloaderCore::uploadBegin(Upload &u, const esp_partition_t* target) {
+  fwdl_set_flash_hook(onEngineFlash);
+  bool app = target->type == ESP_PARTITION_TYPE_APP;
+  esp_err_t err = fwdl_upload_begin(&u, target);
+  if (err == ESP_ERR_INVALID_ARG) {
+    ESP_LOGW(TAG_UPLOAD, "Cannot update active partition '%s'.", target->label);
+  } else if (err != ESP_OK) {
+    ESP_LOGE(TAG_UPLOAD, "%s failed: %s", app ? "esp_ota_begin" : "Erase", esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG_UPLOAD, "%s partition '%s' (size: %u bytes).", app ? "OTA update begun for" : "Erased DATA",
+             target->label, (unsigned)target->size);
+  }
+  return err;
+}
+
+esp_err_t FirmwareDownloaderCore::uploadWrite(Upload &u, const uint8_t *data, size_t len) {
+  uint32_t offset = u.written;
+  esp_err_t err = fwdl_upload_write(&u, data, len);
+  if (err == ESP_ERR_INVALID_SIZE) {
+    ESP_LOGW(TAG_UPLOAD, "Image exceeds partition '%s' (%u bytes).", u.target->label, (unsigned)u.target->size);
+  } else if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG_UPLOAD, "Write failed at offset %u: %s", (unsigned)offset, esp_err_to_name(err));
+  }
+  return err;
+}
+
+// uploadBegin() erased the whole partition, so each offset is written once.
+esp_err_t FirmwareDownloaderCore::uploadWriteAt(Upload &u, uint32_t offset, const uint8_t *data, size_t len) {
+  esp_err_t err = fwdl_upload_write_at(&u, offset, data, len);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE && err != ESP_ERR_INVALID_SIZE) {
+    ESP_LOGE(TAG_UPLOAD, "Write failed at offset %u: %s", (unsigned)offset, esp_err_to_name(err));
+  }
+  return err;
+}
+
+esp_err_t FirmwareDownloaderCore::uploadEnd(Upload &u, bool activate) {
+  if (!u.active) return ESP_ERR_INVALID_STATE;
+  esp_err_t err = fwdl_upload_end(&u, activate);
+  wearFlush();
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG_UPLOAD, "Finalizing '%s' failed: %s", u.target->label, esp_err_to_name(err));
+  } else {
+    ESP_LOGI(TAG_UPLOAD, "'%s' update complete (%u bytes).", u.target->label, (unsigned)u.written);
+  }
+  return err;
+}
+
+void FirmwareDownloaderCore::uploadAbort(Upload &u) {
+  fwdl_upload_abort(&u);
+  wearFlush();
+}
+
+#else
+// Nothing in this build writes partitions, so no upload ever begins and the
+// engine's OTA and erase paths are not linked.
+esp_err_t FirmwareDownloaderCore::uploadBegin(Upload &, const esp_partition_t*) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t FirmwareDownloaderCore::uploadWrite(Upload &, const uint8_t *, size_t) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t FirmwareDownloaderCore::uploadWriteAt(Upload &, uint32_t, const uint8_t *, size_t) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t FirmwareDownloaderCore::uploadEnd(Upload &, bool) {
+  return ESP_ERR_INVALID_STATE;
+}
+
+void FirmwareDownloaderCore::uploadAbort(Upload &u) {
+  u.active = false;
+}
+#endif
+
+//////////////////////////////
+// Streams and Uploads
+//////////////////////////////
+// The loops front ends with a task per request (esp_http_server) drive.
+
+uint8_t FirmwareDownloaderCore::openStream(Reader &r, uint8_t mode, uint32_t offset, uint32_t length,
+                                           const char* label, const char* tag) {
+  memset(&r, 0, sizeof(r));
+  r.slot = -1;
+  fwdl_status_t status = fwdl_stream_open(&r.stream, (fwdl_mode_t)mode, offset, length, label ? label : "");
+  if (status != FWDL_OK) return status;
+  // No close callback: these servers rely on their own send timeouts.
+  r.slot = acquireSession(tag, r.stream.length, &r.sessionId);
+  if (r.slot < 0) return BUSY;
+  r.tag = tag;
+  return OK;
+}
+
+uint8_t FirmwareDownloaderCore::openBootloader(Reader &r, const char* tag) {
+  return openStream(r, MODE_RANGE, FWDL_BOOTLOADER_OFFSET, FWDL_BOOTLOADER_SIZE, nullptr, tag);
+}
+
+size_t FirmwareDownloaderCore::readStream(Reader &r, uint8_t *buffer, size_t len) {
+  uint32_t addr = r.stream.start + r.stream.position;
+  size_t n = fwdl_stream_read(&r.stream, buffer, len);
+  if (!n) {
+    if (r.stream.error != ESP_OK) {
+      ESP_LOGE(r.tag, "Error at 0x%08X: %s", (unsigned)addr, esp_err_to_name(r.stream.error));
+    }
+    return 0;
+  }
+  if (r.stream.position - r.lastPrinted >= PROGRESS_LOG_BYTES) {
+    ESP_LOGI(r.tag, "Streamed %u/%u bytes...", (unsigned)r.stream.position, (unsigned)r.stream.length);
+    r.lastPrinted = r.stream.position;
+  }
+  esp_task_wdt_reset();
+  if (r.slot >= 0) noteSessionProgress(r.slot, r.sessionId, r.stream.position, r.stream.position);
+  return n;
+}
+
+void FirmwareDownloaderCore::closeStream(Reader &r) {
+  if (r.slot >= 0) releaseSession(r.slot, r.sessionId);
+  r.slot = -1;
+}
+
+uint8_t FirmwareDownloaderCore::beginUpload(Upload &u, const char* label) {
+  memset(&u, 0, sizeof(u));
+#if FWDL_ENABLE_UPLOAD
+  const esp_partition_t* target = label ? fwdl_find_partition(label) : nullptr;
+  if (!target) return NOT_FOUND;
+  esp_err_t err = uploadBegin(u, target);
+  if (err == ESP_ERR_INVALID_ARG) return BAD_REQUEST;   // the running partition
+  return err == ESP_OK ? OK : IO_ERROR;
+#else
+  (void)label;
+  return UNSUPPORTED;
+#endif
+}
+
+uint8_t FirmwareDownloaderCore::writeUpload(Upload &u, const uint8_t *data, size_t len) {
+  esp_err_t err = uploadWrite(u, data, len);
+  if (err == ESP_ERR_INVALID_SIZE) return OUT_OF_RANGE;
+  if (err == ESP_ERR_INVALID_STATE) return SEQUENCE;
+  return err == ESP_OK ? OK : IO_ERROR;
+}
+
+uint8_t FirmwareDownloaderCore::endUpload(Upload &u, bool activate) {
+  return uploadEnd(u, activate) == ESP_OK ? OK : IO_ERROR;
+}
+
+void FirmwareDownloaderCore::abortUpload(Upload &u) {
+  uploadAbort(u);
+}
+
+//////////////////////////////
+// Listings
+//////////////////////////////
+
+// Append to a bounded buffer; false once it no longer fits.
+static bool appendf(char *out, size_t outLen, size_t &pos, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(out + pos, outLen - pos, fmt, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= outLen - pos) return false;
+  pos += n;
+  return true;
+}
+
+size_t FirmwareDownloaderCore::partitionsJson(char *out, size_t outLen) {
+  size_t pos = 0;
+  bool ok = appendf(out, outLen, pos, "{\"flashSize\":%u,\"partitions\":[", (unsigned)fwdl_flash_size());
+  fwdl_partition_info_t page[8];
+  size_t total = 1;
+  for (size_t done = 0; ok && done < total; ) {
+    total = fwdl_list_partitions(page, 8, done);
+    size_t n = total - done < 8 ? total - done : 8;
+    for (size_t i = 0; ok && i < n; i++) {
+      const fwdl_partition_info_t &p = page[i];
+      ok = appendf(out, outLen, pos,
+                   "%s{\"label\":\"%s\",\"type\":%d,\"subtype\":%d,\"address\":%u,\"size\":%u,"
+                   "\"generation\":%u,\"running\":%s}",
+                   done + i ? "," : "", p.label, (int)p.type, (int)p.subtype, (unsigned)p.address,
+                   (unsigned)p.size, (unsigned)generationAt(p.address), p.running ? "true" : "false");
+    }
+    done += n;
+  }
+  ok = ok && appendf(out, outLen, pos, "]}");
+  return ok ? pos : 0;
+}
+
+static bool appendJob(char *out, size_t outLen, size_t &pos, const Job &job) {
+  return appendf(out, outLen, pos,
+                 "{\"id\":%u,\"job\":\"%s\",\"state\":\"%s\",\"priority\":%u,\"running\":%s,\"ok\":%s,"
+                 "\"done\":%u,\"total\":%u,\"elapsedMs\":%u,\"message\":\"%s\"}",
+                 (unsigned)job.id, job.name, Core::jobStateName(job.state), (unsigned)job.priority,
+                 job.state <= Core::JOB_RUNNING ? "true" : "false", job.state == Core::JOB_DONE ? "true" : "false",
+                 (unsigned)job.done, (unsigned)job.total, (unsigned)jobElapsed(job), job.message);
+}
+
+size_t FirmwareDownloaderCore::jobJson(char *out, size_t outLen, uint32_t id, const char* name) {
+  Job job;
+  findJob(id, name, job);
+  size_t pos = 0;
+  return appendJob(out, outLen, pos, job) ? pos : 0;
+}
+
+size_t FirmwareDownloaderCore::jobsJson(char *out, size_t outLen, uint32_t id) {
+  if (id) return jobJson(out, outLen, id);
+  Job jobs[MAX_JOBS];
+  int n = listJobs(jobs, MAX_JOBS);
+  size_t pos = 0;
+  bool ok = appendf(out, outLen, pos, "{\"workers\":%d,\"jobs\":[", jobWorkers());
+  for (int i = 0; ok && i < n; i++) {
+    ok = (!i || appendf(out, outLen, pos, ",")) && appendJob(out, outLen, pos, jobs[i]);
+  }
+  ok = ok && appendf(out, outLen, pos, "]}");
+  return ok ? pos : 0;
+}
+
+const char* FirmwareDownloaderCore::statusName(uint8_t status) {
+  return fwdl_status_name((fwdl_status_t)status);
+}
+
+void FirmwareDownloaderCore::restart() {
+  wearFlush(true);
+  esp_restart();
+}
@@ -0,0 +1,195 @@
+#ifndef FIRMWAREDOWNLOADERCORE_H
+#define FIRMWAREDOWNLOADERCORE_H
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fwdl.h"
+
+// Transport-neutral operations behind every server front end: flash stream
+// sources, upload sinks, session slots, write generations, wear counters, the
+// job scheduler and listings. The AsyncWebServer handlers, the raw TCP, serial
+// and WebSocket transports and the esp_http_server adapter all reach flash
+// through these, so protection, blanking, session accounting and write
+// generations behave the same whichever server a product ships. This header
+// deliberately pulls in no Arduino or web server types, and the core logs
+// through ESP_LOG. Below it sits the plain C engine (fwdl.h), which IDF-only
+// products can use on its own.
+class FirmwareDownloaderCore {
+public:
+  // Source selectors and status codes, shared with the raw, serial and
+  // WebSocket wire formats.
+  enum Mode : uint8_t {
+    MODE_FULL = FWDL_MODE_FULL, MODE_SECURE = FWDL_MODE_SECURE, MODE_PARTITION = FWDL_MODE_PARTITION,
+    MODE_RANGE = FWDL_MODE_RANGE
+  };
+  enum Status : uint8_t {
+    OK = FWDL_OK, BAD_REQUEST = FWDL_BAD_REQUEST, NOT_FOUND = FWDL_NOT_FOUND, OUT_OF_RANGE = FWDL_OUT_OF_RANGE,
+    UNSUPPORTED = FWDL_UNSUPPORTED, BUSY = FWDL_BUSY, SEQUENCE = FWDL_SEQUENCE, IO_ERROR = FWDL_IO_ERROR,
+    FORBIDDEN = FWDL_FORBIDDEN
+  };
+
+  // An open read stream. Holds a session slot until closeStream().
+  struct Reader {
+    fwdl_stream_t stream;    // start, length, position, blanking, first error
+    const char* tag;
+    uint32_t lastPrinted;
+    int slot;                // session slot, -1 if none
+    uint32_t sessionId;
+  };
+
+  // An upload in progress (the C engine's sink).
+  typedef fwdl_upload_t Upload;
+
+  // Resolve a source and claim a session slot. BUSY when all slots are taken.
+  static uint8_t openStream(Reader &r, uint8_t mode, uint32_t offset, uint32_t length, const char* label,
+                            const char* tag);
+  // Bootloader region (not a partition).
+  static uint8_t openBootloader(Reader &r, const char* tag);
+  // Up to len bytes at the current position; 0 at the end or on a read error.
+  static size_t readStream(Reader &r, uint8_t *buffer, size_t len);
+  static void closeStream(Reader &r);
+
+  static uint8_t beginUpload(Upload &u, const char* label);
+  static uint8_t writeUpload(Upload &u, const uint8_t *data, size_t len);
+  static uint8_t endUpload(Upload &u, bool activate);
+  static void abortUpload(Upload &u);
+
+  // The same sink with IDF error codes, for transports that choose the
+  // target partition themselves. Each call logs its failures; every erase and
+  // write bumps the write generations and the wear counters.
+  static esp_err_t uploadBegin(Upload &u, const esp_partition_t* target);
+  static esp_err_t uploadWrite(Upload &u, const uint8_t *data, size_t len);
+  // Out of order, for transports that repair gaps later (multicast).
+  static esp_err_t uploadWriteAt(Upload &u, uint32_t offset, const uint8_t *data, size_t len);
+  static esp_err_t uploadEnd(Upload &u, bool activate);
+  static void uploadAbort(Upload &u);
+
+  // Session slots. Each stream, whatever its transport, occupies one for its
+  // lifetime; a periodic watchdog closes sessions that stall or go idle
+  // through the close callback given at acquire time (from the esp_timer
+  // task, so it should only ask the transport to close). Sessions without a
+  // callback are counted but never closed by the watchdog.
+  static const int MAX_SESSIONS = 4;
+  typedef void (*SessionClose)(void* owner);
+  struct StreamStats {
+    uint32_t started;
+    uint32_t completed;
+    uint32_t rejected;      // refused because all session slots were busy
+    uint32_t stalled;       // closed for staying below the minimum throughput
+    uint32_t idle;          // closed by the idle timeout
+    uint64_t sourceBytes;   // flash bytes consumed by finished streams
+    uint64_t wireBytes;     // bytes they sent (smaller when encoded)
+  };
+  struct StallPolicy {
+    uint32_t minBytesPerSec;
+    uint32_t stallMs;
+    uint32_t idleTimeoutMs;
+  };
+  // Claim a free slot; returns its index, or -1 when all are busy.
+  static int acquireSession(const char* tag, size_t totalLen, uint32_t *idOut, SessionClose close = nullptr,
+                            void* owner = nullptr);
+  // sourceBytes is what the watchdog measures; wireBytes differ for encoded streams.
+  static void noteSessionProgress(int slot, uint32_t id, size_t sourceBytes, size_t wireBytes);
+  // Free a slot. Safe to call more than once; stale ids are ignored.
+  static void releaseSession(int slot, uint32_t id);
+  static void setStallPolicy(uint32_t minBytesPerSec, uint32_t stallSeconds, uint32_t idleTimeoutSeconds);
+  static StallPolicy stallPolicy();
+  static StreamStats streamStats();
+  static int activeSessions();
+
+  // Write generations. Each partition carries a counter that moves whenever
+  // flash inside it is written; caches store the generation they were
+  // computed at and are valid only while it still matches. Call after the
+  // erase or write has completed (or failed). notifyStore runs the listener
+  // (the persistent hash store); its own commits pass false.
+  typedef void (*GenerationListener)();
+  static void bumpGeneration(uint32_t address, uint32_t length, bool notifyStore = true);
+  static void bumpPartition(const esp_partition_t* part);
+  // Generation of the partition starting at address (0 if unknown).
+  static uint32_t generationAt(uint32_t address);
+  // The partition's generation when the range lies inside one partition,
+  // otherwise the global flash generation.
+  static uint32_t generationFor(uint32_t address, uint32_t length);
+  // Restore a partition's generation from a persistent store at boot.
+  static void seedGeneration(uint32_t address, uint32_t gen);
+  static void setGenerationListener(GenerationListener listener);
+
+  // Erase counters, one per flash sector, persisted to NVS. wearRecord()
+  // counts one erase of every sector overlapping the range; wearFlush()
+  // writes them if they changed and the last write is old enough (or force).
+  struct WearInfo {
+    const uint16_t* counts;   // per sector; live, read without locking
+    uint32_t sectors;
+    uint32_t sinceBoot;       // sector erases recorded since boot
+    bool pending;             // not yet persisted
+  };
+  static void wearRecord(uint32_t address, uint32_t length);
+  static void wearFlush(bool force = false);
+  // False without memory for the table.
+  static bool wearInfo(WearInfo &out);
+
+  // Job scheduler. Long flash operations run as jobs on up to two worker
+  // tasks, highest priority first; jobs of the same name, and any two
+  // writers, never run side by side. Job functions report through
+  // currentJob(), jobMessage() and jobCancelled().
+  enum JobState : uint8_t { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED, JOB_INTERRUPTED };
+  enum JobPriority : uint8_t { JOB_PRIO_LOW = 0, JOB_PRIO_NORMAL = 1, JOB_PRIO_HIGH = 2 };
+  static const int MAX_JOBS = 10;           // queued + running + history
+  static const size_t JOB_JSON_MAX = 384;   // one job's JSON, NUL included
+  typedef bool (*JobFn)(void* arg);
+  typedef void (*JobDispose)(void* arg);
+  struct Job {
+    uint32_t id;               // 0: free slot
+    uint8_t state;
+    uint8_t priority;
+    bool persist;              // housekeeping jobs are not written to NVS and leave no history
+    bool writer;               // writes app or data partitions; writers run one at a time
+    bool rebootAfter;          // set by the job; the worker restarts after recording it
+    volatile bool cancel;
+    char name[16];
+    uint32_t total;
+    volatile uint32_t done;
+    uint32_t startMs;
+    uint32_t endMs;
+    char message[96];
+    JobFn run;
+    void* arg;
+    JobDispose dispose;        // frees arg once the job has run or was cancelled in the queue
+  };
+  // Queue a job. Returns its id, or 0 when the queue is full. arg is handed
+  // to dispose in every case once the job has been accepted.
+  static uint32_t submitJob(const char* name, uint8_t priority, JobFn run, void* arg, JobDispose dispose,
+                            bool persist = true, bool writer = false);
+  // True while a job with this name is queued (or running, unless queuedOnly).
+  static bool jobActive(const char* name, bool queuedOnly = false);
+  // A queued job is dropped at once; a running job stops at its next
+  // cancellation point. False for unknown or finished jobs.
+  static bool cancelJob(uint32_t id);
+  // The job running on the calling task, or nullptr outside a worker.
+  static Job* currentJob();
+  // Cancellation point for long loops. Always false outside a worker.
+  static bool jobCancelled();
+  static void jobMessage(const char* fmt, ...);
+  // Copy of job id, or of the newest job called name when id is 0. False
+  // (and state 0xFF) when there is none.
+  static bool findJob(uint32_t id, const char* name, Job &out);
+  // Copies of every queued, running and remembered job, newest first.
+  static int listJobs(Job *out, int max);
+  static int jobWorkers();
+  static const char* jobStateName(uint8_t state);
+
+  // JSON listings, written NUL-terminated into out. Return the length, or 0 if
+  // out is too small.
+  static size_t partitionsJson(char *out, size_t outLen);
+  static size_t jobsJson(char *out, size_t outLen, uint32_t id = 0);   // id 0: all jobs
+  // One job as from findJob(); unknown jobs report state "none".
+  static size_t jobJson(char *out, size_t outLen, uint32_t id, const char* name = nullptr);
+
+  static const char* statusName(uint8_t status);
+
+  // Persist pending state (wear counters) and restart.
+  static void restart();
+};
+
+#endif
@@ -0,0 +1,240 @@
+// esp_http_server adapter. Built only where ESP-IDF's server is available;
+// see FirmwareDownloaderHttpd.h.
+#if __has_include(<esp_http_server.h>)
+
+#include "FirmwareDownloaderHttpd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char*  TAG            = "FWDL-httpd";
+static const size_t HTTPD_CHUNK    = 4096;
+static const size_t HTTPD_LIST_MAX = 4096;
+static const size_t HTTPD_QUERY_MAX = 160;
+
+typedef FirmwareDownloaderCore Core;
+
+enum HttpdRoute : uint8_t {
+  ROUTE_FULL, ROUTE_SECURE, ROUTE_PARTITION, ROUTE_BOOT,
+  ROUTE_LIST_PARTITIONS, ROUTE_LIST_JOBS
+};
+
+static const char* httpStatus(uint8_t status) {
+  switch (status) {
+    case Core::OK:           return "200 OK";
+    case Core::BAD_REQUEST:
+    case Core::SEQUENCE:     return "400 Bad Request";
+    case Core::FORBIDDEN:    return "403 Forbidden";
+    case Core::NOT_FOUND:    return "404 Not Found";
+    case Core::OUT_OF_RANGE: return "416 Range Not Satisfiable";
+    case Core::UNSUPPORTED:  return "501 Not Implemented";
+    case Core::BUSY:         return "503 Service Unavailable";
+    default:                 return "500 Internal Server Error";
+  }
+}
+
+static esp_err_t sendStatus(httpd_req_t *req, uint8_t status, const char* msg = nullptr) {
+  httpd_resp_set_status(req, httpStatus(status));
+  httpd_resp_set_type(req, "text/plain");
+  return httpd_resp_sendstr(req, msg ? msg : Core::statusName(status));
+}
+
+static bool queryValue(httpd_req_t *req, const char* key, char *out, size_t outLen) {
+  char query[HTTPD_QUERY_MAX];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) return false;
+  return httpd_query_key_value(query, key, out, outLen) == ESP_OK;
+}
+
+// Decimal or 0x hex with an optional K, M or s (sector) suffix, as /dumprange takes.
+static bool queryNumber(httpd_req_t *req, const char* key, uint32_t *out) {
+  char text[24];
+  if (!queryValue(req, key, text, sizeof(text))) return false;
+  char *end = nullptr;
+  unsigned long long v = strtoull(text, &end, 0);
+  if (end == text) return false;
+  if (*end == 'k' || *end == 'K') v *= 1024;
+  else if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+  else if (*end == 's' || *end == 'S') v *= 4096;
+  else if (*end) return false;
+  if (v > UINT32_MAX) return false;
+  *out = (uint32_t)v;
+  return true;
+}
+
+static bool queryFlag(httpd_req_t *req, const char* key) {
+  char text[4];
+  return queryValue(req, key, text, sizeof(text)) && !strcmp(text, "1");
+}
+
+esp_err_t FirmwareDownloaderHttpd::sendReader(httpd_req_t *req, Core::Reader &r, const char* filename) {
+  uint8_t *buf = (uint8_t*)malloc(HTTPD_CHUNK);
+  if (!buf) {
+    Core::closeStream(r);
+    return sendStatus(req, Core::IO_ERROR, "Out of memory");
+  }
+  // Header values must outlive the response; these stay in scope until it ends.
+  char disposition[48], length[12];
+  snprintf(disposition, sizeof(disposition), "attachment; filename=%s", filename);
+  snprintf(length, sizeof(length), "%u", (unsigned)r.stream.length);
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+  httpd_resp_set_hdr(req, "X-Image-Length", length);
+
+  esp_err_t err = ESP_OK;
+  while (r.stream.position < r.stream.length) {
+    size_t n = Core::readStream(r, buf, HTTPD_CHUNK);
+    if (!n) {
+      err = ESP_FAIL;
+      break;
+    }
+    err = httpd_resp_send_chunk(req, (const char*)buf, n);
+    if (err != ESP_OK) break;
+  }
+  if (err == ESP_OK) err = httpd_resp_send_chunk(req, nullptr, 0);
+  ESP_LOGI(TAG, "%s: %u/%u bytes (%s)", r.tag, (unsigned)r.stream.position, (unsigned)r.stream.length,
+           esp_err_to_name(err));
+  Core::closeStream(r);
+  free(buf);
+  return err;
+}
+
+esp_err_t FirmwareDownloaderHttpd::handleDump(httpd_req_t *req) {
+  Core::Reader r;
+  uint8_t status;
+  char label[20] = "";
+  const char* filename = "fullclone.bin";
+  switch ((uintptr_t)req->user_ctx) {
+    case ROUTE_FULL:
+      status = Core::openStream(r, Core::MODE_FULL, 0, 0, nullptr, "HttpdStream");
+      break;
+    case ROUTE_SECURE:
+      status = Core::openStream(r, Core::MODE_SECURE, 0, 0, nullptr, "HttpdSecureStream");
+      filename = "fullclone_secure.bin";
+      break;
+    case ROUTE_PARTITION:
+      if (!queryValue(req, "label", label, sizeof(label))) return sendStatus(req, Core::BAD_REQUEST, "Missing 'label'");
+      status = Core::openStream(r, Core::MODE_PARTITION, 0, 0, label, "HttpdPartitionStream");
+      filename = label;
+      break;
+    default:
+      status = Core::openBootloader(r, "HttpdBootloaderStream");
+      filename = "bootloader.bin";
+      break;
+  }
+  if (status != Core::OK) return sendStatus(req, status);
+  return sendReader(req, r, filename);
+}
+
+esp_err_t FirmwareDownloaderHttpd::handleRange(httpd_req_t *req) {
+  uint32_t offset = 0, length = 0;
+  if (!queryNumber(req, "offset", &offset) || !queryNumber(req, "length", &length)) {
+    return sendStatus(req, Core::BAD_REQUEST, "Need 'offset' and 'length'");
+  }
+  char label[20];
+  if (queryValue(req, "label", label, sizeof(label))) {
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!part) return sendStatus(req, Core::NOT_FOUND);
+    if (offset >= part->size || length > part->size - offset) return sendStatus(req, Core::OUT_OF_RANGE);
+    offset += part->address;
+  }
+  Core::Reader r;
+  uint8_t status = Core::openStream(r, Core::MODE_RANGE, offset, length, nullptr, "HttpdRangeStream");
+  if (status != Core::OK) return sendStatus(req, status);
+  return sendReader(req, r, "range.bin");
+}
+
+esp_err_t FirmwareDownloaderHttpd::handleUpload(httpd_req_t *req) {
+  char label[20];
+  if (!queryValue(req, "label", label, sizeof(label))) return sendStatus(req, Core::BAD_REQUEST, "Missing 'label'");
+  bool activate = queryFlag(req, "activate");
+  bool reboot = queryFlag(req, "reboot");
+  Core::Upload u;
+  uint8_t status = Core::beginUpload(u, label);
+  if (status != Core::OK) return sendStatus(req, status);
+
+  uint8_t *buf = (uint8_t*)malloc(HTTPD_CHUNK);
+  if (!buf) {
+    Core::abortUpload(u);
+    return sendStatus(req, Core::IO_ERROR, "Out of memory");
+  }
+  size_t remaining = req->content_len;
+  while (remaining && status == Core::OK) {
+    int n = httpd_req_recv(req, (char*)buf, remaining < HTTPD_CHUNK ? remaining : HTTPD_CHUNK);
+    if (n == HTTPD_SOCK_ERR_TIMEOUT) continue;
+    if (n <= 0) {
+      status = Core::IO_ERROR;
+      break;
+    }
+    status = Core::writeUpload(u, buf, n);
+    remaining -= n;
+  }
+  free(buf);
+  if (status != Core::OK) {
+    Core::abortUpload(u);
+    ESP_LOGW(TAG, "Upload to %s failed after %u bytes: %s", label, (unsigned)u.written, Core::statusName(status));
+    return sendStatus(req, status);
+  }
+  status = Core::endUpload(u, activate);
+  if (status != Core::OK) return sendStatus(req, status);
+
+  char json[96];
+  snprintf(json, sizeof(json), "{\"label\":\"%s\",\"written\":%u,\"activated\":%s,\"reboot\":%s}",
+           label, (unsigned)u.written, activate ? "true" : "false", reboot ? "true" : "false");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_sendstr(req, json);
+  ESP_LOGI(TAG, "Upload to %s complete (%u bytes).", label, (unsigned)u.written);
+  if (reboot) {
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    Core::restart();
+  }
+  return ESP_OK;
+}
+
+esp_err_t FirmwareDownloaderHttpd::handleList(httpd_req_t *req) {
+  char *json = (char*)malloc(HTTPD_LIST_MAX);
+  if (!json) return sendStatus(req, Core::IO_ERROR, "Out of memory");
+  size_t n;
+  if ((uintptr_t)req->user_ctx == ROUTE_LIST_PARTITIONS) {
+    n = Core::partitionsJson(json, HTTPD_LIST_MAX);
+  } else {
+    uint32_t id = 0;
+    queryNumber(req, "id", &id);
+    n = Core::jobsJson(json, HTTPD_LIST_MAX, id);
+  }
+  esp_err_t err;
+  if (!n) {
+    err = sendStatus(req, Core::IO_ERROR, "Listing too large");
+  } else {
+    httpd_resp_set_type(req, "application/json");
+    err = httpd_resp_send(req, json, n);
+  }
+  free(json);
+  return err;
+}
+
+bool FirmwareDownloaderHttpd::attach(httpd_handle_t server) {
+  static const httpd_uri_t uris[] = {
+    { "/dumpflash",        HTTP_GET,  handleDump,   (void*)ROUTE_FULL },
+    { "/dumpflash_secure", HTTP_GET,  handleDump,   (void*)ROUTE_SECURE },
+    { "/downloaddirect",   HTTP_GET,  handleDump,   (void*)ROUTE_PARTITION },
+    { "/downloadboot",     HTTP_GET,  handleDump,   (void*)ROUTE_BOOT },
+    { "/dumprange",        HTTP_GET,  handleRange,  nullptr },
+    { "/upload",           HTTP_POST, handleUpload, nullptr },
+    { "/partitions",       HTTP_GET,  handleList,   (void*)ROUTE_LIST_PARTITIONS },
+    { "/jobs",             HTTP_GET,  handleList,   (void*)ROUTE_LIST_JOBS },
+  };
+  bool ok = true;
+  for (const httpd_uri_t &uri : uris) {
+    esp_err_t err = httpd_register_uri_handler(server, &uri);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Registering %s failed: %s", uri.uri, esp_err_to_name(err));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef FIRMWAREDOWNLOADERHTTPD_H
+#define FIRMWAREDOWNLOADERHTTPD_H
+#pragma once
+
+#include <esp_http_server.h>
+#include "FirmwareDownloaderCore.h"
+
+// ESP-IDF esp_http_server front end over FirmwareDownloaderCore. Each
+// request runs to completion on the server's task: dumps are read and sent
+// in 4 KB chunks, uploads are received straight into the upload sink. Keep it
+// out of translation units that include ESPAsyncWebServer.h, because the two
+// headers declare conflicting HTTP_GET/HTTP_POST enumerators.
+//
+//   GET  /dumpflash, /dumpflash_secure, /downloaddirect?label=, /downloadboot
+//   GET  /dumprange?offset=&length=[&label=]
+//   POST /upload?label=[&activate=1][&reboot=1]   raw image as the body
+//   GET  /partitions, /jobs[?id=]
+class FirmwareDownloaderHttpd {
+public:
+  // Register the endpoints on a started server. Uses 8 URI handler slots:
+  // raise httpd_config_t.max_uri_handlers if the application has its own.
+  static bool attach(httpd_handle_t server);
+
+private:
+  static esp_err_t handleDump(httpd_req_t *req);
+  static esp_err_t handleRange(httpd_req_t *req);
+  static esp_err_t handleUpload(httpd_req_t *req);
+  static esp_err_t handleList(httpd_req_t *req);
+  static esp_err_t sendReader(httpd_req_t *req, FirmwareDownloaderCore::Reader &r, const char* filename);
+};
+
+#endif
@@ -0,0 +1,276 @@
+// Plain C flash engine; see fwdl.h.
+
+#include "fwdl.h"
+#include <string.h>
+#include "esp_flash.h"
+#include "esp_log.h"
+
+static const char *TAG = "fwdl";
+
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+  const char *description;
+} fwdl_region_t;
+
+static fwdl_region_t s_blank[FWDL_MAX_BLANK_REGIONS];
+static int s_num_blank = 0;
+static fwdl_region_t s_protected[FWDL_MAX_PROTECTED_REGIONS];
+static int s_num_protected = 0;
+static fwdl_flash_hook_t s_hook = NULL;
+
+static inline bool overlaps(uint32_t a, uint32_t alen, uint32_t b, uint32_t blen) {
+  return a < b + blen && b < a + alen;
+}
+
+// After every erase or write, whether or not it succeeded: a failed operation
+// may still have changed flash.
+static void notify(uint32_t address, uint32_t length, bool erase) {
+  if (s_hook) s_hook(address, length, erase);
+}
+
+//////////////////////////////
+// Regions
+//////////////////////////////
+
+bool fwdl_add_blank_region(uint32_t offset, uint32_t length, const char *description) {
+  if (s_num_blank >= FWDL_MAX_BLANK_REGIONS) return false;
+  s_blank[s_num_blank].offset = offset;
+  s_blank[s_num_blank].length = length;
+  s_blank[s_num_blank].description = description;
+  s_num_blank++;
+  return true;
+}
+
+void fwdl_clear_blank_regions(void) {
+  s_num_blank = 0;
+}
+
+bool fwdl_add_protected_region(uint32_t offset, uint32_t length, const char *description) {
+  if (s_num_protected >= FWDL_MAX_PROTECTED_REGIONS) return false;
+  s_protected[s_num_protected].offset = offset;
+  s_protected[s_num_protected].length = length;
+  s_protected[s_num_protected].description = description;
+  s_num_protected++;
+  return true;
+}
+
+const char *fwdl_range_denied(uint32_t offset, uint32_t length) {
+  static const esp_partition_subtype_t secret_subtypes[] = {ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS,
+                                                            ESP_PARTITION_SUBTYPE_DATA_EFUSE_EM};
+  for (size_t i = 0; i < sizeof(secret_subtypes) / sizeof(secret_subtypes[0]); i++) {
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_DATA, secret_subtypes[i], NULL);
+    while (it != NULL) {
+      const esp_partition_t *p = esp_partition_get(it);
+      if (overlaps(offset, length, p->address, p->size)) {
+        esp_partition_iterator_release(it);
+        return "overlaps a key partition";
+      }
+      it = esp_partition_next(it);
+    }
+  }
+  for (int i = 0; i < s_num_protected; i++) {
+    if (overlaps(offset, length, s_protected[i].offset, s_protected[i].length)) return s_protected[i].description;
+  }
+  return NULL;
+}
+
+//////////////////////////////
+// Partitions and Reads
+//////////////////////////////
+
+uint32_t fwdl_flash_size(void) {
+  uint32_t size = 0;
+  if (esp_flash_get_size(esp_flash_default_chip, &size) != ESP_OK) return 0;
+  return size;
+}
+
+const esp_partition_t *fwdl_find_partition(const char *label) {
+  if (!label) return NULL;
+  const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, label);
+  if (!part) part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+  return part;
+}
+
+size_t fwdl_list_partitions(fwdl_partition_info_t *out, size_t max, size_t skip) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  size_t total = 0;
+  esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+  while (it != NULL) {
+    if (total >= skip && total - skip < max) {
+      const esp_partition_t *p = esp_partition_get(it);
+      fwdl_partition_info_t *info = &out[total - skip];
+      strncpy(info->label, p->label, sizeof(info->label) - 1);
+      info->label[sizeof(info->label) - 1] = '\0';
+      info->type = (uint8_t)p->type;
+      info->subtype = (uint8_t)p->subtype;
+      info->address = p->address;
+      info->size = p->size;
+      info->running = running && running->address == p->address;
+    }
+    total++;
+    it = esp_partition_next(it);
+  }
+  return total;
+}
+
+esp_err_t fwdl_read(uint32_t address, void *buf, size_t len, bool blanked) {
+  esp_err_t err = esp_flash_read(esp_flash_default_chip, buf, address, len);
+  if (err != ESP_OK || !blanked) return err;
+  for (int i = 0; i < s_num_blank; i++) {
+    const fwdl_region_t *r = &s_blank[i];
+    if (!overlaps(address, len, r->offset, r->length)) continue;
+    uint32_t from = address > r->offset ? address : r->offset;
+    uint32_t to = address + len < r->offset + r->length ? address + len : r->offset + r->length;
+    memset((uint8_t *)buf + (from - address), 0xFF, to - from);
+    ESP_LOGD(TAG, "Blanked %s (0x%08x - 0x%08x)", r->description, (unsigned)from, (unsigned)to);
+  }
+  return ESP_OK;
+}
+
+//////////////////////////////
+// Streams
+//////////////////////////////
+
+fwdl_status_t fwdl_stream_open(fwdl_stream_t *s, fwdl_mode_t mode, uint32_t offset, uint32_t length,
+                               const char *label) {
+  memset(s, 0, sizeof(*s));
+  uint32_t flash_size = fwdl_flash_size();
+  if (mode == FWDL_MODE_FULL || mode == FWDL_MODE_SECURE) {
+    s->length = flash_size;
+    s->blanked = mode == FWDL_MODE_SECURE;
+  } else if (mode == FWDL_MODE_PARTITION) {
+    const esp_partition_t *part = fwdl_find_partition(label);
+    if (!part) return FWDL_NOT_FOUND;
+    if (fwdl_range_denied(part->address, part->size)) return FWDL_FORBIDDEN;
+    s->start = part->address;
+    s->length = part->size;
+  } else if (mode == FWDL_MODE_RANGE) {
+    if (length == 0 || offset >= flash_size || length > flash_size - offset) return FWDL_OUT_OF_RANGE;
+    if (fwdl_range_denied(offset, length)) return FWDL_FORBIDDEN;
+    s->start = offset;
+    s->length = length;
+  } else {
+    return FWDL_BAD_REQUEST;
+  }
+  return FWDL_OK;
+}
+
+fwdl_status_t fwdl_stream_open_bootloader(fwdl_stream_t *s) {
+  return fwdl_stream_open(s, FWDL_MODE_RANGE, FWDL_BOOTLOADER_OFFSET, FWDL_BOOTLOADER_SIZE, NULL);
+}
+
+size_t fwdl_stream_read(fwdl_stream_t *s, void *buf, size_t len) {
+  if (s->position >= s->length) return 0;
+  uint32_t lead = (FWDL_SECTOR_SIZE - s->start % FWDL_SECTOR_SIZE) % FWDL_SECTOR_SIZE;
+  if (s->position == 0 && lead && len > lead) len = lead;
+  if (len > s->length - s->position) len = s->length - s->position;
+  uint32_t address = s->start + s->position;
+  esp_err_t err = fwdl_read(address, buf, len, s->blanked);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Read at 0x%08x failed: %s", (unsigned)address, esp_err_to_name(err));
+    s->error = err;
+    return 0;
+  }
+  s->position += len;
+  return len;
+}
+
+//////////////////////////////
+// Uploads
+//////////////////////////////
+
+static bool upload_is_app(const fwdl_upload_t *u) {
+  return u->target && u->target->type == ESP_PARTITION_TYPE_APP;
+}
+
+esp_err_t fwdl_upload_begin(fwdl_upload_t *u, const esp_partition_t *target) {
+  memset(u, 0, sizeof(*u));
+  if (!target) return ESP_ERR_NOT_FOUND;
+  u->target = target;
+  esp_err_t err;
+  if (upload_is_app(u)) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (running && target->address == running->address) return ESP_ERR_INVALID_ARG;
+    err = esp_ota_begin(target, target->size, &u->ota_handle);   // erases image_size bytes up front
+    notify(target->address, target->size, true);
+    if (err != ESP_OK) u->ota_handle = 0;
+  } else {
+    err = esp_partition_erase_range(target, 0, target->size);
+    notify(target->address, target->size, true);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Preparing '%s' failed: %s", target->label, esp_err_to_name(err));
+    return err;
+  }
+  u->active = true;
+  return ESP_OK;
+}
+
+esp_err_t fwdl_upload_write_at(fwdl_upload_t *u, uint32_t offset, const void *data, size_t len) {
+  if (!u->active) return ESP_ERR_INVALID_STATE;
+  if (offset > u->target->size || len > u->target->size - offset) return ESP_ERR_INVALID_SIZE;
+  esp_err_t err;
+  if (upload_is_app(u)) {
+    err = esp_ota_write_with_offset(u->ota_handle, data, len, offset);
+  } else {
+    err = esp_partition_write(u->target, offset, data, len);
+  }
+  notify(u->target->address + offset, len, false);
+  if (err != ESP_OK) return err;
+  u->written += len;
+  return ESP_OK;
+}
+
+esp_err_t fwdl_upload_write(fwdl_upload_t *u, const void *data, size_t len) {
+  if (!u->active) return ESP_ERR_INVALID_STATE;
+  if (len > u->target->size - u->written) return ESP_ERR_INVALID_SIZE;
+  esp_err_t err;
+  if (upload_is_app(u)) {
+    err = esp_ota_write(u->ota_handle, data, len);
+  } else {
+    err = esp_partition_write(u->target, u->written, data, len);
+  }
+  notify(u->target->address + u->written, len, false);
+  if (err != ESP_OK) return err;
+  u->written += len;
+  return ESP_OK;
+}
+
+esp_err_t fwdl_upload_end(fwdl_upload_t *u, bool activate) {
+  if (!u->active) return ESP_ERR_INVALID_STATE;
+  u->active = false;
+  if (!upload_is_app(u)) return ESP_OK;
+  esp_err_t err = esp_ota_end(u->ota_handle);
+  u->ota_handle = 0;
+  if (err != ESP_OK || !activate) return err;
+  const esp_partition_t *otadata = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA,
+                                                            NULL);
+  err = esp_ota_set_boot_partition(u->target);
+  if (otadata) notify(otadata->address, otadata->size, false);   // erased inside IDF, not counted
+  return err;
+}
+
+void fwdl_upload_abort(fwdl_upload_t *u) {
+  if (u->active && upload_is_app(u)) esp_ota_abort(u->ota_handle);
+  u->ota_handle = 0;
+  u->active = false;
+}
+
+void fwdl_set_flash_hook(fwdl_flash_hook_t hook) {
+  s_hook = hook;
+}
+
+const char *fwdl_status_name(fwdl_status_t status) {
+  switch (status) {
+    case FWDL_OK:           return "ok";
+    case FWDL_BAD_REQUEST:  return "bad request";
+    case FWDL_NOT_FOUND:    return "not found";
+    case FWDL_OUT_OF_RANGE: return "out of range";
+    case FWDL_UNSUPPORTED:  return "unsupported";
+    case FWDL_BUSY:         return "busy";
+    case FWDL_SEQUENCE:     return "out of sequence";
+    case FWDL_FORBIDDEN:    return "forbidden";
+    default:                return "I/O error";
+  }
+}
@@ -0,0 +1,133 @@
+#ifndef FWDL_H
+#define FWDL_H
+#pragma once
+
+// Plain C flash engine behind ESP32FirmwareDownloader: stream sources with
+// blanking and protected regions, partition listing and upload sinks. It
+// depends on ESP-IDF only (no Arduino, no web server) and allocates nothing
+// itself, though IDF calls it makes do (esp_partition_find, esp_ota_begin), so
+// IDF components can embed it directly. State lives in caller-provided
+// structs; the region tables are fixed-size statics configured at startup.
+//
+//   fwdl_stream_t s;
+//   if (fwdl_stream_open(&s, FWDL_MODE_PARTITION, 0, 0, "nvs") == FWDL_OK) {
+//     size_t n;
+//     while ((n = fwdl_stream_read(&s, buf, sizeof(buf))) > 0) send(buf, n);
+//     if (s.error != ESP_OK) fail();
+//   }
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FWDL_BOOTLOADER_OFFSET     0x1000
+#define FWDL_BOOTLOADER_SIZE       0x7000
+#define FWDL_SECTOR_SIZE           4096
+#define FWDL_MAX_BLANK_REGIONS     4
+#define FWDL_MAX_PROTECTED_REGIONS 4
+
+// Source selectors and status codes; the raw, serial and WebSocket wire
+// formats use the same values.
+typedef enum {
+  FWDL_MODE_FULL      = 0,
+  FWDL_MODE_SECURE    = 1,   // full flash with the blank regions read as 0xFF
+  FWDL_MODE_PARTITION = 2,
+  FWDL_MODE_RANGE     = 3
+} fwdl_mode_t;
+
+typedef enum {
+  FWDL_OK           = 0,
+  FWDL_BAD_REQUEST  = 1,
+  FWDL_NOT_FOUND    = 2,
+  FWDL_OUT_OF_RANGE = 3,
+  FWDL_UNSUPPORTED  = 4,
+  FWDL_BUSY         = 5,
+  FWDL_SEQUENCE     = 6,     // upload data out of order
+  FWDL_IO_ERROR     = 7,
+  FWDL_FORBIDDEN    = 8      // touches a protected region
+} fwdl_status_t;
+
+typedef struct {
+  uint32_t start;            // absolute flash address
+  uint32_t length;
+  uint32_t position;         // bytes returned so far
+  bool blanked;
+  esp_err_t error;           // first read error, ESP_OK while reads succeed
+} fwdl_stream_t;
+
+// An upload in progress: OTA for APP partitions, erase + write for DATA.
+typedef struct {
+  const esp_partition_t *target;
+  esp_ota_handle_t ota_handle;
+  uint32_t written;
+  bool active;
+} fwdl_upload_t;
+
+typedef struct {
+  char label[17];
+  uint8_t type;
+  uint8_t subtype;
+  uint32_t address;
+  uint32_t size;
+  bool running;              // the APP partition executing now
+} fwdl_partition_info_t;
+
+// Called after the engine erased or wrote [address, address+length), also
+// when the operation failed, so a host can invalidate caches or count erases.
+// Switching the boot partition reports otadata once the switch has returned.
+typedef void (*fwdl_flash_hook_t)(uint32_t address, uint32_t length, bool erase);
+
+// Region tables. description must outlive the engine. Adding fails once the
+// table is full.
+bool fwdl_add_blank_region(uint32_t offset, uint32_t length, const char *description);
+void fwdl_clear_blank_regions(void);
+bool fwdl_add_protected_region(uint32_t offset, uint32_t length, const char *description);
+// Why [offset, offset+length) may not be read (a key or eFuse partition, or a
+// protected region), or NULL when it may.
+const char *fwdl_range_denied(uint32_t offset, uint32_t length);
+
+uint32_t fwdl_flash_size(void);
+// By label, preferring APP partitions over DATA.
+const esp_partition_t *fwdl_find_partition(const char *label);
+// Fill up to max entries, skipping the first skip partitions. Returns the total
+// number of partitions, so a caller with a small array can page through.
+size_t fwdl_list_partitions(fwdl_partition_info_t *out, size_t max, size_t skip);
+
+// Read flash, overwriting blank regions with 0xFF when blanked is set.
+esp_err_t fwdl_read(uint32_t address, void *buf, size_t len, bool blanked);
+
+// label is used by FWDL_MODE_PARTITION, offset and length by FWDL_MODE_RANGE.
+fwdl_status_t fwdl_stream_open(fwdl_stream_t *s, fwdl_mode_t mode, uint32_t offset, uint32_t length,
+                               const char *label);
+fwdl_status_t fwdl_stream_open_bootloader(fwdl_stream_t *s);
+// Up to len bytes at the current position. The first read of an unaligned
+// stream stops at the sector boundary. 0 at the end, or on a read error with
+// s->error set.
+size_t fwdl_stream_read(fwdl_stream_t *s, void *buf, size_t len);
+
+// ESP_ERR_INVALID_ARG for the running APP partition.
+esp_err_t fwdl_upload_begin(fwdl_upload_t *u, const esp_partition_t *target);
+// ESP_ERR_INVALID_SIZE past the end of the partition, ESP_ERR_INVALID_STATE
+// when no upload is active.
+esp_err_t fwdl_upload_write(fwdl_upload_t *u, const void *data, size_t len);
+// Out of order, for transports that repair gaps later. Each offset once.
+esp_err_t fwdl_upload_write_at(fwdl_upload_t *u, uint32_t offset, const void *data, size_t len);
+// For APP partitions, activate makes the image the boot partition.
+esp_err_t fwdl_upload_end(fwdl_upload_t *u, bool activate);
+void fwdl_upload_abort(fwdl_upload_t *u);
+
+void fwdl_set_flash_hook(fwdl_flash_hook_t hook);
+const char *fwdl_status_name(fwdl_status_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
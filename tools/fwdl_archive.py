@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Client for ESP32FirmwareDownloader dedup archives (FWDA).
+
+Examples:
+  fwdl_archive.py pull http://192.168.1.50 -o unit7.bin --store sectors/
+  fwdl_archive.py pull http://192.168.1.50 --label nvs -o nvs.bin --store sectors/
+  fwdl_archive.py decode unit7.fwda -o unit7.bin --store sectors/
+  fwdl_archive.py manifest sectors/
+
+With --store, the SHA-256 of every sector already in the store is posted to
+/archive, so the device sends only a 36-byte reference for those, and each
+newly received sector is added to the store (sectors/<sha256>). Archiving a
+fleet into one store therefore transfers each distinct sector once.
+"""
+import argparse
+import hashlib
+import os
+import struct
+import sys
+import urllib.request
+import zlib
+
+DA_DATA, DA_ERASED, DA_COPY, DA_KNOWN, DA_END = 0, 1, 2, 3, 0xFF
+MAX_KNOWN = 4096    # digests the device accepts per request
+
+
+class Store:
+    def __init__(self, path):
+        self.path = path
+        if path:
+            os.makedirs(path, exist_ok=True)
+
+    def digests(self):
+        if not self.path:
+            return []
+        return sorted(name for name in os.listdir(self.path) if len(name) == 64)
+
+    def get(self, digest):
+        with open(os.path.join(self.path, digest.hex()), "rb") as f:
+            data = f.read()
+        if hashlib.sha256(data).digest() != digest:
+            raise ValueError("store entry %s is corrupt" % digest.hex())
+        return data
+
+    def put(self, data):
+        if not self.path:
+            return
+        name = os.path.join(self.path, hashlib.sha256(data).hexdigest())
+        if not os.path.exists(name):
+            with open(name, "wb") as f:
+                f.write(data)
+
+
+def decode(data, store):
+    if data[:4] != b"FWDA":
+        raise ValueError("not an FWDA stream")
+    sector, total, start = struct.unpack_from("<III", data, 4)
+    pos = 16
+    out = bytearray()
+    counts = {"data": 0, "erased": 0, "copy": 0, "known": 0}
+    while True:
+        rtype, _, plen = struct.unpack_from("<BBH", data, pos)
+        payload = data[pos + 4:pos + 4 + plen]
+        pos += 4 + plen
+        if rtype == DA_DATA:
+            out += payload
+            store.put(payload)
+            counts["data"] += 1
+        elif rtype == DA_ERASED:
+            (run,) = struct.unpack("<I", payload)
+            out += b"\xff" * (sector * run)
+            counts["erased"] += run
+        elif rtype == DA_COPY:
+            (index,) = struct.unpack("<I", payload)
+            if (index + 1) * sector > len(out):
+                raise ValueError("copy of sector %d before it was sent" % index)
+            out += out[index * sector:(index + 1) * sector]
+            counts["copy"] += 1
+        elif rtype == DA_KNOWN:
+            if not store.path:
+                raise ValueError("archive references stored sectors; pass --store")
+            out += store.get(bytes(payload))
+            counts["known"] += 1
+        elif rtype == DA_END:
+            length, crc = struct.unpack_from("<II", payload)
+            if length != len(out) or length != total:
+                raise ValueError("length mismatch: %d decoded, %d announced" % (len(out), length))
+            if zlib.crc32(out) & 0xFFFFFFFF != crc:
+                raise ValueError("CRC-32 mismatch")
+            return bytes(out), start, counts, pos
+        else:
+            raise ValueError("unknown record type 0x%02x at %d" % (rtype, pos))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("pull")
+    p.add_argument("host", help="device base URL, e.g. http://192.168.1.50")
+    p.add_argument("--label", help="partition label (default: full flash)")
+    p.add_argument("--secure", action="store_true", help="blank user data partitions")
+    p.add_argument("--store", help="content-addressed sector store directory")
+    p.add_argument("-o", "--output", default="dump.bin")
+    d = sub.add_parser("decode")
+    d.add_argument("input")
+    d.add_argument("--store")
+    d.add_argument("-o", "--output", default="dump.bin")
+    m = sub.add_parser("manifest")
+    m.add_argument("store")
+    args = ap.parse_args()
+
+    if args.cmd == "manifest":
+        store = Store(args.store)
+        names = store.digests()
+        size = sum(os.path.getsize(os.path.join(args.store, n)) for n in names)
+        for name in names:
+            print(name)
+        print("%d sectors, %d bytes" % (len(names), size), file=sys.stderr)
+        return
+
+    store = Store(args.store)
+    if args.cmd == "pull":
+        query = []
+        if args.label:
+            query.append("label=" + args.label)
+        if args.secure:
+            query.append("secure=1")
+        url = args.host.rstrip("/") + "/archive" + ("?" + "&".join(query) if query else "")
+        known = [bytes.fromhex(n) for n in store.digests()[:MAX_KNOWN]]
+        if known:
+            req = urllib.request.Request(url, data=b"".join(known), method="POST",
+                                         headers={"Content-Type": "application/octet-stream"})
+        else:
+            req = urllib.request.Request(url)
+        with urllib.request.urlopen(req) as resp:
+            data = resp.read()
+    else:
+        with open(args.input, "rb") as fh:
+            data = fh.read()
+    image, start, counts, wire = decode(data, store)
+    with open(args.output, "wb") as fh:
+        fh.write(image)
+    print("%d bytes on the wire -> %d bytes at 0x%x (data %d, copy %d, known %d, erased %d sectors) -> %s"
+          % (wire, len(image), start, counts["data"], counts["copy"], counts["known"], counts["erased"],
+             args.output))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Fetch a consistent dump and apply its trailing patch blocks.
+
+Examples:
+  fwdl_consistent.py http://192.168.1.50/dumpflash -o fullclone.bin
+  fwdl_consistent.py "http://192.168.1.50/downloaddirect?label=nvs" --base 0x9000 -o nvs.bin
+  fwdl_consistent.py --apply raw_response.bin --image-length 0x400000 -o fullclone.bin
+"""
+import argparse
+import struct
+import sys
+import urllib.request
+
+
+def apply_patches(image_len, data, base=0):
+    image = bytearray(data[:image_len])
+    pos = image_len
+    while True:
+        magic = data[pos:pos + 4]
+        if magic == b"FWPE":
+            rounds, total, unsettled = struct.unpack_from("<III", data, pos + 4)
+            return bytes(image), rounds, total, unsettled
+        if magic != b"FWPB":
+            raise ValueError("bad patch block magic at %d: %r" % (pos, magic))
+        _, count, sector = struct.unpack_from("<III", data, pos + 4)
+        pos += 16
+        for _ in range(count):
+            (addr,) = struct.unpack_from("<I", data, pos)
+            off = addr - base
+            image[off:off + sector] = data[pos + 4:pos + 4 + sector]
+            pos += 4 + sector
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("source", help="dump URL, or a saved response with --apply")
+    ap.add_argument("--apply", action="store_true", help="source is a saved response body")
+    ap.add_argument("--image-length", type=lambda v: int(v, 0), help="X-Image-Length of a saved response")
+    ap.add_argument("--base", type=lambda v: int(v, 0), default=None,
+                    help="flash address of the first image byte (default 0; required for partition dumps)")
+    ap.add_argument("-o", "--output", default="dump.bin")
+    args = ap.parse_args()
+
+    base = args.base or 0
+    if args.apply:
+        if args.image_length is None:
+            sys.exit("--apply needs --image-length")
+        with open(args.source, "rb") as f:
+            body = f.read()
+        image_len = args.image_length
+    else:
+        if args.base is None and "label=" in args.source:
+            sys.exit("partition dumps need --base <partition address> to place patch sectors")
+        sep = "&" if "?" in args.source else "?"
+        with urllib.request.urlopen(args.source + sep + "consistent=1") as resp:
+            image_len = int(resp.headers["X-Image-Length"])
+            body = resp.read()
+
+    image, rounds, resent, unsettled = apply_patches(image_len, body, base)
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("%d bytes, %d sectors re-sent in %d rounds, %d unsettled -> %s"
+          % (len(image), resent, rounds, unsettled, args.output))
+    if unsettled:
+        print("warning: some sectors kept changing; image may not be fully consistent", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""Decoder and benchmark for ESP32FirmwareDownloader adaptive (FWZ1) dumps.
+
+Examples:
+  fwdl_fwz.py fetch http://192.168.1.50/dumpflash -o fullclone.bin
+  fwdl_fwz.py decode dump.fwz -o fullclone.bin
+  fwdl_fwz.py bench corpus/*.bin          # per-mode decisions and ratio for real dumps
+
+The bench command runs a Python mirror of the device encoder (same block
+size, erased detection, entropy threshold and LZ4 parameters), so a corpus of
+real dumps can be evaluated off-device and compared with zlib.
+"""
+import argparse
+import math
+import struct
+import sys
+import time
+import urllib.request
+import zlib
+
+BLOCK_SIZE = 4096
+FWZ_ERASED, FWZ_STORED, FWZ_LZ4, FWZ_END = 0, 1, 2, 0xFF
+ENTROPY_LIMIT = 7.2
+MIN_SAVING = 64
+HASH_BITS = 12
+ERASED_BLOCK = b"\xff" * BLOCK_SIZE
+
+
+def lz4_decompress(src, size):
+    out = bytearray()
+    i = 0
+    while i < len(src):
+        token = src[i]
+        i += 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                b = src[i]
+                i += 1
+                lit += b
+                if b != 255:
+                    break
+        out += src[i:i + lit]
+        i += lit
+        if i >= len(src):
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        mlen = (token & 15) + 4
+        if (token & 15) == 15:
+            while True:
+                b = src[i]
+                i += 1
+                mlen += b
+                if b != 255:
+                    break
+        start = len(out) - offset
+        if offset == 0 or start < 0:
+            raise ValueError("bad LZ4 offset %d" % offset)
+        for k in range(mlen):           # byte-wise: matches may overlap
+            out.append(out[start + k])
+    if len(out) != size:
+        raise ValueError("LZ4 block decoded to %d bytes, expected %d" % (len(out), size))
+    return bytes(out)
+
+
+def decode(data):
+    if data[:4] != b"FWZ1":
+        raise ValueError("not an FWZ1 stream")
+    block, total = struct.unpack_from("<II", data, 4)
+    pos = 16
+    out = bytearray()
+    counts = {"erased": 0, "stored": 0, "lz4": 0}
+    while True:
+        rtype, _, plen = struct.unpack_from("<BBH", data, pos)
+        payload = data[pos + 4:pos + 4 + plen]
+        pos += 4 + plen
+        if rtype == FWZ_ERASED:
+            (run,) = struct.unpack("<I", payload)
+            out += b"\xff" * (block * run)
+            counts["erased"] += run
+        elif rtype == FWZ_STORED:
+            out += payload
+            counts["stored"] += 1
+        elif rtype == FWZ_LZ4:
+            out += lz4_decompress(payload, min(block, total - len(out)))
+            counts["lz4"] += 1
+        elif rtype == FWZ_END:
+            length, crc = struct.unpack("<II", payload)
+            if length != len(out) or length != total:
+                raise ValueError("length mismatch: %d decoded, %d announced" % (len(out), length))
+            if zlib.crc32(out) & 0xFFFFFFFF != crc:
+                raise ValueError("CRC-32 mismatch")
+            return bytes(out), counts, pos
+        else:
+            raise ValueError("unknown record type 0x%02x at %d" % (rtype, pos))
+
+
+# --- Python mirror of the device encoder, for bench ---
+
+def sample_entropy(block):
+    sample = block[::4]
+    hist = [0] * 256
+    for b in sample:
+        hist[b] += 1
+    n = len(sample)
+    return -sum((c / n) * math.log2(c / n) for c in hist if c)
+
+
+def put_length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def lz4_compress(src, cap):
+    n = len(src)
+    table = [0] * (1 << HASH_BITS)
+    out = bytearray()
+    ip = anchor = 0
+    if n > 12:
+        match_limit = n - 5
+        while ip + 12 <= n:
+            seq = struct.unpack_from("<I", src, ip)[0]
+            h = ((seq * 2654435761) & 0xFFFFFFFF) >> (32 - HASH_BITS)
+            ref = table[h]
+            table[h] = ip
+            if ref >= ip or src[ref:ref + 4] != src[ip:ip + 4]:
+                ip += 1
+                continue
+            mlen = 4
+            while ip + mlen < match_limit and src[ref + mlen] == src[ip + mlen]:
+                mlen += 1
+            lit = ip - anchor
+            ml = mlen - 4
+            out.append((min(lit, 15) << 4) | min(ml, 15))
+            if lit >= 15:
+                put_length(out, lit - 15)
+            out += src[anchor:ip]
+            out += struct.pack("<H", ip - ref)
+            if ml >= 15:
+                put_length(out, ml - 15)
+            ip += mlen
+            anchor = ip
+            if len(out) > cap:
+                return None
+    lit = n - anchor
+    out.append(min(lit, 15) << 4)
+    if lit >= 15:
+        put_length(out, lit - 15)
+    out += src[anchor:]
+    return bytes(out) if len(out) <= cap else None
+
+
+def bench(path):
+    with open(path, "rb") as f:
+        image = f.read()
+    stats = {"erased": 0, "entropy": 0, "nogain": 0, "lz4": 0}
+    encoded = 16 + 12
+    run = 0
+    t0 = time.time()
+    for off in range(0, len(image), BLOCK_SIZE):
+        block = image[off:off + BLOCK_SIZE]
+        if len(block) == BLOCK_SIZE and block == ERASED_BLOCK:
+            run += 1
+            stats["erased"] += 1
+            continue
+        if run:
+            encoded += 8
+            run = 0
+        packed = None
+        if sample_entropy(block) >= ENTROPY_LIMIT:
+            stats["entropy"] += 1
+        else:
+            packed = lz4_compress(block, len(block) - MIN_SAVING) if len(block) > MIN_SAVING else None
+            stats["lz4" if packed else "nogain"] += 1
+        encoded += 4 + (len(packed) if packed else len(block))
+    if run:
+        encoded += 8
+    elapsed = time.time() - t0
+    zsize = len(zlib.compress(image, 6))
+    print("%s: %d -> %d bytes (%.1f%%), zlib-6 %d (%.1f%%); blocks erased %d, lz4 %d, stored %d entropy + %d no gain; %.1fs"
+          % (path, len(image), encoded, 100.0 * encoded / max(len(image), 1), zsize,
+             100.0 * zsize / max(len(image), 1), stats["erased"], stats["lz4"], stats["entropy"],
+             stats["nogain"], elapsed))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    f = sub.add_parser("fetch")
+    f.add_argument("url")
+    f.add_argument("-o", "--output", default="dump.bin")
+    d = sub.add_parser("decode")
+    d.add_argument("input")
+    d.add_argument("-o", "--output", default="dump.bin")
+    b = sub.add_parser("bench")
+    b.add_argument("dumps", nargs="+")
+    args = ap.parse_args()
+
+    if args.cmd == "bench":
+        for path in args.dumps:
+            bench(path)
+        return
+    if args.cmd == "fetch":
+        sep = "&" if "?" in args.url else "?"
+        with urllib.request.urlopen(args.url + sep + "encoding=adaptive") as resp:
+            data = resp.read()
+    else:
+        with open(args.input, "rb") as fh:
+            data = fh.read()
+    image, counts, wire = decode(data)
+    with open(args.output, "wb") as fh:
+        fh.write(image)
+    print("%d bytes on the wire -> %d bytes (erased %d, stored %d, lz4 %d blocks) -> %s"
+          % (wire, len(image), counts["erased"], counts["stored"], counts["lz4"], args.output))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
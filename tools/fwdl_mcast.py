@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Host side of the ESP32FirmwareDownloader multicast distribution protocol.
+
+  fwdl_mcast.py send firmware.bin [--label ota_0] [--rate 400]   feed devices from the host
+  fwdl_mcast.py recv out.bin [--drop 0.05]                        simulated receiver
+
+Run a sender and a few receivers on one machine (loopback, --iface 127.0.0.1)
+to exercise loss and repair without hardware.
+"""
+import argparse
+import hashlib
+import random
+import socket
+import struct
+import sys
+import time
+
+HDR = struct.Struct("<4sBBHII")
+ANNOUNCE, DATA, END, NACK, COMPLETE = 0x01, 0x02, 0x03, 0x10, 0x11
+BLOCK, NACK_BITS, QUIET_ROUNDS, MAX_PASSES = 1024, 256, 3, 20
+
+
+def mcast_socket(group, port, iface, bind_port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(("", bind_port))
+    s.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(iface))
+    s.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    return s
+
+
+def send(args):
+    image = open(args.image, "rb").read()
+    blocks = (len(image) + BLOCK - 1) // BLOCK
+    session = random.randrange(0x10000)
+    sock = mcast_socket(args.group, args.port, args.iface, args.port + 1)
+    dest = (args.group, args.port)
+    announce = HDR.pack(b"FWMC", ANNOUNCE, 0, session, 0, len(image)) + struct.pack(
+        "<HH32s16s", BLOCK, 0, hashlib.sha256(image).digest(), args.label.encode()[:16])
+    for _ in range(3):
+        sock.sendto(announce, dest)
+        time.sleep(0.2)
+    pending = set(range(blocks))
+    quiet, completes, nacks, repairs = 0, set(), 0, 0
+    rate = args.rate * 1024
+    t0 = time.monotonic()
+    sent = 0
+    for pas in range(1, MAX_PASSES + 1):
+        if quiet >= QUIET_ROUNDS:
+            break
+        for b in sorted(pending):
+            data = image[b * BLOCK:(b + 1) * BLOCK]
+            sock.sendto(HDR.pack(b"FWMC", DATA, 0, session, b, len(image)) + data, dest)
+            sent += len(data)
+            if pas > 1:
+                repairs += 1
+            while time.monotonic() - t0 < sent / rate:
+                time.sleep(0.0005)
+            if b % 64 == 0:
+                sock.sendto(announce, dest)
+        sock.sendto(HDR.pack(b"FWMC", END, 0, session, pas, blocks), dest)
+        pending = set()
+        got_nack = False
+        sock.settimeout(0.05)
+        deadline = time.monotonic() + 0.5
+        while time.monotonic() < deadline:
+            try:
+                pkt, addr = sock.recvfrom(2048)
+            except socket.timeout:
+                continue
+            magic, typ, _f, sess, seq, arg = HDR.unpack(pkt[:16])
+            if magic != b"FWMC" or sess != session:
+                continue
+            if typ == NACK:
+                got_nack = True
+                nacks += 1
+                bitmap = pkt[16:]
+                for i in range(min(arg, len(bitmap) * 8)):
+                    if bitmap[i >> 3] & (1 << (i & 7)) and seq + i < blocks:
+                        pending.add(seq + i)
+            elif typ == COMPLETE:
+                completes.add(addr)
+        quiet = 0 if got_nack else quiet + 1
+        print("pass %d: %d NACKs so far, %d receivers complete, %d blocks to repair" % (pas, nacks, len(completes), len(pending)))
+    dt = time.monotonic() - t0
+    print("done: %d bytes, %d repair blocks, %.1f KB/s" % (len(image), repairs, len(image) / 1024 / dt))
+
+
+def recv(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    mreq = socket.inet_aton(args.group) + socket.inet_aton(args.iface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    session, image, have, digest = None, None, None, None
+    while True:
+        pkt, addr = sock.recvfrom(2048)
+        if len(pkt) < 16 or pkt[:4] != b"FWMC":
+            continue
+        _m, typ, _f, sess, seq, arg = HDR.unpack(pkt[:16])
+        if typ == ANNOUNCE and sess != session:
+            session, total = sess, arg
+            _bs, _r, digest, _label = struct.unpack("<HH32s16s", pkt[16:68])
+            image = bytearray(total)
+            blocks = (total + BLOCK - 1) // BLOCK
+            have = [False] * blocks
+            print("session %04X: %d bytes" % (sess, total))
+            continue
+        if sess != session or image is None:
+            continue
+        if typ == DATA and seq < len(have) and not have[seq]:
+            if random.random() < args.drop:
+                continue
+            image[seq * BLOCK:seq * BLOCK + len(pkt) - 16] = pkt[16:]
+            have[seq] = True
+        elif typ == END:
+            missing = [i for i, h in enumerate(have) if not h]
+            if not missing:
+                ok = hashlib.sha256(image).digest() == digest
+                sock.sendto(HDR.pack(b"FWMC", COMPLETE, 0, session, 0, 0 if ok else 1), addr)
+                if ok:
+                    open(args.output, "wb").write(image)
+                    print("complete, digest verified -> %s" % args.output)
+                    return
+                sys.exit("digest mismatch")
+            sent = 0
+            for base in range(0, len(have), NACK_BITS):
+                bitmap = bytearray(NACK_BITS // 8)
+                for i in range(NACK_BITS):
+                    if base + i < len(have) and not have[base + i]:
+                        bitmap[i >> 3] |= 1 << (i & 7)
+                if any(bitmap) and sent < 8:
+                    sock.sendto(HDR.pack(b"FWMC", NACK, 0, session, base, NACK_BITS) + bytes(bitmap), addr)
+                    sent += 1
+            print("pass %d: missing %d blocks" % (seq, len(missing)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--group", default="239.255.70.68")
+    ap.add_argument("--port", type=int, default=5768)
+    ap.add_argument("--iface", default="0.0.0.0", help="local interface address")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    s = sub.add_parser("send")
+    s.add_argument("image")
+    s.add_argument("--label", default="ota_0")
+    s.add_argument("--rate", type=int, default=400, help="KB/s")
+    r = sub.add_parser("recv")
+    r.add_argument("output")
+    r.add_argument("--drop", type=float, default=0.0, help="simulated packet loss ratio")
+    args = ap.parse_args()
+    send(args) if args.cmd == "send" else recv(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Fetch and split ESP32FirmwareDownloader RAM dumps (FWRM).
+
+Examples:
+  fwdl_ramdump.py fetch http://192.168.1.50 --regions dram,psram --heap -o snap/
+  fwdl_ramdump.py split ramdump.fwrm -o snap/
+
+Each memory region is written to <name>_<address>.bin, ready to load at its
+address in a debugger or compare between two snapshots. The heap summary
+region, if present, is printed and saved as heap.json.
+"""
+import argparse
+import json
+import os
+import struct
+import sys
+import urllib.request
+
+RAM_REGION_SUMMARY = 1
+BUCKETS = ["<=16", "<=32", "<=64", "<=128", "<=256", "<=512", "<=1K", "<=2K", "<=4K", "<=8K", "<=16K", ">16K"]
+
+
+def split(data, outdir):
+    if data[:4] != b"FWRM":
+        raise ValueError("not an FWRM stream")
+    version, count = data[4], data[5]
+    if version != 1:
+        raise ValueError("unsupported version %d" % version)
+    pos = 8 + 16 * count
+    os.makedirs(outdir, exist_ok=True)
+    for i in range(count):
+        name, address, length, flags = struct.unpack_from("<4sIII", data, 8 + 16 * i)
+        name = name.decode("ascii")
+        body = data[pos:pos + length]
+        pos += length
+        if len(body) != length:
+            raise ValueError("region %s truncated: %d of %d bytes" % (name, len(body), length))
+        if flags & RAM_REGION_SUMMARY:
+            heap = json.loads(body)
+            with open(os.path.join(outdir, "heap.json"), "w") as f:
+                json.dump(heap, f, indent=1)
+            print_heap(heap)
+            continue
+        path = os.path.join(outdir, "%s_%08x.bin" % (name.lower(), address))
+        with open(path, "wb") as f:
+            f.write(body)
+        print("%s 0x%08x %8d bytes -> %s" % (name, address, length, path))
+
+
+def print_heap(heap):
+    for caps in ("internal", "psram"):
+        if caps in heap:
+            h = heap[caps]
+            print("%-8s free %d, allocated %d, largest free %d, min free %d, %d/%d blocks allocated/free"
+                  % (caps, h["free"], h["allocated"], h["largestFree"], h["minFree"], h["allocatedBlocks"],
+                     h["freeBlocks"]))
+    for t in sorted(heap.get("tasks", []), key=lambda t: -(t["internalBytes"] + t["psramBytes"])):
+        print("  task %s: %d bytes in %d blocks internal, %d bytes in %d blocks PSRAM"
+              % (t["task"], t["internalBytes"], t["internalBlocks"], t["psramBytes"], t["psramBlocks"]))
+    if "blockSizes" in heap:
+        print("  block sizes (%d sampled): %s" % (heap["blocksSampled"], ", ".join(
+            "%s:%d" % (BUCKETS[i], n) for i, n in enumerate(heap["blockSizes"]) if n)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    f = sub.add_parser("fetch")
+    f.add_argument("host", help="device base URL, e.g. http://192.168.1.50")
+    f.add_argument("--regions", default="dram")
+    f.add_argument("--heap", action="store_true", help="include the heap summary")
+    f.add_argument("--rate", type=int, help="KB/s (0 unpaced, device default 256)")
+    f.add_argument("-o", "--output", default="ramdump")
+    s = sub.add_parser("split")
+    s.add_argument("input")
+    s.add_argument("-o", "--output", default="ramdump")
+    args = ap.parse_args()
+
+    if args.cmd == "fetch":
+        url = args.host.rstrip("/") + "/ramdump?regions=" + args.regions
+        if args.heap:
+            url += "&heap=1"
+        if args.rate is not None:
+            url += "&rate=%d" % args.rate
+        with urllib.request.urlopen(url) as resp:
+            data = resp.read()
+    else:
+        with open(args.input, "rb") as fh:
+            data = fh.read()
+    split(data, args.output)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
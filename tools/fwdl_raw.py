@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Client for the ESP32FirmwareDownloader raw TCP dump service.
+
+Examples:
+  fwdl_raw.py 192.168.1.50 full -o fullclone.bin
+  fwdl_raw.py 192.168.1.50 partition --label ota_0 -o ota_0.bin
+  fwdl_raw.py 192.168.1.50 range --offset 0x10000 --length 0x10000 -o region.bin
+  fwdl_raw.py 192.168.1.50 full --compress -o fullclone.bin      # FWZ1 on the wire
+  fwdl_raw.py 192.168.1.50 full --bench                          # raw TCP vs HTTP, same source
+
+--bench fetches the same source over raw TCP and then over the HTTP endpoint
+(/dumpflash, /dumpflash_secure, /downloaddirect or /dumprange), with and
+without compression, and prints the throughput of each. Nothing is written.
+"""
+import argparse
+import hashlib
+import os
+import socket
+import struct
+import sys
+import time
+import urllib.request
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fwdl_fwz  # noqa: E402
+
+MODES = {"full": 0, "secure": 1, "partition": 2, "range": 3}
+STATUS = {0: "ok", 1: "bad request", 2: "not found", 3: "out of range", 4: "unsupported",
+          5: "busy", 6: "out of sequence", 7: "I/O error", 8: "forbidden"}
+COMPRESSION_FWZ = 1
+
+
+def recv_exact(sock, n):
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise EOFError("connection closed after %d/%d bytes" % (len(buf), n))
+        buf += chunk
+    return bytes(buf)
+
+
+def fetch_raw(args, compress):
+    """Returns (image, wire bytes, seconds, start address)."""
+    req = struct.pack("<4sBBBBII16s", b"FWDQ", 1, MODES[args.mode], COMPRESSION_FWZ if compress else 0, 0,
+                      args.offset, args.length, args.label.encode()[:16])
+    start = time.monotonic()
+    with socket.create_connection((args.host, args.port)) as sock:
+        sock.sendall(req)
+        magic, status, comp, _rsvd, addr, length = struct.unpack("<4sBBHII", recv_exact(sock, 16))
+        if magic != b"FWDR":
+            sys.exit("bad response magic %r" % magic)
+        if status != 0:
+            sys.exit("device refused request: %s" % STATUS.get(status, status))
+        if comp == COMPRESSION_FWZ:
+            # Self-delimiting FWZ1 stream: read to the close, the trailer is the last 36 bytes.
+            buf = bytearray()
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                buf += chunk
+            payload, trailer = bytes(buf[:-36]), bytes(buf[-36:])
+        else:
+            payload = recv_exact(sock, length)
+            trailer = recv_exact(sock, 36)
+    elapsed = time.monotonic() - start
+    # The trailer covers the payload as sent, so check it before decoding.
+    if trailer[:4] != b"FWDT" or trailer[4:] != hashlib.sha256(payload).digest():
+        sys.exit("digest mismatch: payload is corrupt")
+    image = payload
+    if comp == COMPRESSION_FWZ:
+        image, _counts, _end = fwdl_fwz.decode(payload)   # checks length and CRC-32
+    return image, len(payload), elapsed, addr
+
+
+def http_url(args, compress):
+    base = "http://%s:%d" % (args.host, args.http_port)
+    if args.mode == "full":
+        url = base + "/dumpflash?"
+    elif args.mode == "secure":
+        url = base + "/dumpflash_secure?"
+    elif args.mode == "partition":
+        url = base + "/downloaddirect?label=%s&" % args.label
+    else:
+        url = base + "/dumprange?offset=0x%X&length=%d&" % (args.offset, args.length)
+    return url + ("encoding=adaptive" if compress else "")
+
+
+def fetch_http(args, compress):
+    start = time.monotonic()
+    with urllib.request.urlopen(http_url(args, compress)) as resp:
+        body = resp.read()
+    elapsed = time.monotonic() - start
+    image = fwdl_fwz.decode(body)[0] if compress else body
+    return image, len(body), elapsed
+
+
+def bench(args):
+    print("%-22s %12s %12s %9s %10s" % ("transport", "image", "wire", "seconds", "KB/s"))
+    reference = None
+    for compress in (False, True):
+        for name in ("raw TCP", "HTTP"):
+            if name == "raw TCP":
+                image, wire, elapsed, _addr = fetch_raw(args, compress)
+            else:
+                image, wire, elapsed = fetch_http(args, compress)
+            digest = hashlib.sha256(image).digest()
+            # Secure dumps and live DATA partitions may legitimately differ between fetches.
+            note = "" if reference in (None, digest) else "  (image differs from first fetch)"
+            reference = reference or digest
+            label = name + (" adaptive" if compress else "")
+            print("%-22s %12d %12d %9.2f %10.1f%s"
+                  % (label, len(image), wire, elapsed, len(image) / 1024 / elapsed, note))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("host")
+    ap.add_argument("mode", choices=MODES.keys())
+    ap.add_argument("--port", type=int, default=8023)
+    ap.add_argument("--http-port", type=int, default=80, help="HTTP port for --bench")
+    ap.add_argument("--label", default="")
+    ap.add_argument("--offset", type=lambda v: int(v, 0), default=0)
+    ap.add_argument("--length", type=lambda v: int(v, 0), default=0)
+    ap.add_argument("--compress", action="store_true", help="request the FWZ1 adaptive encoding")
+    ap.add_argument("--bench", action="store_true", help="compare raw TCP with HTTP instead of saving")
+    ap.add_argument("-o", "--output", default="dump.bin")
+    args = ap.parse_args()
+
+    if args.bench:
+        bench(args)
+        return
+    image, wire, elapsed, addr = fetch_raw(args, args.compress)
+    with open(args.output, "wb") as out:
+        out.write(image)
+    print("0x%08X + %d bytes (%d on the wire) -> %s in %.2f s (%.1f KB/s), sha256 %s"
+          % (addr, len(image), wire, args.output, elapsed, len(image) / 1024 / elapsed,
+             hashlib.sha256(image).hexdigest()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Host side of the ESP32FirmwareDownloader serial transport (needs pyserial).
+
+Examples:
+  fwdl_serial.py /dev/ttyUSB0 list
+  fwdl_serial.py /dev/ttyUSB0 --baud 2000000 dump --mode full -o fullclone.bin
+  fwdl_serial.py /dev/ttyUSB0 --baud 2000000 dump --mode partition --label nvs -o nvs.bin
+  fwdl_serial.py /dev/ttyUSB0 --baud 2000000 upload --label ota_1 --activate firmware.bin
+
+Works against any character device, including one side of a pty pair.
+"""
+import argparse
+import hashlib
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+END, ESC, ESC_END, ESC_ESC = 0xC0, 0xDB, 0xDC, 0xDD
+SF_HELLO, SF_SET_BAUD, SF_READ, SF_DATA, SF_DATA_ACK, SF_ABORT = 0x01, 0x02, 0x10, 0x11, 0x12, 0x13
+SF_UPLOAD_BEGIN, SF_UPLOAD_DATA, SF_UPLOAD_END, SF_REBOOT, SF_LIST = 0x20, 0x21, 0x22, 0x30, 0x40
+SF_STATUS, SF_HELLO_ACK, SF_READ_INFO, SF_READ_DONE, SF_LIST_REPLY = 0x80, 0x81, 0x90, 0x91, 0xC0
+MODES = {"full": 0, "secure": 1, "partition": 2, "range": 3}
+STATUS = {0: "ok", 1: "bad request", 2: "not found", 3: "out of range", 4: "unsupported",
+          5: "busy", 6: "out of sequence", 7: "I/O error", 8: "forbidden"}
+
+
+class Link:
+    def __init__(self, port, baud):
+        self.ser = serial.Serial(port, baud, timeout=0.05)
+        self.buf = bytearray()
+        self.seq = 0
+
+    def send(self, ftype, payload=b""):
+        self.seq = (self.seq + 1) & 0xFFFF
+        body = struct.pack("<BH", ftype, self.seq) + payload
+        body += struct.pack("<I", zlib.crc32(body))
+        out = bytearray([END])
+        for b in body:
+            if b == END:
+                out += bytes([ESC, ESC_END])
+            elif b == ESC:
+                out += bytes([ESC, ESC_ESC])
+            else:
+                out.append(b)
+        out.append(END)
+        self.ser.write(out)
+
+    def recv(self, timeout=2.0):
+        """Return (type, seq, payload) of the next valid frame, or None on timeout."""
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            while END in self.buf:
+                idx = self.buf.index(END)
+                raw, self.buf = self.buf[:idx], self.buf[idx + 1:]
+                frame = raw.replace(bytes([ESC, ESC_END]), bytes([END])).replace(bytes([ESC, ESC_ESC]), bytes([ESC]))
+                if len(frame) < 7 or zlib.crc32(frame[:-4]) != struct.unpack("<I", frame[-4:])[0]:
+                    continue  # debug text or a damaged frame
+                ftype, seq = struct.unpack("<BH", frame[:3])
+                return ftype, seq, bytes(frame[3:-4])
+            self.buf += self.ser.read(max(1, self.ser.in_waiting))
+        return None
+
+    def expect(self, ftype, timeout=2.0):
+        while True:
+            frame = self.recv(timeout)
+            if frame is None:
+                sys.exit("timeout waiting for frame 0x%02X" % ftype)
+            if frame[0] == ftype:
+                return frame[2]
+
+    def status(self, timeout=5.0):
+        payload = self.expect(SF_STATUS, timeout)
+        return payload[0], struct.unpack("<I", payload[1:5])[0]
+
+
+def negotiate(link, baud):
+    link.send(SF_HELLO)
+    version, window, max_data, max_baud = struct.unpack("<BBHI", link.expect(SF_HELLO_ACK))
+    if baud and baud != link.ser.baudrate:
+        link.send(SF_SET_BAUD, struct.pack("<I", baud))
+        st, val = link.status()
+        if st != 0:
+            sys.exit("device refused %d baud (max %d)" % (baud, val))
+        time.sleep(0.05)
+        link.ser.baudrate = baud
+        link.buf.clear()
+        link.send(SF_HELLO)   # confirms the new rate on the device side
+        link.expect(SF_HELLO_ACK)
+    return window, max_data
+
+
+def cmd_list(link, args):
+    link.send(SF_LIST)
+    data = link.expect(SF_LIST_REPLY)
+    for i in range(0, len(data), 26):
+        label, ptype, sub, addr, size = struct.unpack("<16sBBII", data[i:i + 26])
+        print("%-16s %s 0x%02X 0x%08X %8d" % (label.rstrip(b"\0").decode(), "APP " if ptype == 0 else "DATA", sub, addr, size))
+
+
+def cmd_dump(link, args):
+    req = struct.pack("<BII16s", MODES[args.mode], args.offset, args.length, args.label.encode()[:16])
+    link.send(SF_READ, req)
+    st, start, length = struct.unpack("<BII", link.expect(SF_READ_INFO))
+    if st != 0:
+        sys.exit("read refused: %s" % STATUS.get(st, st))
+    t0 = time.monotonic()
+    expected = 0
+    image = bytearray(length)
+    digest = None
+    while digest is None:
+        frame = link.recv(5.0)
+        if frame is None:
+            link.send(SF_DATA_ACK, struct.pack("<I", expected))
+            continue
+        ftype, _seq, payload = frame
+        if ftype == SF_DATA:
+            off = struct.unpack("<I", payload[:4])[0]
+            if off == expected:
+                image[off:off + len(payload) - 4] = payload[4:]
+                expected += len(payload) - 4
+            link.send(SF_DATA_ACK, struct.pack("<I", expected))
+        elif ftype == SF_READ_DONE:
+            digest = payload
+        elif ftype == SF_STATUS:
+            sys.exit("device error: %s" % STATUS.get(payload[0], payload[0]))
+    if hashlib.sha256(image).digest() != digest:
+        sys.exit("digest mismatch")
+    with open(args.output, "wb") as f:
+        f.write(image)
+    dt = time.monotonic() - t0
+    print("0x%08X + %d bytes -> %s in %.2f s (%.1f KB/s)" % (start, length, args.output, dt, length / 1024 / dt))
+
+
+def cmd_upload(link, args, window, max_data):
+    image = open(args.image, "rb").read()
+    link.send(SF_UPLOAD_BEGIN, struct.pack("<16sI", args.label.encode()[:16], len(image)))
+    st, _ = link.status(timeout=60.0)   # erase can take a while
+    if st != 0:
+        sys.exit("upload refused: %s" % STATUS.get(st, st))
+    t0 = time.monotonic()
+    acked = 0
+    sent = 0
+    while acked < len(image):
+        while sent < len(image) and sent - acked < window * max_data:
+            chunk = image[sent:sent + max_data]
+            link.send(SF_UPLOAD_DATA, struct.pack("<I", sent) + chunk)
+            sent += len(chunk)
+        frame = link.recv(5.0)
+        if frame is None:
+            sent = acked   # resend the window
+            continue
+        if frame[0] != SF_STATUS:
+            continue
+        st, nxt = frame[2][0], struct.unpack("<I", frame[2][1:5])[0]
+        if st == 6:
+            sent = nxt
+        elif st != 0:
+            sys.exit("upload failed: %s" % STATUS.get(st, st))
+        acked = max(acked, nxt)
+    link.send(SF_UPLOAD_END, bytes([1 if args.activate else 0]))
+    st, written = link.status(timeout=30.0)
+    if st != 0:
+        sys.exit("finalize failed: %s" % STATUS.get(st, st))
+    dt = time.monotonic() - t0
+    print("%d bytes -> %s in %.2f s (%.1f KB/s)" % (written, args.label, dt, written / 1024 / dt))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("port")
+    ap.add_argument("--base-baud", type=int, default=115200)
+    ap.add_argument("--baud", type=int, default=0, help="negotiate this rate after connecting")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("list")
+    d = sub.add_parser("dump")
+    d.add_argument("--mode", choices=MODES.keys(), default="full")
+    d.add_argument("--label", default="")
+    d.add_argument("--offset", type=lambda v: int(v, 0), default=0)
+    d.add_argument("--length", type=lambda v: int(v, 0), default=0)
+    d.add_argument("-o", "--output", default="dump.bin")
+    u = sub.add_parser("upload")
+    u.add_argument("--label", required=True)
+    u.add_argument("--activate", action="store_true")
+    u.add_argument("image")
+    args = ap.parse_args()
+
+    link = Link(args.port, args.base_baud)
+    window, max_data = negotiate(link, args.baud)
+    if args.cmd == "list":
+        cmd_list(link, args)
+    elif args.cmd == "dump":
+        cmd_dump(link, args)
+    else:
+        cmd_upload(link, args, window, max_data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Per-configuration footprint of ESP32FirmwareDownloader from linker map files.
+
+Examples:
+  fwdl_size.py build/firmware.map
+  fwdl_size.py full.map minimal.map minimal_mcast.map
+
+Reads the "Linker script and memory map" part of each GNU ld map (the input
+sections that survived --gc-sections), keeps the objects whose name matches
+--match, and sums code (.text, .literal, .iram*), read-only data (.rodata*),
+initialized data (.data*, .dram*) and .bss per object. With several maps
+(one per FWDL_ENABLE_* set) the totals are printed side by side, so the cost
+of each feature is the difference between two columns.
+
+PlatformIO writes the map with build_flags = -Wl,-Map,firmware.map, ESP-IDF
+writes build/<project>.map.
+"""
+import argparse
+import os
+import re
+import sys
+
+KINDS = ("code", "rodata", "data", "bss")
+
+SECTION = re.compile(r"^ (\.[\w.$]+|COMMON)\s*$")
+ENTRY = re.compile(r"^ (?:(\.[\w.$]+|COMMON)\s+)?\s*0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$")
+
+
+def kind_of(section):
+    if section.startswith((".text", ".literal", ".iram")):
+        return "code"
+    if section.startswith(".rodata"):
+        return "rodata"
+    if section.startswith((".data", ".dram", ".sdata")):
+        return "data"
+    if section.startswith((".bss", ".sbss")) or section == "COMMON":
+        return "bss"
+    return None
+
+
+def object_name(path):
+    m = re.search(r"\(([^)]+)\)$", path)       # lib.a(member.o)
+    name = m.group(1) if m else os.path.basename(path)
+    return re.sub(r"\.(c|cpp)?\.?o(bj)?$", "", name)
+
+
+def parse_map(path, pattern):
+    sizes = {}
+    pending = None
+    in_map = False
+    with open(path, errors="replace") as f:
+        for line in f:
+            if not in_map:
+                in_map = line.startswith("Linker script and memory map")
+                continue
+            m = ENTRY.match(line)
+            if m:
+                section = m.group(1) or pending
+                pending = None
+                size = int(m.group(3), 16)
+                kind = kind_of(section) if section else None
+                obj = m.group(4).strip()
+                if not kind or size == 0 or not pattern.search(obj):
+                    continue
+                row = sizes.setdefault(object_name(obj), dict.fromkeys(KINDS, 0))
+                row[kind] += size
+                continue
+            m = SECTION.match(line)
+            pending = m.group(1) if m else None
+    return sizes
+
+
+def total(sizes):
+    return {k: sum(row[k] for row in sizes.values()) for k in KINDS}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("maps", nargs="+", help="linker map files, one per configuration")
+    ap.add_argument("--match", default=r"FirmwareDownloader|fwdl",
+                    help="regex selecting the library's objects (default: %(default)s)")
+    args = ap.parse_args()
+    pattern = re.compile(args.match)
+
+    results = [(path, parse_map(path, pattern)) for path in args.maps]
+    if len(results) == 1:
+        path, sizes = results[0]
+        if not sizes:
+            sys.exit("%s: no objects match %r" % (path, args.match))
+        print("%-36s %9s %9s %9s %9s" % (("object",) + KINDS))
+        for name in sorted(sizes):
+            print("%-36s %9d %9d %9d %9d" % ((name,) + tuple(sizes[name][k] for k in KINDS)))
+        t = total(sizes)
+        print("%-36s %9d %9d %9d %9d" % (("total",) + tuple(t[k] for k in KINDS)))
+        return
+
+    names = [os.path.basename(p) for p, _ in results]
+    print("%-8s" % "" + "".join(" %14s" % n[:14] for n in names))
+    totals = [total(sizes) for _, sizes in results]
+    for k in KINDS + ("flash", "ram"):
+        cells = []
+        for t in totals:
+            if k == "flash":
+                v = t["code"] + t["rodata"] + t["data"]
+            elif k == "ram":
+                v = t["data"] + t["bss"]
+            else:
+                v = t[k]
+            cells.append(v)
+        base = cells[0]
+        row = " %14d" % base + "".join(" %14s" % ("%d (%+d)" % (v, v - base)) for v in cells[1:])
+        print("%-8s%s" % (k, row))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Erase-count heatmap and wear benchmark for ESP32FirmwareDownloader.
+
+Examples:
+  fwdl_wear.py show http://192.168.1.50
+  fwdl_wear.py bench http://192.168.1.50 --runs 5 "/snapshot?src=nvs&dst=nvs_backup"
+  fwdl_wear.py bench http://192.168.1.50 --runs 5 --upload nvs.bin --label nvs_backup
+
+bench reads /wear, repeats one operation, waits for each background job to
+finish (for endpoints that answer 202 with a job id), reads /wear again and
+prints the erases it cost per partition. Running the same workload through
+/snapshot (diff write: only sectors that can't be programmed over are erased)
+and through /upload (the whole target is erased) shows the difference.
+"""
+import argparse
+import json
+import sys
+import time
+import urllib.request
+import uuid
+
+
+def get_json(url):
+    with urllib.request.urlopen(url) as resp:
+        return json.loads(resp.read())
+
+
+def wait_job(host, reply):
+    try:
+        job = json.loads(reply)
+    except ValueError:
+        return
+    if "id" not in job:
+        return
+    while job.get("state") in ("queued", "running"):
+        time.sleep(0.5)
+        job = get_json("%s/jobs?id=%d" % (host, job["id"]))
+    if job.get("state") != "done":
+        raise RuntimeError("job %d %s: %s" % (job["id"], job.get("state"), job.get("message")))
+
+
+def upload(host, label, path):
+    with open(path, "rb") as f:
+        image = f.read()
+    boundary = uuid.uuid4().hex
+    body = (("--%s\r\nContent-Disposition: form-data; name=\"label\"\r\n\r\n%s\r\n"
+             "--%s\r\nContent-Disposition: form-data; name=\"file\"; filename=\"image.bin\"\r\n"
+             "Content-Type: application/octet-stream\r\n\r\n") % (boundary, label, boundary)).encode()
+    body += image + ("\r\n--%s--\r\n" % boundary).encode()
+    req = urllib.request.Request(host + "/upload", data=body, method="POST",
+                                 headers={"Content-Type": "multipart/form-data; boundary=" + boundary})
+    with urllib.request.urlopen(req) as resp:
+        resp.read()
+
+
+def show(wear):
+    print("%d sectors, %d erases recorded (%d since boot), hottest 0x%x with %d"
+          % (wear["sectors"], wear["totalErases"], wear["sinceBoot"], wear["hottestAddress"], wear["maxErases"]))
+    for p in wear["partitions"]:
+        if p["erases"]:
+            print("  %-16s 0x%08x %8d bytes  %6d erases, max %d" % (p["label"], p["address"], p["size"],
+                                                                    p["erases"], p["max"]))
+    for i, row in enumerate(wear["heatmap"]):
+        print("0x%08x %s" % (i * 64 * wear["sectorSize"], row))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    s = sub.add_parser("show")
+    s.add_argument("host")
+    b = sub.add_parser("bench")
+    b.add_argument("host")
+    b.add_argument("path", nargs="?", help="endpoint to repeat, e.g. /snapshot?src=nvs&dst=nvs_backup")
+    b.add_argument("--runs", type=int, default=3)
+    b.add_argument("--upload", help="image to upload instead of calling an endpoint")
+    b.add_argument("--label", help="target partition for --upload")
+    args = ap.parse_args()
+    host = args.host.rstrip("/")
+
+    if args.cmd == "show":
+        show(get_json(host + "/wear"))
+        return
+    if not args.path and not (args.upload and args.label):
+        ap.error("bench needs an endpoint path or --upload with --label")
+
+    before = get_json(host + "/wear")
+    t0 = time.time()
+    for _ in range(args.runs):
+        if args.upload:
+            upload(host, args.label, args.upload)
+        else:
+            with urllib.request.urlopen(host + args.path) as resp:
+                wait_job(host, resp.read())
+    after = get_json(host + "/wear")
+    elapsed = time.time() - t0
+    was = {p["label"]: p["erases"] for p in before["partitions"]}
+    print("%d runs in %.1fs, %d sector erases (%.1f per run)"
+          % (args.runs, elapsed, after["totalErases"] - before["totalErases"],
+             (after["totalErases"] - before["totalErases"]) / float(args.runs)))
+    for p in after["partitions"]:
+        delta = p["erases"] - was.get(p["label"], 0)
+        if delta:
+            print("  %-16s %6d erases (%.1f per run)" % (p["label"], delta, delta / float(args.runs)))
+
+
+if __name__ == "__main__":
+    sys.exit(main())